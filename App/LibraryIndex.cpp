@@ -0,0 +1,373 @@
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <fcntl.h>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "LibraryIndex.h"
+#include "Utils/Utils.h"
+
+using ted::LibraryEntry;
+using ted::LibraryIndex;
+using ted::TalkStatus;
+
+static const std::string Header = "#TedShadow library 1\n";
+static constexpr size_t FieldCount = 9;
+// compaction is not worth it for a handful of stale lines
+static constexpr size_t MinCompactLines = 64;
+
+static void appendField(std::string &line, std::string_view field) {
+  for (char c : field) {
+    switch (c) {
+    case '\t':
+      line += "\\t";
+      break;
+    case '\n':
+      line += "\\n";
+      break;
+    case '\\':
+      line += "\\\\";
+      break;
+    default:
+      line += c;
+    }
+  }
+}
+
+static std::string unescape(std::string_view field) {
+  std::string value;
+  value.reserve(field.size());
+  for (size_t i = 0; i < field.size(); ++i) {
+    if (field[i] != '\\' || i + 1 == field.size()) {
+      value += field[i];
+      continue;
+    }
+    char next = field[++i];
+    value += next == 't' ? '\t' : next == 'n' ? '\n' : next;
+  }
+  return value;
+}
+
+static char statusCode(TalkStatus status) {
+  switch (status) {
+  case TalkStatus::Partial:
+    return 'P';
+  case TalkStatus::Cached:
+    return 'C';
+  case TalkStatus::Removed:
+    return 'R';
+  }
+  return 'P';
+}
+
+// url, id, title, speaker, duration, sentences, media and subtitle bytes,
+// status; tab separated
+static std::string formatEntry(const LibraryEntry &entry) {
+  std::string line;
+  for (auto field : {&entry.url, &entry.id, &entry.title, &entry.speaker}) {
+    appendField(line, *field);
+    line += '\t';
+  }
+  for (auto number : {entry.durationMs, entry.sentences, entry.mediaBytes,
+                      entry.subtitleBytes}) {
+    line += std::to_string(number);
+    line += '\t';
+  }
+  line += statusCode(entry.status);
+  line += '\n';
+  return line;
+}
+
+static bool parseEntry(std::string_view line, LibraryEntry &entry) {
+  std::string_view fields[FieldCount];
+  size_t count = 0;
+  while (count < FieldCount) {
+    size_t tab = line.find('\t');
+    fields[count++] = line.substr(0, tab);
+    if (tab == std::string_view::npos) {
+      break;
+    }
+    line.remove_prefix(tab + 1);
+  }
+  if (count != FieldCount || fields[8].size() != 1) {
+    return false;
+  }
+
+  entry.url = unescape(fields[0]);
+  entry.id = unescape(fields[1]);
+  entry.title = unescape(fields[2]);
+  entry.speaker = unescape(fields[3]);
+  int64_t *numbers[] = {&entry.durationMs, &entry.sentences,
+                        &entry.mediaBytes, &entry.subtitleBytes};
+  for (size_t i = 0; i < 4; ++i) {
+    auto field = fields[4 + i];
+    const char *last = field.data() + field.size();
+    auto [end, error] = std::from_chars(field.data(), last, *numbers[i]);
+    if (error != std::errc() || end != last) {
+      return false;
+    }
+  }
+  switch (fields[8][0]) {
+  case 'P':
+    entry.status = TalkStatus::Partial;
+    break;
+  case 'C':
+    entry.status = TalkStatus::Cached;
+    break;
+  case 'R':
+    entry.status = TalkStatus::Removed;
+    break;
+  default:
+    return false;
+  }
+  return !entry.url.empty();
+}
+
+namespace {
+
+// holds an exclusive flock across processes; on a file of its own since
+// compaction replaces the index under its name
+class FileLock {
+public:
+  explicit FileLock(const std::string &path)
+      : mFd(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) {
+    while (mFd >= 0 && flock(mFd, LOCK_EX) != 0) {
+      if (errno != EINTR) {
+        close(mFd);
+        mFd = -1;
+      }
+    }
+  }
+
+  ~FileLock() {
+    if (mFd >= 0) {
+      close(mFd);
+    }
+  }
+
+  FileLock(const FileLock &) = delete;
+  FileLock &operator=(const FileLock &) = delete;
+
+  [[nodiscard]] bool locked() const { return mFd >= 0; }
+
+private:
+  int mFd;
+};
+
+} // namespace
+
+LibraryIndex::LibraryIndex(std::string path) : mPath(std::move(path)) {}
+
+int LibraryIndex::load() {
+  std::unique_lock lock(mMutex);
+  return loadLocked();
+}
+
+int LibraryIndex::loadLocked() {
+  mIndex.clear();
+  mEntries.clear();
+  mLiveCount = 0;
+  mLines = 0;
+
+  int fd = open(mPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    logger.error("failed to map library index {}", mPath);
+    return -1;
+  }
+
+  std::string_view content(static_cast<const char *>(data), st.st_size);
+  if (!content.starts_with(Header)) {
+    munmap(data, st.st_size);
+    logger.error("library index {} has an unknown format", mPath);
+    return -1;
+  }
+  content.remove_prefix(Header.size());
+
+  // a line without its newline is an append cut short and is ignored
+  size_t newline;
+  while ((newline = content.find('\n')) != std::string_view::npos) {
+    auto line = content.substr(0, newline);
+    content.remove_prefix(newline + 1);
+    ++mLines;
+
+    LibraryEntry entry;
+    if (!parseEntry(line, entry)) {
+      continue;
+    }
+    auto [iter, inserted] = mIndex.try_emplace(entry.url, mEntries.size());
+    if (inserted) {
+      mEntries.emplace_back(std::move(entry));
+    } else {
+      mEntries[iter->second] = std::move(entry);
+    }
+  }
+  munmap(data, st.st_size);
+
+  for (auto &&entry : mEntries) {
+    mLiveCount += entry.status != TalkStatus::Removed;
+  }
+  return 0;
+}
+
+int LibraryIndex::appendLocked(const LibraryEntry &entry) {
+  // another process may be compacting the file this line goes to
+  FileLock fileLock(lockPath());
+  if (!fileLock.locked()) {
+    logger.error("failed to lock library index {}", mPath);
+    return -1;
+  }
+  int fd = open(mPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    logger.error("failed to open library index {}", mPath);
+    return -1;
+  }
+  struct stat st {};
+  std::string line = formatEntry(entry);
+  char last = '\n';
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    line = Header + line;
+  } else if (pread(fd, &last, 1, st.st_size - 1) == 1 && last != '\n') {
+    // terminate a torn line so this record does not merge into it
+    line = '\n' + line;
+  }
+  // a single write keeps concurrent appenders from interleaving lines
+  bool written = write(fd, line.data(), line.size()) == (ssize_t)line.size();
+  close(fd);
+  if (!written) {
+    logger.error("failed to append to library index {}", mPath);
+    return -1;
+  }
+  ++mLines;
+
+  if (mLines > MinCompactLines && mLines > mLiveCount * 2) {
+    return compactLocked();
+  }
+  return 0;
+}
+
+int LibraryIndex::put(const LibraryEntry &entry) {
+  std::unique_lock lock(mMutex);
+  auto [iter, inserted] = mIndex.try_emplace(entry.url, mEntries.size());
+  if (inserted) {
+    mEntries.push_back(entry);
+    mLiveCount += entry.status != TalkStatus::Removed;
+  } else {
+    auto &current = mEntries[iter->second];
+    mLiveCount -= current.status != TalkStatus::Removed;
+    mLiveCount += entry.status != TalkStatus::Removed;
+    current = entry;
+  }
+  return appendLocked(entry);
+}
+
+int LibraryIndex::remove(const std::string &url) {
+  std::unique_lock lock(mMutex);
+  auto iter = mIndex.find(url);
+  if (iter == mIndex.end() ||
+      mEntries[iter->second].status == TalkStatus::Removed) {
+    return 0;
+  }
+  auto &entry = mEntries[iter->second];
+  entry.status = TalkStatus::Removed;
+  --mLiveCount;
+  return appendLocked(entry);
+}
+
+bool LibraryIndex::find(const std::string &url, LibraryEntry &entry) const {
+  std::unique_lock lock(mMutex);
+  auto iter = mIndex.find(url);
+  if (iter == mIndex.end() ||
+      mEntries[iter->second].status == TalkStatus::Removed) {
+    return false;
+  }
+  entry = mEntries[iter->second];
+  return true;
+}
+
+std::vector<LibraryEntry> LibraryIndex::entries() const {
+  std::unique_lock lock(mMutex);
+  std::vector<LibraryEntry> live;
+  live.reserve(mLiveCount);
+  for (auto &&entry : mEntries) {
+    if (entry.status != TalkStatus::Removed) {
+      live.push_back(entry);
+    }
+  }
+  return live;
+}
+
+size_t LibraryIndex::size() const {
+  std::unique_lock lock(mMutex);
+  return mLiveCount;
+}
+
+int LibraryIndex::compact() {
+  std::unique_lock lock(mMutex);
+  FileLock fileLock(lockPath());
+  if (!fileLock.locked()) {
+    logger.error("failed to lock library index {}", mPath);
+    return -1;
+  }
+  return compactLocked();
+}
+
+std::string LibraryIndex::lockPath() const { return mPath + ".lock"; }
+
+int LibraryIndex::compactLocked() {
+  // the file is the truth, it holds lines other processes appended since
+  // this one loaded it
+  if (loadLocked() != 0) {
+    return -1;
+  }
+
+  std::string content = Header;
+  std::vector<LibraryEntry> live;
+  live.reserve(mLiveCount);
+  for (auto &&entry : mEntries) {
+    if (entry.status != TalkStatus::Removed) {
+      content += formatEntry(entry);
+      live.push_back(entry);
+    }
+  }
+
+  std::string tmpPath = mPath + ".tmp";
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (file == nullptr) {
+    logger.error("failed to write library index {}", tmpPath);
+    return -1;
+  }
+  bool written = fwrite(content.data(), 1, content.size(), file) ==
+                 content.size();
+  written = fclose(file) == 0 && written;
+  if (!written || std::rename(tmpPath.c_str(), mPath.c_str()) != 0) {
+    logger.error("failed to compact library index {}", mPath);
+    unlink(tmpPath.c_str());
+    return -1;
+  }
+
+  mEntries = std::move(live);
+  mIndex.clear();
+  for (size_t i = 0; i < mEntries.size(); ++i) {
+    mIndex[mEntries[i].url] = i;
+  }
+  mLines = mEntries.size();
+  return 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ted {
+
+enum class TalkStatus {
+  // some files of the talk are still missing
+  Partial,
+  Cached,
+  // dropped from the cache, kept in the log until the next compaction
+  Removed,
+};
+
+struct LibraryEntry {
+  std::string id;
+  std::string url;
+  std::string title;
+  std::string speaker;
+  int64_t durationMs = 0;
+  int64_t sentences = 0;
+  int64_t mediaBytes = 0;
+  int64_t subtitleBytes = 0;
+  TalkStatus status = TalkStatus::Partial;
+};
+
+/**
+ * One file describing every cached talk, so the library lists without
+ * touching the talk directories. Updates are appended as one line each and
+ * the last line for a url wins; the file is rewritten with only the live
+ * entries once stale lines outnumber them. load() maps the file and parses
+ * it in place.
+ *
+ * The player and the prefetcher share the file: appends and compactions
+ * take an flock on path.lock, and a compaction reloads the file first so
+ * lines appended by the other process are kept.
+ */
+class LibraryIndex {
+public:
+  explicit LibraryIndex(std::string path);
+
+  // 0 if the file was read or does not exist yet, -1 on errors
+  int load();
+
+  // add or replace the entry of entry.url
+  int put(const LibraryEntry &entry);
+
+  // mark url removed
+  int remove(const std::string &url);
+
+  [[nodiscard]] bool find(const std::string &url, LibraryEntry &entry) const;
+
+  // live entries in the order they were first added
+  [[nodiscard]] std::vector<LibraryEntry> entries() const;
+
+  [[nodiscard]] size_t size() const;
+
+  // rewrite the file with one line per live entry
+  int compact();
+
+private:
+  int loadLocked();
+
+  // both hold the lock file across processes, compactLocked() expects the
+  // caller to hold it
+  int appendLocked(const LibraryEntry &entry);
+
+  int compactLocked();
+
+  [[nodiscard]] std::string lockPath() const;
+
+  std::string mPath;
+  mutable std::mutex mMutex;
+  // by url; order keeps first insertion so listings are stable
+  std::map<std::string, size_t> mIndex;
+  std::vector<LibraryEntry> mEntries;
+  size_t mLiveCount = 0;
+  size_t mLines = 0;
+};
+
+} // namespace ted
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+
+#include "PrefetchScheduler.h"
+#include "TalkCache.h"
+#include "Utils/DownloadService.h"
+#include "Utils/Utils.h"
+
+using ted::logger;
+using ted::PrefetchScheduler;
+
+static const char *STATE_QUEUED = "queued";
+static const char *STATE_DONE = "done";
+static const char *STATE_FAILED = "failed";
+// 2^20 times the initial backoff is past any sensible maxBackoff
+static constexpr int MAX_BACKOFF_SHIFT = 20;
+
+PrefetchScheduler::PrefetchScheduler(std::string journalPath,
+                                     PrefetchOptions options)
+    : mJournalPath(std::move(journalPath)), mOptions(options),
+      mFetch(fetchTalkToCache), mCached(isTalkCached) {
+  mOptions.maxConcurrent = std::max(mOptions.maxConcurrent, 1);
+  mOptions.maxPerHost = std::max(mOptions.maxPerHost, 1);
+  mOptions.maxAttempts = std::max(mOptions.maxAttempts, 1);
+  loadJournal();
+}
+
+void PrefetchScheduler::setFetchFunction(FetchFunction fetch) {
+  mFetch = std::move(fetch);
+}
+
+void PrefetchScheduler::setCachedFunction(CachedFunction cached) {
+  mCached = std::move(cached);
+}
+
+std::string PrefetchScheduler::hostOf(const std::string &url) {
+  size_t schemeEnd = url.find("://");
+  size_t begin = schemeEnd == std::string::npos ? 0 : schemeEnd + 3;
+  size_t end = url.find_first_of("/?#", begin);
+  return url.substr(begin, end == std::string::npos ? end : end - begin);
+}
+
+void PrefetchScheduler::loadJournal() {
+  // one "<state> <url>" line per change, the last one wins
+  std::ifstream journal(mJournalPath);
+  std::string line;
+  while (std::getline(journal, line)) {
+    size_t space = line.find(' ');
+    if (space == std::string::npos) {
+      continue;
+    }
+    mJournalStates[line.substr(space + 1)] = line.substr(0, space);
+  }
+}
+
+void PrefetchScheduler::appendJournal(const std::string &url,
+                                      const std::string &state, int attempts) {
+  mJournalStates[url] = state;
+  std::ofstream journal(mJournalPath, std::ios::app);
+  journal << state << " " << url << "\n";
+  journal.flush();
+  if (!journal) {
+    logger.error("failed to write prefetch journal {}", mJournalPath);
+  }
+  logger.info("prefetch {} {} after {} attempts", url, state, attempts);
+}
+
+void PrefetchScheduler::compactJournal() {
+  std::string tmpPath = mJournalPath + ".tmp";
+  {
+    std::ofstream journal(tmpPath, std::ios::trunc);
+    for (auto &&[url, state] : mJournalStates) {
+      journal << state << " " << url << "\n";
+    }
+    journal.flush();
+    if (!journal) {
+      logger.error("failed to compact prefetch journal {}", mJournalPath);
+      unlink(tmpPath.c_str());
+      return;
+    }
+  }
+  if (std::rename(tmpPath.c_str(), mJournalPath.c_str()) != 0) {
+    logger.error("failed to compact prefetch journal {}", mJournalPath);
+    unlink(tmpPath.c_str());
+  }
+}
+
+std::chrono::milliseconds PrefetchScheduler::backoffAfter(int attempts) const {
+  int shift = std::clamp(attempts - 1, 0, MAX_BACKOFF_SHIFT);
+  return std::min(mOptions.maxBackoff,
+                  mOptions.initialBackoff * (int64_t(1) << shift));
+}
+
+size_t PrefetchScheduler::add(const std::vector<std::string> &urls) {
+  std::unique_lock lock(mMutex);
+  size_t queued = 0;
+  for (auto &&url : urls) {
+    bool duplicate = std::any_of(mQueue.begin(), mQueue.end(),
+                                 [&](const Job &job) { return job.url == url; });
+    auto state = mJournalStates.find(url);
+    if (duplicate ||
+        (state != mJournalStates.end() && state->second == STATE_DONE) ||
+        mCached(url)) {
+      ++mStats.skipped;
+      continue;
+    }
+    mQueue.push_back(Job{.url = url,
+                         .host = hostOf(url),
+                         .attempts = 0,
+                         .notBefore = std::chrono::steady_clock::now()});
+    if (state == mJournalStates.end() || state->second != STATE_QUEUED) {
+      appendJournal(url, STATE_QUEUED, 0);
+    }
+    ++queued;
+  }
+  return queued;
+}
+
+size_t PrefetchScheduler::resume() {
+  std::vector<std::string> unfinished;
+  {
+    std::unique_lock lock(mMutex);
+    for (auto &&[url, state] : mJournalStates) {
+      if (state == STATE_QUEUED) {
+        unfinished.push_back(url);
+      }
+    }
+  }
+  return add(unfinished);
+}
+
+bool PrefetchScheduler::takeJob(Job &job,
+                                std::chrono::steady_clock::time_point &wakeUp) {
+  auto now = std::chrono::steady_clock::now();
+  wakeUp = std::chrono::steady_clock::time_point::max();
+  for (auto iter = mQueue.begin(); iter != mQueue.end(); ++iter) {
+    if (mActivePerHost[iter->host] >= mOptions.maxPerHost) {
+      continue;
+    }
+    if (iter->notBefore > now) {
+      wakeUp = std::min(wakeUp, iter->notBefore);
+      continue;
+    }
+    job = std::move(*iter);
+    mQueue.erase(iter);
+    return true;
+  }
+  return false;
+}
+
+void PrefetchScheduler::worker() {
+  std::unique_lock lock(mMutex);
+  while (true) {
+    Job job;
+    std::chrono::steady_clock::time_point wakeUp;
+    if (!takeJob(job, wakeUp)) {
+      // nothing queued and nothing running that could requeue
+      if (mQueue.empty() && mActive == 0) {
+        mCond.notify_all();
+        return;
+      }
+      if (wakeUp == std::chrono::steady_clock::time_point::max()) {
+        mCond.wait(lock);
+      } else {
+        mCond.wait_until(lock, wakeUp);
+      }
+      continue;
+    }
+
+    ++mActive;
+    ++mActivePerHost[job.host];
+    ++job.attempts;
+    lock.unlock();
+
+    logger.info("prefetching {}, attempt {}", job.url, job.attempts);
+    int ret = mFetch(job.url);
+
+    lock.lock();
+    --mActive;
+    --mActivePerHost[job.host];
+    if (ret == 0) {
+      ++mStats.completed;
+      appendJournal(job.url, STATE_DONE, job.attempts);
+    } else if (job.attempts >= mOptions.maxAttempts) {
+      ++mStats.failed;
+      appendJournal(job.url, STATE_FAILED, job.attempts);
+    } else {
+      auto backoff = backoffAfter(job.attempts);
+      logger.error("prefetch of {} failed, retrying in {} ms", job.url,
+                   backoff.count());
+      job.notBefore = std::chrono::steady_clock::now() + backoff;
+      mQueue.push_back(std::move(job));
+    }
+    mCond.notify_all();
+  }
+}
+
+int PrefetchScheduler::run() {
+  if (mOptions.maxBytesPerSecond > 0) {
+    DownloadService::instance().setMaxBytesPerSecond(
+        mOptions.maxBytesPerSecond);
+  }
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < mOptions.maxConcurrent; ++i) {
+    workers.emplace_back([this]() { worker(); });
+  }
+  worker();
+  for (auto &&thread : workers) {
+    thread.join();
+  }
+
+  if (mOptions.maxBytesPerSecond > 0) {
+    DownloadService::instance().setMaxBytesPerSecond(0);
+  }
+
+  {
+    std::unique_lock lock(mMutex);
+    compactJournal();
+  }
+
+  auto stats = getStats();
+  logger.info("prefetch finished: {} completed, {} failed, {} skipped",
+              stats.completed, stats.failed, stats.skipped);
+  DownloadService::instance().logStats();
+  return stats.failed == 0 ? 0 : -1;
+}
+
+PrefetchScheduler::Stats PrefetchScheduler::getStats() const {
+  std::unique_lock lock(mMutex);
+  return mStats;
+}
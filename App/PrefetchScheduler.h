@@ -0,0 +1,106 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ted {
+
+struct PrefetchOptions {
+  // talks fetched at the same time
+  int maxConcurrent = 4;
+  // talks fetched at the same time from one host
+  int maxPerHost = 2;
+  // combined receive rate of all downloads, 0 for no cap
+  int64_t maxBytesPerSecond = 0;
+  int maxAttempts = 4;
+  // doubled after every failed attempt, up to maxBackoff
+  std::chrono::milliseconds initialBackoff = std::chrono::seconds(2);
+  std::chrono::milliseconds maxBackoff = std::chrono::minutes(5);
+};
+
+/**
+ * Fetches a list of talks into the cache without a window. Talks run on a
+ * bounded set of workers with a per-host limit, failures are retried with
+ * exponential backoff, and every state change is appended to a journal so
+ * an interrupted run picks up where it stopped. Once a run settles the
+ * journal is rewritten with one line per url.
+ */
+class PrefetchScheduler {
+public:
+  // 0 on success, anything else is retried
+  using FetchFunction = std::function<int(const std::string &)>;
+  using CachedFunction = std::function<bool(const std::string &)>;
+
+  struct Stats {
+    size_t completed = 0;
+    size_t failed = 0;
+    size_t skipped = 0;
+  };
+
+  explicit PrefetchScheduler(std::string journalPath,
+                             PrefetchOptions options = PrefetchOptions());
+
+  // replace the talk fetch and cache check, e.g. in tests
+  void setFetchFunction(FetchFunction fetch);
+
+  void setCachedFunction(CachedFunction cached);
+
+  // queue urls that are neither cached nor finished in the journal, returns
+  // how many were queued
+  size_t add(const std::vector<std::string> &urls);
+
+  // queue urls the journal recorded as unfinished
+  size_t resume();
+
+  // fetch every queued url, 0 if all of them succeeded
+  int run();
+
+  [[nodiscard]] Stats getStats() const;
+
+  static std::string hostOf(const std::string &url);
+
+private:
+  struct Job {
+    std::string url;
+    std::string host;
+    int attempts = 0;
+    std::chrono::steady_clock::time_point notBefore;
+  };
+
+  void loadJournal();
+
+  void appendJournal(const std::string &url, const std::string &state,
+                     int attempts);
+
+  // replace the journal with the last state of every url
+  void compactJournal();
+
+  [[nodiscard]] std::chrono::milliseconds backoffAfter(int attempts) const;
+
+  // pop the next job allowed to start; when none is, false with the time a
+  // backoff expires in wakeUp
+  bool takeJob(Job &job, std::chrono::steady_clock::time_point &wakeUp);
+
+  void worker();
+
+  std::string mJournalPath;
+  PrefetchOptions mOptions;
+  FetchFunction mFetch;
+  CachedFunction mCached;
+
+  mutable std::mutex mMutex;
+  std::condition_variable mCond;
+  std::vector<Job> mQueue;
+  std::map<std::string, int> mActivePerHost;
+  int mActive = 0;
+  // last journaled state of every url
+  std::map<std::string, std::string> mJournalStates;
+  Stats mStats;
+};
+
+} // namespace ted
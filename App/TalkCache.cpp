@@ -0,0 +1,193 @@
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Media/Remuxer.h"
+#include "Media/SubtitleDecoder.h"
+#include "Media/WaveformPeaks.h"
+#include "TalkCache.h"
+#include "Utils/HLS.h"
+#include "Utils/Hash.h"
+#include "Utils/HttpCache.h"
+#include "Utils/MediaCache.h"
+
+using ted::logger;
+using ted::MediaCache;
+using ted::Xxh64;
+
+static inline bool exists(const std::string &path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+static int64_t fileSize(const std::string &path) {
+  struct stat st {};
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+std::string ted::talkCacheDir(const std::string &url) {
+  return MediaCache::instance().entryDir(url);
+}
+
+std::string ted::talkMediaFile(const std::string &url) {
+  return MediaCache::instance().path(url, TalkMediaName);
+}
+
+std::string ted::talkPcmFile(const std::string &url) {
+  return MediaCache::instance().path(url, TalkPcmName);
+}
+
+std::string ted::talkSubtitleFile(const std::string &url) {
+  return MediaCache::instance().path(url, TalkSubtitleName);
+}
+
+std::string ted::talkPageFile(const std::string &url) {
+  return MediaCache::instance().path(url, TalkPageName);
+}
+
+std::string ted::talkPeaksFile(const std::string &url) {
+  return MediaCache::instance().path(url, TalkPeaksName);
+}
+
+int ted::fetchTalkPage(const std::string &url, std::string &html,
+                       const CancelToken &cancel) {
+  makeTalkCacheDir(url);
+  auto result = fetchRevalidated(url, talkPageFile(url), html, cancel);
+  if (result == FetchResult::Failed) {
+    return -1;
+  }
+  if (result == FetchResult::Updated) {
+    auto &cache = MediaCache::instance();
+    cache.remove(url, TalkSubtitleName);
+    cache.commit(url, TalkPageName);
+  }
+  return 0;
+}
+
+void ted::makeTalkCacheDir(const std::string &url) {
+  MediaCache::instance().open(url);
+}
+
+bool ted::isTalkCached(const std::string &url) {
+  auto &cache = MediaCache::instance();
+  return (cache.contains(url, TalkMediaName) ||
+          cache.contains(url, TalkPcmName)) &&
+         cache.contains(url, TalkSubtitleName);
+}
+
+int ted::writeTalkSubtitles(const std::string &html, const std::string &path,
+                            uint64_t *checksum) {
+  auto subtitles = retrieveSubtitlesFromTranscript(html);
+  if (subtitles.empty()) {
+    logger.error("no transcript found for {}", path);
+    return -1;
+  }
+
+  std::string tmp = path + ".tmp";
+  Xxh64 hash;
+  {
+    std::ofstream file(tmp);
+    for (auto &&subtitle : subtitles) {
+      auto line = subtitle.toString() + "\n";
+      hash.update(line);
+      file << line;
+    }
+    if (!file) {
+      unlink(tmp.c_str());
+      return -1;
+    }
+  }
+  if (checksum != nullptr) {
+    *checksum = hash.digest();
+  }
+  return rename(tmp.c_str(), path.c_str()) == 0 ? 0 : -1;
+}
+
+int ted::fetchTalkToCache(const std::string &url) {
+  if (isTalkCached(url)) {
+    return 0;
+  }
+  makeTalkCacheDir(url);
+  // commits of other talks must not evict this one while it is filled
+  MediaCache::ScopedPin pin(MediaCache::instance(), url);
+
+  std::string html;
+  if (fetchTalkPage(url, html) != 0) {
+    return -1;
+  }
+
+  try {
+    auto &cache = MediaCache::instance();
+    auto subtitleFile = talkSubtitleFile(url);
+    uint64_t checksum = 0;
+    if (!exists(subtitleFile) &&
+        (writeTalkSubtitles(html, MediaCache::stagingPath(subtitleFile),
+                            &checksum) != 0 ||
+         cache.commit(url, TalkSubtitleName, checksum) != 0)) {
+      return -1;
+    }
+
+    auto mediaFile = talkMediaFile(url);
+    if (!exists(mediaFile)) {
+      HLSParser parser(retrieveM3U8UrlFromTalkHtml(html));
+      if (parser.init() != 0 || parser.getAudioPlayList().empty()) {
+        return -1;
+      }
+      auto segmentFile = talkCacheDir(url) + "/audio.ts";
+      if (parser.downloadAudioAdaptive(segmentFile) != 0) {
+        return -1;
+      }
+      int ret = remuxAudioToM4A(segmentFile, mediaFile);
+      unlink(segmentFile.c_str());
+      if (ret != 0 || cache.commit(url, TalkMediaName) != 0) {
+        return -1;
+      }
+    }
+
+    // the waveform is a convenience, playback does not depend on it
+    auto peaksFile = talkPeaksFile(url);
+    if (!exists(peaksFile) && buildWaveformPeaks(mediaFile, peaksFile) == 0) {
+      cache.commit(url, TalkPeaksName);
+    }
+  } catch (const std::exception &e) {
+    logger.error("failed to fetch {}: {}", url, e.what());
+    return -1;
+  }
+
+  recordTalk(url, html);
+  logger.info("cached {}", url);
+  return 0;
+}
+
+ted::LibraryIndex &ted::talkLibrary() {
+  static LibraryIndex library(MediaCache::instance().getRoot() +
+                              "/library.tsv");
+  static std::once_flag loaded;
+  std::call_once(loaded, [] {
+    library.load();
+    MediaCache::instance().setEvictionCallback(
+        [](const std::string &url) { library.remove(url); });
+  });
+  return library;
+}
+
+int ted::recordTalk(const std::string &url, const std::string &html) {
+  LibraryEntry entry;
+  try {
+    auto info = retrieveTalkInfoFromHtml(html);
+    entry.id = info.id;
+    entry.title = info.title;
+    entry.speaker = info.speaker;
+    entry.durationMs = info.durationMs;
+    entry.sentences =
+        (int64_t)mergeSubtitles(retrieveSubtitlesFromTranscript(html)).size();
+  } catch (const std::exception &e) {
+    logger.error("no talk info in the page of {}: {}", url, e.what());
+  }
+  entry.url = url;
+  entry.mediaBytes = fileSize(talkMediaFile(url)) + fileSize(talkPcmFile(url));
+  entry.subtitleBytes = fileSize(talkSubtitleFile(url));
+  entry.status = isTalkCached(url) ? TalkStatus::Cached : TalkStatus::Partial;
+  return talkLibrary().put(entry);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "LibraryIndex.h"
+#include "Utils/Cancellation.h"
+
+namespace ted {
+
+// files of a talk inside its MediaCache entry
+inline constexpr const char *TalkMediaName = "audio.m4a";
+// pcm audio cached by older builds
+inline constexpr const char *TalkPcmName = "audio.wav";
+inline constexpr const char *TalkSubtitleName = "subtitle.txt";
+inline constexpr const char *TalkPageName = "page.html";
+inline constexpr const char *TalkPeaksName = "peaks.bin";
+
+// per talk cache layout under ./.cacheMedias
+std::string talkCacheDir(const std::string &url);
+
+std::string talkMediaFile(const std::string &url);
+
+std::string talkPcmFile(const std::string &url);
+
+std::string talkSubtitleFile(const std::string &url);
+
+std::string talkPageFile(const std::string &url);
+
+std::string talkPeaksFile(const std::string &url);
+
+// talk page html, revalidated against the cached copy; subtitles derived
+// from an outdated copy are dropped. 0 on success
+int fetchTalkPage(const std::string &url, std::string &html,
+                  const CancelToken &cancel = {});
+
+// create the cache entry of url, adopting one left by older builds
+void makeTalkCacheDir(const std::string &url);
+
+// audio, m4a or pcm, and subtitles of url are both on disk
+bool isTalkCached(const std::string &url);
+
+// subtitles of a talk page as written to talkSubtitleFile, with the xxh64
+// of the written bytes in checksum if given
+int writeTalkSubtitles(const std::string &html, const std::string &path,
+                       uint64_t *checksum = nullptr);
+
+// download everything playback needs without a window, 0 on success
+int fetchTalkToCache(const std::string &url);
+
+// library.tsv next to the talk entries, loaded on first use and kept in
+// step with cache evictions
+LibraryIndex &talkLibrary();
+
+// update the library entry of url from its page and the files on disk
+int recordTalk(const std::string &url, const std::string &html);
+
+} // namespace ted
@@ -1,18 +1,27 @@
-#include <fstream>
-#include <sys/stat.h>
+#include <optional>
+#include <sstream>
 #include <unistd.h>
 
 #include <SDL_opengl.h>
 
+#include "Media/MappedPcmSource.h"
+#include "Media/Remuxer.h"
+#include "Media/StreamInfoCache.h"
+#include "Media/WaveformPeaks.h"
+#include "TalkCache.h"
 #include "TedController.h"
+#include "Utils/AsyncFileIO.h"
+#include "Utils/DownloadService.h"
 #include "Utils/HLS.h"
-#include "Utils/ThreadPool.h"
+#include "Utils/Hash.h"
+#include "Utils/MediaCache.h"
+#include "Utils/TaskGraph.h"
+#include "Utils/WorkStealingPool.h"
 
 #include "Imgui/imgui.h"
 #include "Imgui/imgui_impl_opengl3.h"
 #include "Imgui/imgui_impl_sdl2.h"
 
-#define MEDIA_FILE_SUFFIX ".wav"
 using ted::logger;
 
 [[maybe_unused]] static std::vector<ted::Subtitle>
@@ -41,20 +50,10 @@ retrieveAllSubtitlesFromAss(const std::string &mediaFile) {
   return subtitles;
 }
 
-static const char *CacheDir = "./.cacheMedias";
-
 static inline bool exists(const std::string &path) {
   return access(path.c_str(), F_OK) == 0;
 }
 
-static inline std::string getCacheFile(const std::string &url) {
-  auto file = std::hash<std::string>{}(url);
-  std::stringstream ss;
-  ss << std::hex;
-  ss << CacheDir << "/" << file;
-  return ss.str();
-}
-
 void TedController::GlobalInit() {
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_AUDIO |
                SDL_INIT_GAMECONTROLLER) != 0) {
@@ -72,24 +71,204 @@ void TedController::GlobalInit() {
   SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
 }
 
+// past it a cached talk page is used without waiting for revalidation
+static constexpr auto PAGE_TIMEOUT = std::chrono::seconds(10);
+
+static int64_t millisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
 TedController::TedController(std::string url)
-    : mUrl(std::move(url)),
-      mMediaFile(getCacheFile(mUrl) + "/audio" + MEDIA_FILE_SUFFIX),
-      mSubtitleFile(getCacheFile(mUrl) + "/subtitle.txt"), mThreadPool(4) {
-  if (!exists(CacheDir)) {
-    mkdir(CacheDir, 0777);
+    : mUrl(std::move(url)), mMediaFile(ted::talkMediaFile(mUrl)),
+      mSubtitleFile(ted::talkSubtitleFile(mUrl)),
+      // the download and the waveform reader each hold a worker for as long
+      // as the audio streams in, the rest of the load never waits on one
+      mThreadPool(ted::WorkStealingPool::defaultThreads() + 2) {
+  ted::makeTalkCacheDir(mUrl);
+  // other talks may be evicted to make room, never the one being played
+  ted::MediaCache::instance().pin(mUrl);
+  // caches from before the m4a switch hold pcm, served from a mapping
+  auto pcmFile = ted::talkPcmFile(mUrl);
+  if (!exists(mMediaFile) && exists(pcmFile)) {
+    mMediaFile = pcmFile;
+  }
+  if (!exists(mMediaFile)) {
+    mProgressiveFile = ted::NativeHLSDownloader::partPath(
+        ted::talkCacheDir(mUrl) + "/audio.ts");
+    mProgressiveSource =
+        std::make_shared<ted::GrowingFileSource>(mProgressiveFile);
+    mPeaksSource = std::make_shared<ted::GrowingFileSource>(mProgressiveFile);
   }
-  if (!exists(getCacheFile(mUrl))) {
-    mkdir(getCacheFile(mUrl).c_str(), 0777);
+
+  // the window comes up first, network and probing report into it
+  initUI();
+  loadTalk();
+}
+
+void TedController::loadTalk() {
+  ted::TaskGraph graph(mThreadPool, mUrl,
+                       ted::CancelToken(mStop.get_token()));
+  auto cancel = graph.cancelToken();
+
+  auto page = graph.add("page", [this, cancel]() {
+    auto html = fetchPage(cancel);
+    auto stage = LoadStage::FetchingPage;
+    mLoadStage.compare_exchange_strong(stage, LoadStage::WaitingForAudio);
+    return html;
+  });
+
+  // the sentence being played comes first, these run behind it
+  ted::GraphNode<void> firstSegment;
+  if (mProgressiveSource != nullptr) {
+    page.then("download", ted::TaskPriority::Bulk,
+              [this, cancel](const std::shared_ptr<const std::string> &html) {
+                downloadAudio(html, cancel);
+              });
+    // completed by the download committing its first segment, not by a
+    // worker parked on the file
+    firstSegment = page.thenAsync<void>(
+        "first segment", [this](const std::shared_ptr<const std::string> &,
+                                ted::GraphPromise<void> promise) {
+          mProgressiveSource->whenStarted([this, promise](bool started) {
+            if (started) {
+              promise.set();
+            } else if (mDownloadError) {
+              promise.fail(mDownloadError);
+            } else {
+              promise.fail(std::make_exception_ptr(std::runtime_error(
+                  "the download stopped before any audio arrived")));
+            }
+          });
+        });
+    // a second reader builds the waveform while the audio arrives
+    firstSegment.then("peaks", ted::TaskPriority::Bulk, [this, cancel]() {
+      if (ted::buildWaveformPeaks(mProgressiveFile, ted::talkPeaksFile(mUrl),
+                                  mPeaksSource, cancel) == 0) {
+        ted::MediaCache::instance().commit(mUrl, ted::TalkPeaksName);
+      }
+    });
+  } else if (!exists(ted::talkPeaksFile(mUrl))) {
+    graph.add("peaks", ted::TaskPriority::Bulk, [this, cancel]() {
+      if (ted::buildWaveformPeaks(mMediaFile, ted::talkPeaksFile(mUrl),
+                                  nullptr, cancel) == 0) {
+        ted::MediaCache::instance().commit(mUrl, ted::TalkPeaksName);
+      }
+    });
   }
-  fetchTedTalk();
 
-  mAudioDecoder = std::make_unique<ted::AudioDecoder>(mMediaFile);
-  mAudioDecoder->init();
+  // a changed page drops the cached subtitles, whether there are any is
+  // only known once it has been fetched
+  auto cachedSubtitles = page.thenAsync<std::optional<std::string>>(
+      "read subtitles",
+      [this](const std::shared_ptr<const std::string> &,
+             ted::GraphPromise<std::optional<std::string>> promise) {
+        if (!exists(mSubtitleFile)) {
+          promise.set(std::nullopt);
+          return;
+        }
+        ted::AsyncFileIO::instance().readFile(
+            mSubtitleFile,
+            [promise](std::exception_ptr error, std::string content) {
+              if (error) {
+                promise.fail(error);
+              } else {
+                promise.set(std::move(content));
+              }
+            });
+      });
+  // the subtitles parsed from the page, null when the cached ones were used
+  auto subtitles = cachedSubtitles.then(
+      "subtitles",
+      [this, page](const std::optional<std::string> &cached)
+          -> std::shared_ptr<const std::vector<ted::Subtitle>> {
+        if (cached.has_value()) {
+          std::istringstream subtitleFile(*cached);
+          std::string line;
+          while (std::getline(subtitleFile, line)) {
+            mSubtitles.emplace_back(ted::Subtitle::fromString(line));
+          }
+          return nullptr;
+        }
+        auto parsed = std::make_shared<const std::vector<ted::Subtitle>>(
+            ted::retrieveSubtitlesFromTranscript(*page.future().get()));
+        mSubtitles = ted::mergeSubtitles(*parsed);
+        return parsed;
+      });
+  // off the load path, playback does not wait for the file; the write
+  // completes on the io thread, the commit and its eviction on a worker
+  auto savedSubtitles = subtitles.thenAsync<std::optional<uint64_t>>(
+      "save subtitles", ted::TaskPriority::Bulk,
+      [this](const std::shared_ptr<const std::vector<ted::Subtitle>> &parsed,
+             ted::GraphPromise<std::optional<uint64_t>> promise) {
+        if (parsed == nullptr || parsed->empty()) {
+          promise.set(std::nullopt);
+          return;
+        }
+        saveSubtitles(*parsed, std::move(promise));
+      });
+  savedSubtitles.then("commit subtitles", ted::TaskPriority::Bulk,
+                      [url = mUrl](const std::optional<uint64_t> &checksum) {
+                        if (checksum.has_value()) {
+                          ted::MediaCache::instance().commit(
+                              url, ted::TalkSubtitleName, *checksum);
+                        }
+                      });
+
+  // a download is only probed once its first segment is in
+  auto audio =
+      mProgressiveSource != nullptr
+          ? firstSegment.then("open audio", [this]() { openAudio(); })
+          : graph.add("open audio", [this]() { openAudio(); });
+
+  auto ready = graph.whenSettled(
+      "ready", ted::TaskPriority::Interactive,
+      [this, audio, subtitles]() {
+        try {
+          audio.future().get();
+          subtitles.future().get();
+          if (mSubtitles.empty()) {
+            throw std::runtime_error("the talk has no transcript");
+          }
+        } catch (const std::exception &e) {
+          logger.error("failed to load {}: {}", mUrl, e.what());
+          std::unique_lock lock(mLoadMutex);
+          mLoadError = e.what();
+          mLoadStage = LoadStage::Failed;
+          return;
+        }
+
+        std::unique_lock lock(mLoadMutex);
+        mLoadStage = LoadStage::Ready;
+        logger.info("talk ready after {} ms", millisecondsSince(mStartTime));
+        if (!mUserExit) {
+          mPlayThread = std::thread(&TedController::runImpl, this);
+        }
+      },
+      audio, subtitles);
+  graph.traceCriticalPath(ready);
+  mLoad = ready.future();
+  mLoadIdle = graph.whenIdle();
+}
+
+void TedController::openAudio() {
+  if (mProgressiveSource != nullptr) {
+    // the first segment is in, probing rarely reads past it
+    mAudioDecoder = std::make_unique<ted::AudioDecoder>(mProgressiveFile);
+    mAudioDecoder->setIOSource(mProgressiveSource);
+    mAudioDecoder->setCancelToken(ted::CancelToken(mStop.get_token()));
+    if (mAudioDecoder->init() != 0) {
+      throw std::runtime_error("failed to open the downloading audio");
+    }
+  } else {
+    mAudioDecoder = ted::openAudioDecoder(mMediaFile);
+    if (mAudioDecoder == nullptr) {
+      throw std::runtime_error("failed to open " + mMediaFile);
+    }
+  }
   mPlayer.init(mAudioDecoder->getAudioParam());
   mPlayer.play();
-
-  initUI();
 }
 
 int TedController::play() {
@@ -122,11 +301,21 @@ int TedController::play() {
     }
 
     mPlayer.enqueue(frame);
+    if (!mFirstAudioReported) {
+      mFirstAudioReported = true;
+      logger.info("time to first audio: {} ms", millisecondsSince(mStartTime));
+    }
     if (mAudioDecoder->getCurrentTime() >= subtitle.end) {
       break;
     }
   }
 
+  if (!mFirstSentenceReported) {
+    mFirstSentenceReported = true;
+    logger.info("time to first sentence: {} ms",
+                millisecondsSince(mStartTime));
+  }
+
   ++mSubtitleIndex;
 
   return 0;
@@ -185,7 +374,13 @@ void TedController::run() {
 
     {
       ImGui::Begin("ted");
-      ImGui::Text("hello, world");
+      if (mLoadStage == LoadStage::Ready) {
+        auto index = std::min<size_t>(mSubtitleIndex, mSubtitles.size() - 1);
+        ImGui::Text("%zu / %zu", index + 1, mSubtitles.size());
+        ImGui::TextWrapped("%s", mSubtitles[index].text.c_str());
+      } else {
+        drawLoadProgress();
+      }
       ImGui::End();
     }
 
@@ -197,11 +392,63 @@ void TedController::run() {
 
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
     SDL_GL_SwapWindow(mWindow);
+    if (!mWindowReported) {
+      mWindowReported = true;
+      logger.info("time to window: {} ms", millisecondsSince(mStartTime));
+    }
+  }
+
+  exit();
+}
+
+void TedController::drawLoadProgress() {
+  switch (mLoadStage.load()) {
+  case LoadStage::FetchingPage:
+    ImGui::Text("fetching the talk page");
+    break;
+  case LoadStage::WaitingForAudio:
+    ImGui::Text("waiting for the first audio");
+    break;
+  case LoadStage::Failed: {
+    std::unique_lock lock(mLoadMutex);
+    ImGui::TextWrapped("failed to load the talk: %s", mLoadError.c_str());
+    return;
+  }
+  case LoadStage::Ready:
+    return;
+  }
+
+  size_t total = mSegmentsTotal;
+  if (total > 0) {
+    size_t done = mSegmentsDone;
+    auto label = std::to_string(done) + " / " + std::to_string(total);
+    ImGui::ProgressBar((float)done / (float)total, ImVec2(-1, 0),
+                       label.c_str());
   }
 }
 
 void TedController::exit() {
-  mUserExit.store(true);
+  {
+    std::unique_lock lock(mLoadMutex);
+    mUserExit.store(true);
+  }
+  // queued work of this talk is dropped, running work gives up at its next
+  // check instead of finishing a download nobody will play
+  mStop.request_stop();
+  // a decoder waiting for segments would otherwise hold up the join
+  if (mProgressiveSource != nullptr) {
+    mProgressiveSource->abort();
+    mPeaksSource->abort();
+  }
+  // the loader has either started the play thread or will not start it
+  if (mLoad.valid()) {
+    mLoad.wait();
+  }
+  // saving subtitles, the waveform and the rest of the download finish or
+  // give up before the pool they continue on goes away with this object
+  if (mLoadIdle.valid()) {
+    mLoadIdle.wait();
+  }
   if (mPlayThread.joinable()) {
     mPlayThread.join();
   }
@@ -217,53 +464,87 @@ void TedController::runImpl() {
   }
 }
 
-void TedController::fetchTedTalk() {
-  std::string html;
-
-  auto cacheFile = getCacheFile(mUrl);
-  std::optional<std::future<void>> audioDownload, subtitleDownload;
+std::shared_ptr<const std::string>
+TedController::fetchPage(const ted::CancelToken &cancel) {
+  auto html = std::make_shared<std::string>();
   if (!exists(mMediaFile) || !exists(mSubtitleFile)) {
-    ted::SimpleDownloader downloader(mUrl, &html);
-    downloader.init();
-    downloader.download();
-  }
-  if (!exists(mMediaFile)) {
-    audioDownload = mThreadPool.enqueue([this, &html]() {
-      auto m3u8 = ted::retrieveM3U8UrlFromTalkHtml(html);
-      logger.info("fetching media resources from {}", m3u8);
-
-      ted::HLSParser parser(m3u8);
-      parser.init();
-      if (parser.getAudioPlayList().empty()) {
-        throw std::runtime_error("no audio playlist");
-      }
-      parser.downloadAudioByName("medium", mMediaFile);
-    });
+    // an unchanged page costs a 304 and keeps the parsed subtitles; a slow
+    // revalidation falls back to the cached copy, without one the first
+    // fetch takes as long as it takes
+    auto pageCancel = exists(ted::talkPageFile(mUrl))
+                          ? cancel.withTimeout(PAGE_TIMEOUT)
+                          : cancel;
+    if (ted::fetchTalkPage(mUrl, *html, pageCancel) != 0) {
+      html->clear();
+    }
   }
+  return html;
+}
 
-  if (!exists(mSubtitleFile)) {
-    subtitleDownload = mThreadPool.enqueue([this, &html]() {
-      auto subtitles = ted::retrieveSubtitlesFromTranscript(html);
-      mSubtitles = ted::mergeSubtitles(subtitles);
-      std::ofstream subtitleFile(mSubtitleFile);
-      for (auto &&subtitle : subtitles) {
-        subtitleFile << subtitle.toString() << "\n";
-      }
-    });
-  } else {
-    subtitleDownload = mThreadPool.enqueue([this]() {
-      std::ifstream subtitleFile(mSubtitleFile);
-      std::string line;
-      while (std::getline(subtitleFile, line)) {
-        mSubtitles.emplace_back(ted::Subtitle::fromString(line));
-      }
-    });
+void TedController::downloadAudio(std::shared_ptr<const std::string> html,
+                                  const ted::CancelToken &cancel) {
+  auto segmentFile = ted::talkCacheDir(mUrl) + "/audio.ts";
+  try {
+    auto m3u8 = ted::retrieveM3U8UrlFromTalkHtml(*html);
+    logger.info("fetching media resources from {}", m3u8);
+
+    ted::HLSParser parser(m3u8);
+    parser.setCancelToken(cancel);
+    parser.init();
+    if (parser.getAudioPlayList().empty()) {
+      throw std::runtime_error("no audio playlist");
+    }
+    // start on the cheapest rendition and step up once throughput is
+    // known, renditions share segment boundaries so the ts stays whole
+    bool downloaded = parser.downloadAudioAdaptive(
+                          segmentFile, "medium",
+                          [this](size_t done, size_t total, int64_t bytes) {
+                            mProgressiveSource->grow(bytes);
+                            mPeaksSource->grow(bytes);
+                            mSegmentsTotal = total;
+                            mSegmentsDone = done;
+                          }) == 0;
+    if (!downloaded) {
+      cancel.throwIfCancelled();
+      throw std::runtime_error("failed to download audio");
+    }
+  } catch (...) {
+    // the sources publish it to the first segment stage when finished
+    mDownloadError = std::current_exception();
+    mProgressiveSource->finish(false);
+    mPeaksSource->finish(false);
+    throw;
   }
+  mProgressiveSource->finish(true);
+  mPeaksSource->finish(true);
 
-  if (audioDownload) {
-    audioDownload->wait();
+  // segments are stream copied into mp4, never transcoded; the decoder
+  // keeps reading the unlinked ts until this session ends
+  if (ted::remuxAudioToM4A(segmentFile, mMediaFile) != 0) {
+    throw std::runtime_error("failed to remux audio");
   }
-  if (subtitleDownload) {
-    subtitleDownload->wait();
+  unlink(segmentFile.c_str());
+  ted::MediaCache::instance().commit(mUrl, ted::TalkMediaName);
+  ted::recordTalk(mUrl, *html);
+  ted::DownloadService::instance().logStats();
+}
+
+void TedController::saveSubtitles(
+    const std::vector<ted::Subtitle> &subtitles,
+    ted::GraphPromise<std::optional<uint64_t>> promise) {
+  std::string content;
+  for (auto &&subtitle : subtitles) {
+    content += subtitle.toString() + "\n";
   }
+  // renamed into place by the write, the cache only accounts for it
+  auto checksum = ted::xxh64(content);
+  ted::AsyncFileIO::instance().writeFile(
+      mSubtitleFile, std::move(content), [promise, checksum](int ret) {
+        if (ret == 0) {
+          promise.set(checksum);
+        } else {
+          promise.fail(std::make_exception_ptr(
+              std::runtime_error("failed to save the subtitles")));
+        }
+      });
 }
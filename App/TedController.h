@@ -1,13 +1,21 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <optional>
 #include <sstream>
+#include <stop_token>
 #include <vector>
 
 #include "Media/AudioDecoder.h"
 #include "Media/AudioPlayer.h"
 #include "Media/SubtitleDecoder.h"
+#include "Utils/TaskGraph.h"
 #include "Utils/Utils.h"
-#include "Utils/ThreadPool.h"
+#include "Utils/WorkStealingPool.h"
 
 class TedController {
 public:
@@ -28,9 +36,43 @@ private:
 
   int seekByIndex(int64_t index);
 
-  void fetchTedTalk();
+  // stage the page, audio, subtitles and waveform as a TaskGraph on the
+  // pool and return at once; mLoad completes when the talk is ready or
+  // failed to load, mLoadIdle once every stage of the load has completed
+  void loadTalk();
+
+  // the talk page, empty when nothing that needs it is missing
+  std::shared_ptr<const std::string> fetchPage(const ted::CancelToken &cancel);
+
+  // download into mProgressiveFile, growing both sources as segments land
+  void downloadAudio(std::shared_ptr<const std::string> html,
+                     const ted::CancelToken &cancel);
+
+  // open the decoder and start the player
+  void openAudio();
+
+  // write the subtitle file without waiting for it, promise gets the xxh64
+  // of the content once it is in place
+  void saveSubtitles(const std::vector<ted::Subtitle> &subtitles,
+                     ted::GraphPromise<std::optional<uint64_t>> promise);
+
+  void drawLoadProgress();
+
+  enum class LoadStage { FetchingPage, WaitingForAudio, Ready, Failed };
 
   std::atomic<bool> mUserExit = false;
+  // requested by exit(), cancels the download, decoding and analysis of
+  // the talk still in flight
+  std::stop_source mStop;
+
+  std::atomic<LoadStage> mLoadStage = LoadStage::FetchingPage;
+  std::mutex mLoadMutex;
+  // guarded by mLoadMutex
+  std::string mLoadError;
+  std::shared_future<void> mLoad;
+  std::shared_future<void> mLoadIdle;
+  std::atomic<size_t> mSegmentsDone = 0;
+  std::atomic<size_t> mSegmentsTotal = 0;
 
   std::string mUrl;
   std::string mMediaFile;
@@ -39,13 +81,29 @@ private:
   ted::AudioPlayer mPlayer;
   std::unique_ptr<ted::AudioDecoder> mAudioDecoder;
 
+  // set while the audio is still downloading and played as it arrives
+  std::shared_ptr<ted::GrowingFileSource> mProgressiveSource;
+  // second reader of the same file for the waveform
+  std::shared_ptr<ted::GrowingFileSource> mPeaksSource;
+  std::string mProgressiveFile;
+  // why the download stopped, set before the sources are finished so the
+  // first segment stage can report it
+  std::exception_ptr mDownloadError;
+
+  std::chrono::steady_clock::time_point mStartTime =
+      std::chrono::steady_clock::now();
+  bool mWindowReported = false;
+  bool mFirstAudioReported = false;
+  bool mFirstSentenceReported = false;
+
+  // written before mLoadStage becomes Ready, read-only afterwards
   std::vector<ted::Subtitle> mSubtitles;
-  decltype(mSubtitles)::size_type mSubtitleIndex = 0;
+  std::atomic<decltype(mSubtitles)::size_type> mSubtitleIndex = 0;
 
   SDL_GLContext mGLContext;
   SDL_Window* mWindow;
 
-  ThreadPool mThreadPool;
+  ted::WorkStealingPool mThreadPool;
   std::thread mPlayThread;
   std::atomic<bool> isRunning = false;
 };
@@ -1,10 +1,130 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+#include "PrefetchScheduler.h"
+#include "TalkCache.h"
 #include "TedController.h"
+#include "Utils/MediaCache.h"
 
 using ted::logger;
 
-int main() {
-  std::string url = "https://www.ted.com/talks/"
-                          "francis_de_los_reyes_how_the_water_you_flush_becomes_the_water_you_drink";
+// TedShadow --prefetch <url list> [--rate <bytes/s>] [--per-host <n>]
+//           [--jobs <n>] [--cache-budget <MiB>]
+static int prefetch(int argc, char **argv) {
+  std::string listFile = argv[2];
+  ted::PrefetchOptions options;
+  for (int i = 3; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--rate") == 0) {
+      options.maxBytesPerSecond = std::stoll(argv[i + 1]);
+    } else if (strcmp(argv[i], "--per-host") == 0) {
+      options.maxPerHost = std::stoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--jobs") == 0) {
+      options.maxConcurrent = std::stoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--cache-budget") == 0) {
+      ted::MediaCache::instance().setBudget(std::stoll(argv[i + 1]) << 20);
+    } else {
+      logger.error("unknown option {}", argv[i]);
+      return 1;
+    }
+  }
+
+  std::ifstream list(listFile);
+  if (!list) {
+    logger.error("cannot open {}", listFile);
+    return 1;
+  }
+  std::vector<std::string> urls;
+  std::string line;
+  while (std::getline(list, line)) {
+    auto url = ted::trim(line);
+    if (!url.empty() && !url.starts_with('#')) {
+      urls.emplace_back(url);
+    }
+  }
+
+  ted::PrefetchScheduler scheduler(listFile + ".journal", options);
+  scheduler.resume();
+  scheduler.add(urls);
+  return scheduler.run() == 0 ? 0 : 1;
+}
+
+// TedShadow --list
+static int listLibrary() {
+  auto start = std::chrono::steady_clock::now();
+  auto &library = ted::talkLibrary();
+  auto entries = library.entries();
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  for (auto &&entry : entries) {
+    logger.info("{} {} - {} [{}:{:02}, {} sentences, {:.1f} MiB{}]",
+                entry.id, entry.speaker, entry.title,
+                entry.durationMs / 60000, entry.durationMs / 1000 % 60,
+                entry.sentences, (double)entry.mediaBytes / (1 << 20),
+                entry.status == ted::TalkStatus::Cached ? "" : ", partial");
+  }
+  logger.info("{} talks listed in {} us", entries.size(), elapsed.count());
+  return 0;
+}
+
+// TedShadow --verify [--jobs <n>] [--evict]
+static int verifyCache(int argc, char **argv) {
+  size_t jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  bool evict = false;
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      jobs = std::stoul(argv[++i]);
+    } else if (strcmp(argv[i], "--evict") == 0) {
+      evict = true;
+    } else {
+      logger.error("unknown option {}", argv[i]);
+      return 1;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto report = ted::MediaCache::instance().verify(jobs, evict);
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  for (auto &&problem : report.problems) {
+    // pinned entries are reported but not removed
+    const char *outcome = "";
+    if (problem.evicted) {
+      outcome = ", evicted";
+    } else if (evict) {
+      outcome = ", kept while pinned";
+    }
+    logger.error("{} {}: {}{}", problem.url, problem.name, problem.reason,
+                 outcome);
+  }
+  logger.info("verified {} files, {:.1f} MiB in {:.2f} s ({:.0f} MiB/s), "
+              "{} damaged, {} without checksum",
+              report.files, (double)report.bytes / (1 << 20), seconds,
+              (double)report.bytes / (1 << 20) / std::max(seconds, 1e-6),
+              report.problems.size(), report.unchecked);
+  return report.problems.empty() ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 3 && strcmp(argv[1], "--prefetch") == 0) {
+    return prefetch(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "--list") == 0) {
+    return listLibrary();
+  }
+  if (argc >= 2 && strcmp(argv[1], "--verify") == 0) {
+    return verifyCache(argc, argv);
+  }
+
+  std::string url = argc >= 2 ? argv[1]
+                              : "https://www.ted.com/talks/"
+                                "francis_de_los_reyes_how_the_water_you_flush_"
+                                "becomes_the_water_you_drink";
 
   TedController::GlobalInit();
 
@@ -12,4 +132,4 @@ int main() {
   controller.run();
 
   return 0;
-}
\ No newline at end of file
+}
@@ -24,7 +24,7 @@ int AudioDecoder::init() {
     logger.info("Audio decoder is ready");
   }
 
-  return 0;
+  return ret;
 }
 
 int AudioDecoder::seek(int64_t timestampUs) {
@@ -34,6 +34,11 @@ int AudioDecoder::seek(int64_t timestampUs) {
 int AudioDecoder::getNextFrame(std::shared_ptr<AVFrame>& frame) {
   int ret = decodeLoopOnce();
 
+  if (ret == AVERROR_EOF) {
+    frame = nullptr;
+    return 0;
+  }
+
   if (ret == 0 && mFrame->linesize[0] > 0) {
     auto *interleaved = interleaveSamples(mFrame);
     frame = {interleaved, [](AVFrame *f) {
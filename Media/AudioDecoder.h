@@ -21,7 +21,7 @@ public:
 
   int getNextFrame(std::shared_ptr<AVFrame>& frame) override;
 
-  [[nodiscard]] AudioParam getAudioParam() const;
+  [[nodiscard]] virtual AudioParam getAudioParam() const;
 
   [[nodiscard]] Time convertTime(int64_t timestampUs) const;
 };
@@ -0,0 +1,130 @@
+#include "ClipPlaylist.h"
+#include "Utils/Utils.h"
+
+using ted::CancelToken;
+using ted::ClipPlaylist;
+using ted::DecodedClip;
+using ted::TaskPriority;
+
+int ted::decodeClip(DecoderPool &pool, const Clip &clip, DecodedClip &decoded,
+                    const CancelToken &cancel) {
+  auto decoder = pool.acquire(clip.mediaFile, clip.subtitle.start.us());
+  if (decoder == nullptr) {
+    return -1;
+  }
+
+  decoded.clip = clip;
+  decoded.param = decoder->getAudioParam();
+  decoded.frames.clear();
+
+  while (decoder->getCurrentTime() < clip.subtitle.end) {
+    if (cancel.cancelled()) {
+      return -1;
+    }
+    std::shared_ptr<AVFrame> frame;
+    int ret = decoder->getNextFrame(frame);
+    if (ret != 0) {
+      logger.error("Clip decode failed: {}", clip.mediaFile);
+      return -1;
+    }
+    if (frame == nullptr) {
+      break;
+    }
+    decoded.frames.push_back(std::move(frame));
+  }
+
+  return 0;
+}
+
+ClipPlaylist::ClipPlaylist(DecoderPool &decoderPool,
+                           WorkStealingPool &threadPool)
+    : mDecoderPool(decoderPool), mThreadPool(threadPool) {}
+
+ClipPlaylist::~ClipPlaylist() { cancelPrefetch(); }
+
+void ClipPlaylist::cancelPrefetch() {
+  if (mPrefetch) {
+    mPrefetch->stop.request_stop();
+    mPrefetch->result.wait();
+    mPrefetch.reset();
+  }
+}
+
+void ClipPlaylist::setClips(std::vector<Clip> clips) {
+  cancelPrefetch();
+  mClips = std::move(clips);
+  mIndex = 0;
+  prefetch(0);
+}
+
+bool ClipPlaylist::hasNext() const { return mIndex < mClips.size(); }
+
+void ClipPlaylist::prefetch(size_t index) {
+  if (index >= mClips.size()) {
+    return;
+  }
+
+  std::stop_source stop;
+  auto future = mThreadPool.enqueueCancellable(
+      TaskPriority::Interactive, CancelToken(stop.get_token()),
+      [this, clip = mClips[index]](
+          const CancelToken &cancel) -> std::optional<DecodedClip> {
+        DecodedClip decoded;
+        if (decodeClip(mDecoderPool, clip, decoded, cancel) != 0) {
+          return std::nullopt;
+        }
+        return decoded;
+      });
+  mPrefetch = Prefetched{index, std::move(stop), std::move(future)};
+}
+
+int ClipPlaylist::next(DecodedClip &decoded) {
+  if (!hasNext()) {
+    return -1;
+  }
+
+  size_t index = mIndex++;
+  if (!mPrefetch || mPrefetch->index != index) {
+    cancelPrefetch();
+    prefetch(index);
+  }
+  auto result = mPrefetch->result.get();
+  mPrefetch.reset();
+
+  // start decoding the following clip while the caller plays this one
+  prefetch(mIndex);
+
+  if (!result) {
+    logger.error("failed to decode clip {} of {}", index, mClips.size());
+    return -1;
+  }
+  decoded = std::move(*result);
+  return 0;
+}
+
+int ClipPlaylist::play(AudioPlayer &player, const std::atomic<bool> &stop) {
+  std::optional<AudioParam> param;
+  while (hasNext() && !stop.load()) {
+    DecodedClip decoded;
+    if (next(decoded) != 0) {
+      continue;
+    }
+
+    if (!param) {
+      param = decoded.param;
+    } else if (param->sampleRate != decoded.param.sampleRate ||
+               param->channels != decoded.param.channels ||
+               param->sampleFormat != decoded.param.sampleFormat) {
+      logger.error("skip clip with mismatched audio format: {}",
+                   decoded.clip.mediaFile);
+      continue;
+    }
+
+    logger.info("playing clip\n {}", decoded.clip.subtitle.text);
+    for (auto &&frame : decoded.frames) {
+      player.enqueue(frame);
+    }
+  }
+
+  return 0;
+}
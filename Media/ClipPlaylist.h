@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <future>
+#include <optional>
+#include <stop_token>
+#include <vector>
+
+#include "AudioPlayer.h"
+#include "DecoderPool.h"
+#include "SubtitleDecoder.h"
+#include "Utils/WorkStealingPool.h"
+
+namespace ted {
+
+// one sentence of one talk
+struct Clip {
+  std::string mediaFile;
+  Subtitle subtitle;
+};
+
+struct DecodedClip {
+  Clip clip;
+  AudioParam param;
+  std::vector<std::shared_ptr<AVFrame>> frames;
+};
+
+// decode the frames covering clip.subtitle using a pooled decoder, -1 if
+// cancel is cancelled first
+int decodeClip(DecoderPool &pool, const Clip &clip, DecodedClip &decoded,
+               const CancelToken &cancel = {});
+
+/**
+ * Plays clips from many talks back to back. While one clip is being played,
+ * the next one is decoded on the thread pool so that switching talks does
+ * not stall on opening a decoder.
+ */
+class ClipPlaylist {
+public:
+  ClipPlaylist(DecoderPool &decoderPool, WorkStealingPool &threadPool);
+
+  ~ClipPlaylist();
+
+  void setClips(std::vector<Clip> clips);
+
+  [[nodiscard]] bool hasNext() const;
+
+  // blocks until the next clip is decoded, then prefetches the one after
+  int next(DecodedClip &decoded);
+
+  // feed every clip into the player until the list ends or stop is set
+  int play(AudioPlayer &player, const std::atomic<bool> &stop);
+
+private:
+  void prefetch(size_t index);
+
+  // stop a prefetch that is no longer wanted and wait for its worker
+  void cancelPrefetch();
+
+  DecoderPool &mDecoderPool;
+  WorkStealingPool &mThreadPool;
+
+  std::vector<Clip> mClips;
+  size_t mIndex = 0;
+
+  struct Prefetched {
+    size_t index;
+    std::stop_source stop;
+    std::future<std::optional<DecodedClip>> result;
+  };
+  std::optional<Prefetched> mPrefetch;
+};
+
+} // namespace ted
@@ -1,6 +1,8 @@
 #include "DecoderBase.h"
+#include "StreamInfoCache.h"
 #include "Utils/Utils.h"
 
+using ted::CancelToken;
 using ted::DecoderBase;
 
 DecoderBase::DecoderBase(std::string mediaFile, AVMediaType type)
@@ -13,6 +15,7 @@ DecoderBase::~DecoderBase() {
   if (mFormatContext != nullptr) {
     avformat_close_input(&mFormatContext);
   }
+  IOSource::freeAVIOContext(&mIOContext);
   if (mFrame != nullptr) {
     av_frame_free(&mFrame);
   }
@@ -21,14 +24,78 @@ DecoderBase::~DecoderBase() {
   }
 }
 
-int DecoderBase::init() {
-  int ret;
-  ret = avformat_open_input(&mFormatContext, mPath.c_str(), nullptr, nullptr);
+// enough for the container header, codec parameters come from the cache
+static constexpr int64_t CACHED_PROBE_SIZE = 32 * 1024;
+static constexpr int64_t DEFAULT_PROBE_SIZE = 5000000;
+
+void DecoderBase::setStreamInfoCache(std::string cacheFile) {
+  mStreamInfoCache = std::move(cacheFile);
+}
+
+void DecoderBase::setIOSource(std::shared_ptr<IOSource> source) {
+  mIOSource = std::move(source);
+}
+
+void DecoderBase::setCancelToken(CancelToken token) {
+  mCancel = std::move(token);
+}
+
+int DecoderBase::interruptCallback(void *opaque) {
+  return static_cast<DecoderBase *>(opaque)->mCancel.cancelled() ? 1 : 0;
+}
+
+int DecoderBase::openInput() {
+  StreamInfoCache cache(mStreamInfoCache);
+  // a custom source has no stable file to validate cached entries against
+  bool cacheEnabled = !mStreamInfoCache.empty() && mIOSource == nullptr;
+  bool useCache = cacheEnabled && cache.exists();
+
+  if (mIOSource != nullptr) {
+    mIOContext = mIOSource->createAVIOContext();
+    mFormatContext = avformat_alloc_context();
+    if (mIOContext == nullptr || mFormatContext == nullptr) {
+      logger.error("Decoder failed to allocate custom io: {}, {}", mPath,
+                   TYPE_STR);
+      return -1;
+    }
+    mFormatContext->pb = mIOContext;
+    mFormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+  if (mCancel.cancellable()) {
+    if (mFormatContext == nullptr) {
+      mFormatContext = avformat_alloc_context();
+      if (mFormatContext == nullptr) {
+        logger.error("Decoder failed to allocate format context: {}, {}",
+                     mPath, TYPE_STR);
+        return -1;
+      }
+    }
+    // polled by ffmpeg's own protocols while connecting and reading
+    mFormatContext->interrupt_callback = {interruptCallback, this};
+  }
+
+  AVDictionary *options = nullptr;
+  if (useCache) {
+    av_dict_set_int(&options, "probesize", CACHED_PROBE_SIZE, 0);
+  }
+  int ret = avformat_open_input(&mFormatContext, mPath.c_str(), nullptr,
+                                &options);
+  av_dict_free(&options);
   if (ret < 0) {
     logger.error("Decoder failed to open input file: {}, {}", mPath, TYPE_STR);
     return -1;
   }
 
+  if (useCache) {
+    int streamIndex = cache.restore(mPath, mFormatContext, mMediaType);
+    if (streamIndex >= 0) {
+      logger.info("Decoder restored stream info from cache: {}, {}", mPath,
+                  TYPE_STR);
+      return streamIndex;
+    }
+    mFormatContext->probesize = DEFAULT_PROBE_SIZE;
+  }
+
   ret = avformat_find_stream_info(mFormatContext, nullptr);
   if (ret < 0) {
     logger.error("Decoder failed to find stream info: {}, {}", mPath, TYPE_STR);
@@ -42,6 +109,20 @@ int DecoderBase::init() {
                  TYPE_STR);
     return -1;
   }
+
+  if (cacheEnabled) {
+    cache.save(mPath, mFormatContext, streamIndex);
+  }
+
+  return streamIndex;
+}
+
+int DecoderBase::init() {
+  int ret;
+  int streamIndex = openInput();
+  if (streamIndex < 0) {
+    return -1;
+  }
   mStreamIndex = streamIndex;
 
   for (int i = 0; i < (int)mFormatContext->nb_streams; ++i) {
@@ -117,16 +198,22 @@ int DecoderBase::decodeLoopOnce() {
 
   int ret;
   do {
+    // a custom IOSource never sees the interrupt callback
+    if (mCancel.cancelled()) {
+      logger.info("Decoder cancelled: {}, {}", mPath, TYPE_STR);
+      return AVERROR_EXIT;
+    }
     while (true) {
       ret = av_read_frame(mFormatContext, mPacket);
       if (mPacket->stream_index == mStreamIndex || ret < 0) {
         break;
       }
+      av_packet_unref(mPacket);
     }
     if (ret < 0) {
       if (ret == AVERROR_EOF) {
         logger.info("Decoder reached end of file, {}", TYPE_STR);
-        break;
+        return ret;
       } else {
         logger.error("Decoder failed to read frame: {}, {}",
                      getFFmpegErrorStr(ret), TYPE_STR);
@@ -135,6 +222,7 @@ int DecoderBase::decodeLoopOnce() {
     }
 
     ret = avcodec_send_packet(mCodecContext, mPacket);
+    av_packet_unref(mPacket);
     if (ret < 0) {
       logger.error("Decoder failed to send packet: {}, {}",
                    getFFmpegErrorStr(ret), TYPE_STR);
@@ -3,6 +3,7 @@
 #include <string>
 #include <memory>
 
+#include "IOSource.h"
 #include "Utils/Utils.h"
 
 #define TYPE_STR av_get_media_type_string(mMediaType)
@@ -21,12 +22,32 @@ public:
 
   virtual Time getCurrentTime() const;
 
+  // enable reusing probed stream parameters across opens of mPath
+  void setStreamInfoCache(std::string cacheFile);
+
+  // read through source instead of opening mPath, call before init
+  void setIOSource(std::shared_ptr<IOSource> source);
+
+  // give up opening and reading once token is cancelled, reads then fail
+  // with AVERROR_EXIT; call before init
+  void setCancelToken(CancelToken token);
+
 protected:
+  static int interruptCallback(void *opaque);
+
   int decodeLoopOnce();
 
+  int openInput();
+
   std::string mPath;
+  std::string mStreamInfoCache;
   AVMediaType mMediaType = AVMEDIA_TYPE_UNKNOWN;
 
+  std::shared_ptr<IOSource> mIOSource;
+  AVIOContext *mIOContext = nullptr;
+
+  CancelToken mCancel;
+
   AVFormatContext *mFormatContext = nullptr;
   AVCodecContext *mCodecContext = nullptr;
   int mStreamIndex = -1;
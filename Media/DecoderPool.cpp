@@ -0,0 +1,80 @@
+#include "DecoderPool.h"
+#include "MappedPcmSource.h"
+#include "Utils/Utils.h"
+
+using ted::AudioDecoder;
+using ted::DecoderPool;
+
+DecoderPool::DecoderPool(size_t capacity) : mCapacity(capacity) {}
+
+DecoderPool::~DecoderPool() {
+  logger.info("Decoder pool destroyed, {} hits, {} misses", mHits, mMisses);
+}
+
+std::shared_ptr<AudioDecoder> DecoderPool::acquire(const std::string &mediaFile) {
+  std::unique_ptr<AudioDecoder> decoder;
+  {
+    std::unique_lock lock(mMutex);
+    auto iter = std::find_if(mIdle.begin(), mIdle.end(), [&](const Entry &e) {
+      return e.path == mediaFile;
+    });
+    if (iter != mIdle.end()) {
+      decoder = std::move(iter->decoder);
+      mIdle.erase(iter);
+      ++mHits;
+    } else {
+      ++mMisses;
+    }
+  }
+
+  if (decoder == nullptr) {
+    decoder = openAudioDecoder(mediaFile);
+    if (decoder == nullptr) {
+      logger.error("Decoder pool failed to open {}", mediaFile);
+      return nullptr;
+    }
+  }
+
+  return {decoder.release(), [this, mediaFile](AudioDecoder *d) {
+            release(mediaFile, d);
+          }};
+}
+
+std::shared_ptr<AudioDecoder> DecoderPool::acquire(const std::string &mediaFile,
+                                                   int64_t timestampUs) {
+  auto decoder = acquire(mediaFile);
+  if (decoder == nullptr) {
+    return nullptr;
+  }
+  if (decoder->seek(timestampUs) != 0) {
+    return nullptr;
+  }
+  return decoder;
+}
+
+void DecoderPool::release(std::string path, AudioDecoder *decoder) {
+  std::unique_ptr<AudioDecoder> evicted;
+  std::unique_lock lock(mMutex);
+  mIdle.push_front(Entry{std::move(path), std::unique_ptr<AudioDecoder>(decoder)});
+  if (mIdle.size() > mCapacity) {
+    // destroy outside of the lock, closing a decoder is not free
+    evicted = std::move(mIdle.back().decoder);
+    mIdle.pop_back();
+  }
+  lock.unlock();
+}
+
+size_t DecoderPool::idleCount() const {
+  std::unique_lock lock(mMutex);
+  return mIdle.size();
+}
+
+size_t DecoderPool::hitCount() const {
+  std::unique_lock lock(mMutex);
+  return mHits;
+}
+
+size_t DecoderPool::missCount() const {
+  std::unique_lock lock(mMutex);
+  return mMisses;
+}
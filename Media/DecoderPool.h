@@ -0,0 +1,59 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "AudioDecoder.h"
+
+namespace ted {
+
+/**
+ * Bounded LRU pool of initialized audio decoders keyed by media path.
+ *
+ * Opening a decoder costs a demuxer probe and a codec open, so clips coming
+ * from the same talk reuse an idle decoder and only pay for a seek. Leased
+ * decoders go back to the pool when the last reference is dropped; the pool
+ * must outlive all of its leases.
+ */
+class DecoderPool {
+public:
+  explicit DecoderPool(size_t capacity = 8);
+
+  ~DecoderPool();
+
+  DecoderPool(const DecoderPool &) = delete;
+  DecoderPool &operator=(const DecoderPool &) = delete;
+
+  // returns nullptr if the decoder cannot be opened
+  std::shared_ptr<AudioDecoder> acquire(const std::string &mediaFile);
+
+  // acquire and seek to timestampUs in one go
+  std::shared_ptr<AudioDecoder> acquire(const std::string &mediaFile,
+                                        int64_t timestampUs);
+
+  [[nodiscard]] size_t idleCount() const;
+
+  [[nodiscard]] size_t hitCount() const;
+
+  [[nodiscard]] size_t missCount() const;
+
+private:
+  struct Entry {
+    std::string path;
+    std::unique_ptr<AudioDecoder> decoder;
+  };
+
+  void release(std::string path, AudioDecoder *decoder);
+
+  size_t mCapacity;
+
+  mutable std::mutex mMutex;
+  // most recently used at front
+  std::list<Entry> mIdle;
+  size_t mHits = 0;
+  size_t mMisses = 0;
+};
+
+} // namespace ted
@@ -0,0 +1,90 @@
+#include <chrono>
+#include <string>
+
+#include "TestHttpServer.h"
+#include "TestTalkFixture.h"
+#include "Utils/DownloadService.h"
+#include "Utils/HLS.h"
+#include "Utils/Utils.h"
+
+using ted::logger;
+
+// Download throughput and per-request overhead against the loopback
+// server, so changes to the download stack can be compared offline.
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+static void benchmarkThroughput(ted::TestHttpServer &server) {
+  constexpr size_t size = 64 << 20;
+  server.serve("/large.bin", std::string(size, 'x'));
+
+  std::string buffer;
+  buffer.reserve(size);
+  auto start = std::chrono::steady_clock::now();
+  ted::SimpleDownloader downloader(server.url("/large.bin"), &buffer);
+  downloader.init();
+  downloader.download();
+  double seconds = secondsSince(start);
+  logger.info("SimpleDownloader: {} MiB in {:.3f} s, {:.1f} MiB/s",
+              size >> 20, seconds, (double)(size >> 20) / seconds);
+}
+
+static void benchmarkRequestOverhead(ted::TestHttpServer &server) {
+  constexpr int requests = 500;
+  server.serve("/small.txt", std::string(1024, 'x'));
+
+  auto before = ted::DownloadService::instance().getStats();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < requests; ++i) {
+    std::string buffer;
+    ted::SimpleDownloader downloader(server.url("/small.txt"), &buffer);
+    downloader.init();
+    downloader.download();
+  }
+  double seconds = secondsSince(start);
+  auto after = ted::DownloadService::instance().getStats();
+  logger.info("request overhead: {:.1f} us per 1 KiB request, {} new "
+              "connections for {} requests",
+              seconds * 1e6 / requests,
+              after.newConnections - before.newConnections, requests);
+}
+
+static void benchmarkHLS(ted::TestHttpServer &server) {
+  ted::TestTalkFixture talk(server, 60, 256 * 1024);
+  double megabytes = 60 * 256.0 / 1024;
+
+  auto start = std::chrono::steady_clock::now();
+  ted::HLSParser parser(talk.masterUrl());
+  parser.init();
+  logger.info("HLSParser: master playlist in {:.2f} ms",
+              secondsSince(start) * 1e3);
+
+  // a CDN round trip per segment is what parallelism has to hide
+  server.setLatency(std::chrono::milliseconds(20));
+  for (int parallelism : {1, 4, 8}) {
+    ted::NativeHLSDownloader downloader(talk.playListUrl("medium"),
+                                        "/tmp/ted_benchmark.ts", parallelism);
+    start = std::chrono::steady_clock::now();
+    downloader.init();
+    downloader.download();
+    double seconds = secondsSince(start);
+    logger.info("NativeHLSDownloader x{}: {} segments in {:.3f} s, "
+                "{:.1f} MiB/s",
+                parallelism, talk.segmentCount(), seconds,
+                megabytes / seconds);
+  }
+  server.setLatency(std::chrono::milliseconds(0));
+}
+
+int main() {
+  ted::TestHttpServer server;
+  benchmarkThroughput(server);
+  benchmarkRequestOverhead(server);
+  benchmarkHLS(server);
+  ted::DownloadService::instance().logStats();
+  return 0;
+}
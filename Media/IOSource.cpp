@@ -0,0 +1,280 @@
+#include <cstring>
+
+#include "IOSource.h"
+#include "Utils/HLS.h"
+
+using ted::GrowingFileSource;
+using ted::IOSource;
+using ted::MemorySource;
+
+AVIOContext *IOSource::createAVIOContext() {
+  auto *buffer = static_cast<uint8_t *>(av_malloc(AVIO_BUFFER_SIZE));
+  if (buffer == nullptr) {
+    return nullptr;
+  }
+  AVIOContext *context =
+      avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, this, readCallback,
+                         nullptr, seekCallback);
+  if (context == nullptr) {
+    av_free(buffer);
+  }
+  return context;
+}
+
+void IOSource::freeAVIOContext(AVIOContext **context) {
+  if (*context == nullptr) {
+    return;
+  }
+  // ffmpeg may have replaced the buffer we allocated
+  av_freep(&(*context)->buffer);
+  avio_context_free(context);
+}
+
+int IOSource::readCallback(void *opaque, uint8_t *buffer, int size) {
+  return static_cast<IOSource *>(opaque)->read(buffer, size);
+}
+
+int64_t IOSource::seekCallback(void *opaque, int64_t offset, int whence) {
+  return static_cast<IOSource *>(opaque)->seek(offset, whence & ~AVSEEK_FORCE);
+}
+
+GrowingFileSource::GrowingFileSource(std::string path)
+    : mPath(std::move(path)) {}
+
+GrowingFileSource::~GrowingFileSource() {
+  if (mFile != nullptr) {
+    fclose(mFile);
+  }
+}
+
+void GrowingFileSource::grow(int64_t size) {
+  std::vector<std::function<void(bool)>> waiters;
+  bool started;
+  {
+    std::unique_lock lock(mMutex);
+    // open while the writer is known to hold the file under this name, it
+    // may be renamed once the download completes
+    if (mFile == nullptr) {
+      mFile = fopen(mPath.c_str(), "rb");
+      if (mFile == nullptr) {
+        logger.error("GrowingFileSource failed to open {}", mPath);
+        mFailed = true;
+      }
+    }
+    mAvailable = std::max(mAvailable, size);
+    mCond.notify_all();
+    if (mAvailable > 0) {
+      waiters.swap(mWaiters);
+    }
+    started = startedLocked();
+  }
+  notify(std::move(waiters), started);
+}
+
+void GrowingFileSource::finish(bool success) {
+  std::vector<std::function<void(bool)>> waiters;
+  bool started;
+  {
+    std::unique_lock lock(mMutex);
+    mFinished = true;
+    mFailed = mFailed || !success;
+    mCond.notify_all();
+    waiters.swap(mWaiters);
+    started = startedLocked();
+  }
+  notify(std::move(waiters), started);
+}
+
+void GrowingFileSource::abort() {
+  std::vector<std::function<void(bool)>> waiters;
+  bool started;
+  {
+    std::unique_lock lock(mMutex);
+    mAborted = true;
+    mCond.notify_all();
+    waiters.swap(mWaiters);
+    started = startedLocked();
+  }
+  notify(std::move(waiters), started);
+}
+
+void GrowingFileSource::whenStarted(std::function<void(bool)> done) {
+  bool started;
+  {
+    std::unique_lock lock(mMutex);
+    if (mAvailable == 0 && !mFinished && !mAborted) {
+      mWaiters.push_back(std::move(done));
+      return;
+    }
+    started = startedLocked();
+  }
+  done(started);
+}
+
+bool GrowingFileSource::startedLocked() const {
+  return mAvailable > 0 && !mFailed;
+}
+
+void GrowingFileSource::notify(std::vector<std::function<void(bool)>> waiters,
+                               bool started) {
+  for (auto &&waiter : waiters) {
+    waiter(started);
+  }
+}
+
+int64_t GrowingFileSource::available() const {
+  std::unique_lock lock(mMutex);
+  return mAvailable;
+}
+
+int GrowingFileSource::read(uint8_t *buffer, int size) {
+  std::unique_lock lock(mMutex);
+  mCond.wait(lock, [&]() {
+    return mAborted || mFailed || mFinished || mPosition < mAvailable;
+  });
+  if (mAborted) {
+    return AVERROR_EXIT;
+  }
+  // bytes already on disk are served even after the download failed
+  if (mFile == nullptr || mPosition >= mAvailable) {
+    return mFailed ? AVERROR(EIO) : AVERROR_EOF;
+  }
+
+  auto toRead = (size_t)std::min<int64_t>(size, mAvailable - mPosition);
+  lock.unlock();
+
+  // only this reader moves mPosition, the lock guards the writer state
+  if (fseeko(mFile, mPosition, SEEK_SET) != 0) {
+    return AVERROR(EIO);
+  }
+  size_t n = fread(buffer, 1, toRead, mFile);
+  if (n == 0) {
+    return AVERROR(EIO);
+  }
+  mPosition += (int64_t)n;
+  return (int)n;
+}
+
+int64_t GrowingFileSource::seek(int64_t offset, int whence) {
+  std::unique_lock lock(mMutex);
+  switch (whence) {
+  case AVSEEK_SIZE:
+    // the final size is unknown while downloading, expose what exists so
+    // timestamp searches stay inside the received data
+    return mAvailable;
+  case SEEK_SET:
+    mPosition = offset;
+    break;
+  case SEEK_CUR:
+    mPosition += offset;
+    break;
+  case SEEK_END:
+    if (!mFinished) {
+      return -1;
+    }
+    mPosition = mAvailable + offset;
+    break;
+  default:
+    return -1;
+  }
+  return mPosition;
+}
+
+MemorySource::MemorySource(std::string data)
+    : mData(std::move(data)), mFinished(true) {}
+
+void MemorySource::append(const char *data, size_t size) {
+  std::unique_lock lock(mMutex);
+  mData.append(data, size);
+  mCond.notify_all();
+}
+
+void MemorySource::finish(bool success) {
+  std::unique_lock lock(mMutex);
+  mFinished = true;
+  mFailed = !success;
+  mCond.notify_all();
+}
+
+void MemorySource::abort() {
+  std::unique_lock lock(mMutex);
+  mAborted = true;
+  mCond.notify_all();
+}
+
+int64_t MemorySource::available() const {
+  std::unique_lock lock(mMutex);
+  return (int64_t)mData.size();
+}
+
+int MemorySource::read(uint8_t *buffer, int size) {
+  std::unique_lock lock(mMutex);
+  mCond.wait(lock, [&]() {
+    return mAborted || mFinished || mPosition < (int64_t)mData.size();
+  });
+  if (mAborted) {
+    return AVERROR_EXIT;
+  }
+  if (mPosition >= (int64_t)mData.size()) {
+    return mFailed ? AVERROR(EIO) : AVERROR_EOF;
+  }
+
+  auto n = (int)std::min<int64_t>(size, (int64_t)mData.size() - mPosition);
+  memcpy(buffer, mData.data() + mPosition, n);
+  mPosition += n;
+  return n;
+}
+
+int64_t MemorySource::seek(int64_t offset, int whence) {
+  std::unique_lock lock(mMutex);
+  auto size = (int64_t)mData.size();
+  switch (whence) {
+  case AVSEEK_SIZE:
+    return size;
+  case SEEK_SET:
+    mPosition = offset;
+    break;
+  case SEEK_CUR:
+    mPosition += offset;
+    break;
+  case SEEK_END:
+    if (!mFinished) {
+      return -1;
+    }
+    mPosition = size + offset;
+    break;
+  default:
+    return -1;
+  }
+  return mPosition;
+}
+
+int ted::downloadToMemorySource(const std::string &url, MemorySource &source) {
+  SimpleDownloader downloader(url, [&source](const char *data, size_t size) {
+    source.append(data, size);
+    return true;
+  });
+  int ret = downloader.init();
+  if (ret == 0) {
+    ret = downloader.download();
+  }
+  source.finish(ret == 0);
+  return ret;
+}
+
+int ted::downloadHLSToMemorySource(const std::string &playListUrl,
+                                   MemorySource &source, int parallelism) {
+  NativeHLSDownloader downloader(
+      playListUrl,
+      [&source](const char *data, size_t size) {
+        source.append(data, size);
+        return true;
+      },
+      parallelism);
+  int ret = downloader.init();
+  if (ret == 0) {
+    ret = downloader.download();
+  }
+  source.finish(ret == 0);
+  return ret;
+}
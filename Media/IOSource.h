@@ -0,0 +1,134 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Utils/Utils.h"
+
+namespace ted {
+
+/**
+ * Byte source a decoder can read from instead of a file path. Subclasses
+ * follow the AVIOContext callback conventions: read returns the byte count,
+ * AVERROR_EOF or another negative AVERROR; seek handles AVSEEK_SIZE.
+ */
+class IOSource {
+public:
+  virtual ~IOSource() = default;
+
+  virtual int read(uint8_t *buffer, int size) = 0;
+
+  virtual int64_t seek(int64_t offset, int whence) = 0;
+
+  // caller owns the context, free with freeAVIOContext
+  AVIOContext *createAVIOContext();
+
+  static void freeAVIOContext(AVIOContext **context);
+
+private:
+  static constexpr int AVIO_BUFFER_SIZE = 64 * 1024;
+
+  static int readCallback(void *opaque, uint8_t *buffer, int size);
+
+  static int64_t seekCallback(void *opaque, int64_t offset, int whence);
+};
+
+/**
+ * Reads a file that is still being appended by a download. Reads past the
+ * bytes written so far block until the writer reports more data or
+ * finishes, so the demuxer can start on the first segments.
+ */
+class GrowingFileSource : public IOSource {
+public:
+  explicit GrowingFileSource(std::string path);
+
+  ~GrowingFileSource() override;
+
+  // writer side: size bytes of the file are now readable
+  void grow(int64_t size);
+
+  // writer side: no more data will arrive
+  void finish(bool success);
+
+  // unblock readers, e.g. when the decoder is being torn down
+  void abort();
+
+  // call done once the first bytes have arrived or the writer gave up,
+  // right away if that already happened, otherwise on the writer's
+  // thread; done is told whether readable data arrived and must not block
+  void whenStarted(std::function<void(bool started)> done);
+
+  [[nodiscard]] int64_t available() const;
+
+  int read(uint8_t *buffer, int size) override;
+
+  int64_t seek(int64_t offset, int whence) override;
+
+private:
+  // data arrived and the file could be opened, mMutex must be held
+  [[nodiscard]] bool startedLocked() const;
+
+  // run the whenStarted callbacks taken out under the lock
+  static void notify(std::vector<std::function<void(bool)>> waiters,
+                     bool started);
+
+  std::string mPath;
+  FILE *mFile = nullptr;
+  int64_t mPosition = 0;
+
+  mutable std::mutex mMutex;
+  std::condition_variable mCond;
+  std::vector<std::function<void(bool)>> mWaiters;
+  int64_t mAvailable = 0;
+  bool mFinished = false;
+  bool mFailed = false;
+  bool mAborted = false;
+};
+
+/**
+ * Serves bytes held in memory, either a complete buffer or one still being
+ * filled by a download. Seeks inside received data cost nothing and reads
+ * past it block like GrowingFileSource.
+ */
+class MemorySource : public IOSource {
+public:
+  MemorySource() = default;
+
+  // a complete buffer, e.g. an already fetched segment
+  explicit MemorySource(std::string data);
+
+  // writer side
+  void append(const char *data, size_t size);
+
+  void finish(bool success);
+
+  void abort();
+
+  [[nodiscard]] int64_t available() const;
+
+  int read(uint8_t *buffer, int size) override;
+
+  int64_t seek(int64_t offset, int whence) override;
+
+private:
+  mutable std::mutex mMutex;
+  std::condition_variable mCond;
+  std::string mData;
+  int64_t mPosition = 0;
+  bool mFinished = false;
+  bool mFailed = false;
+  bool mAborted = false;
+};
+
+// stream url into source with curl, finishing it when the transfer ends
+int downloadToMemorySource(const std::string &url, MemorySource &source);
+
+// same for every segment of an hls media playlist, in order
+int downloadHLSToMemorySource(const std::string &playListUrl,
+                              MemorySource &source, int parallelism = 4);
+
+} // namespace ted
@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MappedPcmSource.h"
+#include "StreamInfoCache.h"
+
+using ted::AudioDecoder;
+using ted::AudioParam;
+using ted::MappedPcmSource;
+
+static constexpr uint16_t WAVE_FORMAT_PCM = 1;
+static constexpr uint16_t WAVE_FORMAT_IEEE_FLOAT = 3;
+static constexpr uint16_t WAVE_FORMAT_EXTENSIBLE = 0xfffe;
+
+struct MappedPcmSource::Mapping {
+  void *address = MAP_FAILED;
+  size_t length = 0;
+
+  ~Mapping() {
+    if (address != MAP_FAILED) {
+      munmap(address, length);
+    }
+  }
+};
+
+// wav fields are little-endian
+static uint32_t readLE(const uint8_t *p, int bytes) {
+  uint32_t value = 0;
+  for (int i = bytes - 1; i >= 0; --i) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+MappedPcmSource::MappedPcmSource(std::string wavFile)
+    : AudioDecoder(std::move(wavFile)) {}
+
+MappedPcmSource::~MappedPcmSource() = default;
+
+bool MappedPcmSource::isWav(const std::string &path) {
+  char header[12];
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool wav = read(fd, header, sizeof(header)) == sizeof(header) &&
+             memcmp(header, "RIFF", 4) == 0 &&
+             memcmp(header + 8, "WAVE", 4) == 0;
+  close(fd);
+  return wav;
+}
+
+int MappedPcmSource::init() {
+  int fd = open(mPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    logger.error("MappedPcmSource failed to open {}", mPath);
+    return -1;
+  }
+  struct stat st {};
+  auto mapping = std::make_shared<Mapping>();
+  if (fstat(fd, &st) == 0 && st.st_size > 12) {
+    mapping->length = st.st_size;
+    mapping->address =
+        mmap(nullptr, mapping->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping->address == MAP_FAILED) {
+    logger.error("MappedPcmSource failed to map {}", mPath);
+    return -1;
+  }
+
+  auto *file = static_cast<const uint8_t *>(mapping->address);
+  size_t size = mapping->length;
+  if (memcmp(file, "RIFF", 4) != 0 || memcmp(file + 8, "WAVE", 4) != 0) {
+    logger.error("MappedPcmSource: {} is not a wav file", mPath);
+    return -1;
+  }
+
+  uint16_t format = 0;
+  uint16_t channels = 0;
+  uint32_t sampleRate = 0;
+  uint16_t bits = 0;
+  const uint8_t *data = nullptr;
+  size_t dataSize = 0;
+  for (size_t offset = 12; offset + 8 <= size;) {
+    const uint8_t *chunk = file + offset;
+    size_t chunkSize = readLE(chunk + 4, 4);
+    size_t available = size - offset - 8;
+    if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16 &&
+        available >= 16) {
+      format = readLE(chunk + 8, 2);
+      channels = readLE(chunk + 10, 2);
+      sampleRate = readLE(chunk + 12, 4);
+      bits = readLE(chunk + 22, 2);
+      // the sub format GUID starts with the plain format tag
+      if (format == WAVE_FORMAT_EXTENSIBLE && chunkSize >= 40 &&
+          available >= 40) {
+        format = readLE(chunk + 32, 2);
+      }
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      // writers that stream leave the size at 0 or 0xffffffff
+      data = chunk + 8;
+      dataSize = chunkSize == 0 || chunkSize > available ? available
+                                                         : chunkSize;
+      break;
+    }
+    // chunks are padded to an even size
+    offset += 8 + chunkSize + (chunkSize & 1);
+  }
+
+  if (format == WAVE_FORMAT_PCM && bits == 16) {
+    mSampleFormat = AV_SAMPLE_FMT_S16;
+    mParam.sampleFormat = AudioFormat::Int16;
+  } else if (format == WAVE_FORMAT_PCM && bits == 32) {
+    // AudioPlayer takes no 32 bit integers, frames are converted to float
+    mSampleFormat = AV_SAMPLE_FMT_S32;
+    mParam.sampleFormat = AudioFormat::Float32;
+  } else if (format == WAVE_FORMAT_IEEE_FLOAT && bits == 32) {
+    mSampleFormat = AV_SAMPLE_FMT_FLT;
+    mParam.sampleFormat = AudioFormat::Float32;
+  } else {
+    logger.error("MappedPcmSource: unsupported format {} with {} bits in {}",
+                 format, bits, mPath);
+    return -1;
+  }
+  if (data == nullptr || channels == 0 || sampleRate == 0) {
+    logger.error("MappedPcmSource: no audio data in {}", mPath);
+    return -1;
+  }
+
+  mParam.sampleRate = (int)sampleRate;
+  mParam.channels = channels;
+  mSampleBytes = channels * bits / 8;
+  mSampleCount = (int64_t)(dataSize / mSampleBytes);
+  mData = data;
+  mMapping = std::move(mapping);
+  mPosition = 0;
+  mCurrentTime = Time(0);
+
+  logger.info("MappedPcmSource mapped {}, {} samples at {} Hz", mPath,
+              mSampleCount, mParam.sampleRate);
+  return 0;
+}
+
+int MappedPcmSource::seek(int64_t timestampUs) {
+  if (mMapping == nullptr) {
+    logger.error("MappedPcmSource is not initialized, {}", mPath);
+    return -1;
+  }
+  mPosition = std::clamp<int64_t>(timestampUs * mParam.sampleRate / 1000000,
+                                  0, mSampleCount);
+  mCurrentTime = Time(timestampUs);
+  return 0;
+}
+
+int MappedPcmSource::getNextFrame(std::shared_ptr<AVFrame> &frame) {
+  if (mMapping == nullptr) {
+    logger.error("MappedPcmSource is not initialized, {}", mPath);
+    return -1;
+  }
+  auto bytes = samples(mPosition, FRAME_SAMPLES);
+  if (bytes.empty()) {
+    frame = nullptr;
+    return 0;
+  }
+
+  int count = (int)(bytes.size() / mSampleBytes);
+  AVFrame *raw = av_frame_alloc();
+  if (mSampleFormat == AV_SAMPLE_FMT_S32) {
+    raw->format = AV_SAMPLE_FMT_FLT;
+    raw->nb_samples = count;
+    av_channel_layout_default(&raw->ch_layout, mParam.channels);
+    if (av_frame_get_buffer(raw, 0) < 0) {
+      av_frame_free(&raw);
+      return AVERROR(ENOMEM);
+    }
+    auto *out = reinterpret_cast<float *>(raw->data[0]);
+    for (size_t i = 0; i < bytes.size() / sizeof(int32_t); ++i) {
+      int32_t value;
+      memcpy(&value, bytes.data() + i * sizeof(int32_t), sizeof(value));
+      out[i] = (float)value / 2147483648.0f;
+    }
+  } else {
+    // the buffer holds a reference to the mapping instead of owning memory
+    auto *owner = new std::shared_ptr<Mapping>(mMapping);
+    raw->buf[0] = av_buffer_create(
+        const_cast<uint8_t *>(bytes.data()), bytes.size(),
+        [](void *opaque, uint8_t *) {
+          delete static_cast<std::shared_ptr<Mapping> *>(opaque);
+        },
+        owner, AV_BUFFER_FLAG_READONLY);
+    if (raw->buf[0] == nullptr) {
+      delete owner;
+      av_frame_free(&raw);
+      return AVERROR(ENOMEM);
+    }
+
+    raw->data[0] = raw->buf[0]->data;
+    raw->extended_data = raw->data;
+    raw->linesize[0] = (int)bytes.size();
+    raw->nb_samples = count;
+    raw->format = mSampleFormat;
+    av_channel_layout_default(&raw->ch_layout, mParam.channels);
+  }
+  raw->sample_rate = mParam.sampleRate;
+  raw->pts = mPosition;
+
+  mCurrentTime = Time(mPosition, mParam.sampleRate);
+  mPosition += count;
+  frame = {raw, [](AVFrame *f) { av_frame_free(&f); }};
+  return 0;
+}
+
+AudioParam MappedPcmSource::getAudioParam() const { return mParam; }
+
+std::span<const uint8_t> MappedPcmSource::samples(int64_t firstSample,
+                                                  int64_t count) const {
+  firstSample = std::clamp<int64_t>(firstSample, 0, mSampleCount);
+  count = std::clamp<int64_t>(count, 0, mSampleCount - firstSample);
+  return {mData + firstSample * mSampleBytes, (size_t)(count * mSampleBytes)};
+}
+
+int64_t MappedPcmSource::getSampleCount() const { return mSampleCount; }
+
+std::unique_ptr<AudioDecoder>
+ted::openAudioDecoder(const std::string &mediaFile) {
+  if (MappedPcmSource::isWav(mediaFile)) {
+    auto source = std::make_unique<MappedPcmSource>(mediaFile);
+    if (source->init() == 0) {
+      return source;
+    }
+  }
+
+  auto decoder = std::make_unique<AudioDecoder>(mediaFile);
+  decoder->setStreamInfoCache(StreamInfoCache::pathFor(mediaFile));
+  if (decoder->init() != 0) {
+    return nullptr;
+  }
+  return decoder;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <memory>
+#include <span>
+#include <string>
+
+#include "AudioDecoder.h"
+
+namespace ted {
+
+/**
+ * Serves a PCM WAV file straight from a read-only mapping of its data
+ * chunk. Frames point into the mapping, so there is no demuxing, decoding
+ * or copying, and a seek only moves the read position. Handles 16 and 32
+ * bit integer and 32 bit float samples; 32 bit integers are converted to
+ * float per frame since AudioPlayer cannot take them. init fails for
+ * anything else so callers can fall back to AudioDecoder.
+ */
+class MappedPcmSource : public AudioDecoder {
+public:
+  static constexpr int FRAME_SAMPLES = 1024;
+
+  explicit MappedPcmSource(std::string wavFile);
+
+  ~MappedPcmSource() override;
+
+  int init() override;
+
+  int seek(int64_t timestampUs) override;
+
+  // frames alias the mapping and keep it alive, treat them as read-only;
+  // converted 32 bit integer frames own their samples
+  int getNextFrame(std::shared_ptr<AVFrame> &frame) override;
+
+  [[nodiscard]] AudioParam getAudioParam() const override;
+
+  // interleaved bytes of count samples starting at firstSample as stored in
+  // the file, clamped to the end of the data
+  [[nodiscard]] std::span<const uint8_t> samples(int64_t firstSample,
+                                                 int64_t count) const;
+
+  [[nodiscard]] int64_t getSampleCount() const;
+
+  // the file has a RIFF/WAVE header, without checking the sample format
+  static bool isWav(const std::string &path);
+
+private:
+  struct Mapping;
+
+  std::shared_ptr<Mapping> mMapping;
+  const uint8_t *mData = nullptr;
+  int64_t mSampleCount = 0;
+  // all channels of one sample
+  int mSampleBytes = 0;
+  AVSampleFormat mSampleFormat = AV_SAMPLE_FMT_NONE;
+  AudioParam mParam;
+  int64_t mPosition = 0;
+};
+
+// an initialized decoder for mediaFile, mapped when it is a PCM WAV file;
+// nullptr if it cannot be opened
+std::unique_ptr<AudioDecoder> openAudioDecoder(const std::string &mediaFile);
+
+} // namespace ted
@@ -2,21 +2,57 @@
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
 #include <catch2/matchers/catch_matchers_vector.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <numeric>
+#include <optional>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "App/LibraryIndex.h"
+#include "App/PrefetchScheduler.h"
 #include "AudioDecoder.h"
 #include "AudioPlayer.h"
+#include "ClipPlaylist.h"
+#include "DecoderPool.h"
+#include "IOSource.h"
+#include "MappedPcmSource.h"
+#include "Remuxer.h"
+#include "SparseSegmentSource.h"
+#include "StreamInfoCache.h"
 #include "SubtitleDecoder.h"
+#include "WaveformPeaks.h"
+#include "TestHttpServer.h"
+#include "TestTalkFixture.h"
+#include "Utils/AsyncFileIO.h"
+#include "Utils/DownloadManifest.h"
+#include "Utils/DownloadService.h"
 #include "Utils/HLS.h"
+#include "Utils/Hash.h"
+#include "Utils/HttpCache.h"
+#include "Utils/M3U8.h"
+#include "Utils/MediaCache.h"
+#include "Utils/SingleFlight.h"
+#include "Utils/TaskGraph.h"
 #include "Utils/Utils.h"
+#include "Utils/VariantSelector.h"
+#include "Utils/WorkStealingPool.h"
 
 TEST_CASE("logger output", "[logger]") {
   std::stringstream ss;
@@ -61,14 +97,21 @@ static std::string url =
 static std::string local = "/tmp/test.mp4";
 
 TEST_CASE("test curl downloading ted talks", "[downloader]") {
+  ted::TestHttpServer server;
+  std::string video(1 << 20, '\0');
+  for (size_t i = 0; i < video.size(); ++i) {
+    video[i] = static_cast<char>(i * 131 >> 3);
+  }
+  server.serve("/products/168016.mp4", video, "video/mp4");
 
-  ted::SimpleDownloader downloader(url, local);
-  downloader.init();
-  downloader.download();
+  std::string output = "/tmp/ted_fixture_download.mp4";
+  ted::SimpleDownloader downloader(server.url("/products/168016.mp4"), output);
+  REQUIRE(downloader.init() == 0);
+  REQUIRE(downloader.download() == 0);
 
   struct stat file_info {};
-  stat(local.c_str(), &file_info);
-  REQUIRE(file_info.st_size > 0);
+  stat(output.c_str(), &file_info);
+  REQUIRE(file_info.st_size == (off_t)video.size());
 }
 
 #define DOWNLOAD_TEST_VIDEO                                                    \
@@ -118,6 +161,477 @@ TEST_CASE("test audio decoder", "[audio]") {
   }
 }
 
+TEST_CASE("test stream info cache", "[audio]") {
+  DOWNLOAD_TEST_VIDEO
+
+  auto cacheFile = ted::StreamInfoCache::pathFor(local);
+  unlink(cacheFile.c_str());
+
+  ted::AudioDecoder probed(local);
+  probed.setStreamInfoCache(cacheFile);
+  REQUIRE(probed.init() == 0);
+  REQUIRE(ted::StreamInfoCache(cacheFile).exists());
+
+  ted::AudioDecoder restored(local);
+  restored.setStreamInfoCache(cacheFile);
+  REQUIRE(restored.init() == 0);
+
+  auto param = probed.getAudioParam();
+  auto cachedParam = restored.getAudioParam();
+  REQUIRE(cachedParam.sampleRate == param.sampleRate);
+  REQUIRE(cachedParam.channels == param.channels);
+  REQUIRE(cachedParam.sampleFormat == param.sampleFormat);
+
+  std::shared_ptr<AVFrame> frame, cachedFrame;
+  REQUIRE(probed.getNextFrame(frame) == 0);
+  REQUIRE(restored.getNextFrame(cachedFrame) == 0);
+  REQUIRE(frame->pts == cachedFrame->pts);
+  REQUIRE(frame->nb_samples == cachedFrame->nb_samples);
+}
+
+TEST_CASE("test malformed stream info cache", "[audio]") {
+  DOWNLOAD_TEST_VIDEO
+
+  auto cacheFile = ted::StreamInfoCache::pathFor(local);
+  for (auto &&entry :
+       {R"({"version": 1})", R"({"version": 1, "fileSize": "large"})",
+        R"([1, 2, 3])"}) {
+    std::ofstream(cacheFile) << entry;
+
+    ted::AudioDecoder decoder(local);
+    decoder.setStreamInfoCache(cacheFile);
+    // falls back to a full probe, which rewrites the entry
+    REQUIRE(decoder.init() == 0);
+    REQUIRE(decoder.getAudioParam().sampleRate > 0);
+    std::shared_ptr<AVFrame> frame;
+    REQUIRE(decoder.getNextFrame(frame) == 0);
+  }
+}
+
+TEST_CASE("test remux audio to m4a", "[audio]") {
+  DOWNLOAD_TEST_VIDEO
+
+  std::string m4a = "/tmp/ted_remux.m4a";
+  REQUIRE(ted::remuxAudioToM4A(local, m4a) == 0);
+
+  ted::AudioDecoder source(local);
+  ted::AudioDecoder remuxed(m4a);
+  REQUIRE(source.init() == 0);
+  REQUIRE(remuxed.init() == 0);
+  REQUIRE(remuxed.getAudioParam().sampleRate ==
+          source.getAudioParam().sampleRate);
+  REQUIRE(remuxed.getAudioParam().channels == source.getAudioParam().channels);
+
+  REQUIRE(remuxed.seek(10 * 1000000) == 0);
+  std::shared_ptr<AVFrame> frame;
+  REQUIRE(remuxed.getNextFrame(frame) == 0);
+  REQUIRE(frame != nullptr);
+}
+
+// what the old `ffmpeg -i <url> audio.wav` cache produced: s16 pcm
+static void writeS16Wav(ted::AudioDecoder &decoder, const std::string &path) {
+  auto param = decoder.getAudioParam();
+  std::ofstream file(path, std::ios::binary);
+  file.write("RIFF\0\0\0\0WAVEfmt ", 16);
+  auto put = [&file](auto value) {
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  put(uint32_t(16));
+  put(uint16_t(1));
+  put(uint16_t(param.channels));
+  put(uint32_t(param.sampleRate));
+  put(uint32_t(param.sampleRate * param.channels * 2));
+  put(uint16_t(param.channels * 2));
+  put(uint16_t(16));
+  file.write("data\0\0\0\0", 8);
+
+  uint32_t dataSize = 0;
+  std::shared_ptr<AVFrame> frame;
+  while (decoder.getNextFrame(frame) == 0 && frame != nullptr) {
+    auto *samples = reinterpret_cast<const float *>(frame->data[0]);
+    for (int i = 0; i < frame->nb_samples * param.channels; ++i) {
+      float clamped = std::max(-1.0f, std::min(1.0f, samples[i]));
+      put(int16_t(clamped * 32767));
+    }
+    dataSize += frame->nb_samples * param.channels * 2;
+  }
+
+  file.seekp(4);
+  put(uint32_t(36 + dataSize));
+  file.seekp(40);
+  put(dataSize);
+}
+
+template <typename Decoder = ted::AudioDecoder>
+static double measureOpenMs(const std::string &path, int rounds) {
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; ++i) {
+    Decoder decoder(path);
+    REQUIRE(decoder.init() == 0);
+    REQUIRE(decoder.seek(60 * 1000000) == 0);
+    std::shared_ptr<AVFrame> frame;
+    REQUIRE(decoder.getNextFrame(frame) == 0);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - begin;
+  return std::chrono::duration<double, std::milli>(elapsed).count() / rounds;
+}
+
+TEST_CASE("benchmark wav and m4a audio cache", "[.benchmark]") {
+  DOWNLOAD_TEST_VIDEO
+
+  std::string wav = "/tmp/ted_bench.wav";
+  std::string m4a = "/tmp/ted_bench.m4a";
+  {
+    ted::AudioDecoder decoder(local);
+    REQUIRE(decoder.init() == 0);
+    writeS16Wav(decoder, wav);
+  }
+  REQUIRE(ted::remuxAudioToM4A(local, m4a) == 0);
+
+  struct stat wavInfo {}, m4aInfo {};
+  stat(wav.c_str(), &wavInfo);
+  stat(m4a.c_str(), &m4aInfo);
+
+  constexpr int rounds = 20;
+  double wavMs = measureOpenMs(wav, rounds);
+  double m4aMs = measureOpenMs(m4a, rounds);
+  double mappedMs = measureOpenMs<ted::MappedPcmSource>(wav, rounds);
+
+  ted::logger.info("wav cache: {} bytes, open+seek+first frame {:.2f} ms",
+                   (int64_t)wavInfo.st_size, wavMs);
+  ted::logger.info("m4a cache: {} bytes, open+seek+first frame {:.2f} ms",
+                   (int64_t)m4aInfo.st_size, m4aMs);
+  ted::logger.info("mapped wav: open+seek+first frame {:.2f} ms", mappedMs);
+  ted::logger.info("m4a is {:.1f}x smaller",
+                   (double)wavInfo.st_size / (double)m4aInfo.st_size);
+  REQUIRE(m4aInfo.st_size < wavInfo.st_size);
+}
+
+// interleaved wav, float samples as IEEE float and integers as PCM
+template <class Sample>
+static void writePcmWav(const std::string &path,
+                        const std::vector<Sample> &samples, int channels,
+                        int rate) {
+  std::ofstream file(path, std::ios::binary);
+  auto put = [&file](auto value) {
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  uint32_t dataSize = samples.size() * sizeof(Sample);
+  file.write("RIFF", 4);
+  put(uint32_t(36 + dataSize));
+  file.write("WAVEfmt ", 8);
+  put(uint32_t(16));
+  put(uint16_t(std::is_floating_point_v<Sample> ? 3 : 1));
+  put(uint16_t(channels));
+  put(uint32_t(rate));
+  put(uint32_t(rate * channels * sizeof(Sample)));
+  put(uint16_t(channels * sizeof(Sample)));
+  put(uint16_t(sizeof(Sample) * 8));
+  file.write("data", 4);
+  put(dataSize);
+  file.write(reinterpret_cast<const char *>(samples.data()), dataSize);
+}
+
+TEST_CASE("test mapped pcm source", "[io]") {
+  constexpr int rate = 48000;
+  constexpr int channels = 2;
+  constexpr int sampleCount = rate + 100;
+  std::string path = "/tmp/ted_mapped.wav";
+  std::vector<float> ramp(sampleCount * channels);
+  for (size_t i = 0; i < ramp.size(); ++i) {
+    ramp[i] = float(i) / (sampleCount * channels);
+  }
+  writePcmWav(path, ramp, channels, rate);
+
+  auto decoder = ted::openAudioDecoder(path);
+  auto *source = dynamic_cast<ted::MappedPcmSource *>(decoder.get());
+  REQUIRE(source != nullptr);
+  REQUIRE(source->getAudioParam().sampleRate == rate);
+  REQUIRE(source->getAudioParam().channels == channels);
+  REQUIRE(source->getAudioParam().sampleFormat == ted::AudioFormat::Float32);
+  REQUIRE(source->getSampleCount() == sampleCount);
+
+  // frames point into the mapping
+  std::shared_ptr<AVFrame> frame;
+  REQUIRE(source->getNextFrame(frame) == 0);
+  REQUIRE(frame->nb_samples == ted::MappedPcmSource::FRAME_SAMPLES);
+  REQUIRE(frame->data[0] == source->samples(0, 1).data());
+
+  REQUIRE(source->seek(500000) == 0);
+  REQUIRE(source->getNextFrame(frame) == 0);
+  REQUIRE(frame->pts == rate / 2);
+  auto *first = reinterpret_cast<const float *>(frame->data[0]);
+  REQUIRE(first[0] == float(rate / 2 * channels) / (sampleCount * channels));
+
+  // the tail is a short frame, then end of stream
+  REQUIRE(source->seek(1000000) == 0);
+  REQUIRE(source->getNextFrame(frame) == 0);
+  REQUIRE(frame->nb_samples == 100);
+  std::shared_ptr<AVFrame> end;
+  REQUIRE(source->getNextFrame(end) == 0);
+  REQUIRE(end == nullptr);
+
+  // frames keep the mapping alive after the source is gone
+  decoder.reset();
+  REQUIRE(reinterpret_cast<const float *>(frame->data[0])[0] ==
+          float(rate * channels) / (sampleCount * channels));
+
+  // 32 bit integers are played as float, AudioPlayer cannot take them
+  std::vector<int32_t> integers = {0, 1 << 30, -(1 << 30), INT32_MIN};
+  writePcmWav(path, integers, channels, rate);
+  auto converted = ted::openAudioDecoder(path);
+  REQUIRE(dynamic_cast<ted::MappedPcmSource *>(converted.get()) != nullptr);
+  REQUIRE(converted->getAudioParam().sampleFormat ==
+          ted::AudioFormat::Float32);
+  std::shared_ptr<AVFrame> floats;
+  REQUIRE(converted->getNextFrame(floats) == 0);
+  REQUIRE(floats->format == AV_SAMPLE_FMT_FLT);
+  REQUIRE(floats->nb_samples == 2);
+  auto *values = reinterpret_cast<const float *>(floats->data[0]);
+  REQUIRE(values[0] == 0.0f);
+  REQUIRE(values[1] == 0.5f);
+  REQUIRE(values[2] == -0.5f);
+  REQUIRE(values[3] == -1.0f);
+}
+
+TEST_CASE("test waveform peaks", "[io]") {
+  constexpr int rate = 16000;
+  constexpr int channels = 2;
+  constexpr int sampleCount = 10000;
+  std::vector<float> samples(sampleCount * channels);
+  for (size_t i = 0; i < samples.size(); ++i) {
+    samples[i] = std::sin((float)i * 0.01f) * (i % 2 ? 0.5f : 1.0f);
+  }
+
+  // feeding odd sized frames must not change any bucket
+  ted::WaveformBuilder whole(rate, channels);
+  whole.addSamples(samples.data(), sampleCount);
+  whole.finish();
+  ted::WaveformBuilder chunked(rate, channels);
+  for (int offset = 0; offset < sampleCount; offset += 333) {
+    chunked.addSamples(samples.data() + offset * channels,
+                       std::min(333, sampleCount - offset));
+  }
+  chunked.finish();
+
+  for (size_t level = 0; level < 3; ++level) {
+    int bucket = ted::WaveformBuilder::BUCKET_SAMPLES[level];
+    auto &peaks = whole.level(level);
+    REQUIRE(peaks.size() == (size_t)(sampleCount + bucket - 1) / bucket);
+    REQUIRE(chunked.level(level).size() == peaks.size());
+
+    for (size_t i = 0; i < peaks.size(); ++i) {
+      auto begin = samples.begin() + i * bucket * channels;
+      auto end = samples.begin() +
+                 std::min<size_t>((i + 1) * bucket * channels, samples.size());
+      double squares = 0;
+      for (auto iter = begin; iter != end; ++iter) {
+        squares += *iter * *iter;
+      }
+      REQUIRE(peaks[i].min == *std::min_element(begin, end));
+      REQUIRE(peaks[i].max == *std::max_element(begin, end));
+      REQUIRE_THAT(peaks[i].rms,
+                   Catch::Matchers::WithinRel(
+                       std::sqrt(squares / (double)(end - begin)), 1e-4));
+      REQUIRE(chunked.level(level)[i].max == peaks[i].max);
+    }
+  }
+
+  std::string wav = "/tmp/ted_peaks.wav";
+  std::string peaksFile = "/tmp/ted_peaks.bin";
+  writePcmWav(wav, samples, channels, rate);
+  REQUIRE(ted::buildWaveformPeaks(wav, peaksFile) == 0);
+
+  ted::WaveformPeaks peaks;
+  REQUIRE(peaks.load(peaksFile) == 0);
+  REQUIRE(peaks.levelCount() == 3);
+  REQUIRE(peaks.getSampleRate() == rate);
+  REQUIRE(peaks.getSampleCount() == sampleCount);
+  REQUIRE(peaks.samplesPerBucket(2) == 4096);
+  REQUIRE(peaks.level(1).size() == whole.level(1).size());
+  REQUIRE(peaks.level(1)[3].min == whole.level(1)[3].min);
+  REQUIRE(peaks.levelFor(100) == 0);
+  REQUIRE(peaks.levelFor(2000) == 1);
+  REQUIRE(peaks.levelFor(1e6) == 2);
+}
+
+TEST_CASE("test async file io", "[io]") {
+  ted::AsyncFileIO io(2);
+  std::string path = "/tmp/ted_async_io.bin";
+  unlink(path.c_str());
+
+  std::string content(300000, '\0');
+  for (size_t i = 0; i < content.size(); ++i) {
+    content[i] = (char)(i * 31 % 251);
+  }
+  REQUIRE(io.writeFile(path, content).get() == 0);
+  REQUIRE(io.readFile(path).get() == content);
+  REQUIRE_THROWS(io.readFile("/tmp/ted_async_io_missing.bin").get());
+
+  // the callback forms report the same results on the completing thread
+  std::promise<int> written;
+  io.writeFile(path, content,
+               [&written](int ret) { written.set_value(ret); });
+  REQUIRE(written.get_future().get() == 0);
+  std::promise<std::string> read;
+  io.readFile(path, [&read](std::exception_ptr error, std::string data) {
+    if (error) {
+      read.set_exception(error);
+    } else {
+      read.set_value(std::move(data));
+    }
+  });
+  REQUIRE(read.get_future().get() == content);
+
+  // one batch of reads into a registered buffer, the last runs off the end
+  std::vector<uint8_t> buffer(4 * 4096);
+  REQUIRE(io.registerBuffers({std::span<uint8_t>(buffer)}) == 0);
+  int fd = open(path.c_str(), O_RDONLY);
+  REQUIRE(fd >= 0);
+  std::vector<ted::FileRequest> requests;
+  for (int i = 0; i < 4; ++i) {
+    int64_t offset = i < 3 ? i * 50000 : (int64_t)content.size() - 1000;
+    requests.push_back({.op = ted::FileRequest::Op::Read,
+                        .fd = fd,
+                        .buffer = buffer.data() + i * 4096,
+                        .size = 4096,
+                        .offset = offset,
+                        .bufferIndex = 0});
+  }
+  auto results = io.submit(requests);
+  for (int i = 0; i < 4; ++i) {
+    int64_t expected = i < 3 ? 4096 : 1000;
+    REQUIRE(results[i].get() == expected);
+    REQUIRE(memcmp(buffer.data() + i * 4096,
+                   content.data() + requests[i].offset, expected) == 0);
+  }
+
+  // memory outside the registered buffer is refused
+  uint8_t other[16];
+  auto refused = io.submit({{.op = ted::FileRequest::Op::Read,
+                             .fd = fd,
+                             .buffer = other,
+                             .size = sizeof(other),
+                             .offset = 0,
+                             .bufferIndex = 0}});
+  REQUIRE(refused[0].get() == -EINVAL);
+  close(fd);
+  REQUIRE(io.read(-1, other, sizeof(other), 0).get() == -EBADF);
+}
+
+TEST_CASE("test growing file source", "[io]") {
+  std::string path = "/tmp/ted_growing.bin";
+  FILE *writer = fopen(path.c_str(), "wb");
+  REQUIRE(writer != nullptr);
+
+  ted::GrowingFileSource source(path);
+  // fired by the first grow, not before
+  std::promise<int64_t> started;
+  source.whenStarted([&](bool ok) {
+    REQUIRE(ok);
+    started.set_value(source.available());
+  });
+  std::thread producer([&]() {
+    for (int chunk = 0; chunk < 4; ++chunk) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      std::string data(1000, static_cast<char>('a' + chunk));
+      fwrite(data.data(), 1, data.size(), writer);
+      fflush(writer);
+      source.grow((chunk + 1) * 1000);
+    }
+    source.finish(true);
+  });
+
+  // the first read blocks until the writer reports data
+  std::string received;
+  uint8_t buffer[700];
+  int n;
+  while ((n = source.read(buffer, sizeof(buffer))) > 0) {
+    received.append(reinterpret_cast<char *>(buffer), n);
+  }
+  producer.join();
+  fclose(writer);
+
+  REQUIRE(n == AVERROR_EOF);
+  REQUIRE(received.size() == 4000);
+  REQUIRE(received[0] == 'a');
+  REQUIRE(received[3999] == 'd');
+  REQUIRE(started.get_future().get() == 1000);
+  bool again = false;
+  source.whenStarted([&again](bool ok) { again = ok; });
+  REQUIRE(again);
+
+  // a writer giving up before any data reports that nothing started
+  ted::GrowingFileSource failed(path);
+  std::optional<bool> failedStart;
+  failed.whenStarted([&failedStart](bool ok) { failedStart = ok; });
+  REQUIRE(!failedStart.has_value());
+  failed.finish(false);
+  REQUIRE(failedStart == false);
+
+  REQUIRE(source.seek(0, AVSEEK_SIZE) == 4000);
+  REQUIRE(source.seek(2500, SEEK_SET) == 2500);
+  REQUIRE(source.read(buffer, 10) == 10);
+  REQUIRE(buffer[0] == 'c');
+
+  // a writer failing midway still leaves what it wrote readable
+  ted::GrowingFileSource partial(path);
+  partial.grow(1500);
+  partial.finish(false);
+  size_t partialRead = 0;
+  while ((n = partial.read(buffer, sizeof(buffer))) > 0) {
+    partialRead += n;
+  }
+  REQUIRE(partialRead == 1500);
+  REQUIRE(n == AVERROR(EIO));
+}
+
+TEST_CASE("test memory source", "[io]") {
+  ted::MemorySource source;
+  std::thread producer([&]() {
+    for (int chunk = 0; chunk < 3; ++chunk) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      std::string data(500, static_cast<char>('x' + chunk));
+      source.append(data.data(), data.size());
+    }
+    source.finish(true);
+  });
+
+  uint8_t buffer[1500];
+  int total = 0;
+  int n;
+  while ((n = source.read(buffer + total, sizeof(buffer) - total)) > 0) {
+    total += n;
+  }
+  producer.join();
+
+  REQUIRE(n == AVERROR_EOF);
+  REQUIRE(total == 1500);
+  REQUIRE(source.seek(0, AVSEEK_SIZE) == 1500);
+  REQUIRE(source.seek(-10, SEEK_END) == 1490);
+  REQUIRE(source.read(buffer, 100) == 10);
+  REQUIRE(buffer[0] == 'z');
+}
+
+TEST_CASE("test audio decoder from memory", "[audio]") {
+  DOWNLOAD_TEST_VIDEO
+
+  std::ifstream file(local, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  auto source = std::make_shared<ted::MemorySource>(std::move(content));
+
+  ted::AudioDecoder decoder("memory.mp4");
+  decoder.setIOSource(source);
+  REQUIRE(decoder.init() == 0);
+  REQUIRE(decoder.getAudioParam().sampleRate == 48000);
+
+  REQUIRE(decoder.seek(30 * 1000000) == 0);
+  std::shared_ptr<AVFrame> frame;
+  REQUIRE(decoder.getNextFrame(frame) == 0);
+  REQUIRE(frame != nullptr);
+}
+
 TEST_CASE("test audio player", "[audio]") {
   DOWNLOAD_TEST_VIDEO
 
@@ -161,35 +675,1538 @@ TEST_CASE("test subtitle", "[subtitle]") {
   REQUIRE(subtitle.start != subtitle.end);
 }
 
-static std::string talkUrl =
-    "https://www.ted.com/talks/"
-    "francis_de_los_reyes_how_the_water_you_flush_becomes_the_water_you_drink";
+TEST_CASE("test decoder pool reuse", "[pool]") {
+  DOWNLOAD_TEST_VIDEO
+
+  ted::DecoderPool pool(2);
+  {
+    auto decoder = pool.acquire(local);
+    REQUIRE(decoder != nullptr);
+    REQUIRE(pool.missCount() == 1);
+  }
+  REQUIRE(pool.idleCount() == 1);
+
+  auto decoder = pool.acquire(local, 1000000);
+  REQUIRE(decoder != nullptr);
+  REQUIRE(pool.hitCount() == 1);
+  REQUIRE(pool.idleCount() == 0);
+
+  std::shared_ptr<AVFrame> frame;
+  REQUIRE(decoder->getNextFrame(frame) == 0);
+  REQUIRE(frame != nullptr);
+}
+
+TEST_CASE("test clip playlist prefetch", "[pool]") {
+  DOWNLOAD_TEST_VIDEO
+
+  ted::DecoderPool pool(2);
+  ted::WorkStealingPool threadPool(2);
+  ted::ClipPlaylist playlist(pool, threadPool);
+
+  std::vector<ted::Clip> clips;
+  for (int i = 0; i < 3; ++i) {
+    ted::Subtitle subtitle;
+    subtitle.start = ted::Time::fromS(i * 2);
+    subtitle.end = ted::Time::fromS(i * 2 + 1);
+    clips.push_back(ted::Clip{.mediaFile = local, .subtitle = subtitle});
+  }
+  playlist.setClips(clips);
+
+  int count = 0;
+  while (playlist.hasNext()) {
+    ted::DecodedClip decoded;
+    REQUIRE(playlist.next(decoded) == 0);
+    REQUIRE(!decoded.frames.empty());
+    REQUIRE(decoded.param.sampleRate == 48000);
+    ++count;
+  }
+  REQUIRE(count == 3);
+  // the clips come from one file, so only the first open misses
+  REQUIRE(pool.missCount() == 1);
+}
+
+TEST_CASE("test work stealing pool", "[pool]") {
+  int small = 0;
+  char large[256] = {};
+  REQUIRE(ted::Task([&small]() { ++small; }).isInline());
+  REQUIRE(!ted::Task([large]() { (void)large; }).isInline());
+
+  ted::WorkStealingPool pool(4);
+  REQUIRE(pool.enqueue([](int a, int b) { return a + b; }, 2, 3).get() == 5);
+  auto failed = pool.enqueue([]() { throw std::runtime_error("failed"); });
+  REQUIRE_THROWS_AS(failed.get(), std::runtime_error);
+
+  // tasks spawned by tasks stay on their worker and are stolen by the rest
+  std::atomic<int> leaves = 0;
+  std::vector<std::future<void>> roots;
+  for (int i = 0; i < 8; ++i) {
+    roots.push_back(pool.enqueue(ted::TaskPriority::Bulk, [&]() {
+      for (int j = 0; j < 100; ++j) {
+        pool.post(ted::TaskPriority::Bulk, [&leaves]() { ++leaves; });
+      }
+    }));
+  }
+  for (auto &&root : roots) {
+    root.get();
+  }
+
+  // with the only worker busy, interactive work overtakes queued bulk work
+  std::mutex mutex;
+  std::vector<std::string> order;
+  auto record = [&](std::string name) {
+    return [&, name]() {
+      std::unique_lock lock(mutex);
+      order.push_back(name);
+    };
+  };
+  {
+    ted::WorkStealingPool single(1);
+    std::promise<void> gate;
+    std::shared_future<void> opened = gate.get_future().share();
+    single.post(ted::TaskPriority::Bulk, [opened]() { opened.wait(); });
+    single.post(ted::TaskPriority::Bulk, record("bulk"));
+    single.post(ted::TaskPriority::Interactive, record("interactive"));
+    gate.set_value();
+  }
+  REQUIRE(order == std::vector<std::string>{"interactive", "bulk"});
+
+  while (leaves < 800) {
+    std::this_thread::yield();
+  }
+}
+
+TEST_CASE("test cooperative cancellation", "[pool]") {
+  using namespace std::chrono_literals;
+  REQUIRE(!ted::CancelToken().cancelled());
+  REQUIRE(ted::CancelToken().withTimeout(-1ms).cancelled());
+
+  ted::WorkStealingPool pool(2);
+  REQUIRE(pool.enqueueCancellable(
+                  ted::TaskPriority::Bulk, ted::CancelToken(),
+                  [](const ted::CancelToken &cancel, int value) {
+                    return cancel.cancelled() ? -1 : value;
+                  },
+                  7)
+              .get() == 7);
+
+  // a task cancelled while queued never runs
+  std::stop_source stop;
+  stop.request_stop();
+  std::atomic<bool> ran = false;
+  auto dropped = pool.enqueueCancellable(
+      ted::TaskPriority::Bulk, ted::CancelToken(stop.get_token()),
+      [&ran](const ted::CancelToken &) { ran = true; });
+  REQUIRE_THROWS_AS(dropped.get(), ted::Cancelled);
+  REQUIRE(!ran);
+
+  // 4 MiB at 64 KiB/s, aborted from the progress callback instead
+  ted::TestHttpServer server;
+  server.serve("/large", std::string(4 << 20, 'x'));
+  server.setBandwidth(64 * 1024);
+  std::stop_source downloadStop;
+  std::string body;
+  ted::SimpleDownloader downloader(server.url("/large"), &body);
+  downloader.setCancelToken(ted::CancelToken(downloadStop.get_token()));
+  REQUIRE(downloader.init() == 0);
+  auto start = std::chrono::steady_clock::now();
+  auto download =
+      pool.enqueue([&downloader]() { return downloader.download(); });
+  std::this_thread::sleep_for(200ms);
+  downloadStop.request_stop();
+  REQUIRE(download.get() != 0);
+  REQUIRE(std::chrono::steady_clock::now() - start < 3s);
+  REQUIRE(body.size() < (4u << 20));
+
+  // past its deadline a revalidation falls back to the cached copy
+  server.setBandwidth(0);
+  server.serve("/page", "<html>cached</html>");
+  std::string cacheFile = "/tmp/ted_cancel_revalidate.html";
+  unlink(cacheFile.c_str());
+  unlink((cacheFile + ".meta").c_str());
+  REQUIRE(ted::fetchRevalidated(server.url("/page"), cacheFile, body) ==
+          ted::FetchResult::Updated);
+  server.setLatency(3s);
+  body.clear();
+  start = std::chrono::steady_clock::now();
+  REQUIRE(ted::fetchRevalidated(server.url("/page"), cacheFile, body,
+                                ted::CancelToken().withTimeout(200ms)) ==
+          ted::FetchResult::NotModified);
+  REQUIRE(std::chrono::steady_clock::now() - start < 2500ms);
+  REQUIRE(body == "<html>cached</html>");
+  server.setLatency(0ms);
+}
+
+TEST_CASE("test task graph", "[pool]") {
+  using namespace std::chrono_literals;
+  ted::WorkStealingPool pool(2);
+  ted::TaskGraph graph(pool, "test");
+
+  // page, then audio and subtitles side by side, joined by ready
+  auto page = graph.add("page", []() {
+    std::this_thread::sleep_for(20ms);
+    return std::string("html");
+  });
+  auto audio = page.then("audio", ted::TaskPriority::Bulk,
+                         [](const std::string &html) { return html.size(); });
+  auto subtitles = page.then("subtitles", [](const std::string &html) {
+    std::this_thread::sleep_for(30ms);
+    return html + "!";
+  });
+  auto ready = graph.whenAll(
+      "ready", ted::TaskPriority::Interactive,
+      [audio, subtitles]() {
+        return subtitles.future().get() +
+               std::to_string(audio.future().get());
+      },
+      audio, subtitles);
+  REQUIRE(ready.future().get() == "html!4");
+
+  auto path = graph.criticalPath(ready);
+  REQUIRE(path.size() == 3);
+  REQUIRE(path[0].name == "page");
+  REQUIRE(path[1].name == "subtitles");
+  REQUIRE(path[1].runMs >= 25);
+  REQUIRE(path[2].name == "ready");
+
+  // a failure skips continuations and still reaches settled joins
+  auto failed =
+      graph.add("failed", []() -> int { throw std::runtime_error("failed"); });
+  std::atomic<bool> ran = false;
+  auto skipped = failed.then("skipped", [&ran](int) { ran = true; });
+  REQUIRE_THROWS_AS(skipped.future().get(), std::runtime_error);
+  REQUIRE(!ran);
+  auto settled = graph.whenSettled(
+      "settled", ted::TaskPriority::Interactive,
+      [skipped]() {
+        try {
+          skipped.future().get();
+        } catch (const std::runtime_error &) {
+          return true;
+        }
+        return false;
+      },
+      skipped, ready);
+  REQUIRE(settled.future().get());
+  REQUIRE(graph.criticalPath(settled).front().failed);
+
+  // waiting stages hold no worker, a long chain runs on a single one
+  {
+    ted::WorkStealingPool single(1);
+    ted::TaskGraph chain(single, "chain");
+    auto node = chain.add("0", []() { return 0; });
+    for (int i = 1; i < 200; ++i) {
+      node = node.then(std::to_string(i), [](int value) { return value + 1; });
+    }
+    REQUIRE(node.future().get() == 199);
+    REQUIRE(chain.criticalPath(node).size() == 200);
+  }
+
+  // async stages complete through their promise, not when their function
+  // returns, and hold no worker meanwhile
+  {
+    ted::WorkStealingPool single(1);
+    ted::TaskGraph io(single, "io");
+    std::promise<ted::GraphPromise<int>> handed;
+    auto read =
+        io.addAsync<int>("read", [&handed](ted::GraphPromise<int> promise) {
+          handed.set_value(promise);
+        });
+    auto plusOne = read.then("plus one", [](int value) { return value + 1; });
+    auto promise = handed.get_future().get();
+    auto other = io.add("other", []() { return 1; });
+    REQUIRE(other.future().get() == 1);
+    std::this_thread::sleep_for(30ms);
+    promise.set(41);
+    // only the first result counts
+    promise.set(0);
+    promise.fail(std::make_exception_ptr(std::runtime_error("late")));
+    REQUIRE(plusOne.future().get() == 42);
+    auto path = io.criticalPath(plusOne);
+    REQUIRE(path.size() == 2);
+    REQUIRE(path[0].name == "read");
+    REQUIRE(path[0].runMs >= 25);
+
+    auto rejected = read.thenAsync<int>(
+        "rejected", [](int, ted::GraphPromise<int> promise) {
+          promise.fail(std::make_exception_ptr(std::runtime_error("io")));
+        });
+    REQUIRE_THROWS_AS(rejected.future().get(), std::runtime_error);
+
+    // a promise dropped unset fails its stage instead of hanging it
+    auto abandoned =
+        io.addAsync<void>("abandoned", [](ted::GraphPromise<void>) {});
+    REQUIRE_THROWS_AS(abandoned.future().get(), std::runtime_error);
+
+    auto gate = io.addAsync<void>(
+        "gate", [](ted::GraphPromise<void> promise) { promise.set(); });
+    auto opened = gate.thenAsync<int>(
+        "opened", [](ted::GraphPromise<int> promise) { promise.set(7); });
+    REQUIRE(opened.future().get() == 7);
+  }
+
+  // stages not started when the token is cancelled never run
+  std::stop_source stop;
+  ted::TaskGraph cancelled(pool, "cancelled",
+                           ted::CancelToken(stop.get_token()));
+  std::promise<void> gate;
+  auto blocker = cancelled.add(
+      "blocker", [opened = gate.get_future().share()]() { opened.wait(); });
+  auto after = blocker.then("after", [&ran]() { ran = true; });
+  stop.request_stop();
+  gate.set_value();
+  REQUIRE_THROWS_AS(after.future().get(), ted::Cancelled);
+  REQUIRE(!ran);
+
+  // whenIdle waits for stages no join depends on
+  {
+    ted::TaskGraph idle(pool, "idle");
+    std::atomic<bool> finished = false;
+    idle.add("a", []() { return 1; })
+        .then("b", ted::TaskPriority::Bulk, [&finished](int) {
+          std::this_thread::sleep_for(20ms);
+          finished = true;
+        });
+    idle.whenIdle().wait();
+    REQUIRE(finished);
+  }
+
+  // an async stage completed after the owner of its pool returned fails
+  // its continuations instead of posting to the pool that is gone
+  std::optional<ted::GraphPromise<int>> late;
+  std::shared_future<int> orphaned;
+  {
+    ted::WorkStealingPool owned(1);
+    ted::TaskGraph io(owned, "owned");
+    std::promise<ted::GraphPromise<int>> handed;
+    auto read =
+        io.addAsync<int>("read", [&handed](ted::GraphPromise<int> promise) {
+          handed.set_value(promise);
+        });
+    orphaned = read.then("plus one", [](int value) { return value + 1; })
+                   .future();
+    late = handed.get_future().get();
+    REQUIRE(io.whenIdle().wait_for(10ms) == std::future_status::timeout);
+  }
+  std::thread([&late]() { late->set(1); }).join();
+  REQUIRE_THROWS_AS(orphaned.get(), ted::Cancelled);
+}
 
 TEST_CASE("test ted fetch", "[downloader]") {
+  ted::TestHttpServer server;
+  ted::TestTalkFixture talk(server);
+
   std::string buffer;
-  auto downloader = ted::SimpleDownloader(talkUrl, "./test.html");
+  auto downloader = ted::SimpleDownloader(talk.talkUrl(), &buffer);
   REQUIRE(downloader.init() == 0);
   REQUIRE(downloader.download() == 0);
+  REQUIRE(ted::retrieveM3U8UrlFromTalkHtml(buffer) == talk.masterUrl());
+
+  auto info = ted::retrieveTalkInfoFromHtml(buffer);
+  REQUIRE(info.id == "1024");
+  REQUIRE(info.speaker == "Test Speaker");
+  REQUIRE(info.durationMs == (int64_t)(talk.segmentCount() * 6000));
 }
 
 TEST_CASE("test ffmpeg hls downloader", "[hls]") {
-  auto m3u8Url = ted::retrieveM3U8UrlFromTalkHtml(talkUrl);
+  ted::TestHttpServer server;
+  ted::TestTalkFixture talk(server);
+
+  std::string html;
+  ted::SimpleDownloader downloader(talk.talkUrl(), &html);
+  REQUIRE(downloader.init() == 0);
+  REQUIRE(downloader.download() == 0);
+  auto m3u8Url = ted::retrieveM3U8UrlFromTalkHtml(html);
 
   ted::HLSParser parser(m3u8Url);
   REQUIRE(parser.init() == 0);
   auto playlist = parser.getPlayList();
   REQUIRE(!playlist.empty());
-  REQUIRE(parser.downloadAudioByName("medium", "./m3u8.mp3") == 0);
+
+  std::string output = "/tmp/ted_fixture_medium.ts";
+  REQUIRE(parser.downloadAudioByName("medium", output) == 0);
+  std::ifstream file(output, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  REQUIRE(content == talk.audio("medium"));
+}
+
+TEST_CASE("test hls downloader against a faulty server", "[hls]") {
+  ted::TestHttpServer server;
+  ted::TestTalkFixture talk(server, 6, 64 * 1024);
+  server.setLatency(std::chrono::milliseconds(20));
+  server.injectFailures(talk.segmentPath("medium", 1), 2);
+  server.injectDisconnects(talk.segmentPath("medium", 4), 1);
+
+  std::string output = "/tmp/ted_fixture_faulty.ts";
+  ted::NativeHLSDownloader downloader(talk.playListUrl("medium"), output, 2);
+  REQUIRE(downloader.init() == 0);
+  REQUIRE(downloader.download() == 0);
+  REQUIRE(server.requestCount(talk.segmentPath("medium", 1)) == 3);
+  REQUIRE(server.requestCount(talk.segmentPath("medium", 4)) == 2);
+
+  std::ifstream file(output, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  REQUIRE(content == talk.audio("medium"));
+
+  // 384 KiB at 1 MiB/s per connection over two connections
+  server.setLatency(std::chrono::milliseconds(0));
+  server.setBandwidth(1 << 20);
+  ted::NativeHLSDownloader throttled(talk.playListUrl("low"), output, 2);
+  REQUIRE(throttled.init() == 0);
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(throttled.download() == 0);
+  REQUIRE(std::chrono::steady_clock::now() - start >=
+          std::chrono::milliseconds(150));
+}
+
+static std::string makeSegment(size_t index, size_t size) {
+  std::string segment(size, '\0');
+  for (size_t i = 0; i < size; ++i) {
+    segment[i] = static_cast<char>((index * 31 + i) & 0xff);
+  }
+  return segment;
+}
+
+TEST_CASE("test media playlist parser", "[hls]") {
+  std::string playList = "#EXTM3U\n"
+                         "#EXT-X-TARGETDURATION:6\n"
+                         "#EXTINF:6.000,\n"
+                         "seg0.ts\n"
+                         "#EXTINF:4.5,\n"
+                         "/abs/seg1.ts\n"
+                         "#EXTINF:2,\n"
+                         "https://cdn.example.com/seg2.ts\n"
+                         "#EXT-X-ENDLIST\n";
+  auto segments = ted::parseMediaPlayList(
+      playList, "https://hls.example.com/talk/audio/index.m3u8?token=1");
+
+  REQUIRE(segments.size() == 3);
+  REQUIRE(segments[0].url == "https://hls.example.com/talk/audio/seg0.ts");
+  REQUIRE(segments[0].duration == 6.0);
+  REQUIRE(segments[1].url == "https://hls.example.com/abs/seg1.ts");
+  REQUIRE(segments[1].duration == 4.5);
+  REQUIRE(segments[2].url == "https://cdn.example.com/seg2.ts");
+}
+
+TEST_CASE("test m3u8 attribute lists", "[hls]") {
+  std::string master =
+      "#EXTM3U\n"
+      "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aac\",NAME=\"medium\","
+      "DEFAULT=YES,URI=\"audio/medium.m3u8\"\n"
+      "#EXT-X-STREAM-INF:BANDWIDTH=320000,CODECS=\"avc1.42c00d,mp4a.40.2\","
+      "RESOLUTION=320x180,FRAME-RATE=23.976,AUDIO=\"aac\"\n"
+      "video/180.m3u8\n";
+  ted::M3U8MasterPlaylist playList;
+  REQUIRE(ted::parseM3U8Master(master, playList) == 0);
+
+  REQUIRE(playList.variants.size() == 1);
+  auto &variant = playList.variants[0];
+  REQUIRE(variant.uri == "video/180.m3u8");
+  REQUIRE(variant.bandwidth == 320000);
+  REQUIRE(variant.codecs == "avc1.42c00d,mp4a.40.2");
+  REQUIRE(variant.width == 320);
+  REQUIRE(variant.height == 180);
+  REQUIRE_THAT(variant.frameRate, Catch::Matchers::WithinAbs(23.976, 1e-9));
+  REQUIRE(variant.audioGroup == "aac");
+
+  REQUIRE(playList.renditions.size() == 1);
+  auto &rendition = playList.renditions[0];
+  REQUIRE(rendition.type == "AUDIO");
+  REQUIRE(rendition.name == "medium");
+  REQUIRE(rendition.uri == "audio/medium.m3u8");
+  REQUIRE(rendition.isDefault);
+
+  // views point into the playlist text, nothing is copied
+  REQUIRE(variant.uri.data() >= master.data());
+  REQUIRE(variant.uri.data() < master.data() + master.size());
+
+  ted::M3U8MasterPlaylist invalid;
+  REQUIRE(ted::parseM3U8Master("<html></html>", invalid) == -1);
+}
+
+TEST_CASE("test m3u8 media timeline", "[hls]") {
+  std::string media = "#EXTM3U\r\n"
+                      "#EXT-X-TARGETDURATION:6\r\n"
+                      "#EXT-X-MEDIA-SEQUENCE:7\r\n"
+                      "#EXT-X-MAP:URI=\"init.mp4\",BYTERANGE=\"720@0\"\r\n"
+                      "#EXTINF:6.0,\r\n"
+                      "#EXT-X-BYTERANGE:1000@720\r\n"
+                      "main.mp4\r\n"
+                      "#EXTINF:5.5,title\r\n"
+                      "#EXT-X-BYTERANGE:2000\r\n"
+                      "main.mp4\r\n"
+                      "#EXT-X-DISCONTINUITY\r\n"
+                      "#EXTINF:4,\r\n"
+                      "ad.ts\r\n"
+                      "#EXT-X-ENDLIST\r\n";
+  ted::M3U8MediaPlaylist playList;
+  REQUIRE(ted::parseM3U8Media(media, playList) == 0);
+  REQUIRE(playList.targetDuration == 6);
+  REQUIRE(playList.mediaSequence == 7);
+  REQUIRE(playList.endList);
+  REQUIRE(playList.segments.size() == 3);
+
+  auto &first = playList.segments[0];
+  REQUIRE(first.mapUri == "init.mp4");
+  REQUIRE(first.mapByteRange->length == 720);
+  REQUIRE(first.byteRange->offset == 720);
+  REQUIRE(first.byteRange->length == 1000);
+  REQUIRE(playList.segments[1].byteRange->offset == 1720);
+  REQUIRE(playList.segments[1].start == 6.0);
+  REQUIRE(playList.segments[2].start == 11.5);
+  REQUIRE(playList.segments[2].discontinuity == 1);
+  REQUIRE(!playList.segments[2].byteRange);
+  REQUIRE(playList.duration() == 15.5);
+
+  REQUIRE(playList.segmentsCovering(0, 1) == std::pair<size_t, size_t>{0, 1});
+  REQUIRE(playList.segmentsCovering(5, 7) == std::pair<size_t, size_t>{0, 2});
+  REQUIRE(playList.segmentsCovering(6, 20) ==
+          std::pair<size_t, size_t>{1, 3});
+  REQUIRE(playList.segmentsCovering(20, 30).first == 3);
+
+  auto segments = ted::parseMediaPlayList(media, "http://host/talk/index.m3u8");
+  REQUIRE(segments.size() == 4);
+  REQUIRE(segments[0].isInit);
+  REQUIRE(segments[0].url == "http://host/talk/init.mp4");
+  REQUIRE(segments[0].rangeLength == 720);
+  REQUIRE(segments[2].rangeOffset == 1720);
+  REQUIRE(segments[3].rangeLength < 0);
+  // the init section starts with the first segment and is never selected
+  REQUIRE(ted::segmentsCovering(segments, 5, 7) ==
+          std::pair<size_t, size_t>{1, 3});
+}
+
+TEST_CASE("test native hls downloader", "[hls]") {
+  ted::TestHttpServer server;
+
+  constexpr size_t segmentCount = 12;
+  std::string playList = "#EXTM3U\n#EXT-X-TARGETDURATION:6\n";
+  std::string expected;
+  for (size_t i = 0; i < segmentCount; ++i) {
+    auto segment = makeSegment(i, 1000 + i * 37);
+    expected += segment;
+    server.serve("/audio/seg" + std::to_string(i) + ".ts", segment);
+    playList += "#EXTINF:6.0,\nseg" + std::to_string(i) + ".ts\n";
+  }
+  playList += "#EXT-X-ENDLIST\n";
+  server.serve("/audio/index.m3u8", playList);
+
+  std::string output = "/tmp/ted_native_hls.ts";
+  ted::NativeHLSDownloader downloader(server.url("/audio/index.m3u8"), output,
+                                      3);
+  size_t lastDone = 0;
+  downloader.setProgressCallback([&](size_t done, size_t total, int64_t) {
+    REQUIRE(done == lastDone + 1);
+    REQUIRE(total == segmentCount);
+    lastDone = done;
+  });
+  REQUIRE(downloader.init() == 0);
+  REQUIRE(downloader.getSegments().size() == segmentCount);
+  REQUIRE(downloader.download() == 0);
+  REQUIRE(lastDone == segmentCount);
+
+  std::ifstream file(output, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  REQUIRE(content == expected);
+}
+
+TEST_CASE("test native hls downloader missing segment", "[hls]") {
+  ted::TestHttpServer server;
+  server.serve("/audio/index.m3u8",
+               "#EXTM3U\n#EXTINF:6.0,\nseg0.ts\n#EXTINF:6.0,\nmissing.ts\n");
+  server.serve("/audio/seg0.ts", makeSegment(0, 100));
+
+  std::string output = "/tmp/ted_native_hls_missing.ts";
+  unlink(output.c_str());
+  ted::NativeHLSDownloader downloader(server.url("/audio/index.m3u8"), output);
+  REQUIRE(downloader.init() == 0);
+  REQUIRE(downloader.download() != 0);
+  REQUIRE(access(output.c_str(), F_OK) != 0);
+}
+
+TEST_CASE("test hls download to memory", "[hls]") {
+  ted::TestHttpServer server;
+  std::string expected;
+  std::string playList = "#EXTM3U\n";
+  for (size_t i = 0; i < 5; ++i) {
+    auto segment = makeSegment(i, 2048);
+    expected += segment;
+    server.serve("/mem/seg" + std::to_string(i) + ".ts", segment);
+    playList += "#EXTINF:6.0,\nseg" + std::to_string(i) + ".ts\n";
+  }
+  server.serve("/mem/index.m3u8", playList);
+
+  ted::MemorySource source;
+  REQUIRE(ted::downloadHLSToMemorySource(server.url("/mem/index.m3u8"),
+                                         source, 2) == 0);
+  REQUIRE(source.available() == (int64_t)expected.size());
+
+  std::string received(expected.size(), '\0');
+  REQUIRE(source.read(reinterpret_cast<uint8_t *>(received.data()),
+                      (int)received.size()) == (int)expected.size());
+  REQUIRE(received == expected);
+}
+
+TEST_CASE("test variant selector", "[hls]") {
+  ted::VariantSelector selector({256000, 64000, 128000});
+  ted::ThroughputEstimator throughput;
+  REQUIRE(selector.lowest() == 1);
+  REQUIRE(selector.select(5, throughput) == 1);
+
+  // 50 KB/s = 400 kbps, 0.7 of it fits the top variant
+  throughput.addSample(50000, 1.0);
+  REQUIRE(selector.select(0, throughput) == 1);
+  REQUIRE(selector.select(2, throughput) == 0);
+
+  // collapse to 80 kbps, only the lowest fits
+  for (int i = 0; i < 20; ++i) {
+    throughput.addSample(10000, 1.0);
+  }
+  REQUIRE(selector.select(3, throughput) == 1);
+}
+
+TEST_CASE("test adaptive audio download", "[hls]") {
+  ted::TestHttpServer server;
+
+  constexpr size_t segmentCount = 6;
+  std::string expected;
+  for (const std::string name : {"lo", "hi"}) {
+    std::string playList = "#EXTM3U\n";
+    for (size_t i = 0; i < segmentCount; ++i) {
+      auto segment = name + makeSegment(i, 512);
+      server.serve("/" + name + "/seg" + std::to_string(i) + ".ts", segment);
+      playList += "#EXTINF:6.0,\nseg" + std::to_string(i) + ".ts\n";
+      // fast start takes two segments from the low variant
+      if ((i < 2) == (name == "lo")) {
+        expected += segment;
+      }
+    }
+    server.serve("/" + name + "/index.m3u8", playList);
+  }
+  server.serve(
+      "/master.m3u8",
+      "#EXTM3U\n"
+      "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"a64\",NAME=\"low\","
+      "URI=\"lo/index.m3u8\",DEFAULT=NO\n"
+      "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"a128\",NAME=\"high\","
+      "URI=\"hi/index.m3u8\",DEFAULT=NO\n"
+      "#EXT-X-STREAM-INF:BANDWIDTH=64000,CODECS=\"mp4a.40.2\",AUDIO=\"a64\"\n"
+      "v64.m3u8\n"
+      "#EXT-X-STREAM-INF:BANDWIDTH=128000,CODECS=\"mp4a.40.2\",AUDIO=\"a128\"\n"
+      "v128.m3u8\n");
+
+  ted::HLSParser parser(server.url("/master.m3u8"));
+  REQUIRE(parser.init() == 0);
+  auto audios = parser.getAudioPlayList();
+  REQUIRE(audios.size() == 2);
+  REQUIRE(audios[0].groupId == "a64");
+  REQUIRE(audios[0].bandwidth == 64000);
+  REQUIRE(audios[1].bandwidth == 128000);
+
+  std::string output = "/tmp/ted_adaptive_hls.ts";
+  REQUIRE(parser.downloadAudioAdaptive(output) == 0);
+  std::ifstream file(output, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  REQUIRE(content.size() == expected.size());
+  REQUIRE(content.starts_with(expected.substr(0, 2 * expected.size() / 6)));
+
+  // one transfer at a time so every switch decision has a measurement
+  ted::NativeHLSDownloader downloader(server.url("/master.m3u8"), output, 1);
+  downloader.addVariant(server.url("/hi/index.m3u8"), 128000);
+  downloader.addVariant(server.url("/lo/index.m3u8"), 64000);
+  REQUIRE(downloader.init() == 0);
+  REQUIRE(downloader.download() == 0);
+  REQUIRE(downloader.getSegmentVariants() ==
+          std::vector<size_t>{0, 0, 1, 1, 1, 1});
+
+  std::ifstream adaptive(output, std::ios::binary);
+  content.assign((std::istreambuf_iterator<char>(adaptive)),
+                 std::istreambuf_iterator<char>());
+  REQUIRE(content == expected);
+}
+
+TEST_CASE("test adaptive audio keeps one format", "[hls]") {
+  ted::TestHttpServer server;
+
+  constexpr size_t segmentCount = 6;
+  std::string expected;
+  for (const std::string name : {"lo", "hi", "ec3"}) {
+    std::string playList = "#EXTM3U\n";
+    for (size_t i = 0; i < segmentCount; ++i) {
+      auto segment = name + makeSegment(i, name == "ec3" ? 900 : 512);
+      server.serve("/" + name + "/seg" + std::to_string(i) + ".ts", segment);
+      playList += "#EXTINF:6.0,\nseg" + std::to_string(i) + ".ts\n";
+      // two segments from the low variant, the rest from the high one
+      if (name != "ec3" && (i < 2) == (name == "lo")) {
+        expected += segment;
+      }
+    }
+    server.serve("/" + name + "/index.m3u8", playList);
+  }
+  // the richest rendition is surround ac-3 behind the same segment timeline
+  server.serve(
+      "/master.m3u8",
+      "#EXTM3U\n"
+      "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"a64\",NAME=\"low\","
+      "URI=\"lo/index.m3u8\",CHANNELS=\"2\"\n"
+      "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"a128\",NAME=\"high\","
+      "URI=\"hi/index.m3u8\",CHANNELS=\"2\"\n"
+      "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"a384\",NAME=\"surround\","
+      "URI=\"ec3/index.m3u8\",CHANNELS=\"6\"\n"
+      "#EXT-X-STREAM-INF:BANDWIDTH=64000,"
+      "CODECS=\"avc1.42c00d,mp4a.40.2\",AUDIO=\"a64\"\nv64.m3u8\n"
+      "#EXT-X-STREAM-INF:BANDWIDTH=128000,"
+      "CODECS=\"avc1.4d401f,mp4a.40.2\",AUDIO=\"a128\"\nv128.m3u8\n"
+      "#EXT-X-STREAM-INF:BANDWIDTH=384000,"
+      "CODECS=\"avc1.4d401f,ec-3\",AUDIO=\"a384\"\nv384.m3u8\n");
+
+  ted::HLSParser parser(server.url("/master.m3u8"));
+  REQUIRE(parser.init() == 0);
+  auto audios = parser.getAudioPlayList();
+  REQUIRE(audios.size() == 3);
+  REQUIRE(audios[0].codecs == "mp4a.40.2");
+  REQUIRE(audios[1].codecs == "mp4a.40.2");
+  REQUIRE(audios[2].codecs == "ec-3");
+  REQUIRE(audios[2].channels == "6");
+
+  std::string output = "/tmp/ted_adaptive_format_hls.ts";
+  REQUIRE(parser.downloadAudioAdaptive(output) == 0);
+  std::ifstream file(output, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  REQUIRE(content.size() == expected.size());
+  REQUIRE(content.find("ec3") == std::string::npos);
+
+  // a declared sample rate separates renditions of the same codec too
+  ted::NativeHLSDownloader downloader(server.url("/master.m3u8"), output, 1);
+  ted::VariantFormat cd{.codecs = "mp4a.40.2", .channels = "2",
+                       .sampleRate = 44100};
+  ted::VariantFormat studio{.codecs = "mp4a.40.2", .channels = "2",
+                           .sampleRate = 48000};
+  downloader.addVariant(server.url("/lo/index.m3u8"), 64000, cd);
+  downloader.addVariant(server.url("/hi/index.m3u8"), 128000);
+  downloader.addVariant(server.url("/ec3/index.m3u8"), 384000, studio);
+  REQUIRE(downloader.init() == 0);
+  REQUIRE(downloader.download() == 0);
+  // a variant without declarations is kept, the 48 kHz one is not
+  REQUIRE(downloader.getSegmentVariants() ==
+          std::vector<size_t>{0, 0, 1, 1, 1, 1});
+  std::ifstream adaptive(output, std::ios::binary);
+  content.assign((std::istreambuf_iterator<char>(adaptive)),
+                 std::istreambuf_iterator<char>());
+  REQUIRE(content == expected);
+
+  REQUIRE(cd.compatible(ted::VariantFormat()));
+  REQUIRE(!cd.compatible(studio));
+  studio.sampleRate = 0;
+  REQUIRE(cd.compatible(studio));
+  studio.channels = "6";
+  REQUIRE(!cd.compatible(studio));
+}
+
+TEST_CASE("test sentence targeted fetch", "[hls]") {
+  ted::TestHttpServer server;
+
+  constexpr size_t segmentCount = 10;
+  std::string expected;
+  std::string playList = "#EXTM3U\n#EXT-X-TARGETDURATION:6\n";
+  std::atomic<int> gets[segmentCount] = {};
+  for (size_t i = 0; i < segmentCount; ++i) {
+    auto segment = makeSegment(i, 700 + i * 13);
+    expected += segment;
+    server.route("/sparse/seg" + std::to_string(i) + ".ts",
+                 [&gets, i, segment](const ted::TestHttpServer::Request &request) {
+                   if (request.method == "GET") {
+                     ++gets[i];
+                   }
+                   return ted::TestHttpServer::rangeResponse(request, segment);
+                 });
+    playList += "#EXTINF:6.0,\nseg" + std::to_string(i) + ".ts\n";
+  }
+  server.serve("/sparse/index.m3u8", playList + "#EXT-X-ENDLIST\n");
+
+  std::string cacheDir = "/tmp/ted_sparse_cache";
+  system(("rm -rf " + cacheDir).c_str());
+
+  ted::SparseSegmentSource source(server.url("/sparse/index.m3u8"), cacheDir);
+  REQUIRE(source.init() == 0);
+  REQUIRE(source.size() == (int64_t)expected.size());
+
+  // 7s-13s spans segments 1 and 2, 40.5s-41s sits in segment 6
+  std::vector<ted::Subtitle> sentences = {
+      {"first", ted::Time::fromMs(7000), ted::Time::fromMs(13000)},
+      {"second", ted::Time::fromMs(40500), ted::Time::fromMs(41000)},
+  };
+  REQUIRE(source.fetchSubtitles(sentences) == 0);
+  REQUIRE(source.cachedCount() == 3);
+  for (size_t i = 0; i < segmentCount; ++i) {
+    REQUIRE(gets[i] == (i == 1 || i == 2 || i == 6 ? 1 : 0));
+  }
+
+  // reading a sentence is served from the cache
+  int64_t offset = (int64_t)(700 + (700 + 13));
+  REQUIRE(source.seek(offset, SEEK_SET) == offset);
+  std::string chunk(100, '\0');
+  REQUIRE(source.read(reinterpret_cast<uint8_t *>(chunk.data()), 100) == 100);
+  REQUIRE(chunk == expected.substr(offset, 100));
+  REQUIRE(source.cachedCount() == 3);
+
+  // the index survives, a reopened source reads everything, filling gaps
+  ted::SparseSegmentSource reopened(server.url("/sparse/index.m3u8"),
+                                    cacheDir);
+  REQUIRE(reopened.init() == 0);
+  REQUIRE(reopened.cachedCount() == 3);
+  std::string all;
+  std::string buffer(4096, '\0');
+  int n;
+  while ((n = reopened.read(reinterpret_cast<uint8_t *>(buffer.data()),
+                            (int)buffer.size())) > 0) {
+    all.append(buffer.data(), n);
+  }
+  REQUIRE(n == AVERROR_EOF);
+  REQUIRE(all == expected);
+  REQUIRE(reopened.cachedCount() == segmentCount);
+  REQUIRE(gets[1] == 1);
+
+  // a malformed index is probed again instead of throwing
+  std::string url = server.url("/sparse/index.m3u8");
+  for (auto &&entry :
+       {R"({"version": 1, "url": ")" + url + R"("})",
+        R"({"version": 1, "url": ")" + url +
+            R"(", "segments": [{"url": "seg0.ts", "duration": "6"}]})",
+        std::string(R"({"version": 1, "url": 7})"), std::string("[1, 2]")}) {
+    std::ofstream(cacheDir + "/segments.json") << entry;
+    ted::SparseSegmentSource reprobed(url, cacheDir);
+    REQUIRE(reprobed.init() == 0);
+    REQUIRE(reprobed.size() == (int64_t)expected.size());
+  }
+}
+
+TEST_CASE("test shared connection reuse", "[downloader]") {
+  ted::TestHttpServer server;
+  server.serve("/small.txt", "small response");
+
+  auto before = ted::DownloadService::instance().getStats();
+  for (int i = 0; i < 5; ++i) {
+    std::string buffer;
+    ted::SimpleDownloader downloader(server.url("/small.txt"), &buffer);
+    REQUIRE(downloader.init() == 0);
+    REQUIRE(downloader.download() == 0);
+    REQUIRE(buffer == "small response");
+  }
+  auto after = ted::DownloadService::instance().getStats();
+
+  REQUIRE(server.connectionCount() == 1);
+  REQUIRE(after.transfers - before.transfers == 5);
+  REQUIRE(after.reusedConnections - before.reusedConnections == 4);
+}
+
+TEST_CASE("test single flight fetch", "[downloader]") {
+  ted::TestHttpServer server;
+  std::atomic<int> gets = 0;
+  server.route("/slow.m3u8", [&](const ted::TestHttpServer::Request &request) {
+    ++gets;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    return ted::TestHttpServer::rangeResponse(request, "#EXTM3U\n");
+  });
+  server.serve("/big.bin", std::string(64 * 1024, 'x'));
+
+  auto &singleFlight = ted::SingleFlight::instance();
+  singleFlight.setCachePolicy(16 * 1024, std::chrono::seconds(10));
+
+  std::vector<ted::SingleFlight::Response> responses(8);
+  std::vector<std::thread> threads;
+  for (auto &&response : responses) {
+    threads.emplace_back([&]() {
+      response = singleFlight.get(server.url("/slow.m3u8"));
+    });
+  }
+  for (auto &&thread : threads) {
+    thread.join();
+  }
+  REQUIRE(gets == 1);
+  for (auto &&response : responses) {
+    REQUIRE(response.status == 0);
+    REQUIRE(response.body == responses[0].body);
+    REQUIRE(*response.body == "#EXTM3U\n");
+  }
+
+  // small responses are served from memory for a while, ranges are keyed
+  // separately
+  REQUIRE(singleFlight.get(server.url("/slow.m3u8")).status == 0);
+  REQUIRE(gets == 1);
+  REQUIRE(*singleFlight.get(server.url("/slow.m3u8"), "0-2").body == "#EX");
+  REQUIRE(gets == 2);
+
+  singleFlight.clearCache();
+  REQUIRE(singleFlight.get(server.url("/slow.m3u8")).status == 0);
+  REQUIRE(gets == 3);
+
+  // large ones are not kept
+  REQUIRE(singleFlight.get(server.url("/big.bin")).status == 0);
+  REQUIRE(singleFlight.get(server.url("/big.bin")).status == 0);
+  REQUIRE(server.requestCount("/big.bin") == 2);
+
+  // the cache as a whole stays within its budget
+  server.serve("/a.bin", std::string(8 * 1024, 'a'));
+  server.serve("/b.bin", std::string(8 * 1024, 'b'));
+  singleFlight.setCachePolicy(16 * 1024, std::chrono::seconds(10), 12 * 1024);
+  REQUIRE(singleFlight.get(server.url("/a.bin")).status == 0);
+  REQUIRE(singleFlight.get(server.url("/b.bin")).status == 0);
+  REQUIRE(singleFlight.get(server.url("/b.bin")).status == 0);
+  REQUIRE(singleFlight.get(server.url("/a.bin")).status == 0);
+  REQUIRE(server.requestCount("/a.bin") == 2);
+  REQUIRE(server.requestCount("/b.bin") == 1);
+  singleFlight.setCachePolicy(16 * 1024, std::chrono::seconds(10));
+
+  REQUIRE(singleFlight.get(server.url("/missing")).status != 0);
+
+  // a cancelled waiter stops waiting, the transfer goes on for the caller
+  // that started it
+  auto shared = std::async(std::launch::async, [&]() {
+    return singleFlight.get(server.url("/slow.m3u8"), "0-3");
+  });
+  while (gets < 4) {
+    std::this_thread::yield();
+  }
+  std::stop_source waiterStop;
+  auto waiter = std::async(std::launch::async, [&]() {
+    return singleFlight.get(server.url("/slow.m3u8"), "0-3",
+                            ted::CancelToken(waiterStop.get_token()));
+  });
+  waiterStop.request_stop();
+  REQUIRE(waiter.get().cancelled);
+  REQUIRE(*shared.get().body == "#EXT");
+  REQUIRE(gets == 4);
+
+  // cancelling the caller that started the transfer makes a waiter that
+  // was not cancelled fetch again; the first response would take long
+  // enough for curl to notice the cancel before it arrives
+  std::atomic<int> stalls = 0;
+  server.route("/stalled.m3u8",
+               [&](const ted::TestHttpServer::Request &request) {
+                 if (++stalls == 1) {
+                   std::this_thread::sleep_for(std::chrono::seconds(3));
+                 }
+                 return ted::TestHttpServer::rangeResponse(request,
+                                                           "#EXTM3U\n");
+               });
+  std::stop_source starterStop;
+  auto starter = std::async(std::launch::async, [&]() {
+    return singleFlight.get(server.url("/stalled.m3u8"), "",
+                            ted::CancelToken(starterStop.get_token()));
+  });
+  while (stalls < 1) {
+    std::this_thread::yield();
+  }
+  auto patient = std::async(std::launch::async, [&]() {
+    return singleFlight.get(server.url("/stalled.m3u8"));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  starterStop.request_stop();
+  REQUIRE(starter.get().cancelled);
+  auto retried = patient.get();
+  REQUIRE(retried.status == 0);
+  REQUIRE(*retried.body == "#EXTM3U\n");
+  REQUIRE(stalls == 2);
+  singleFlight.setCachePolicy(512 * 1024, std::chrono::seconds(10));
+}
+
+TEST_CASE("test conditional revalidation", "[downloader]") {
+  ted::TestHttpServer server;
+  std::string page = "<html>talk</html>";
+  std::string etag = "\"v1\"";
+  std::atomic<int> fullResponses = 0;
+  std::string acceptEncoding;
+  server.route("/talk", [&](const ted::TestHttpServer::Request &request) {
+    acceptEncoding = request.header("Accept-Encoding");
+    if (request.header("If-None-Match") == etag) {
+      return ted::TestHttpServer::Response{
+          .status = 304, .body = "", .headers = {{"ETag", etag}}};
+    }
+    ++fullResponses;
+    return ted::TestHttpServer::Response{
+        .status = 200,
+        .body = page,
+        .headers = {{"ETag", etag},
+                    {"Last-Modified", "Mon, 05 Oct 2026 08:00:00 GMT"}}};
+  });
+
+  std::string cacheFile = "/tmp/ted_revalidate.html";
+  unlink(cacheFile.c_str());
+  unlink((cacheFile + ".meta").c_str());
+
+  std::string body;
+  REQUIRE(ted::fetchRevalidated(server.url("/talk"), cacheFile, body) ==
+          ted::FetchResult::Updated);
+  REQUIRE(body == page);
+  REQUIRE(!acceptEncoding.empty());
+
+  body.clear();
+  REQUIRE(ted::fetchRevalidated(server.url("/talk"), cacheFile, body) ==
+          ted::FetchResult::NotModified);
+  REQUIRE(body == page);
+  REQUIRE(fullResponses == 1);
+
+  // a changed resource replaces the cached copy
+  page = "<html>edited</html>";
+  etag = "\"v2\"";
+  REQUIRE(ted::fetchRevalidated(server.url("/talk"), cacheFile, body) ==
+          ted::FetchResult::Updated);
+  REQUIRE(body == page);
+  REQUIRE(fullResponses == 2);
+}
+
+TEST_CASE("test media cache eviction", "[cache]") {
+  // keys are persisted, so the hash must match the reference output
+  REQUIRE(ted::xxh64("") == 0xef46db3751d8e999ULL);
+  REQUIRE(ted::xxh64("Nobody inspects the spammish repetition") ==
+          0xfbcea83c8a378bf1ULL);
+  ted::Xxh64 streamed;
+  streamed.update("Nobody inspects ");
+  streamed.update("the spammish repetition");
+  REQUIRE(streamed.digest() == 0xfbcea83c8a378bf1ULL);
+
+  std::string root = "/tmp/ted_media_cache";
+  ted::MediaCache(root, 0).evict();
+
+  auto store = [](ted::MediaCache &cache, const std::string &url) {
+    REQUIRE(cache.open(url) == 0);
+    auto path = cache.path(url, "audio.m4a");
+    std::ofstream(ted::MediaCache::stagingPath(path)) << std::string(100, 'x');
+    REQUIRE(!cache.contains(url, "audio.m4a"));
+    REQUIRE(cache.commit(url, "audio.m4a") == 0);
+    REQUIRE(cache.contains(url, "audio.m4a"));
+  };
+
+  ted::MediaCache cache(root, 250);
+  store(cache, "https://www.ted.com/talks/a");
+  store(cache, "https://www.ted.com/talks/b");
+  cache.touch("https://www.ted.com/talks/a");
+  store(cache, "https://www.ted.com/talks/c");
+
+  // b was used least recently
+  REQUIRE(!cache.contains("https://www.ted.com/talks/b", "audio.m4a"));
+  REQUIRE(cache.contains("https://www.ted.com/talks/a", "audio.m4a"));
+  REQUIRE(cache.totalSize() == 200);
+
+  cache.pin("https://www.ted.com/talks/a");
+  store(cache, "https://www.ted.com/talks/d");
+  REQUIRE(cache.contains("https://www.ted.com/talks/a", "audio.m4a"));
+  REQUIRE(!cache.contains("https://www.ted.com/talks/c", "audio.m4a"));
+
+  // the index survives a restart
+  REQUIRE(ted::MediaCache(root, 250).totalSize() == 200);
+
+  // a malformed index is rebuilt from the directory instead of throwing
+  for (auto &&index :
+       {R"({"entries": [1]})", R"({"entries": {"x": 1}})",
+        R"({"entries": {"x": {"url": 1, "files": []}}})",
+        R"({"entries": {"x": {"url": "u", "lastAccess": "now",
+                              "files": {"a": 1}}}})"}) {
+    std::ofstream(root + "/index.json") << index;
+    REQUIRE(ted::MediaCache(root, 250).totalSize() == 200);
+  }
+
+  // pins nest
+  {
+    ted::MediaCache::ScopedPin pin(cache, "https://www.ted.com/talks/a");
+  }
+  store(cache, "https://www.ted.com/talks/e");
+  REQUIRE(cache.contains("https://www.ted.com/talks/a", "audio.m4a"));
+  REQUIRE(!cache.contains("https://www.ted.com/talks/d", "audio.m4a"));
+
+  // entries written by builds keyed on std::hash are adopted
+  std::string url = "https://www.ted.com/talks/legacy";
+  std::stringstream legacyDir;
+  legacyDir << root << "/" << std::hex << std::hash<std::string>{}(url);
+  mkdir(legacyDir.str().c_str(), 0777);
+  std::ofstream(legacyDir.str() + "/subtitle.txt") << "0 1000 hello";
+  cache.setBudget(1 << 20);
+  REQUIRE(cache.open(url) == 0);
+  REQUIRE(cache.contains(url, "subtitle.txt"));
+  REQUIRE(access(legacyDir.str().c_str(), F_OK) != 0);
+}
+
+TEST_CASE("test media cache verify", "[cache]") {
+  std::string root = "/tmp/ted_media_cache_verify";
+  ted::MediaCache(root, 0).evict();
+  ted::MediaCache cache(root);
+
+  std::string content(3 << 20, 'x');
+  std::vector<std::string> urls = {"https://www.ted.com/talks/good",
+                                   "https://www.ted.com/talks/flipped",
+                                   "https://www.ted.com/talks/short"};
+  for (auto &&url : urls) {
+    REQUIRE(cache.open(url) == 0);
+    std::ofstream(ted::MediaCache::stagingPath(cache.path(url, "audio.m4a")))
+        << content;
+    REQUIRE(cache.commit(url, "audio.m4a") == 0);
+  }
+  // a checksum from the writer is recorded as is
+  std::ofstream(cache.path(urls[0], "subtitle.txt")) << "0 1000 hello";
+  REQUIRE(cache.commit(urls[0], "subtitle.txt",
+                       ted::xxh64("0 1000 hello")) == 0);
+  // nothing recorded for files written around commit()
+  std::ofstream(cache.path(urls[0], "notes.txt")) << "unrecorded";
+
+  {
+    std::fstream file(cache.path(urls[1], "audio.m4a"),
+                      std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(2 << 20);
+    file.put('y');
+  }
+  REQUIRE(truncate(cache.path(urls[2], "audio.m4a").c_str(), 1000) == 0);
+
+  // checksums survive a restart
+  auto report = ted::MediaCache(root).verify(4, false);
+  REQUIRE(report.files == 4);
+  REQUIRE(report.unchecked == 1);
+  REQUIRE(report.problems.size() == 2);
+  std::map<std::string, std::string> reasons;
+  for (auto &&problem : report.problems) {
+    reasons[problem.url] = problem.reason;
+  }
+  REQUIRE(reasons[urls[1]] == "checksum");
+  REQUIRE(reasons[urls[2]] == "truncated");
+
+  for (auto &&problem : report.problems) {
+    REQUIRE(!problem.evicted);
+  }
+
+  // a pinned entry is reported but stays
+  cache.pin(urls[2]);
+  report = cache.verify(2, true);
+  REQUIRE(report.problems.size() == 2);
+  std::map<std::string, bool> evicted;
+  for (auto &&problem : report.problems) {
+    evicted[problem.url] = problem.evicted;
+  }
+  REQUIRE(evicted[urls[1]]);
+  REQUIRE(!evicted[urls[2]]);
+  REQUIRE(cache.contains(urls[0], "audio.m4a"));
+  REQUIRE(!cache.contains(urls[1], "audio.m4a"));
+  REQUIRE(cache.contains(urls[2], "audio.m4a"));
+
+  cache.unpin(urls[2]);
+  report = cache.verify(2, true);
+  REQUIRE(report.problems.size() == 1);
+  REQUIRE(report.problems[0].evicted);
+  REQUIRE(!cache.contains(urls[2], "audio.m4a"));
+  REQUIRE(cache.verify(1, false).problems.empty());
+}
+
+TEST_CASE("test library index", "[cache]") {
+  std::string path = "/tmp/ted_library.tsv";
+  unlink(path.c_str());
+
+  ted::LibraryIndex library(path);
+  REQUIRE(library.load() == 0);
+  REQUIRE(library.size() == 0);
+
+  ted::LibraryEntry entry{.id = "1",
+                          .url = "https://www.ted.com/talks/a",
+                          .title = "Tabs\tand\nnewlines \\ survive",
+                          .speaker = "A",
+                          .durationMs = 600000,
+                          .sentences = 120,
+                          .mediaBytes = 5 << 20,
+                          .subtitleBytes = 20000,
+                          .status = ted::TalkStatus::Partial};
+  REQUIRE(library.put(entry) == 0);
+  entry.status = ted::TalkStatus::Cached;
+  REQUIRE(library.put(entry) == 0);
+  auto other = entry;
+  other.url = "https://www.ted.com/talks/b";
+  REQUIRE(library.put(other) == 0);
+  REQUIRE(library.remove(other.url) == 0);
+
+  // an append cut short by a crash is ignored
+  std::ofstream(path, std::ios::app) << "https://www.ted.com/talks/c\t2";
+
+  ted::LibraryIndex reloaded(path);
+  REQUIRE(reloaded.load() == 0);
+  REQUIRE(reloaded.size() == 1);
+  ted::LibraryEntry found;
+  REQUIRE(reloaded.find(entry.url, found));
+  REQUIRE(found.title == entry.title);
+  REQUIRE(found.sentences == 120);
+  REQUIRE(found.status == ted::TalkStatus::Cached);
+  REQUIRE(!reloaded.find(other.url, found));
+
+  // stale lines are compacted away as they pile up
+  for (int i = 0; i < 100; ++i) {
+    entry.sentences = i;
+    REQUIRE(reloaded.put(entry) == 0);
+  }
+  std::ifstream file(path);
+  auto lines = std::count(std::istreambuf_iterator<char>(file),
+                          std::istreambuf_iterator<char>(), '\n');
+  REQUIRE(lines < 100);
+  ted::LibraryIndex compacted(path);
+  REQUIRE(compacted.load() == 0);
+  REQUIRE(compacted.find(entry.url, found));
+  REQUIRE(found.sentences == 99);
+
+  // a compaction keeps lines another process appended since its load
+  auto appended = entry;
+  appended.url = "https://www.ted.com/talks/d";
+  REQUIRE(compacted.put(appended) == 0);
+  REQUIRE(reloaded.compact() == 0);
+  REQUIRE(reloaded.find(appended.url, found));
+  ted::LibraryIndex merged(path);
+  REQUIRE(merged.load() == 0);
+  REQUIRE(merged.size() == 2);
+  REQUIRE(merged.find(appended.url, found));
+
+  unlink(path.c_str());
+  ted::LibraryIndex large(path);
+  for (int i = 0; i < 5000; ++i) {
+    entry.url = "https://www.ted.com/talks/" + std::to_string(i);
+    REQUIRE(large.put(entry) == 0);
+  }
+  for (int i = 0; i < 200; ++i) {
+    entry.sentences = i;
+    REQUIRE(large.put(entry) == 0);
+  }
+  auto start = std::chrono::steady_clock::now();
+  ted::LibraryIndex listed(path);
+  REQUIRE(listed.load() == 0);
+  auto entries = listed.entries();
+  ted::logger.info("listed {} talks in {} us", entries.size(),
+                   std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count());
+  REQUIRE(entries.size() == 5000);
+  REQUIRE(entries.back().sentences == 199);
+}
+
+TEST_CASE("test rate limiter", "[downloader]") {
+  ted::RateLimiter limiter;
+  REQUIRE(limiter.consume(1 << 20).count() == 0);
+
+  limiter.setBytesPerSecond(1000);
+  // one second of burst, then half a second of debt
+  REQUIRE(limiter.consume(1000).count() == 0);
+  auto pause = limiter.consume(500);
+  REQUIRE(pause > std::chrono::milliseconds(400));
+  REQUIRE(pause <= std::chrono::milliseconds(500));
+}
+
+TEST_CASE("test prefetch scheduler", "[prefetch]") {
+  std::string journal = "/tmp/ted_prefetch.journal";
+  unlink(journal.c_str());
+
+  std::vector<std::string> urls = {
+      "https://a.example.com/talks/1", "https://a.example.com/talks/2",
+      "https://a.example.com/talks/3", "https://b.example.com/talks/4",
+      "https://b.example.com/talks/flaky", "https://b.example.com/talks/broken",
+      "https://b.example.com/talks/cached", "https://a.example.com/talks/1",
+  };
+
+  std::mutex mutex;
+  std::map<std::string, int> activePerHost;
+  std::map<std::string, int> attempts;
+  int maxPerHost = 0;
+  auto fetch = [&](const std::string &url) {
+    auto host = ted::PrefetchScheduler::hostOf(url);
+    int attempt;
+    {
+      std::unique_lock lock(mutex);
+      maxPerHost = std::max(maxPerHost, ++activePerHost[host]);
+      attempt = ++attempts[url];
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    {
+      std::unique_lock lock(mutex);
+      --activePerHost[host];
+    }
+    if (url.ends_with("broken")) {
+      return -1;
+    }
+    return url.ends_with("flaky") && attempt < 3 ? -1 : 0;
+  };
+  auto cached = [](const std::string &url) { return url.ends_with("cached"); };
+
+  ted::PrefetchOptions options{.maxConcurrent = 4,
+                               .maxPerHost = 1,
+                               .maxBytesPerSecond = 0,
+                               .maxAttempts = 3,
+                               .initialBackoff = std::chrono::milliseconds(5)};
+  {
+    ted::PrefetchScheduler scheduler(journal, options);
+    scheduler.setFetchFunction(fetch);
+    scheduler.setCachedFunction(cached);
+    REQUIRE(scheduler.add(urls) == 6);
+    REQUIRE(scheduler.run() != 0);
+
+    auto stats = scheduler.getStats();
+    REQUIRE(stats.completed == 5);
+    REQUIRE(stats.failed == 1);
+    REQUIRE(stats.skipped == 2);
+    REQUIRE(maxPerHost == 1);
+    REQUIRE(attempts["https://b.example.com/talks/flaky"] == 3);
+    REQUIRE(attempts["https://b.example.com/talks/broken"] == 3);
+
+    // the settled run leaves one journal line per url
+    std::ifstream file(journal);
+    REQUIRE(std::count(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>(), '\n') == 6);
+  }
+
+  // a later run only retries what the journal does not record as done
+  ted::PrefetchScheduler scheduler(journal, options);
+  scheduler.setFetchFunction(fetch);
+  scheduler.setCachedFunction(cached);
+  REQUIRE(scheduler.resume() == 0);
+  REQUIRE(scheduler.add(urls) == 1);
+  REQUIRE(scheduler.run() != 0);
+  REQUIRE(attempts["https://b.example.com/talks/broken"] == 6);
+  REQUIRE(attempts["https://a.example.com/talks/1"] == 1);
+
+  // many attempts stay within the backoff cap
+  unlink(journal.c_str());
+  ted::PrefetchScheduler persistent(
+      journal, ted::PrefetchOptions{
+                   .maxConcurrent = 1,
+                   .maxPerHost = 1,
+                   .maxBytesPerSecond = 0,
+                   .maxAttempts = 40,
+                   .initialBackoff = std::chrono::milliseconds(1),
+                   .maxBackoff = std::chrono::milliseconds(2)});
+  int failures = 0;
+  persistent.setFetchFunction([&failures](const std::string &) {
+    ++failures;
+    return -1;
+  });
+  persistent.setCachedFunction(cached);
+  REQUIRE(persistent.add({"https://c.example.com/talks/never"}) == 1);
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(persistent.run() != 0);
+  REQUIRE(failures == 40);
+  REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+}
+
+TEST_CASE("test download manifest ranges", "[downloader]") {
+  ted::DownloadManifest manifest("/tmp/ted_manifest_test.manifest");
+  manifest.reset("http://example.com/file", 100);
+  manifest.addRange(10, 20);
+  manifest.addRange(30, 40);
+  manifest.addRange(18, 32);
+  manifest.addRange(90, 100);
+
+  using Ranges = std::vector<ted::DownloadManifest::Range>;
+  REQUIRE(manifest.getRanges() == Ranges{{10, 40}, {90, 100}});
+  REQUIRE(manifest.missingRanges() == Ranges{{0, 10}, {40, 90}});
+  REQUIRE(manifest.completedBytes() == 40);
+  REQUIRE(!manifest.isComplete());
+
+  REQUIRE(manifest.save() == 0);
+  ted::DownloadManifest loaded("/tmp/ted_manifest_test.manifest");
+  REQUIRE(loaded.load() == 0);
+  REQUIRE(loaded.getUrl() == "http://example.com/file");
+  REQUIRE(loaded.getRanges() == manifest.getRanges());
+
+  loaded.addRange(0, 10);
+  loaded.addRange(40, 90);
+  REQUIRE(loaded.isComplete());
+  loaded.remove();
+
+  // a malformed manifest is refused and leaves the progress as it was
+  for (auto &&text :
+       {R"({"url": "http://example.com/file"})",
+        R"({"url": "u", "size": "100", "segments": 0, "segmentBytes": 0,
+            "ranges": []})",
+        R"({"url": "u", "size": 100, "segments": 0, "segmentBytes": 0,
+            "ranges": [[10]]})",
+        R"({"url": "u", "size": 100, "segments": 0, "segmentBytes": 0,
+            "ranges": [["a", "b"]]})",
+        R"({"url": "u", "size": 100, "segments": 0, "segmentBytes": 0,
+            "ranges": 5})"}) {
+    std::ofstream("/tmp/ted_manifest_test.manifest") << text;
+    REQUIRE(loaded.load() == -1);
+    REQUIRE(loaded.getUrl() == "http://example.com/file");
+    REQUIRE(loaded.isComplete());
+  }
+  loaded.remove();
+}
+
+TEST_CASE("test http server ranges", "[downloader]") {
+  auto respond = [](const std::string &range) {
+    ted::TestHttpServer::Request request{
+        .method = "GET", .path = "/", .query = "", .headers = {}};
+    request.headers["range"] = range;
+    return ted::TestHttpServer::rangeResponse(request, "0123456789");
+  };
+  REQUIRE(respond("bytes=2-4").body == "234");
+  REQUIRE(respond("bytes=7-").body == "789");
+  REQUIRE(respond("bytes=8-100").body == "89");
+  REQUIRE(respond("bytes=-3").body == "789");
+  REQUIRE(respond("bytes=-30").body == "0123456789");
+  // input the server does not handle is refused, not thrown on
+  for (auto &&range : {"bytes=-", "bytes=x-3", "bytes=1-2,4-5", "bytes=5-2",
+                       "bytes=10-", "bytes=-0", "bytes=3"}) {
+    REQUIRE(respond(range).status == 416);
+  }
+}
+
+TEST_CASE("test resumable range download", "[downloader]") {
+  ted::TestHttpServer server;
+  std::string body = makeSegment(7, 1 << 20);
+  std::atomic<bool> interrupted = true;
+  std::atomic<size_t> bytesServed = 0;
+  server.route("/big.bin", [&](const ted::TestHttpServer::Request &request) {
+    auto response = ted::TestHttpServer::rangeResponse(request, body);
+    // first session: everything past the middle fails
+    if (interrupted && response.status == 206 &&
+        std::stoull(request.header("Range").substr(6)) >= body.size() / 2) {
+      return ted::TestHttpServer::Response{.status = 503, .body = "", .headers = {}};
+    }
+    if (request.method == "GET") {
+      bytesServed += response.body.size();
+    }
+    return response;
+  });
+
+  std::string output = "/tmp/ted_resumable.bin";
+  unlink(output.c_str());
+  unlink((output + ".part").c_str());
+  unlink((output + ".part.manifest").c_str());
+
+  {
+    ted::SimpleDownloader downloader(server.url("/big.bin"), output);
+    downloader.enableResume(4, 128 * 1024);
+    REQUIRE(downloader.init() == 0);
+    REQUIRE(downloader.download() != 0);
+    REQUIRE(access(output.c_str(), F_OK) != 0);
+    REQUIRE(access((output + ".part.manifest").c_str(), F_OK) == 0);
+  }
+
+  REQUIRE(bytesServed > 0);
+  interrupted = false;
+  {
+    ted::SimpleDownloader downloader(server.url("/big.bin"), output);
+    downloader.enableResume(4, 128 * 1024);
+    REQUIRE(downloader.init() == 0);
+    REQUIRE(downloader.download() == 0);
+  }
+  // only the missing part is fetched again
+  REQUIRE(bytesServed == body.size());
+  REQUIRE(access((output + ".part.manifest").c_str(), F_OK) != 0);
+
+  std::ifstream file(output, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  REQUIRE(content == body);
+}
+
+TEST_CASE("test resumable download of a changed resource", "[downloader]") {
+  ted::TestHttpServer server;
+  std::string body = makeSegment(7, 1 << 20);
+  std::string etag = "\"v1\"";
+  std::mutex mutex;
+  std::atomic<bool> interrupted = true;
+  server.route("/changed.bin", [&](const ted::TestHttpServer::Request &request) {
+    std::lock_guard lock(mutex);
+    auto response = ted::TestHttpServer::rangeResponse(request, body);
+    response.headers.emplace_back("ETag", etag);
+    if (interrupted && response.status == 206 &&
+        std::stoull(request.header("Range").substr(6)) >= body.size() / 2) {
+      return ted::TestHttpServer::Response{.status = 503, .body = "", .headers = {}};
+    }
+    return response;
+  });
+
+  std::string output = "/tmp/ted_changed.bin";
+  unlink(output.c_str());
+  unlink((output + ".part").c_str());
+  unlink((output + ".part.manifest").c_str());
+
+  {
+    ted::SimpleDownloader downloader(server.url("/changed.bin"), output);
+    downloader.enableResume(4, 128 * 1024);
+    REQUIRE(downloader.init() == 0);
+    REQUIRE(downloader.download() != 0);
+    REQUIRE(access((output + ".part.manifest").c_str(), F_OK) == 0);
+  }
+
+  // same length, different content
+  {
+    std::lock_guard lock(mutex);
+    body = makeSegment(8, 1 << 20);
+    etag = "\"v2\"";
+    interrupted = false;
+  }
+  {
+    ted::SimpleDownloader downloader(server.url("/changed.bin"), output);
+    downloader.enableResume(4, 128 * 1024);
+    REQUIRE(downloader.init() == 0);
+    REQUIRE(downloader.download() == 0);
+  }
+
+  std::ifstream file(output, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  REQUIRE(content == body);
+}
+
+TEST_CASE("test native hls downloader resume", "[hls]") {
+  ted::TestHttpServer server;
+  std::string expected;
+  std::string playList = "#EXTM3U\n";
+  for (size_t i = 0; i < 6; ++i) {
+    auto segment = makeSegment(i, 4096);
+    expected += segment;
+    if (i != 3) {
+      server.serve("/resume/seg" + std::to_string(i) + ".ts", segment);
+    }
+    playList += "#EXTINF:6.0,\nseg" + std::to_string(i) + ".ts\n";
+  }
+  server.serve("/resume/index.m3u8", playList);
+
+  std::string output = "/tmp/ted_hls_resume.ts";
+  unlink(output.c_str());
+  unlink(ted::NativeHLSDownloader::partPath(output).c_str());
+  unlink((ted::NativeHLSDownloader::partPath(output) + ".manifest").c_str());
+  {
+    ted::NativeHLSDownloader downloader(server.url("/resume/index.m3u8"),
+                                        output, 1);
+    REQUIRE(downloader.init() == 0);
+    REQUIRE(downloader.download() != 0);
+  }
+
+  server.serve("/resume/seg3.ts", makeSegment(3, 4096));
+  {
+    ted::NativeHLSDownloader downloader(server.url("/resume/index.m3u8"),
+                                        output, 1);
+    REQUIRE(downloader.init() == 0);
+    REQUIRE(downloader.download() == 0);
+  }
+  REQUIRE(server.requestCount("/resume/seg0.ts") == 1);
+  REQUIRE(server.requestCount("/resume/seg2.ts") == 1);
+
+  std::ifstream file(output, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  REQUIRE(content == expected);
 }
 
 TEST_CASE("test subtitle serializer", "[subtitle]") {
+  ted::TestHttpServer server;
+  ted::TestTalkFixture talk(server);
+
   std::string buffer;
-  auto downloader = ted::SimpleDownloader(talkUrl, &buffer);
+  auto downloader = ted::SimpleDownloader(talk.talkUrl(), &buffer);
   REQUIRE(downloader.init() == 0);
   REQUIRE(downloader.download() == 0);
 
   auto subtitles = ted::retrieveSubtitlesFromTranscript(buffer);
-  REQUIRE(!subtitles.empty());
+  // parenthesized cues such as (Laughter) are dropped
+  REQUIRE(subtitles.size() == ted::TestTalkFixture::cueTexts().size() - 1);
+  REQUIRE(subtitles[1].text == "Water leaves the house and comes back.");
 
   std::vector<std::string> lines;
   for (auto& subtitle : subtitles) {
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "Utils/ThreadPool.h"
+#include "Utils/Utils.h"
+#include "Utils/WorkStealingPool.h"
+
+using ted::logger;
+
+// ThreadPool against WorkStealingPool: throughput of tiny tasks queued by
+// several threads at once, and how long interactive work waits while the
+// pool is full of bulk work.
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+template <class F>
+static void submit(ThreadPool &pool, ted::TaskPriority, F &&f) {
+  pool.enqueue(std::forward<F>(f));
+}
+
+template <class F>
+static void submit(ted::WorkStealingPool &pool, ted::TaskPriority priority,
+                   F &&f) {
+  pool.post(priority, std::forward<F>(f));
+}
+
+template <class Pool>
+static void benchmarkContention(const char *name, size_t threads) {
+  constexpr int producers = 4;
+  constexpr int tasksPerProducer = 250000;
+
+  std::atomic<int> done = 0;
+  auto start = std::chrono::steady_clock::now();
+  {
+    Pool pool(threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < producers; ++i) {
+      workers.emplace_back([&pool, &done]() {
+        for (int j = 0; j < tasksPerProducer; ++j) {
+          submit(pool, ted::TaskPriority::Bulk, [&done]() { ++done; });
+        }
+      });
+    }
+    for (auto &&worker : workers) {
+      worker.join();
+    }
+    while (done < producers * tasksPerProducer) {
+      std::this_thread::yield();
+    }
+  }
+  double seconds = secondsSince(start);
+  logger.info("{}: {} tiny tasks from {} threads in {:.3f} s, {:.2f} M/s",
+              name, producers * tasksPerProducer, producers, seconds,
+              producers * tasksPerProducer / seconds / 1e6);
+}
+
+template <class Pool>
+static void benchmarkInteractiveLatency(const char *name, size_t threads) {
+  constexpr int bulkTasks = 400;
+  constexpr int probes = 20;
+  using namespace std::chrono_literals;
+
+  Pool pool(threads);
+  std::vector<double> waits;
+  for (int i = 0; i < probes; ++i) {
+    // each probe is queued behind a fresh batch of bulk work
+    for (int j = 0; j < bulkTasks / probes; ++j) {
+      submit(pool, ted::TaskPriority::Bulk,
+             []() { std::this_thread::sleep_for(2ms); });
+    }
+    std::promise<double> waited;
+    auto result = waited.get_future();
+    auto queued = std::chrono::steady_clock::now();
+    submit(pool, ted::TaskPriority::Interactive,
+           [&waited, queued]() { waited.set_value(secondsSince(queued)); });
+    waits.push_back(result.get() * 1000);
+  }
+  std::sort(waits.begin(), waits.end());
+  logger.info("{}: interactive wait behind {} bulk tasks each, median "
+              "{:.2f} ms, max {:.2f} ms",
+              name, bulkTasks / probes, waits[waits.size() / 2],
+              waits.back());
+}
+
+int main() {
+  size_t threads = ted::WorkStealingPool::defaultThreads();
+  logger.info("{} workers", threads);
+  benchmarkContention<ThreadPool>("ThreadPool", threads);
+  benchmarkContention<ted::WorkStealingPool>("WorkStealingPool", threads);
+  benchmarkInteractiveLatency<ThreadPool>("ThreadPool", threads);
+  benchmarkInteractiveLatency<ted::WorkStealingPool>("WorkStealingPool",
+                                                     threads);
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Remuxer.h"
+
+static int64_t fileSize(const std::string &path) {
+  struct stat info {};
+  if (stat(path.c_str(), &info) != 0) {
+    return -1;
+  }
+  return info.st_size;
+}
+
+int ted::remuxAudioToM4A(const std::string &input, const std::string &output) {
+  AVFormatContext *inputContext = nullptr;
+  AVFormatContext *outputContext = nullptr;
+  AVPacket *packet = nullptr;
+  std::string partPath = output + ".part";
+  int ret = -1;
+
+  // single exit so every failure path releases the contexts
+  do {
+    if (avformat_open_input(&inputContext, input.c_str(), nullptr, nullptr) <
+        0) {
+      logger.error("Remuxer failed to open input: {}", input);
+      break;
+    }
+    if (avformat_find_stream_info(inputContext, nullptr) < 0) {
+      logger.error("Remuxer failed to find stream info: {}", input);
+      break;
+    }
+    int streamIndex = av_find_best_stream(inputContext, AVMEDIA_TYPE_AUDIO,
+                                          -1, -1, nullptr, 0);
+    if (streamIndex < 0) {
+      logger.error("Remuxer found no audio stream: {}", input);
+      break;
+    }
+    AVStream *inputStream = inputContext->streams[streamIndex];
+
+    // the file name ends with .part, so name the muxer explicitly
+    if (avformat_alloc_output_context2(&outputContext, nullptr, "ipod",
+                                       partPath.c_str()) < 0) {
+      logger.error("Remuxer failed to allocate output: {}", output);
+      break;
+    }
+    AVStream *outputStream = avformat_new_stream(outputContext, nullptr);
+    if (outputStream == nullptr ||
+        avcodec_parameters_copy(outputStream->codecpar,
+                                inputStream->codecpar) < 0) {
+      logger.error("Remuxer failed to create output stream: {}", output);
+      break;
+    }
+    // the ts codec tag does not apply to mp4
+    outputStream->codecpar->codec_tag = 0;
+    outputStream->time_base = inputStream->time_base;
+
+    if (avio_open(&outputContext->pb, partPath.c_str(), AVIO_FLAG_WRITE) < 0) {
+      logger.error("Remuxer failed to open output file: {}", partPath);
+      break;
+    }
+
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "movflags", "+faststart", 0);
+    int err = avformat_write_header(outputContext, &options);
+    av_dict_free(&options);
+    if (err < 0) {
+      logger.error("Remuxer failed to write header: {}, {}", output,
+                   getFFmpegErrorStr(err));
+      break;
+    }
+
+    packet = av_packet_alloc();
+    bool failed = false;
+    while ((err = av_read_frame(inputContext, packet)) >= 0) {
+      if (packet->stream_index != streamIndex) {
+        av_packet_unref(packet);
+        continue;
+      }
+      packet->stream_index = outputStream->index;
+      packet->pos = -1;
+      av_packet_rescale_ts(packet, inputStream->time_base,
+                           outputStream->time_base);
+      // the mp4 muxer inserts aac_adtstoasc for adts input by itself
+      err = av_interleaved_write_frame(outputContext, packet);
+      if (err < 0) {
+        logger.error("Remuxer failed to write packet: {}, {}", output,
+                     getFFmpegErrorStr(err));
+        failed = true;
+        break;
+      }
+    }
+    if (failed || (err < 0 && err != AVERROR_EOF)) {
+      break;
+    }
+
+    if (av_write_trailer(outputContext) < 0) {
+      logger.error("Remuxer failed to write trailer: {}", output);
+      break;
+    }
+    ret = 0;
+  } while (false);
+
+  av_packet_free(&packet);
+  if (outputContext != nullptr) {
+    if (outputContext->pb != nullptr) {
+      avio_closep(&outputContext->pb);
+    }
+    avformat_free_context(outputContext);
+  }
+  avformat_close_input(&inputContext);
+
+  if (ret != 0) {
+    unlink(partPath.c_str());
+    return ret;
+  }
+  if (std::rename(partPath.c_str(), output.c_str()) != 0) {
+    logger.error("Remuxer failed to rename {}", partPath);
+    return -1;
+  }
+
+  logger.info("Remuxer copied audio of {} ({} bytes) to {} ({} bytes)", input,
+              fileSize(input), output, fileSize(output));
+  return 0;
+}
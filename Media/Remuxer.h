@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+#include "Utils/Utils.h"
+
+namespace ted {
+
+/**
+ * Stream-copies the audio of input into an MP4 audio (.m4a) file without
+ * re-encoding. The moov atom is moved to the front so the result can be
+ * opened and seeked without scanning the whole file.
+ */
+int remuxAudioToM4A(const std::string &input, const std::string &output);
+
+} // namespace ted
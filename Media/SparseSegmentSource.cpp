@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <set>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "SparseSegmentSource.h"
+#include "Utils/M3U8.h"
+#include "Utils/SingleFlight.h"
+
+using ted::SparseSegmentSource;
+
+static constexpr int SPARSE_INDEX_VERSION = 1;
+
+// run job(i) for i in [0, count) on up to parallelism threads, -1 if any
+// job failed
+template <typename F>
+static int runParallel(size_t count, int parallelism, F &&job) {
+  std::atomic<size_t> next = 0;
+  std::atomic<bool> failed = false;
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      if (job(i) != 0) {
+        failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  size_t threadCount = std::min<size_t>(std::max(parallelism, 1), count);
+  for (size_t i = 1; i < threadCount; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &&thread : threads) {
+    thread.join();
+  }
+  return failed ? -1 : 0;
+}
+
+SparseSegmentSource::SparseSegmentSource(std::string playListUrl,
+                                         std::string cacheDir)
+    : mPlayListUrl(std::move(playListUrl)), mCacheDir(std::move(cacheDir)) {}
+
+SparseSegmentSource::~SparseSegmentSource() {
+  if (mFile != nullptr) {
+    fclose(mFile);
+  }
+}
+
+std::string SparseSegmentSource::indexPath() const {
+  return mCacheDir + "/segments.json";
+}
+
+std::string SparseSegmentSource::segmentPath(size_t index) const {
+  return mCacheDir + "/seg" + std::to_string(index);
+}
+
+int SparseSegmentSource::init() {
+  mkdir(mCacheDir.c_str(), 0777);
+
+  if (loadIndex() != 0) {
+    NativeHLSDownloader playList(mPlayListUrl, std::string());
+    if (playList.init() != 0) {
+      return -1;
+    }
+    mSegments = playList.getSegments();
+    if (probeSizes(4) != 0) {
+      logger.error("SparseSegmentSource failed to probe segments of {}",
+                   mPlayListUrl);
+      return -1;
+    }
+    saveIndex();
+  }
+
+  mOffsets.assign(1, 0);
+  for (int64_t size : mSizes) {
+    mOffsets.push_back(mOffsets.back() + size);
+  }
+  mCached.assign(mSegments.size(), false);
+  for (size_t i = 0; i < mSegments.size(); ++i) {
+    mCached[i] = access(segmentPath(i).c_str(), F_OK) == 0;
+  }
+
+  logger.info("SparseSegmentSource {} has {} of {} segments cached",
+              mPlayListUrl, cachedCount(), mSegments.size());
+  return 0;
+}
+
+int SparseSegmentSource::loadIndex() {
+  std::ifstream file(indexPath());
+  if (!file) {
+    return -1;
+  }
+  auto json = nlohmann::json::parse(file, nullptr, false);
+  if (json.is_discarded() || !json.is_object() ||
+      json.value("version", 0) != SPARSE_INDEX_VERSION) {
+    logger.error("SparseSegmentSource ignores stale index {}", indexPath());
+    return -1;
+  }
+
+  // read completely before anything is kept, a truncated or hand edited
+  // index is probed again
+  std::vector<MediaSegment> segments;
+  std::vector<int64_t> sizes;
+  try {
+    if (json.at("url").get<std::string>() != mPlayListUrl) {
+      logger.error("SparseSegmentSource ignores stale index {}", indexPath());
+      return -1;
+    }
+    for (auto &&item : json.at("segments")) {
+      segments.push_back(MediaSegment{
+          .url = item.at("url").get<std::string>(),
+          .duration = item.at("duration").get<double>(),
+          .start = item.at("start").get<double>(),
+          .rangeOffset = item.at("rangeOffset").get<int64_t>(),
+          .rangeLength = item.at("rangeLength").get<int64_t>(),
+          .discontinuity = item.at("discontinuity").get<uint32_t>(),
+          .isInit = item.at("isInit").get<bool>(),
+      });
+      sizes.push_back(item.at("size").get<int64_t>());
+    }
+  } catch (const nlohmann::json::exception &e) {
+    logger.error("SparseSegmentSource index {} is corrupted: {}", indexPath(),
+                 e.what());
+    return -1;
+  }
+  if (segments.empty()) {
+    return -1;
+  }
+  mSegments = std::move(segments);
+  mSizes = std::move(sizes);
+  return 0;
+}
+
+int SparseSegmentSource::saveIndex() const {
+  nlohmann::json json;
+  json["version"] = SPARSE_INDEX_VERSION;
+  json["url"] = mPlayListUrl;
+  auto &segments = json["segments"];
+  segments = nlohmann::json::array();
+  for (size_t i = 0; i < mSegments.size(); ++i) {
+    auto &segment = mSegments[i];
+    segments.push_back({
+        {"url", segment.url},
+        {"duration", segment.duration},
+        {"start", segment.start},
+        {"rangeOffset", segment.rangeOffset},
+        {"rangeLength", segment.rangeLength},
+        {"discontinuity", segment.discontinuity},
+        {"isInit", segment.isInit},
+        {"size", mSizes[i]},
+    });
+  }
+
+  std::string tmp = indexPath() + ".tmp";
+  {
+    std::ofstream file(tmp);
+    if (!file || !(file << json.dump())) {
+      logger.error("SparseSegmentSource failed to write {}", tmp);
+      return -1;
+    }
+  }
+  return rename(tmp.c_str(), indexPath().c_str()) == 0 ? 0 : -1;
+}
+
+int SparseSegmentSource::probeSizes(int parallelism) {
+  mSizes.assign(mSegments.size(), -1);
+  return runParallel(mSegments.size(), parallelism, [this](size_t i) {
+    auto &segment = mSegments[i];
+    if (segment.rangeLength >= 0) {
+      mSizes[i] = segment.rangeLength;
+      return 0;
+    }
+    std::string unused;
+    SimpleDownloader downloader(segment.url, &unused);
+    if (downloader.init() != 0) {
+      return -1;
+    }
+    mSizes[i] = downloader.probeContentLength();
+    return mSizes[i] >= 0 ? 0 : -1;
+  });
+}
+
+int SparseSegmentSource::fetchSegment(size_t index) {
+  if (isCached(index)) {
+    return 0;
+  }
+  auto &segment = mSegments[index];
+  std::string range;
+  if (segment.rangeLength >= 0) {
+    range = std::to_string(segment.rangeOffset) + "-" +
+            std::to_string(segment.rangeOffset + segment.rangeLength - 1);
+  }
+  // a lazy read and a background fill may ask for the same segment
+  auto response = SingleFlight::instance().get(segment.url, range);
+  if (response.status != 0) {
+    return -1;
+  }
+  const std::string &data = *response.body;
+  // offsets of the following segments depend on the probed size
+  if ((int64_t)data.size() != mSizes[index]) {
+    logger.error("SparseSegmentSource segment {} is {} bytes, expected {}",
+                 index, data.size(), mSizes[index]);
+    return -1;
+  }
+
+  std::string path = segmentPath(index);
+  // the reader and a background fill may race for the same segment
+  std::string tmp =
+      path + ".tmp" +
+      std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  {
+    std::ofstream file(tmp, std::ios::binary);
+    if (!file || !file.write(data.data(), (std::streamsize)data.size())) {
+      unlink(tmp.c_str());
+      return -1;
+    }
+  }
+  if (rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return -1;
+  }
+
+  std::unique_lock lock(mMutex);
+  mCached[index] = true;
+  return 0;
+}
+
+int SparseSegmentSource::fetchSubtitles(const std::vector<Subtitle> &subtitles,
+                                        int parallelism) {
+  std::set<size_t> wanted;
+  for (auto &&subtitle : subtitles) {
+    auto [first, last] =
+        segmentsCovering(mSegments, (double)subtitle.start.us() / 1e6,
+                         (double)subtitle.end.us() / 1e6);
+    for (size_t i = first; i < last; ++i) {
+      wanted.insert(i);
+    }
+    // fragmented streams need the initialization section in front
+    for (size_t i = first; i-- > 0;) {
+      if (mSegments[i].isInit) {
+        wanted.insert(i);
+        break;
+      }
+    }
+  }
+  return fetchSegments({wanted.begin(), wanted.end()}, parallelism);
+}
+
+int SparseSegmentSource::fetchSegments(std::vector<size_t> indices,
+                                       int parallelism) {
+  std::erase_if(indices, [this](size_t index) {
+    return index >= mSegments.size() || isCached(index);
+  });
+  if (indices.empty()) {
+    return 0;
+  }
+  logger.info("SparseSegmentSource fetching {} segments of {}", indices.size(),
+              mPlayListUrl);
+  return runParallel(indices.size(), parallelism, [&](size_t i) {
+    return fetchSegment(indices[i]);
+  });
+}
+
+int SparseSegmentSource::fillGaps(int parallelism) {
+  std::vector<size_t> all(mSegments.size());
+  for (size_t i = 0; i < all.size(); ++i) {
+    all[i] = i;
+  }
+  return fetchSegments(std::move(all), parallelism);
+}
+
+const std::vector<ted::MediaSegment> &SparseSegmentSource::getSegments() const {
+  return mSegments;
+}
+
+bool SparseSegmentSource::isCached(size_t index) const {
+  std::unique_lock lock(mMutex);
+  return mCached[index];
+}
+
+size_t SparseSegmentSource::cachedCount() const {
+  std::unique_lock lock(mMutex);
+  return std::count(mCached.begin(), mCached.end(), true);
+}
+
+int64_t SparseSegmentSource::size() const { return mOffsets.back(); }
+
+int SparseSegmentSource::read(uint8_t *buffer, int size) {
+  if (mPosition >= this->size()) {
+    return AVERROR_EOF;
+  }
+  // last segment starting at or before the position
+  size_t index =
+      std::upper_bound(mOffsets.begin(), mOffsets.end(), mPosition) -
+      mOffsets.begin() - 1;
+
+  if (mFile == nullptr || mFileIndex != index) {
+    if (fetchSegment(index) != 0) {
+      logger.error("SparseSegmentSource failed to fill segment {}", index);
+      return AVERROR(EIO);
+    }
+    if (mFile != nullptr) {
+      fclose(mFile);
+    }
+    mFile = fopen(segmentPath(index).c_str(), "rb");
+    mFileIndex = index;
+    if (mFile == nullptr) {
+      return AVERROR(EIO);
+    }
+  }
+
+  int64_t inSegment = mPosition - mOffsets[index];
+  auto toRead = (size_t)std::min<int64_t>(size, mSizes[index] - inSegment);
+  if (fseeko(mFile, inSegment, SEEK_SET) != 0) {
+    return AVERROR(EIO);
+  }
+  size_t n = fread(buffer, 1, toRead, mFile);
+  if (n == 0) {
+    return AVERROR(EIO);
+  }
+  mPosition += (int64_t)n;
+  return (int)n;
+}
+
+int64_t SparseSegmentSource::seek(int64_t offset, int whence) {
+  switch (whence) {
+  case AVSEEK_SIZE:
+    return size();
+  case SEEK_SET:
+    mPosition = offset;
+    break;
+  case SEEK_CUR:
+    mPosition += offset;
+    break;
+  case SEEK_END:
+    mPosition = size() + offset;
+    break;
+  default:
+    return -1;
+  }
+  return mPosition;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "IOSource.h"
+#include "SubtitleDecoder.h"
+#include "Utils/HLS.h"
+
+namespace ted {
+
+/**
+ * Presents an HLS media playlist as one seekable stream while only some of
+ * its segments are on disk. Segments covering chosen sentences are fetched
+ * up front into cacheDir; a read landing in a segment that is still missing
+ * downloads it on the spot, so the decoder can seek anywhere and the gaps
+ * fill lazily.
+ */
+class SparseSegmentSource : public IOSource {
+public:
+  SparseSegmentSource(std::string playListUrl, std::string cacheDir);
+
+  ~SparseSegmentSource() override;
+
+  // load the segment index from cacheDir, or fetch the playlist and probe
+  // segment sizes once and store them there
+  int init();
+
+  // fetch the segments overlapping any of subtitles that are not cached yet
+  int fetchSubtitles(const std::vector<Subtitle> &subtitles,
+                     int parallelism = 4);
+
+  int fetchSegments(std::vector<size_t> indices, int parallelism = 4);
+
+  // fetch every segment still missing
+  int fillGaps(int parallelism = 4);
+
+  [[nodiscard]] const std::vector<MediaSegment> &getSegments() const;
+
+  [[nodiscard]] bool isCached(size_t index) const;
+
+  [[nodiscard]] size_t cachedCount() const;
+
+  // size of the whole concatenated stream
+  [[nodiscard]] int64_t size() const;
+
+  int read(uint8_t *buffer, int size) override;
+
+  int64_t seek(int64_t offset, int whence) override;
+
+private:
+  [[nodiscard]] std::string indexPath() const;
+
+  [[nodiscard]] std::string segmentPath(size_t index) const;
+
+  int loadIndex();
+
+  int saveIndex() const;
+
+  int probeSizes(int parallelism);
+
+  int fetchSegment(size_t index);
+
+  std::string mPlayListUrl;
+  std::string mCacheDir;
+
+  std::vector<MediaSegment> mSegments;
+  std::vector<int64_t> mSizes;
+  // byte offset of each segment in the concatenated stream, plus the total
+  std::vector<int64_t> mOffsets;
+
+  mutable std::mutex mMutex;
+  std::vector<bool> mCached;
+
+  int64_t mPosition = 0;
+  FILE *mFile = nullptr;
+  size_t mFileIndex = 0;
+};
+
+} // namespace ted
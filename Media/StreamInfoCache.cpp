@@ -0,0 +1,236 @@
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "StreamInfoCache.h"
+
+using ted::StreamInfoCache;
+
+static constexpr int STREAM_INFO_VERSION = 1;
+
+static bool statFile(const std::string &path, int64_t &size, int64_t &mtime) {
+  struct stat info {};
+  if (stat(path.c_str(), &info) != 0) {
+    return false;
+  }
+  size = info.st_size;
+  mtime = info.st_mtime;
+  return true;
+}
+
+static std::string toHex(const uint8_t *data, int size) {
+  static const char *digits = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(size * 2);
+  for (int i = 0; i < size; ++i) {
+    hex.push_back(digits[data[i] >> 4]);
+    hex.push_back(digits[data[i] & 0xf]);
+  }
+  return hex;
+}
+
+static int fromHexDigit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+StreamInfoCache::StreamInfoCache(std::string cacheFile)
+    : mPath(std::move(cacheFile)) {}
+
+std::string StreamInfoCache::pathFor(const std::string &mediaFile) {
+  return mediaFile + ".streaminfo";
+}
+
+bool StreamInfoCache::exists() const {
+  return access(mPath.c_str(), F_OK) == 0;
+}
+
+std::string StreamInfoCache::getPath() const { return mPath; }
+
+int StreamInfoCache::save(const std::string &mediaFile,
+                          const AVFormatContext *context,
+                          int streamIndex) const {
+  int64_t size, mtime;
+  if (!statFile(mediaFile, size, mtime)) {
+    logger.error("stream info cache failed to stat {}", mediaFile);
+    return -1;
+  }
+
+  const AVStream *stream = context->streams[streamIndex];
+  const AVCodecParameters *par = stream->codecpar;
+
+  nlohmann::json json;
+  json["version"] = STREAM_INFO_VERSION;
+  json["fileSize"] = size;
+  json["fileMtime"] = mtime;
+  json["format"] = context->iformat->name;
+  json["nbStreams"] = context->nb_streams;
+  json["streamIndex"] = streamIndex;
+  json["timeBase"] = {stream->time_base.num, stream->time_base.den};
+  json["startTime"] = stream->start_time;
+  json["duration"] = stream->duration;
+
+  auto &codec = json["codecpar"];
+  codec["codecType"] = par->codec_type;
+  codec["codecId"] = par->codec_id;
+  codec["codecTag"] = par->codec_tag;
+  codec["format"] = par->format;
+  codec["bitRate"] = par->bit_rate;
+  codec["bitsPerCodedSample"] = par->bits_per_coded_sample;
+  codec["bitsPerRawSample"] = par->bits_per_raw_sample;
+  codec["profile"] = par->profile;
+  codec["level"] = par->level;
+  codec["sampleRate"] = par->sample_rate;
+  codec["blockAlign"] = par->block_align;
+  codec["frameSize"] = par->frame_size;
+  codec["initialPadding"] = par->initial_padding;
+  codec["seekPreroll"] = par->seek_preroll;
+  codec["channelOrder"] = par->ch_layout.order;
+  codec["channels"] = par->ch_layout.nb_channels;
+  codec["channelMask"] = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE
+                             ? par->ch_layout.u.mask
+                             : 0;
+  codec["extradata"] = toHex(par->extradata, par->extradata_size);
+
+  // write then rename, decoders of the same talk may open concurrently
+  std::string tmpPath = mPath + ".tmp";
+  {
+    std::ofstream file(tmpPath);
+    if (!file) {
+      logger.error("stream info cache failed to write {}", tmpPath);
+      return -1;
+    }
+    file << json.dump();
+  }
+  if (std::rename(tmpPath.c_str(), mPath.c_str()) != 0) {
+    logger.error("stream info cache failed to rename {}", tmpPath);
+    return -1;
+  }
+
+  logger.info("stream info of {} cached to {}", mediaFile, mPath);
+  return 0;
+}
+
+int StreamInfoCache::restore(const std::string &mediaFile,
+                             AVFormatContext *context,
+                             AVMediaType type) const {
+  std::ifstream file(mPath);
+  if (!file) {
+    return -1;
+  }
+
+  auto json = nlohmann::json::parse(file, nullptr, false);
+  if (json.is_discarded() || !json.is_object() ||
+      json.value("version", 0) != STREAM_INFO_VERSION) {
+    logger.error("stream info cache {} is corrupted", mPath);
+    return -1;
+  }
+
+  // filled completely before anything is applied, a truncated or older
+  // entry falls back to a full probe and leaves the context untouched
+  std::unique_ptr<AVCodecParameters, void (*)(AVCodecParameters *)> cached(
+      avcodec_parameters_alloc(),
+      [](AVCodecParameters *par) { avcodec_parameters_free(&par); });
+  int streamIndex = -1;
+  AVRational timeBase{};
+  int64_t startTime = 0;
+  int64_t duration = 0;
+  try {
+    int64_t size, mtime;
+    if (!statFile(mediaFile, size, mtime) ||
+        json.at("fileSize").get<int64_t>() != size ||
+        json.at("fileMtime").get<int64_t>() != mtime) {
+      logger.info("stream info cache {} is stale", mPath);
+      return -1;
+    }
+
+    streamIndex = json.at("streamIndex").get<int>();
+    if (json.at("format").get<std::string>() != context->iformat->name ||
+        json.at("nbStreams").get<unsigned>() != context->nb_streams ||
+        streamIndex < 0 || streamIndex >= (int)context->nb_streams) {
+      logger.info("stream info cache {} does not match the container",
+                  mPath);
+      return -1;
+    }
+
+    auto &codec = json.at("codecpar");
+    if (codec.at("codecType").get<AVMediaType>() != type) {
+      return -1;
+    }
+
+    AVCodecParameters *par = context->streams[streamIndex]->codecpar;
+    if (par->codec_id != AV_CODEC_ID_NONE &&
+        par->codec_id != codec.at("codecId").get<AVCodecID>()) {
+      logger.info("stream info cache {} has a different codec", mPath);
+      return -1;
+    }
+
+    auto extradata = codec.at("extradata").get<std::string>();
+    int extradataSize = (int)extradata.size() / 2;
+    if (extradataSize > 0) {
+      cached->extradata = static_cast<uint8_t *>(
+          av_mallocz(extradataSize + AV_INPUT_BUFFER_PADDING_SIZE));
+      cached->extradata_size = extradataSize;
+      for (int i = 0; i < extradataSize; ++i) {
+        int high = fromHexDigit(extradata[i * 2]);
+        int low = fromHexDigit(extradata[i * 2 + 1]);
+        if (high < 0 || low < 0) {
+          logger.error("stream info cache {} has invalid extradata", mPath);
+          return -1;
+        }
+        cached->extradata[i] = (uint8_t)(high << 4 | low);
+      }
+    }
+
+    cached->codec_type = codec.at("codecType").get<AVMediaType>();
+    cached->codec_id = codec.at("codecId").get<AVCodecID>();
+    cached->codec_tag = codec.at("codecTag").get<uint32_t>();
+    cached->format = codec.at("format").get<int>();
+    cached->bit_rate = codec.at("bitRate").get<int64_t>();
+    cached->bits_per_coded_sample = codec.at("bitsPerCodedSample").get<int>();
+    cached->bits_per_raw_sample = codec.at("bitsPerRawSample").get<int>();
+    cached->profile = codec.at("profile").get<int>();
+    cached->level = codec.at("level").get<int>();
+    cached->sample_rate = codec.at("sampleRate").get<int>();
+    cached->block_align = codec.at("blockAlign").get<int>();
+    cached->frame_size = codec.at("frameSize").get<int>();
+    cached->initial_padding = codec.at("initialPadding").get<int>();
+    cached->seek_preroll = codec.at("seekPreroll").get<int>();
+
+    auto channels = codec.at("channels").get<int>();
+    if (codec.at("channelOrder").get<AVChannelOrder>() !=
+            AV_CHANNEL_ORDER_NATIVE ||
+        av_channel_layout_from_mask(&cached->ch_layout,
+                                    codec.at("channelMask").get<uint64_t>()) <
+            0) {
+      av_channel_layout_default(&cached->ch_layout, channels);
+    }
+
+    auto &cachedTimeBase = json.at("timeBase");
+    timeBase = AVRational{cachedTimeBase.at(0).get<int>(),
+                          cachedTimeBase.at(1).get<int>()};
+    startTime = json.at("startTime").get<int64_t>();
+    duration = json.at("duration").get<int64_t>();
+  } catch (const nlohmann::json::exception &e) {
+    logger.error("stream info cache {} is incomplete: {}", mPath, e.what());
+    return -1;
+  }
+
+  AVStream *stream = context->streams[streamIndex];
+  if (avcodec_parameters_copy(stream->codecpar, cached.get()) < 0) {
+    logger.error("stream info cache failed to apply {}", mPath);
+    return -1;
+  }
+  stream->time_base = timeBase;
+  stream->start_time = startTime;
+  stream->duration = duration;
+
+  return streamIndex;
+}
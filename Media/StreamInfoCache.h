@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+#include "Utils/Utils.h"
+
+namespace ted {
+
+/**
+ * Persists the result of avformat_find_stream_info for one stream so later
+ * opens of the same file can skip probing. Entries are tied to the media
+ * file's size and modification time and are ignored once the file changes.
+ */
+class StreamInfoCache {
+public:
+  explicit StreamInfoCache(std::string cacheFile);
+
+  // sibling of mediaFile, i.e. "<talk cache>/audio.m4a.streaminfo"
+  static std::string pathFor(const std::string &mediaFile);
+
+  [[nodiscard]] bool exists() const;
+
+  // write parameters of streamIndex after a full probe
+  int save(const std::string &mediaFile, const AVFormatContext *context,
+           int streamIndex) const;
+
+  // fill codecpar and time base of an opened but unprobed context, returns
+  // the cached stream index or -1 if the entry is missing or stale
+  int restore(const std::string &mediaFile, AVFormatContext *context,
+              AVMediaType type) const;
+
+  [[nodiscard]] std::string getPath() const;
+
+private:
+  std::string mPath;
+};
+
+} // namespace ted
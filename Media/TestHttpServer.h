@@ -0,0 +1,393 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace ted {
+
+/**
+ * Loopback HTTP/1.1 server for tests. Serves registered paths on 127.0.0.1
+ * with keep-alive so downloaders can be exercised without the network.
+ * Latency, a per-connection bandwidth limit and per-path failures can be
+ * injected to emulate a real CDN.
+ */
+class TestHttpServer {
+public:
+  struct Request {
+    std::string method;
+    std::string path;
+    std::string query;
+    std::map<std::string, std::string> headers;
+
+    [[nodiscard]] std::string header(const std::string &name) const {
+      auto iter = headers.find(lower(name));
+      return iter == headers.end() ? "" : iter->second;
+    }
+  };
+
+  struct Response {
+    int status = 200;
+    std::string body;
+    std::vector<std::pair<std::string, std::string>> headers;
+  };
+
+  using Handler = std::function<Response(const Request &)>;
+
+  TestHttpServer() {
+    mListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(mListenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(mListenFd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(mListenFd, 64) != 0) {
+      close(mListenFd);
+      throw std::runtime_error("test http server failed to listen");
+    }
+
+    socklen_t len = sizeof(addr);
+    getsockname(mListenFd, (sockaddr *)&addr, &len);
+    mPort = ntohs(addr.sin_port);
+
+    mAcceptThread = std::thread([this]() { acceptLoop(); });
+  }
+
+  ~TestHttpServer() {
+    mStop = true;
+    mAcceptThread.join();
+    close(mListenFd);
+
+    std::vector<std::thread> threads;
+    {
+      std::unique_lock lock(mMutex);
+      threads.swap(mConnectionThreads);
+    }
+    for (auto &&thread : threads) {
+      thread.join();
+    }
+  }
+
+  TestHttpServer(const TestHttpServer &) = delete;
+  TestHttpServer &operator=(const TestHttpServer &) = delete;
+
+  void route(const std::string &path, Handler handler) {
+    std::unique_lock lock(mMutex);
+    mRoutes[path] = std::move(handler);
+  }
+
+  // static content, honoring single "Range: bytes=a-b" requests
+  void serve(const std::string &path, std::string body,
+             std::string contentType = "application/octet-stream") {
+    route(path, [body = std::move(body), contentType = std::move(contentType)](
+                    const Request &request) {
+      auto response = rangeResponse(request, body);
+      response.headers.emplace_back("Content-Type", contentType);
+      return response;
+    });
+  }
+
+  static Response rangeResponse(const Request &request,
+                                const std::string &body) {
+    Response response{.status = 200, .body = "", .headers = {}};
+    response.headers.emplace_back("Accept-Ranges", "bytes");
+
+    std::string range = request.header("Range");
+    if (!range.starts_with("bytes=")) {
+      response.body = body;
+      return response;
+    }
+
+    // one range of first-last, first- or -suffix length; anything else,
+    // e.g. several ranges, is refused
+    auto parse = [](std::string_view digits, size_t &value) {
+      const char *last = digits.data() + digits.size();
+      auto [end, error] = std::from_chars(digits.data(), last, value);
+      return !digits.empty() && error == std::errc() && end == last;
+    };
+    std::string_view spec = std::string_view(range).substr(6);
+    size_t dash = spec.find('-');
+    size_t size = body.size();
+    size_t begin = 0;
+    size_t end = size - 1;
+    bool valid = dash != std::string_view::npos;
+    if (valid && dash == 0) {
+      size_t suffix = 0;
+      valid = parse(spec.substr(1), suffix) && suffix > 0;
+      begin = size - std::min(suffix, size);
+    } else if (valid) {
+      valid = parse(spec.substr(0, dash), begin) &&
+              (dash + 1 == spec.size() || parse(spec.substr(dash + 1), end));
+    }
+    end = std::min(end, size - 1);
+    if (!valid || begin >= size || begin > end) {
+      response.status = 416;
+      response.headers.emplace_back("Content-Range",
+                                    "bytes */" + std::to_string(size));
+      return response;
+    }
+
+    response.status = 206;
+    response.body = body.substr(begin, end - begin + 1);
+    response.headers.emplace_back("Content-Range",
+                                  "bytes " + std::to_string(begin) + "-" +
+                                      std::to_string(end) + "/" +
+                                      std::to_string(size));
+    return response;
+  }
+
+  // delay before every response
+  void setLatency(std::chrono::milliseconds latency) {
+    mLatencyMs = latency.count();
+  }
+
+  // bytes per second each connection may send, 0 for unlimited
+  void setBandwidth(int64_t bytesPerSecond) { mBandwidth = bytesPerSecond; }
+
+  // answer the next count requests for path with status
+  void injectFailures(const std::string &path, size_t count, int status = 503) {
+    std::unique_lock lock(mMutex);
+    mFailures[path] = {count, status};
+  }
+
+  // send half of the body of the next count responses for path, then drop
+  // the connection
+  void injectDisconnects(const std::string &path, size_t count) {
+    std::unique_lock lock(mMutex);
+    mDisconnects[path] = count;
+  }
+
+  [[nodiscard]] std::string url(const std::string &path) const {
+    return "http://127.0.0.1:" + std::to_string(mPort) + path;
+  }
+
+  [[nodiscard]] size_t requestCount() const { return mRequests.load(); }
+
+  [[nodiscard]] size_t connectionCount() const { return mConnections.load(); }
+
+  // number of requests seen for path, query excluded
+  [[nodiscard]] size_t requestCount(const std::string &path) const {
+    std::unique_lock lock(mMutex);
+    auto iter = mPathRequests.find(path);
+    return iter == mPathRequests.end() ? 0 : iter->second;
+  }
+
+private:
+  static std::string lower(std::string str) {
+    for (auto &c : str) {
+      c = (char)std::tolower((unsigned char)c);
+    }
+    return str;
+  }
+
+  void acceptLoop() {
+    while (!mStop) {
+      pollfd pfd{.fd = mListenFd, .events = POLLIN, .revents = 0};
+      if (poll(&pfd, 1, 50) <= 0) {
+        continue;
+      }
+      int fd = accept(mListenFd, nullptr, nullptr);
+      if (fd < 0) {
+        continue;
+      }
+      ++mConnections;
+      std::unique_lock lock(mMutex);
+      mConnectionThreads.emplace_back([this, fd]() { connectionLoop(fd); });
+    }
+  }
+
+  // returns false when the peer closed or the server is stopping
+  bool readRequest(int fd, std::string &pending, Request &request) {
+    size_t headerEnd;
+    while ((headerEnd = pending.find("\r\n\r\n")) == std::string::npos) {
+      pollfd pfd{.fd = fd, .events = POLLIN, .revents = 0};
+      int ret = poll(&pfd, 1, 50);
+      if (mStop) {
+        return false;
+      }
+      if (ret <= 0) {
+        continue;
+      }
+      char buffer[4096];
+      ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+      if (n <= 0) {
+        return false;
+      }
+      pending.append(buffer, n);
+    }
+
+    std::string head = pending.substr(0, headerEnd);
+    pending.erase(0, headerEnd + 4);
+
+    size_t lineEnd = head.find("\r\n");
+    std::string requestLine = head.substr(0, lineEnd);
+    size_t sp1 = requestLine.find(' ');
+    size_t sp2 = requestLine.find(' ', sp1 + 1);
+    request.method = requestLine.substr(0, sp1);
+    std::string target = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+    size_t queryPos = target.find('?');
+    request.path = target.substr(0, queryPos);
+    if (queryPos != std::string::npos) {
+      request.query = target.substr(queryPos + 1);
+    }
+
+    size_t pos = lineEnd == std::string::npos ? head.size() : lineEnd + 2;
+    while (pos < head.size()) {
+      size_t end = head.find("\r\n", pos);
+      if (end == std::string::npos) {
+        end = head.size();
+      }
+      std::string line = head.substr(pos, end - pos);
+      size_t colon = line.find(':');
+      if (colon != std::string::npos) {
+        size_t valueStart = line.find_first_not_of(' ', colon + 1);
+        request.headers[lower(line.substr(0, colon))] =
+            valueStart == std::string::npos ? "" : line.substr(valueStart);
+      }
+      pos = end + 2;
+    }
+    return true;
+  }
+
+  static const char *reason(int status) {
+    switch (status) {
+    case 200:
+      return "OK";
+    case 206:
+      return "Partial Content";
+    case 304:
+      return "Not Modified";
+    case 404:
+      return "Not Found";
+    case 416:
+      return "Range Not Satisfiable";
+    case 500:
+      return "Internal Server Error";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Unknown";
+    }
+  }
+
+  bool sendAll(int fd, const char *data, size_t size) {
+    constexpr size_t chunkSize = 16 * 1024;
+    auto start = std::chrono::steady_clock::now();
+    size_t sent = 0;
+    while (sent < size) {
+      int64_t bandwidth = mBandwidth.load();
+      size_t toSend = bandwidth > 0 ? std::min(chunkSize, size - sent)
+                                    : size - sent;
+      ssize_t n = send(fd, data + sent, toSend, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      sent += n;
+      if (bandwidth > 0) {
+        std::this_thread::sleep_until(
+            start + std::chrono::microseconds(sent * 1000000 / bandwidth));
+      }
+    }
+    return true;
+  }
+
+  void connectionLoop(int fd) {
+    std::string pending;
+    while (!mStop) {
+      Request request;
+      if (!readRequest(fd, pending, request)) {
+        break;
+      }
+      ++mRequests;
+
+      Handler handler;
+      int failure = 0;
+      bool disconnect = false;
+      {
+        std::unique_lock lock(mMutex);
+        ++mPathRequests[request.path];
+        auto iter = mRoutes.find(request.path);
+        if (iter != mRoutes.end()) {
+          handler = iter->second;
+        }
+        if (auto fault = mFailures.find(request.path);
+            fault != mFailures.end() && fault->second.first > 0) {
+          --fault->second.first;
+          failure = fault->second.second;
+        }
+        if (auto fault = mDisconnects.find(request.path);
+            fault != mDisconnects.end() && fault->second > 0) {
+          --fault->second;
+          disconnect = true;
+        }
+      }
+      if (int64_t latency = mLatencyMs.load(); latency > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+      }
+      Response response =
+          failure != 0 ? Response{.status = failure, .body = "", .headers = {}}
+          : handler    ? handler(request)
+                       : Response{.status = 404, .body = "", .headers = {}};
+
+      std::string head = "HTTP/1.1 " + std::to_string(response.status) + " " +
+                         reason(response.status) + "\r\n";
+      for (auto &&[key, value] : response.headers) {
+        head += key + ": " + value + "\r\n";
+      }
+      head += "Content-Length: " + std::to_string(response.body.size()) +
+              "\r\n\r\n";
+
+      bool ok = sendAll(fd, head.data(), head.size());
+      if (ok && disconnect) {
+        sendAll(fd, response.body.data(), response.body.size() / 2);
+        break;
+      }
+      if (ok && request.method != "HEAD") {
+        ok = sendAll(fd, response.body.data(), response.body.size());
+      }
+      if (!ok || lower(request.header("Connection")) == "close") {
+        break;
+      }
+    }
+    close(fd);
+  }
+
+  int mListenFd = -1;
+  uint16_t mPort = 0;
+
+  std::atomic<bool> mStop = false;
+  std::atomic<size_t> mRequests = 0;
+  std::atomic<size_t> mConnections = 0;
+  std::atomic<int64_t> mLatencyMs = 0;
+  std::atomic<int64_t> mBandwidth = 0;
+
+  mutable std::mutex mMutex;
+  std::map<std::string, Handler> mRoutes;
+  std::map<std::string, size_t> mPathRequests;
+  // remaining count and status
+  std::map<std::string, std::pair<size_t, int>> mFailures;
+  std::map<std::string, size_t> mDisconnects;
+  std::thread mAcceptThread;
+  std::vector<std::thread> mConnectionThreads;
+};
+
+} // namespace ted
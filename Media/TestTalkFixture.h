@@ -0,0 +1,136 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "TestHttpServer.h"
+#include "Utils/json.hpp"
+
+namespace ted {
+
+/**
+ * A talk served from TestHttpServer the way ted.com lays it out: a talk
+ * page carrying __NEXT_DATA__ with the transcript and the hls master url,
+ * a master playlist with "low" and "medium" audio renditions and generated
+ * segments behind them.
+ */
+class TestTalkFixture {
+public:
+  static constexpr double SEGMENT_DURATION = 6.0;
+
+  explicit TestTalkFixture(TestHttpServer &server, size_t segmentCount = 8,
+                           size_t segmentSize = 32 * 1024)
+      : mServer(server), mSegmentCount(segmentCount),
+        mSegmentSize(segmentSize) {
+    std::string master = "#EXTM3U\n#EXT-X-INDEPENDENT-SEGMENTS\n";
+    for (auto &&[name, bandwidth] : renditions()) {
+      master += "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"" + name +
+                "\",NAME=\"" + name + "\",DEFAULT=NO,AUTOSELECT=YES,URI=\"" +
+                name + "/index.m3u8\"\n";
+      servePlayList(name);
+    }
+    for (auto &&[name, bandwidth] : renditions()) {
+      master += "#EXT-X-STREAM-INF:BANDWIDTH=" + std::to_string(bandwidth) +
+                ",CODECS=\"avc1.42c00d,mp4a.40.2\",RESOLUTION=320x180,"
+                "AUDIO=\"" +
+                name + "\"\nvideo/180.m3u8\n";
+    }
+    mServer.serve("/hls/master.m3u8", master,
+                  "application/vnd.apple.mpegurl");
+    mServer.serve("/talks/test_talk", page(), "text/html");
+  }
+
+  [[nodiscard]] std::string talkUrl() const {
+    return mServer.url("/talks/test_talk");
+  }
+
+  [[nodiscard]] std::string masterUrl() const {
+    return mServer.url("/hls/master.m3u8");
+  }
+
+  [[nodiscard]] std::string playListUrl(const std::string &name) const {
+    return mServer.url("/hls/" + name + "/index.m3u8");
+  }
+
+  [[nodiscard]] std::string segmentPath(const std::string &name,
+                                        size_t index) const {
+    return "/hls/" + name + "/seg" + std::to_string(index) + ".ts";
+  }
+
+  // concatenated segments of a rendition
+  [[nodiscard]] std::string audio(const std::string &name) const {
+    std::string content;
+    for (size_t i = 0; i < mSegmentCount; ++i) {
+      content += segment(name, i);
+    }
+    return content;
+  }
+
+  [[nodiscard]] size_t segmentCount() const { return mSegmentCount; }
+
+  // cue texts as they appear in the transcript, in order
+  [[nodiscard]] static std::vector<std::string> cueTexts() {
+    return {"Hello and welcome.", "(Laughter)",
+            "Water leaves the house\nand comes back.",
+            "That is the whole cycle."};
+  }
+
+private:
+  static std::vector<std::pair<std::string, int>> renditions() {
+    return {{"low", 64000}, {"medium", 128000}};
+  }
+
+  [[nodiscard]] std::string segment(const std::string &name,
+                                    size_t index) const {
+    std::string data(mSegmentSize, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+      data[i] = static_cast<char>((name.size() * 7 + index * 31 + i) & 0xff);
+    }
+    return data;
+  }
+
+  void servePlayList(const std::string &name) {
+    std::string playList = "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:6\n"
+                           "#EXT-X-MEDIA-SEQUENCE:0\n";
+    for (size_t i = 0; i < mSegmentCount; ++i) {
+      mServer.serve(segmentPath(name, i), segment(name, i), "video/mp2t");
+      playList += "#EXTINF:6.000,\nseg" + std::to_string(i) + ".ts\n";
+    }
+    playList += "#EXT-X-ENDLIST\n";
+    mServer.serve("/hls/" + name + "/index.m3u8", playList,
+                  "application/vnd.apple.mpegurl");
+  }
+
+  [[nodiscard]] std::string page() const {
+    nlohmann::json player;
+    player["resources"]["hls"]["stream"] = masterUrl();
+
+    nlohmann::json cues = nlohmann::json::array();
+    int64_t time = 0;
+    for (auto &&text : cueTexts()) {
+      cues.push_back({{"__typename", "Cue"}, {"text", text}, {"time", time}});
+      time += 4000;
+    }
+
+    nlohmann::json data;
+    auto &pageProps = data["props"]["pageProps"];
+    pageProps["videoData"]["id"] = "1024";
+    pageProps["videoData"]["title"] = "How the water you flush comes back";
+    pageProps["videoData"]["presenterDisplayName"] = "Test Speaker";
+    pageProps["videoData"]["playerData"] = player.dump();
+    pageProps["videoData"]["duration"] =
+        (int)(mSegmentCount * SEGMENT_DURATION);
+    pageProps["transcriptData"]["translation"]["paragraphs"] = {
+        {{"__typename", "Paragraph"}, {"cues", cues}}};
+
+    return "<!DOCTYPE html><html><head><title>test talk</title></head><body>"
+           "<script id=\"__NEXT_DATA__\" type=\"application/json\">" +
+           data.dump() + "</script></body></html>";
+  }
+
+  TestHttpServer &mServer;
+  size_t mSegmentCount;
+  size_t mSegmentSize;
+};
+
+} // namespace ted
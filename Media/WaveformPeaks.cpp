@@ -0,0 +1,378 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MappedPcmSource.h"
+#include "WaveformPeaks.h"
+#include "Utils/AsyncFileIO.h"
+
+using ted::Peak;
+using ted::WaveformBuilder;
+using ted::WaveformPeaks;
+
+// native layout; the file lives next to the audio it was built from and is
+// rebuilt when it does not validate
+static constexpr char PEAKS_MAGIC[8] = {'T', 'S', 'P', 'E', 'A', 'K', 'S', '1'};
+
+struct PeaksHeader {
+  char magic[8];
+  uint32_t levels;
+  uint32_t sampleRate;
+  int64_t sampleCount;
+};
+
+struct PeaksLevel {
+  uint32_t bucketSamples;
+  uint32_t reserved;
+  uint64_t count;
+};
+
+static_assert(sizeof(Peak) == 3 * sizeof(float));
+
+// independent lanes so the compiler can keep them in vector registers
+// without reordering the float operations
+static void reduce(const float *values, int64_t count, float &min, float &max,
+                   double &sumSquares) {
+  constexpr int LANES = 8;
+  float lo[LANES], hi[LANES], squares[LANES];
+  std::fill(lo, lo + LANES, FLT_MAX);
+  std::fill(hi, hi + LANES, -FLT_MAX);
+  std::fill(squares, squares + LANES, 0.0f);
+
+  int64_t i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    for (int lane = 0; lane < LANES; ++lane) {
+      float value = values[i + lane];
+      lo[lane] = std::min(lo[lane], value);
+      hi[lane] = std::max(hi[lane], value);
+      squares[lane] += value * value;
+    }
+  }
+  for (; i < count; ++i) {
+    lo[0] = std::min(lo[0], values[i]);
+    hi[0] = std::max(hi[0], values[i]);
+    squares[0] += values[i] * values[i];
+  }
+
+  min = *std::min_element(lo, lo + LANES);
+  max = *std::max_element(hi, hi + LANES);
+  sumSquares = 0;
+  for (float lane : squares) {
+    sumSquares += lane;
+  }
+}
+
+WaveformBuilder::WaveformBuilder(int sampleRate, int channels)
+    : mSampleRate(sampleRate), mChannels(std::max(channels, 1)) {}
+
+void WaveformBuilder::addSamples(const float *samples, int64_t count) {
+  int64_t values = count * mChannels;
+  int64_t bucketValues = (int64_t)BUCKET_SAMPLES[0] * mChannels;
+  auto &pending = mPending[0];
+
+  while (values > 0) {
+    int64_t take = std::min(values, bucketValues - pending.values);
+    float min, max;
+    double sumSquares;
+    reduce(samples, take, min, max, sumSquares);
+
+    if (pending.values == 0) {
+      pending.min = min;
+      pending.max = max;
+    } else {
+      pending.min = std::min(pending.min, min);
+      pending.max = std::max(pending.max, max);
+    }
+    pending.sumSquares += sumSquares;
+    pending.values += take;
+    samples += take;
+    values -= take;
+
+    if (pending.values == bucketValues) {
+      pending.samples = BUCKET_SAMPLES[0];
+      addBucket(0, pending);
+      pending = {};
+    }
+  }
+  mSampleCount += count;
+}
+
+void WaveformBuilder::addBucket(size_t level, const Accumulator &bucket) {
+  mLevels[level].push_back(Peak{
+      .min = bucket.min,
+      .max = bucket.max,
+      .rms = (float)std::sqrt(bucket.sumSquares / (double)bucket.values)});
+  if (level + 1 == mLevels.size()) {
+    return;
+  }
+
+  // coarser levels are merged from finished buckets, not from samples
+  auto &parent = mPending[level + 1];
+  if (parent.values == 0) {
+    parent.min = bucket.min;
+    parent.max = bucket.max;
+  } else {
+    parent.min = std::min(parent.min, bucket.min);
+    parent.max = std::max(parent.max, bucket.max);
+  }
+  parent.sumSquares += bucket.sumSquares;
+  parent.values += bucket.values;
+  parent.samples += bucket.samples;
+  if (parent.samples == BUCKET_SAMPLES[level + 1]) {
+    addBucket(level + 1, parent);
+    parent = {};
+  }
+}
+
+int WaveformBuilder::addFrame(const AVFrame *frame) {
+  int64_t values = (int64_t)frame->nb_samples * mChannels;
+  switch (frame->format) {
+  case AV_SAMPLE_FMT_FLT:
+    addSamples(reinterpret_cast<const float *>(frame->data[0]),
+               frame->nb_samples);
+    return 0;
+  case AV_SAMPLE_FMT_S16: {
+    auto *samples = reinterpret_cast<const int16_t *>(frame->data[0]);
+    mConverted.resize(values);
+    for (int64_t i = 0; i < values; ++i) {
+      mConverted[i] = (float)samples[i] / 32768.0f;
+    }
+    break;
+  }
+  case AV_SAMPLE_FMT_S32: {
+    auto *samples = reinterpret_cast<const int32_t *>(frame->data[0]);
+    mConverted.resize(values);
+    for (int64_t i = 0; i < values; ++i) {
+      mConverted[i] = (float)((double)samples[i] / 2147483648.0);
+    }
+    break;
+  }
+  default:
+    logger.error("WaveformBuilder: unsupported sample format {}",
+                 frame->format);
+    return -1;
+  }
+  addSamples(mConverted.data(), frame->nb_samples);
+  return 0;
+}
+
+void WaveformBuilder::finish() {
+  for (size_t level = 0; level < mLevels.size(); ++level) {
+    auto &pending = mPending[level];
+    if (pending.values > 0) {
+      if (level == 0) {
+        pending.samples = (int)(pending.values / mChannels);
+      }
+      auto bucket = pending;
+      pending = {};
+      addBucket(level, bucket);
+    }
+  }
+}
+
+const std::vector<Peak> &WaveformBuilder::level(size_t index) const {
+  return mLevels[index];
+}
+
+int WaveformBuilder::save(const std::string &path) const {
+  std::string partPath = path + ".part";
+  int fd = open(partPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    logger.error("WaveformBuilder failed to open {}", partPath);
+    return -1;
+  }
+
+  PeaksHeader header{};
+  memcpy(header.magic, PEAKS_MAGIC, sizeof(PEAKS_MAGIC));
+  header.levels = mLevels.size();
+  header.sampleRate = mSampleRate;
+  header.sampleCount = mSampleCount;
+  std::vector<uint8_t> head(sizeof(header) + mLevels.size() *
+                                                 sizeof(PeaksLevel));
+  memcpy(head.data(), &header, sizeof(header));
+  for (size_t i = 0; i < mLevels.size(); ++i) {
+    PeaksLevel level{.bucketSamples = (uint32_t)BUCKET_SAMPLES[i],
+                     .reserved = 0,
+                     .count = mLevels[i].size()};
+    memcpy(head.data() + sizeof(header) + i * sizeof(level), &level,
+           sizeof(level));
+  }
+
+  // the header and every level go out in one submission
+  std::vector<ted::FileRequest> requests;
+  requests.push_back({.op = ted::FileRequest::Op::Write,
+                      .fd = fd,
+                      .buffer = head.data(),
+                      .size = head.size(),
+                      .offset = 0});
+  int64_t offset = (int64_t)head.size();
+  for (auto &&level : mLevels) {
+    size_t size = level.size() * sizeof(Peak);
+    requests.push_back({.op = ted::FileRequest::Op::Write,
+                        .fd = fd,
+                        .buffer = const_cast<Peak *>(level.data()),
+                        .size = size,
+                        .offset = offset});
+    offset += (int64_t)size;
+  }
+  auto results = ted::AsyncFileIO::instance().submit(requests);
+  bool written = true;
+  for (size_t i = 0; i < results.size(); ++i) {
+    written = results[i].get() == (int64_t)requests[i].size && written;
+  }
+  written = close(fd) == 0 && written;
+
+  if (!written || std::rename(partPath.c_str(), path.c_str()) != 0) {
+    logger.error("WaveformBuilder failed to write {}", path);
+    unlink(partPath.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+struct WaveformPeaks::Mapping {
+  void *address = MAP_FAILED;
+  size_t length = 0;
+
+  ~Mapping() {
+    if (address != MAP_FAILED) {
+      munmap(address, length);
+    }
+  }
+};
+
+WaveformPeaks::WaveformPeaks() = default;
+
+WaveformPeaks::~WaveformPeaks() = default;
+
+int WaveformPeaks::load(const std::string &path) {
+  mMapping.reset();
+  mBucketSamples.clear();
+  mLevels.clear();
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st {};
+  auto mapping = std::make_unique<Mapping>();
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(PeaksHeader)) {
+    mapping->length = st.st_size;
+    mapping->address =
+        mmap(nullptr, mapping->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping->address == MAP_FAILED) {
+    logger.error("failed to map waveform peaks {}", path);
+    return -1;
+  }
+
+  auto *base = static_cast<const uint8_t *>(mapping->address);
+  PeaksHeader header{};
+  memcpy(&header, base, sizeof(header));
+  size_t offset = sizeof(header) + header.levels * sizeof(PeaksLevel);
+  if (memcmp(header.magic, PEAKS_MAGIC, sizeof(PEAKS_MAGIC)) != 0 ||
+      header.levels > 16 || offset > mapping->length) {
+    logger.error("waveform peaks {} are corrupted", path);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < header.levels; ++i) {
+    PeaksLevel level{};
+    memcpy(&level, base + sizeof(header) + i * sizeof(PeaksLevel),
+           sizeof(level));
+    if (level.count > (mapping->length - offset) / sizeof(Peak)) {
+      logger.error("waveform peaks {} are truncated", path);
+      mBucketSamples.clear();
+      mLevels.clear();
+      return -1;
+    }
+    mBucketSamples.push_back((int)level.bucketSamples);
+    mLevels.emplace_back(reinterpret_cast<const Peak *>(base + offset),
+                         level.count);
+    offset += level.count * sizeof(Peak);
+  }
+
+  mSampleRate = (int)header.sampleRate;
+  mSampleCount = header.sampleCount;
+  mMapping = std::move(mapping);
+  return 0;
+}
+
+size_t WaveformPeaks::levelCount() const { return mLevels.size(); }
+
+int WaveformPeaks::samplesPerBucket(size_t level) const {
+  return mBucketSamples[level];
+}
+
+std::span<const Peak> WaveformPeaks::level(size_t index) const {
+  return mLevels[index];
+}
+
+size_t WaveformPeaks::levelFor(double samplesPerPixel) const {
+  size_t best = 0;
+  for (size_t i = 0; i < mBucketSamples.size(); ++i) {
+    if (mBucketSamples[i] <= samplesPerPixel) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+int WaveformPeaks::getSampleRate() const { return mSampleRate; }
+
+int64_t WaveformPeaks::getSampleCount() const { return mSampleCount; }
+
+int ted::buildWaveformPeaks(const std::string &mediaFile,
+                            const std::string &peaksFile,
+                            std::shared_ptr<IOSource> source,
+                            CancelToken cancel) {
+  std::unique_ptr<AudioDecoder> decoder;
+  if (source != nullptr) {
+    decoder = std::make_unique<AudioDecoder>(mediaFile);
+    decoder->setIOSource(std::move(source));
+    decoder->setCancelToken(cancel);
+    if (decoder->init() != 0) {
+      decoder = nullptr;
+    }
+  } else {
+    decoder = openAudioDecoder(mediaFile);
+  }
+  if (decoder == nullptr) {
+    logger.error("failed to open {} for waveform peaks", mediaFile);
+    return -1;
+  }
+
+  auto param = decoder->getAudioParam();
+  WaveformBuilder builder(param.sampleRate, param.channels);
+  while (true) {
+    if (cancel.cancelled()) {
+      logger.info("waveform peaks of {} cancelled", mediaFile);
+      return -1;
+    }
+    std::shared_ptr<AVFrame> frame;
+    if (decoder->getNextFrame(frame) != 0) {
+      if (cancel.cancelled()) {
+        logger.info("waveform peaks of {} cancelled", mediaFile);
+        return -1;
+      }
+      logger.error("failed to decode {} for waveform peaks", mediaFile);
+      return -1;
+    }
+    if (frame == nullptr) {
+      break;
+    }
+    if (builder.addFrame(frame.get()) != 0) {
+      return -1;
+    }
+  }
+  builder.finish();
+  return builder.save(peaksFile);
+}
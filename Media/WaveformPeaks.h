@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "IOSource.h"
+#include "Utils/Utils.h"
+
+namespace ted {
+
+struct Peak {
+  float min = 0;
+  float max = 0;
+  float rms = 0;
+};
+
+/**
+ * Builds min/max/RMS buckets of 256, 1024 and 4096 samples from audio fed
+ * in decode order, so the pyramid is complete as soon as the last frame
+ * is added. All channels of a sample go into the same bucket.
+ */
+class WaveformBuilder {
+public:
+  static constexpr std::array<int, 3> BUCKET_SAMPLES = {256, 1024, 4096};
+
+  WaveformBuilder(int sampleRate, int channels);
+
+  // interleaved floats in [-1, 1]
+  void addSamples(const float *samples, int64_t count);
+
+  // interleaved float, s16 or s32 frames as AudioDecoder returns them
+  int addFrame(const AVFrame *frame);
+
+  // flush the partial buckets at the end of the audio
+  void finish();
+
+  [[nodiscard]] const std::vector<Peak> &level(size_t index) const;
+
+  // write the pyramid to path through path.part, 0 on success
+  int save(const std::string &path) const;
+
+private:
+  struct Accumulator {
+    float min = 0;
+    float max = 0;
+    double sumSquares = 0;
+    int64_t values = 0;
+    int samples = 0;
+  };
+
+  void addBucket(size_t level, const Accumulator &bucket);
+
+  int mSampleRate;
+  int mChannels;
+  int64_t mSampleCount = 0;
+  std::array<Accumulator, BUCKET_SAMPLES.size()> mPending{};
+  std::array<std::vector<Peak>, BUCKET_SAMPLES.size()> mLevels;
+  std::vector<float> mConverted;
+};
+
+/**
+ * A pyramid written by WaveformBuilder, mapped read-only.
+ */
+class WaveformPeaks {
+public:
+  WaveformPeaks();
+
+  ~WaveformPeaks();
+
+  int load(const std::string &path);
+
+  [[nodiscard]] size_t levelCount() const;
+
+  [[nodiscard]] int samplesPerBucket(size_t level) const;
+
+  [[nodiscard]] std::span<const Peak> level(size_t index) const;
+
+  // the coarsest level still at least as fine as samplesPerPixel
+  [[nodiscard]] size_t levelFor(double samplesPerPixel) const;
+
+  [[nodiscard]] int getSampleRate() const;
+
+  [[nodiscard]] int64_t getSampleCount() const;
+
+private:
+  struct Mapping;
+
+  std::unique_ptr<Mapping> mMapping;
+  std::vector<int> mBucketSamples;
+  std::vector<std::span<const Peak>> mLevels;
+  int mSampleRate = 0;
+  int64_t mSampleCount = 0;
+};
+
+// decode mediaFile, through source if given, and save its pyramid to
+// peaksFile; with a GrowingFileSource it follows a download in progress.
+// Stops without writing peaksFile once cancel is cancelled
+int buildWaveformPeaks(const std::string &mediaFile,
+                       const std::string &peaksFile,
+                       std::shared_ptr<IOSource> source = nullptr,
+                       CancelToken cancel = {});
+
+} // namespace ted
@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#ifdef TS_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "AsyncFileIO.h"
+#include "Utils.h"
+
+using ted::AsyncFileIO;
+using ted::FileRequest;
+using ted::TaskPriority;
+using ted::WorkStealingPool;
+
+struct AsyncFileIO::Ring {
+#ifdef TS_HAVE_LIBURING
+  io_uring ring{};
+  std::thread reaper;
+#endif
+};
+
+struct AsyncFileIO::Pending {
+  FileRequest request;
+  // bytes transferred so far, the rest is queued again after a short
+  // transfer
+  int64_t done = 0;
+  std::function<void(int64_t)> complete;
+};
+
+// completions queue in a ring twice the size of the submission queue
+static constexpr size_t MAX_IN_FLIGHT = 2 * AsyncFileIO::QUEUE_DEPTH;
+
+AsyncFileIO::AsyncFileIO(size_t threads) {
+#ifdef TS_HAVE_LIBURING
+  auto ring = std::make_unique<Ring>();
+  int ret = io_uring_queue_init(QUEUE_DEPTH, &ring->ring, 0);
+  if (ret == 0) {
+    mRing = std::move(ring);
+    mRing->reaper = std::thread(&AsyncFileIO::reap, this);
+    return;
+  }
+  // containers and hardened kernels often turn io_uring off
+  logger.info("io_uring is not available ({}), file io runs on threads",
+              strerror(-ret));
+#endif
+  mPool = std::make_unique<WorkStealingPool>(threads);
+}
+
+AsyncFileIO::~AsyncFileIO() {
+  std::unique_lock lock(mMutex);
+  mSpace.wait(lock, [this]() { return mInFlight == 0; });
+#ifdef TS_HAVE_LIBURING
+  if (mRing != nullptr) {
+    // a nop without data tells the reaper to return
+    io_uring_sqe *sqe = io_uring_get_sqe(&mRing->ring);
+    if (sqe == nullptr) {
+      io_uring_submit(&mRing->ring);
+      sqe = io_uring_get_sqe(&mRing->ring);
+    }
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, nullptr);
+    io_uring_submit(&mRing->ring);
+    lock.unlock();
+    mRing->reaper.join();
+    io_uring_queue_exit(&mRing->ring);
+  }
+#endif
+}
+
+AsyncFileIO &AsyncFileIO::instance() {
+  static AsyncFileIO io;
+  return io;
+}
+
+bool AsyncFileIO::usesIoUring() const { return mRing != nullptr; }
+
+int AsyncFileIO::registerBuffers(std::vector<std::span<uint8_t>> buffers) {
+  std::unique_lock lock(mMutex);
+#ifdef TS_HAVE_LIBURING
+  if (mRing != nullptr) {
+    if (!mBuffers.empty()) {
+      io_uring_unregister_buffers(&mRing->ring);
+      mBuffers.clear();
+    }
+    std::vector<iovec> iovecs;
+    for (auto &&buffer : buffers) {
+      iovecs.push_back({buffer.data(), buffer.size()});
+    }
+    int ret = iovecs.empty() ? 0
+                             : io_uring_register_buffers(
+                                   &mRing->ring, iovecs.data(), iovecs.size());
+    if (ret != 0) {
+      logger.error("failed to register {} io buffers: {}", buffers.size(),
+                   strerror(-ret));
+      return -1;
+    }
+  }
+#endif
+  mBuffers = std::move(buffers);
+  return 0;
+}
+
+bool AsyncFileIO::validBuffer(const FileRequest &request) const {
+  if (request.bufferIndex < 0) {
+    return true;
+  }
+  if ((size_t)request.bufferIndex >= mBuffers.size()) {
+    return false;
+  }
+  auto buffer = mBuffers[request.bufferIndex];
+  auto *begin = static_cast<const uint8_t *>(request.buffer);
+  return begin >= buffer.data() &&
+         begin + request.size <= buffer.data() + buffer.size();
+}
+
+std::vector<std::future<int64_t>>
+AsyncFileIO::submit(std::vector<FileRequest> requests) {
+  std::vector<std::future<int64_t>> results;
+  std::vector<std::unique_ptr<Pending>> batch;
+  results.reserve(requests.size());
+  batch.reserve(requests.size());
+  for (auto &&request : requests) {
+    auto promise = std::make_shared<std::promise<int64_t>>();
+    results.push_back(promise->get_future());
+    auto pending = std::make_unique<Pending>();
+    pending->request = request;
+    pending->complete = [promise](int64_t result) {
+      promise->set_value(result);
+    };
+    batch.push_back(std::move(pending));
+  }
+  submitPending(std::move(batch));
+  return results;
+}
+
+std::future<int64_t> AsyncFileIO::read(int fd, void *buffer, size_t size,
+                                       int64_t offset) {
+  return std::move(submit({FileRequest{.op = FileRequest::Op::Read,
+                                       .fd = fd,
+                                       .buffer = buffer,
+                                       .size = size,
+                                       .offset = offset}})
+                       .front());
+}
+
+std::future<int64_t> AsyncFileIO::write(int fd, const void *buffer,
+                                        size_t size, int64_t offset) {
+  // never written through, the request type is shared with reads
+  return std::move(submit({FileRequest{.op = FileRequest::Op::Write,
+                                       .fd = fd,
+                                       .buffer = const_cast<void *>(buffer),
+                                       .size = size,
+                                       .offset = offset}})
+                       .front());
+}
+
+std::future<std::string> AsyncFileIO::readFile(const std::string &path) {
+  auto promise = std::make_shared<std::promise<std::string>>();
+  auto result = promise->get_future();
+  readFile(path, [promise](std::exception_ptr error, std::string content) {
+    if (error) {
+      promise->set_exception(error);
+    } else {
+      promise->set_value(std::move(content));
+    }
+  });
+  return result;
+}
+
+void AsyncFileIO::readFile(
+    const std::string &path,
+    std::function<void(std::exception_ptr, std::string)> done) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    done(std::make_exception_ptr(std::runtime_error("failed to open " + path)),
+         {});
+    return;
+  }
+
+  auto data = std::make_shared<std::string>(st.st_size, '\0');
+  auto pending = std::make_unique<Pending>();
+  pending->request = FileRequest{.op = FileRequest::Op::Read,
+                                 .fd = fd,
+                                 .buffer = data->data(),
+                                 .size = data->size(),
+                                 .offset = 0};
+  pending->complete = [done = std::move(done), data, fd,
+                       path](int64_t bytes) {
+    close(fd);
+    if (bytes < 0) {
+      done(std::make_exception_ptr(
+               std::runtime_error("failed to read " + path)),
+           {});
+      return;
+    }
+    // the file may have shrunk since it was sized
+    data->resize(bytes);
+    done(nullptr, std::move(*data));
+  };
+  std::vector<std::unique_ptr<Pending>> batch;
+  batch.push_back(std::move(pending));
+  submitPending(std::move(batch));
+}
+
+std::future<int> AsyncFileIO::writeFile(const std::string &path,
+                                        std::string data) {
+  auto promise = std::make_shared<std::promise<int>>();
+  auto result = promise->get_future();
+  writeFile(path, std::move(data),
+            [promise](int ret) { promise->set_value(ret); });
+  return result;
+}
+
+void AsyncFileIO::writeFile(const std::string &path, std::string data,
+                            std::function<void(int)> done) {
+  std::string partPath = path + ".part";
+  int fd = open(partPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    logger.error("failed to open {}", partPath);
+    done(-1);
+    return;
+  }
+
+  auto content = std::make_shared<std::string>(std::move(data));
+  auto pending = std::make_unique<Pending>();
+  pending->request = FileRequest{.op = FileRequest::Op::Write,
+                                 .fd = fd,
+                                 .buffer = content->data(),
+                                 .size = content->size(),
+                                 .offset = 0};
+  pending->complete = [done = std::move(done), content, fd, path,
+                       partPath](int64_t bytes) {
+    bool written = bytes == (int64_t)content->size();
+    written = close(fd) == 0 && written;
+    if (!written || std::rename(partPath.c_str(), path.c_str()) != 0) {
+      logger.error("failed to write {}", path);
+      unlink(partPath.c_str());
+      done(-1);
+      return;
+    }
+    done(0);
+  };
+  std::vector<std::unique_ptr<Pending>> batch;
+  batch.push_back(std::move(pending));
+  submitPending(std::move(batch));
+}
+
+void AsyncFileIO::submitPending(std::vector<std::unique_ptr<Pending>> batch) {
+  std::vector<std::unique_ptr<Pending>> rejected;
+  {
+    std::unique_lock lock(mMutex);
+    for (auto &&pending : batch) {
+      if (!validBuffer(pending->request)) {
+        rejected.push_back(std::move(pending));
+        continue;
+      }
+#ifdef TS_HAVE_LIBURING
+      if (mRing != nullptr) {
+        if (mInFlight == MAX_IN_FLIGHT) {
+          // what is queued so far has to reach the kernel to ever complete
+          io_uring_submit(&mRing->ring);
+          mSpace.wait(lock, [this]() { return mInFlight < MAX_IN_FLIGHT; });
+        }
+        ++mInFlight;
+        prepare(*pending.release());
+        continue;
+      }
+#endif
+      ++mInFlight;
+      // callers wait on file io, it goes ahead of bulk work
+      mPool->post(TaskPriority::Interactive,
+                  [this, pending = std::move(pending)]() {
+                    runPending(*pending);
+                  });
+    }
+#ifdef TS_HAVE_LIBURING
+    if (mRing != nullptr) {
+      io_uring_submit(&mRing->ring);
+    }
+#endif
+  }
+
+  for (auto &&pending : rejected) {
+    logger.error("io request outside registered buffer {}",
+                 pending->request.bufferIndex);
+    pending->complete(-EINVAL);
+  }
+}
+
+void AsyncFileIO::runPending(Pending &pending) {
+  auto &request = pending.request;
+  auto *buffer = static_cast<uint8_t *>(request.buffer);
+  int64_t error = 0;
+  while (pending.done < (int64_t)request.size) {
+    size_t size = request.size - pending.done;
+    off_t offset = request.offset + pending.done;
+    ssize_t n = request.op == FileRequest::Op::Read
+                    ? pread(request.fd, buffer + pending.done, size, offset)
+                    : pwrite(request.fd, buffer + pending.done, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      error = -errno;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    pending.done += n;
+  }
+  finish(pending, error < 0 ? error : pending.done);
+}
+
+void AsyncFileIO::finish(Pending &pending, int64_t result) {
+  {
+    std::unique_lock lock(mMutex);
+    --mInFlight;
+  }
+  mSpace.notify_all();
+  pending.complete(result);
+}
+
+#ifdef TS_HAVE_LIBURING
+void AsyncFileIO::prepare(Pending &pending) {
+  io_uring_sqe *sqe = io_uring_get_sqe(&mRing->ring);
+  if (sqe == nullptr) {
+    // submitting hands the queued entries to the kernel and frees them
+    io_uring_submit(&mRing->ring);
+    sqe = io_uring_get_sqe(&mRing->ring);
+  }
+
+  auto &request = pending.request;
+  auto *buffer = static_cast<uint8_t *>(request.buffer) + pending.done;
+  // lengths are 32 bit, longer requests continue after a short transfer
+  unsigned size = std::min<size_t>(request.size - pending.done, 1u << 30);
+  uint64_t offset = request.offset + pending.done;
+  if (request.op == FileRequest::Op::Read) {
+    if (request.bufferIndex >= 0) {
+      io_uring_prep_read_fixed(sqe, request.fd, buffer, size, offset,
+                               request.bufferIndex);
+    } else {
+      io_uring_prep_read(sqe, request.fd, buffer, size, offset);
+    }
+  } else {
+    if (request.bufferIndex >= 0) {
+      io_uring_prep_write_fixed(sqe, request.fd, buffer, size, offset,
+                                request.bufferIndex);
+    } else {
+      io_uring_prep_write(sqe, request.fd, buffer, size, offset);
+    }
+  }
+  io_uring_sqe_set_data(sqe, &pending);
+}
+
+void AsyncFileIO::reap() {
+  while (true) {
+    io_uring_cqe *cqe = nullptr;
+    int ret = io_uring_wait_cqe(&mRing->ring, &cqe);
+    if (ret == -EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      logger.error("io_uring wait failed: {}", strerror(-ret));
+      return;
+    }
+    auto *pending = static_cast<Pending *>(io_uring_cqe_get_data(cqe));
+    int result = cqe->res;
+    io_uring_cqe_seen(&mRing->ring, cqe);
+    if (pending == nullptr) {
+      return;
+    }
+
+    if (result > 0) {
+      pending->done += result;
+    }
+    // a short read ends with a read of 0 bytes at the end of the file
+    bool retry = result == -EAGAIN ||
+                 (result > 0 && pending->done < (int64_t)pending->request.size);
+    if (retry) {
+      std::unique_lock lock(mMutex);
+      prepare(*pending);
+      io_uring_submit(&mRing->ring);
+      continue;
+    }
+
+    std::unique_ptr<Pending> owned(pending);
+    finish(*owned, result < 0 ? result : owned->done);
+  }
+}
+#endif
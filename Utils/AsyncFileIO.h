@@ -0,0 +1,119 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "WorkStealingPool.h"
+
+namespace ted {
+
+struct FileRequest {
+  enum class Op { Read, Write };
+
+  Op op = Op::Read;
+  int fd = -1;
+  void *buffer = nullptr;
+  size_t size = 0;
+  int64_t offset = 0;
+  // index into the buffers given to registerBuffers, buffer must then lie
+  // inside that registered buffer; -1 for any other memory
+  int bufferIndex = -1;
+};
+
+/**
+ * Positional reads and writes that complete into futures instead of
+ * blocking the caller. Built with liburing (TS_HAVE_LIBURING) requests go
+ * through an io_uring and a single thread reaps completions, so many reads
+ * can be in flight without a thread each. Otherwise, or when the kernel
+ * refuses to set up a ring, they run on a small pool of threads.
+ *
+ * A request completes with the number of bytes transferred, which is only
+ * short of its size at the end of the file, or with -errno. Futures must
+ * not outlive the buffers they read into or write from.
+ */
+class AsyncFileIO {
+public:
+  static constexpr unsigned QUEUE_DEPTH = 64;
+
+  explicit AsyncFileIO(size_t threads = 4);
+
+  ~AsyncFileIO();
+
+  AsyncFileIO(const AsyncFileIO &) = delete;
+  AsyncFileIO &operator=(const AsyncFileIO &) = delete;
+
+  // shared by the cache readers and writers
+  static AsyncFileIO &instance();
+
+  [[nodiscard]] bool usesIoUring() const;
+
+  // pin buffers for FileRequest::bufferIndex, replacing any registered
+  // before; must not be called while requests on them are in flight.
+  // 0 on success
+  int registerBuffers(std::vector<std::span<uint8_t>> buffers);
+
+  // queue every request with a single submission, futures in order
+  std::vector<std::future<int64_t>> submit(std::vector<FileRequest> requests);
+
+  std::future<int64_t> read(int fd, void *buffer, size_t size,
+                            int64_t offset);
+
+  std::future<int64_t> write(int fd, const void *buffer, size_t size,
+                             int64_t offset);
+
+  // the whole file; throws from get() if it cannot be read
+  std::future<std::string> readFile(const std::string &path);
+
+  // the same, done is called on the completing thread with the error or
+  // the content; it must not block
+  void readFile(const std::string &path,
+                std::function<void(std::exception_ptr, std::string)> done);
+
+  // write data to path through path.part and rename it into place,
+  // 0 on success
+  std::future<int> writeFile(const std::string &path, std::string data);
+
+  // the same, done gets the result on the completing thread
+  void writeFile(const std::string &path, std::string data,
+                 std::function<void(int)> done);
+
+private:
+  struct Ring;
+  struct Pending;
+
+  void submitPending(std::vector<std::unique_ptr<Pending>> batch);
+
+  // blocking transfer on a pool thread
+  void runPending(Pending &pending);
+
+  void finish(Pending &pending, int64_t result);
+
+  // false if bufferIndex is set but the request is not inside that buffer
+  [[nodiscard]] bool validBuffer(const FileRequest &request) const;
+
+#ifdef TS_HAVE_LIBURING
+  // queue the rest of a request, called with mMutex held
+  void prepare(Pending &pending);
+
+  void reap();
+#endif
+
+  std::unique_ptr<Ring> mRing;
+  std::vector<std::span<uint8_t>> mBuffers;
+
+  std::mutex mMutex;
+  std::condition_variable mSpace;
+  size_t mInFlight = 0;
+
+  // declared last so its workers are joined before the rest goes away
+  std::unique_ptr<WorkStealingPool> mPool;
+};
+
+} // namespace ted
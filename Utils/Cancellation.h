@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+
+namespace ted {
+
+/**
+ * Cooperative cancellation for work on the pool: a std::stop_token and an
+ * optional deadline. Nothing is interrupted from outside; downloads,
+ * decoders and analysis loops poll cancelled() and give up early, so work
+ * for a talk that is no longer wanted frees its worker. A default
+ * constructed token is never cancelled.
+ */
+class CancelToken {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  CancelToken() = default;
+
+  explicit CancelToken(std::stop_token stop,
+                       Clock::time_point deadline = Clock::time_point::max())
+      : mStop(std::move(stop)), mDeadline(deadline) {}
+
+  // stop requested or deadline passed
+  [[nodiscard]] bool cancelled() const {
+    return mStop.stop_requested() || expired();
+  }
+
+  [[nodiscard]] bool expired() const {
+    return mDeadline != Clock::time_point::max() && Clock::now() >= mDeadline;
+  }
+
+  // false for a default token, which never needs polling
+  [[nodiscard]] bool cancellable() const {
+    return mStop.stop_possible() || mDeadline != Clock::time_point::max();
+  }
+
+  [[nodiscard]] Clock::time_point deadline() const { return mDeadline; }
+
+  [[nodiscard]] const std::stop_token &stopToken() const { return mStop; }
+
+  // same stop state, the earlier of both deadlines
+  [[nodiscard]] CancelToken withDeadline(Clock::time_point deadline) const {
+    return CancelToken(mStop, std::min(mDeadline, deadline));
+  }
+
+  [[nodiscard]] CancelToken withTimeout(Clock::duration timeout) const {
+    return withDeadline(Clock::now() + timeout);
+  }
+
+  void throwIfCancelled() const;
+
+private:
+  std::stop_token mStop;
+  Clock::time_point mDeadline = Clock::time_point::max();
+};
+
+// reported by tasks that gave up because their token was cancelled
+class Cancelled : public std::runtime_error {
+public:
+  Cancelled() : std::runtime_error("cancelled") {}
+
+  explicit Cancelled(const std::string &what) : std::runtime_error(what) {}
+};
+
+inline void CancelToken::throwIfCancelled() const {
+  if (mStop.stop_requested()) {
+    throw Cancelled();
+  }
+  if (expired()) {
+    throw Cancelled("deadline exceeded");
+  }
+}
+
+} // namespace ted
@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
+
+#include "DownloadManifest.h"
+#include "Utils.h"
+
+using ted::DownloadManifest;
+
+DownloadManifest::DownloadManifest(std::string path) : mPath(std::move(path)) {}
+
+int DownloadManifest::load() {
+  std::ifstream file(mPath);
+  if (!file) {
+    return -1;
+  }
+  auto json = nlohmann::json::parse(file, nullptr, false);
+  if (json.is_discarded() || !json.is_object()) {
+    logger.error("download manifest {} is corrupted", mPath);
+    return -1;
+  }
+
+  // read completely before anything is kept, a truncated or hand edited
+  // manifest starts the download afresh
+  std::string url;
+  int64_t totalSize;
+  std::string etag;
+  std::string lastModified;
+  size_t segments;
+  int64_t segmentBytes;
+  std::vector<Range> ranges;
+  try {
+    url = json.at("url").get<std::string>();
+    totalSize = json.at("size").get<int64_t>();
+    // absent from manifests written before validators were recorded
+    etag = json.value("etag", "");
+    lastModified = json.value("lastModified", "");
+    segments = json.at("segments").get<size_t>();
+    segmentBytes = json.at("segmentBytes").get<int64_t>();
+    for (auto &&range : json.at("ranges")) {
+      if (!range.is_array() || range.size() != 2) {
+        logger.error("download manifest {} has a malformed range", mPath);
+        return -1;
+      }
+      ranges.emplace_back(range.at(0).get<int64_t>(),
+                          range.at(1).get<int64_t>());
+    }
+  } catch (const nlohmann::json::exception &e) {
+    logger.error("download manifest {} is corrupted: {}", mPath, e.what());
+    return -1;
+  }
+
+  reset(std::move(url), totalSize);
+  setValidators(std::move(etag), std::move(lastModified));
+  setSegments(segments, segmentBytes);
+  for (auto &&[begin, end] : ranges) {
+    addRange(begin, end);
+  }
+  return 0;
+}
+
+int DownloadManifest::save() const {
+  nlohmann::json json;
+  json["url"] = mUrl;
+  json["size"] = mTotalSize;
+  json["etag"] = mEtag;
+  json["lastModified"] = mLastModified;
+  json["segments"] = mSegments;
+  json["segmentBytes"] = mSegmentBytes;
+  json["ranges"] = nlohmann::json::array();
+  for (auto &&[begin, end] : mRanges) {
+    json["ranges"].push_back({begin, end});
+  }
+
+  // synced before the rename, so a crash leaves the old manifest or the
+  // new one and never an empty file
+  std::string tmpPath = mPath + ".tmp";
+  std::string text = json.dump();
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (file == nullptr) {
+    logger.error("failed to write download manifest {}", tmpPath);
+    return -1;
+  }
+  bool written = fwrite(text.data(), 1, text.size(), file) == text.size() &&
+                 fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if (fclose(file) != 0 || !written) {
+    logger.error("failed to write download manifest {}", tmpPath);
+    return -1;
+  }
+  if (std::rename(tmpPath.c_str(), mPath.c_str()) != 0) {
+    logger.error("failed to rename download manifest {}", tmpPath);
+    return -1;
+  }
+  return 0;
+}
+
+void DownloadManifest::remove() const { unlink(mPath.c_str()); }
+
+void DownloadManifest::reset(std::string url, int64_t totalSize) {
+  mUrl = std::move(url);
+  mTotalSize = totalSize;
+  mEtag.clear();
+  mLastModified.clear();
+  mRanges.clear();
+  mSegments = 0;
+  mSegmentBytes = 0;
+}
+
+const std::string &DownloadManifest::getUrl() const { return mUrl; }
+
+int64_t DownloadManifest::getTotalSize() const { return mTotalSize; }
+
+void DownloadManifest::setValidators(std::string etag,
+                                     std::string lastModified) {
+  mEtag = std::move(etag);
+  mLastModified = std::move(lastModified);
+}
+
+const std::string &DownloadManifest::getEtag() const { return mEtag; }
+
+const std::string &DownloadManifest::getLastModified() const {
+  return mLastModified;
+}
+
+void DownloadManifest::addRange(int64_t begin, int64_t end) {
+  if (begin >= end) {
+    return;
+  }
+  auto iter = std::lower_bound(mRanges.begin(), mRanges.end(),
+                               Range{begin, end});
+  iter = mRanges.insert(iter, Range{begin, end});
+
+  // merge with the neighbours that overlap or touch
+  if (iter != mRanges.begin() && std::prev(iter)->second >= iter->first) {
+    --iter;
+    iter->second = std::max(iter->second, std::next(iter)->second);
+    mRanges.erase(std::next(iter));
+  }
+  while (std::next(iter) != mRanges.end() &&
+         std::next(iter)->first <= iter->second) {
+    iter->second = std::max(iter->second, std::next(iter)->second);
+    mRanges.erase(std::next(iter));
+  }
+}
+
+const std::vector<DownloadManifest::Range> &DownloadManifest::getRanges() const {
+  return mRanges;
+}
+
+std::vector<DownloadManifest::Range> DownloadManifest::missingRanges() const {
+  std::vector<Range> missing;
+  int64_t position = 0;
+  for (auto &&[begin, end] : mRanges) {
+    if (begin > position) {
+      missing.emplace_back(position, std::min(begin, mTotalSize));
+    }
+    position = std::max(position, end);
+  }
+  if (position < mTotalSize) {
+    missing.emplace_back(position, mTotalSize);
+  }
+  return missing;
+}
+
+int64_t DownloadManifest::completedBytes() const {
+  int64_t bytes = 0;
+  for (auto &&[begin, end] : mRanges) {
+    bytes += std::min(end, mTotalSize) - begin;
+  }
+  return bytes;
+}
+
+bool DownloadManifest::isComplete() const {
+  return mTotalSize > 0 && missingRanges().empty();
+}
+
+void DownloadManifest::setSegments(size_t count, int64_t bytes) {
+  mSegments = count;
+  mSegmentBytes = bytes;
+}
+
+size_t DownloadManifest::getSegments() const { return mSegments; }
+
+int64_t DownloadManifest::getSegmentBytes() const { return mSegmentBytes; }
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ted {
+
+/**
+ * Sidecar file recording how much of an interrupted download is already on
+ * disk. Byte downloads track completed [begin, end) ranges, HLS downloads
+ * track how many leading segments have been written.
+ */
+class DownloadManifest {
+public:
+  using Range = std::pair<int64_t, int64_t>;
+
+  explicit DownloadManifest(std::string path);
+
+  // 0 if a manifest was read, -1 if there is none or it is unreadable
+  int load();
+
+  // durable once it returns; callers sync the data a range refers to
+  // before recording it, or a crash could leave the manifest ahead of it
+  int save() const;
+
+  void remove() const;
+
+  // forget progress and start tracking url of totalSize bytes
+  void reset(std::string url, int64_t totalSize);
+
+  [[nodiscard]] const std::string &getUrl() const;
+
+  [[nodiscard]] int64_t getTotalSize() const;
+
+  // ETag and Last-Modified of the resource the ranges were fetched from,
+  // empty when the server sent none
+  void setValidators(std::string etag, std::string lastModified);
+
+  [[nodiscard]] const std::string &getEtag() const;
+
+  [[nodiscard]] const std::string &getLastModified() const;
+
+  void addRange(int64_t begin, int64_t end);
+
+  [[nodiscard]] const std::vector<Range> &getRanges() const;
+
+  [[nodiscard]] std::vector<Range> missingRanges() const;
+
+  [[nodiscard]] int64_t completedBytes() const;
+
+  [[nodiscard]] bool isComplete() const;
+
+  void setSegments(size_t count, int64_t bytes);
+
+  [[nodiscard]] size_t getSegments() const;
+
+  [[nodiscard]] int64_t getSegmentBytes() const;
+
+private:
+  std::string mPath;
+  std::string mUrl;
+  int64_t mTotalSize = 0;
+  std::string mEtag;
+  std::string mLastModified;
+  // sorted and merged
+  std::vector<Range> mRanges;
+  size_t mSegments = 0;
+  int64_t mSegmentBytes = 0;
+};
+
+} // namespace ted
@@ -0,0 +1,178 @@
+#include <thread>
+
+#include "DownloadService.h"
+#include "Utils.h"
+
+using ted::DownloadService;
+using ted::RateLimiter;
+
+void RateLimiter::setBytesPerSecond(int64_t rate) {
+  std::unique_lock lock(mMutex);
+  mRate = std::max<int64_t>(rate, 0);
+  mTokens = (double)mRate;
+  mLastRefill = std::chrono::steady_clock::now();
+}
+
+int64_t RateLimiter::getBytesPerSecond() const {
+  std::unique_lock lock(mMutex);
+  return mRate;
+}
+
+std::chrono::microseconds RateLimiter::consume(int64_t bytes) {
+  std::unique_lock lock(mMutex);
+  if (mRate <= 0) {
+    return std::chrono::microseconds(0);
+  }
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - mLastRefill;
+  mLastRefill = now;
+  // at most one second of burst
+  mTokens = std::min(mTokens + elapsed.count() * (double)mRate, (double)mRate);
+  mTokens -= (double)bytes;
+  if (mTokens >= 0) {
+    return std::chrono::microseconds(0);
+  }
+  return std::chrono::microseconds((int64_t)(-mTokens * 1e6 / (double)mRate));
+}
+
+DownloadService &DownloadService::instance() {
+  static DownloadService service;
+  return service;
+}
+
+DownloadService::DownloadService() {
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  mShare = curl_share_init();
+  curl_share_setopt(mShare, CURLSHOPT_LOCKFUNC, lockCallback);
+  curl_share_setopt(mShare, CURLSHOPT_UNLOCKFUNC, unlockCallback);
+  curl_share_setopt(mShare, CURLSHOPT_USERDATA, this);
+  curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+DownloadService::~DownloadService() {
+  for (auto *curl : mIdleHandles) {
+    curl_easy_cleanup(curl);
+  }
+  mHandleStates.clear();
+  curl_share_cleanup(mShare);
+}
+
+void DownloadService::lockCallback(CURL *, curl_lock_data data,
+                                   curl_lock_access, void *user) {
+  static_cast<DownloadService *>(user)->mShareLocks[data].lock();
+}
+
+void DownloadService::unlockCallback(CURL *, curl_lock_data data, void *user) {
+  static_cast<DownloadService *>(user)->mShareLocks[data].unlock();
+}
+
+int DownloadService::progressCallback(void *user, curl_off_t, curl_off_t dlnow,
+                                      curl_off_t, curl_off_t) {
+  auto *state = static_cast<HandleState *>(user);
+  // curl calls this at least once a second even on a stalled connection
+  if (state->cancel.cancelled()) {
+    return 1;
+  }
+  // dlnow restarts from zero when a handle is reused or redirected
+  curl_off_t received = std::max<curl_off_t>(dlnow - state->lastReceived, 0);
+  state->lastReceived = dlnow;
+  if (received > 0) {
+    auto pause = state->service->mRateLimiter.consume(received);
+    if (pause.count() > 0) {
+      // short naps keep curl responsive, the debt carries over
+      std::this_thread::sleep_for(
+          std::min(pause, std::chrono::microseconds(200000)));
+    }
+  }
+  return 0;
+}
+
+CURL *DownloadService::acquire(CancelToken cancel) {
+  CURL *curl = nullptr;
+  HandleState *state = nullptr;
+  {
+    std::unique_lock lock(mHandleMutex);
+    if (!mIdleHandles.empty()) {
+      curl = mIdleHandles.back();
+      mIdleHandles.pop_back();
+    }
+  }
+
+  if (curl == nullptr) {
+    curl = curl_easy_init();
+    if (curl == nullptr) {
+      return nullptr;
+    }
+  } else {
+    // drops options but keeps the handle's own caches
+    curl_easy_reset(curl);
+  }
+  {
+    std::unique_lock lock(mHandleMutex);
+    auto &slot = mHandleStates[curl];
+    if (slot == nullptr) {
+      slot = std::make_unique<HandleState>();
+      slot->service = this;
+    }
+    slot->lastReceived = 0;
+    slot->cancel = std::move(cancel);
+    state = slot.get();
+  }
+  curl_easy_setopt(curl, CURLOPT_SHARE, mShare);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  // every transfer reports progress so the global rate cap and
+  // cancellation apply
+  curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progressCallback);
+  curl_easy_setopt(curl, CURLOPT_XFERINFODATA, state);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  return curl;
+}
+
+void DownloadService::release(CURL *curl) {
+  if (curl == nullptr) {
+    return;
+  }
+  std::unique_lock lock(mHandleMutex);
+  if (mIdleHandles.size() < MAX_IDLE_HANDLES) {
+    // an idle handle must not keep the stop state of its last owner
+    mHandleStates[curl]->cancel = CancelToken();
+    mIdleHandles.push_back(curl);
+    return;
+  }
+  mHandleStates.erase(curl);
+  lock.unlock();
+  curl_easy_cleanup(curl);
+}
+
+void DownloadService::recordTransfer(CURL *curl) {
+  long connects = 0;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+  ++mTransfers;
+  if (connects == 0) {
+    ++mReusedConnections;
+  } else {
+    mNewConnections += connects;
+  }
+}
+
+DownloadService::Stats DownloadService::getStats() const {
+  return Stats{
+      .transfers = mTransfers.load(),
+      .newConnections = mNewConnections.load(),
+      .reusedConnections = mReusedConnections.load(),
+  };
+}
+
+void DownloadService::setMaxBytesPerSecond(int64_t rate) {
+  mRateLimiter.setBytesPerSecond(rate);
+  logger.info("download service: receive rate capped at {} bytes/s", rate);
+}
+
+void DownloadService::logStats() const {
+  auto stats = getStats();
+  logger.info("download service: {} transfers, {} new connections, {} reused",
+              stats.transfers, stats.newConnections, stats.reusedConnections);
+}
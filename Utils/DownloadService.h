@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "Cancellation.h"
+
+namespace ted {
+
+/**
+ * Token bucket shared by all transfers. Callers report received bytes and
+ * are put to sleep while the bucket is in debt, which stalls their socket
+ * reads and lets TCP flow control slow the sender.
+ */
+class RateLimiter {
+public:
+  // 0 disables limiting
+  void setBytesPerSecond(int64_t rate);
+
+  [[nodiscard]] int64_t getBytesPerSecond() const;
+
+  // account for bytes and return how long the caller should pause
+  std::chrono::microseconds consume(int64_t bytes);
+
+private:
+  mutable std::mutex mMutex;
+  int64_t mRate = 0;
+  double mTokens = 0;
+  std::chrono::steady_clock::time_point mLastRefill;
+};
+
+/**
+ * Process wide curl state. All transfers share one CURLSH holding the DNS
+ * cache, the connection pool and TLS sessions, and easy handles are recycled
+ * instead of being created per request, so the page, playlists and every
+ * segment of a talk ride on the same warm connections.
+ */
+class DownloadService {
+public:
+  struct Stats {
+    size_t transfers = 0;
+    size_t newConnections = 0;
+    size_t reusedConnections = 0;
+  };
+
+  static DownloadService &instance();
+
+  DownloadService(const DownloadService &) = delete;
+  DownloadService &operator=(const DownloadService &) = delete;
+
+  // a reset handle attached to the share, give it back with release; its
+  // transfers abort with CURLE_ABORTED_BY_CALLBACK once cancel is cancelled
+  CURL *acquire(CancelToken cancel = {});
+
+  void release(CURL *curl);
+
+  // count a finished transfer of curl towards the reuse statistics
+  void recordTransfer(CURL *curl);
+
+  [[nodiscard]] Stats getStats() const;
+
+  void logStats() const;
+
+  // cap the combined receive rate of every transfer, 0 for no cap
+  void setMaxBytesPerSecond(int64_t rate);
+
+private:
+  DownloadService();
+
+  ~DownloadService();
+
+  static constexpr size_t MAX_IDLE_HANDLES = 16;
+
+  static void lockCallback(CURL *curl, curl_lock_data data,
+                           curl_lock_access access, void *user);
+
+  static void unlockCallback(CURL *curl, curl_lock_data data, void *user);
+
+  struct HandleState {
+    DownloadService *service = nullptr;
+    curl_off_t lastReceived = 0;
+    CancelToken cancel;
+  };
+
+  static int progressCallback(void *user, curl_off_t dltotal, curl_off_t dlnow,
+                              curl_off_t ultotal, curl_off_t ulnow);
+
+  CURLSH *mShare = nullptr;
+  std::array<std::mutex, CURL_LOCK_DATA_LAST> mShareLocks;
+
+  std::mutex mHandleMutex;
+  std::vector<CURL *> mIdleHandles;
+  std::map<CURL *, std::unique_ptr<HandleState>> mHandleStates;
+
+  RateLimiter mRateLimiter;
+
+  std::atomic<size_t> mTransfers = 0;
+  std::atomic<size_t> mNewConnections = 0;
+  std::atomic<size_t> mReusedConnections = 0;
+};
+
+} // namespace ted
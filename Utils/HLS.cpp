@@ -1,8 +1,464 @@
-#include <sstream>
+#include <cstdio>
+#include <unistd.h>
 
+#include "DownloadManifest.h"
+#include "DownloadService.h"
 #include "HLS.h"
+#include "M3U8.h"
+#include "SingleFlight.h"
 
+using ted::CancelToken;
 using ted::FFmpegHLSDownloader;
+using ted::NativeHLSDownloader;
+
+namespace {
+// the audio entries of a CODECS list, "avc1.42c00d,mp4a.40.2" gives
+// "mp4a.40.2"
+std::string audioCodecs(std::string_view codecs) {
+  static constexpr std::string_view audioTypes[] = {
+      "mp4a", "ac-3", "ec-3", "ac-4", "Opus", "opus", "fLaC", "alac"};
+  std::string audio;
+  while (!codecs.empty()) {
+    size_t comma = codecs.find(',');
+    auto codec = ted::trim(codecs.substr(0, comma));
+    codecs.remove_prefix(comma == std::string_view::npos ? codecs.size()
+                                                         : comma + 1);
+    auto type = codec.substr(0, codec.find('.'));
+    if (std::find(std::begin(audioTypes), std::end(audioTypes), type) !=
+        std::end(audioTypes)) {
+      if (!audio.empty()) {
+        audio += ',';
+      }
+      audio += codec;
+    }
+  }
+  return audio;
+}
+} // namespace
+
+std::string ted::resolveUrl(const std::string &base, const std::string &uri) {
+  if (uri.find("://") != std::string::npos) {
+    return uri;
+  }
+  if (uri.starts_with('/')) {
+    size_t schemeEnd = base.find("://");
+    size_t hostEnd = base.find('/', schemeEnd == std::string::npos
+                                        ? 0
+                                        : schemeEnd + 3);
+    return base.substr(0, hostEnd) + uri;
+  }
+  std::string path = base.substr(0, base.find('?'));
+  return path.substr(0, path.find_last_of('/') + 1) + uri;
+}
+
+std::vector<ted::MediaSegment>
+ted::parseMediaPlayList(const std::string &content, const std::string &url) {
+  M3U8MediaPlaylist playList;
+  if (parseM3U8Media(content, playList) != 0) {
+    return {};
+  }
+
+  std::vector<MediaSegment> segments;
+  segments.reserve(playList.segments.size());
+  std::string_view currentMap;
+  for (auto &&segment : playList.segments) {
+    // emit the initialization section whenever it changes, so that the
+    // concatenated output stays decodable
+    if (!segment.mapUri.empty() && segment.mapUri != currentMap) {
+      MediaSegment init{.url = resolveUrl(url, std::string(segment.mapUri)),
+                        .duration = 0,
+                        .start = segment.start,
+                        .discontinuity = segment.discontinuity,
+                        .isInit = true};
+      if (segment.mapByteRange) {
+        init.rangeOffset = segment.mapByteRange->offset;
+        init.rangeLength = segment.mapByteRange->length;
+      }
+      segments.push_back(std::move(init));
+    }
+    currentMap = segment.mapUri;
+
+    MediaSegment media{.url = resolveUrl(url, std::string(segment.uri)),
+                       .duration = segment.duration,
+                       .start = segment.start,
+                       .discontinuity = segment.discontinuity,
+                       .isInit = false};
+    if (segment.byteRange) {
+      media.rangeOffset = segment.byteRange->offset;
+      media.rangeLength = segment.byteRange->length;
+    }
+    segments.push_back(std::move(media));
+  }
+
+  return segments;
+}
+
+NativeHLSDownloader::NativeHLSDownloader(std::string url, std::string localPath,
+                                         int parallelism)
+    : mUrl(std::move(url)), mLocalPath(std::move(localPath)),
+      mParallelism(std::max(parallelism, 1)) {}
+
+NativeHLSDownloader::NativeHLSDownloader(std::string url, DataSink sink,
+                                         int parallelism)
+    : mUrl(std::move(url)), mSink(std::move(sink)),
+      mParallelism(std::max(parallelism, 1)) {}
+
+NativeHLSDownloader::~NativeHLSDownloader() = default;
+
+void NativeHLSDownloader::setProgressCallback(ProgressCallback callback) {
+  mProgressCallback = std::move(callback);
+}
+
+std::string NativeHLSDownloader::partPath(const std::string &localPath) {
+  return localPath + ".part";
+}
+
+const std::vector<ted::MediaSegment> &NativeHLSDownloader::getSegments() const {
+  return mSegments;
+}
+
+void NativeHLSDownloader::setCancelToken(CancelToken token) {
+  mCancel = std::move(token);
+}
+
+bool ted::VariantFormat::compatible(const VariantFormat &other) const {
+  auto differs = [](const auto &a, const auto &b, const auto &unknown) {
+    return a != unknown && b != unknown && a != b;
+  };
+  return !differs(codecs, other.codecs, std::string()) &&
+         !differs(channels, other.channels, std::string()) &&
+         !differs(sampleRate, other.sampleRate, 0);
+}
+
+void NativeHLSDownloader::addVariant(std::string url, int bandwidth,
+                                     VariantFormat format) {
+  mVariants.push_back(Variant{.url = std::move(url),
+                              .bandwidth = bandwidth,
+                              .format = std::move(format),
+                              .segments = {}});
+}
+
+const std::vector<size_t> &NativeHLSDownloader::getSegmentVariants() const {
+  return mSegmentVariants;
+}
+
+int NativeHLSDownloader::fetchPlayList(const std::string &url,
+                                       std::vector<MediaSegment> &segments) {
+  auto playList = SingleFlight::instance().get(url, "", mCancel);
+  if (playList.cancelled) {
+    logger.info("NativeHLSDownloader cancelled fetching playlist {}", url);
+    return -1;
+  }
+  if (playList.status != 0) {
+    logger.error("NativeHLSDownloader failed to fetch playlist {}", url);
+    return -1;
+  }
+
+  segments = parseMediaPlayList(*playList.body, url);
+  if (segments.empty()) {
+    logger.error("NativeHLSDownloader found no segments in {}", url);
+    return -1;
+  }
+  return 0;
+}
+
+int NativeHLSDownloader::init() {
+  if (mVariants.empty()) {
+    if (fetchPlayList(mUrl, mSegments) != 0) {
+      return -1;
+    }
+    logger.info("NativeHLSDownloader got {} segments from {}",
+                mSegments.size(), mUrl);
+    return 0;
+  }
+
+  std::vector<Variant> usable;
+  for (auto &&variant : mVariants) {
+    if (fetchPlayList(variant.url, variant.segments) == 0) {
+      usable.push_back(std::move(variant));
+    }
+  }
+  if (usable.empty()) {
+    return -1;
+  }
+  std::stable_sort(usable.begin(), usable.end(),
+                   [](const Variant &a, const Variant &b) {
+                     return a.bandwidth < b.bandwidth;
+                   });
+
+  // switching is only possible between renditions with the same segments
+  // in the same format, the output is one stream with one set of codec
+  // parameters
+  size_t count = usable.front().segments.size();
+  VariantFormat format = usable.front().format;
+  std::erase_if(usable, [count, &format](const Variant &variant) {
+    if (variant.segments.size() != count) {
+      logger.error("NativeHLSDownloader drops unaligned variant {}",
+                   variant.url);
+      return true;
+    }
+    if (!variant.format.compatible(format)) {
+      logger.error("NativeHLSDownloader drops variant {} in another format, "
+                   "{} {} {} Hz",
+                   variant.url, variant.format.codecs, variant.format.channels,
+                   variant.format.sampleRate);
+      return true;
+    }
+    return false;
+  });
+  mVariants = std::move(usable);
+  mSegments = mVariants.front().segments;
+
+  logger.info("NativeHLSDownloader got {} segments in {} variants from {}",
+              mSegments.size(), mVariants.size(), mUrl);
+  return 0;
+}
+
+namespace {
+struct SegmentTransfer {
+  size_t index = 0;
+  CURL *curl = nullptr;
+  std::string data;
+  int attempts = 0;
+  bool done = false;
+};
+
+size_t writeSegmentCallback(void *contents, size_t size, size_t nmemb,
+                            void *user) {
+  auto *transfer = static_cast<SegmentTransfer *>(user);
+  transfer->data.append(static_cast<char *>(contents), size * nmemb);
+  return size * nmemb;
+}
+} // namespace
+
+int NativeHLSDownloader::download() {
+  if (mSegments.empty()) {
+    logger.error("NativeHLSDownloader is not initialized {}", mUrl);
+    return -1;
+  }
+
+  size_t total = mSegments.size();
+  size_t nextToWrite = 0;
+  int64_t bytesWritten = 0;
+
+  // write aside and rename, a partial file must never look like a cache hit;
+  // the manifest records how many leading segments the part file holds
+  std::string partPath = NativeHLSDownloader::partPath(mLocalPath);
+  DownloadManifest manifest(partPath + ".manifest");
+  FILE *file = nullptr;
+  if (mSink == nullptr) {
+    // for hls the manifest size is the number of segments
+    bool resumed = manifest.load() == 0 && manifest.getUrl() == mUrl &&
+                   manifest.getTotalSize() == (int64_t)total &&
+                   access(partPath.c_str(), F_OK) == 0;
+    if (resumed) {
+      file = fopen(partPath.c_str(), "r+b");
+      if (file != nullptr &&
+          (ftruncate(fileno(file), manifest.getSegmentBytes()) != 0 ||
+           fseeko(file, manifest.getSegmentBytes(), SEEK_SET) != 0)) {
+        fclose(file);
+        file = nullptr;
+      }
+    }
+    if (file != nullptr) {
+      nextToWrite = manifest.getSegments();
+      bytesWritten = manifest.getSegmentBytes();
+      logger.info("NativeHLSDownloader resuming {} at segment {}/{}", mUrl,
+                  nextToWrite, total);
+    } else {
+      manifest.reset(mUrl, (int64_t)total);
+      file = fopen(partPath.c_str(), "wb");
+    }
+    if (file == nullptr) {
+      logger.error("NativeHLSDownloader failed to open {}", partPath);
+      return -1;
+    }
+    if (nextToWrite > 0 && mProgressCallback) {
+      mProgressCallback(nextToWrite, total, bytesWritten);
+    }
+  }
+
+  CURLM *multi = curl_multi_init();
+  curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)mParallelism);
+
+  std::vector<SegmentTransfer> transfers(total);
+  // bound the number of finished segments held in memory out of order
+  size_t window = mParallelism * 2;
+  size_t nextToStart = nextToWrite;
+  int active = 0;
+  bool failed = false;
+
+  std::vector<int> bandwidths;
+  for (auto &&variant : mVariants) {
+    bandwidths.push_back(variant.bandwidth);
+  }
+  VariantSelector selector(bandwidths);
+  ThroughputEstimator throughput;
+  mSegmentVariants.assign(total, 0);
+
+  auto start = [&](SegmentTransfer &transfer) {
+    if (transfer.curl == nullptr) {
+      transfer.curl = DownloadService::instance().acquire(mCancel);
+    }
+    transfer.data.clear();
+    ++transfer.attempts;
+
+    const MediaSegment *segment = &mSegments[transfer.index];
+    if (!mVariants.empty()) {
+      size_t variant = selector.select(transfer.index, throughput);
+      if (transfer.index > 0 &&
+          variant != mSegmentVariants[transfer.index - 1]) {
+        logger.info("NativeHLSDownloader switches to {} bps at segment {}, "
+                    "measured {:.0f} bps",
+                    mVariants[variant].bandwidth, transfer.index,
+                    throughput.bitsPerSecond());
+      }
+      mSegmentVariants[transfer.index] = variant;
+      segment = &mVariants[variant].segments[transfer.index];
+    }
+    curl_easy_setopt(transfer.curl, CURLOPT_URL, segment->url.c_str());
+    std::string range;
+    if (segment->rangeLength >= 0) {
+      range = std::to_string(segment->rangeOffset) + "-" +
+              std::to_string(segment->rangeOffset + segment->rangeLength - 1);
+    }
+    curl_easy_setopt(transfer.curl, CURLOPT_RANGE,
+                     range.empty() ? nullptr : range.c_str());
+    curl_easy_setopt(transfer.curl, CURLOPT_WRITEFUNCTION,
+                     writeSegmentCallback);
+    curl_easy_setopt(transfer.curl, CURLOPT_WRITEDATA, &transfer);
+    curl_easy_setopt(transfer.curl, CURLOPT_PRIVATE, &transfer);
+    curl_easy_setopt(transfer.curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(transfer.curl, CURLOPT_FAILONERROR, 1L);
+    curl_multi_add_handle(multi, transfer.curl);
+    ++active;
+  };
+
+  auto finish = [&](SegmentTransfer &transfer) {
+    curl_multi_remove_handle(multi, transfer.curl);
+    DownloadService::instance().release(transfer.curl);
+    transfer.curl = nullptr;
+    --active;
+  };
+
+  while (nextToWrite < total && !failed) {
+    if (mCancel.cancelled()) {
+      failed = true;
+      break;
+    }
+    while (active < mParallelism && nextToStart < total &&
+           nextToStart < nextToWrite + window) {
+      transfers[nextToStart].index = nextToStart;
+      start(transfers[nextToStart]);
+      ++nextToStart;
+    }
+
+    int running = 0;
+    curl_multi_perform(multi, &running);
+
+    CURLMsg *msg;
+    int left;
+    while ((msg = curl_multi_info_read(multi, &left)) != nullptr) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      SegmentTransfer *transfer = nullptr;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+      CURLcode result = msg->data.result;
+      DownloadService::instance().recordTransfer(transfer->curl);
+
+      if (result == CURLE_OK) {
+        // parallel transfers split the link, scale to the aggregate rate
+        curl_off_t bytes = 0, timeUs = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+        curl_easy_getinfo(transfer->curl, CURLINFO_TOTAL_TIME_T, &timeUs);
+        throughput.addSample(bytes * active, (double)timeUs / 1e6);
+        finish(*transfer);
+        transfer->done = true;
+      } else if (mCancel.cancelled()) {
+        finish(*transfer);
+        failed = true;
+      } else if (transfer->attempts < MAX_SEGMENT_ATTEMPTS) {
+        logger.error("NativeHLSDownloader segment {} failed: {}, retrying",
+                     transfer->index, curl_easy_strerror(result));
+        curl_multi_remove_handle(multi, transfer->curl);
+        --active;
+        start(*transfer);
+      } else {
+        logger.error("NativeHLSDownloader segment {} failed: {}",
+                     transfer->index, curl_easy_strerror(result));
+        finish(*transfer);
+        failed = true;
+      }
+    }
+
+    while (nextToWrite < total && transfers[nextToWrite].done) {
+      auto &data = transfers[nextToWrite].data;
+      bool written = file != nullptr
+                         ? fwrite(data.data(), 1, data.size(), file) ==
+                               data.size()
+                         : mSink(data.data(), data.size());
+      if (!written) {
+        logger.error("NativeHLSDownloader failed to write segment {}",
+                     nextToWrite);
+        failed = true;
+        break;
+      }
+      bytesWritten += (int64_t)data.size();
+      std::string().swap(data);
+      ++nextToWrite;
+      if (file != nullptr) {
+        // flush and sync before recording, so readers of the partial file
+        // see the bytes being reported and a crash cannot leave the
+        // manifest ahead of the file
+        fflush(file);
+        fdatasync(fileno(file));
+        manifest.setSegments(nextToWrite, bytesWritten);
+        manifest.save();
+      }
+      if (mProgressCallback) {
+        mProgressCallback(nextToWrite, total, bytesWritten);
+      }
+    }
+
+    if (nextToWrite < total && !failed) {
+      curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+  }
+
+  for (auto &&transfer : transfers) {
+    if (transfer.curl != nullptr) {
+      finish(transfer);
+    }
+  }
+  curl_multi_cleanup(multi);
+  if (file != nullptr) {
+    fclose(file);
+  }
+
+  if (failed) {
+    if (mCancel.cancelled()) {
+      logger.info("NativeHLSDownloader cancelled at segment {}/{}",
+                  nextToWrite, total);
+    }
+    // the part file and manifest stay for the next attempt
+    return -1;
+  }
+  if (file == nullptr) {
+    logger.info("NativeHLSDownloader streamed {} segments, {} bytes",
+                total, bytesWritten);
+    return 0;
+  }
+  if (std::rename(partPath.c_str(), mLocalPath.c_str()) != 0) {
+    logger.error("NativeHLSDownloader failed to rename {}", partPath);
+    return -1;
+  }
+  manifest.remove();
+
+  logger.info("NativeHLSDownloader downloaded {} segments, {} bytes to {}",
+              total, bytesWritten, mLocalPath);
+  return 0;
+}
 
 FFmpegHLSDownloader::FFmpegHLSDownloader(std::string url, std::string localPath)
     : mUrl(std::move(url)), mLocalPath(std::move(localPath)) {}
@@ -31,99 +487,61 @@ using ted::HLSParser;
 
 HLSParser::HLSParser(std::string url) : mUrl(std::move(url)) {}
 
-static std::string_view removeQuotes(std::string_view str) {
-  if (str.starts_with('\"')) {
-    str.remove_prefix(1);
+int HLSParser::init() {
+  auto response = SingleFlight::instance().get(mUrl, "", mCancel);
+  if (response.cancelled) {
+    logger.info("cancelled fetching playlist {}", mUrl);
+    return -1;
   }
-  if (str.ends_with('\"')) {
-    str.remove_suffix(1);
+  if (response.status != 0) {
+    logger.error("failed to fetch playlist {}", mUrl);
+    return -1;
   }
-  return str;
-}
+  mPlayList = *response.body;
 
-int HLSParser::init() {
-  SimpleDownloader downloader(mUrl, &mPlayList);
-
-  int ret;
-  ret = downloader.init();
-  assert(ret == 0);
-  ret = downloader.download();
-  assert(ret == 0);
-
-  std::string urlBase = mUrl.substr(0, mUrl.find_last_of('/') + 1);
-  std::string_view streamTag = "#EXT-X-STREAM-INF";
-  std::string_view mediaTag = "#EXT-X-MEDIA";
-
-  std::stringstream ss(mPlayList);
-  std::string line;
-  while (std::getline(ss, line)) {
-    if (line.find(streamTag) != std::string::npos) {
-      PlayListItem item;
-      std::string url;
-      std::getline(ss, url);
-      size_t index = streamTag.size();
-      do {
-        size_t equalIndex = line.find('=', index);
-        if (equalIndex == std::string::npos) {
-          break;
-        }
-        size_t commaIndex = line.find(',', equalIndex);
-        if (commaIndex == std::string::npos) {
-          break;
-        }
-        std::string key = line.substr(index, equalIndex - index);
-        std::string value =
-            line.substr(equalIndex + 1, commaIndex - equalIndex - 1);
-        if (key == "CODECS") {
-          item.codec = value;
-        } else if (key == "BANDWIDTH") {
-          item.bandwidth = std::stoi(value);
-        } else if (key == "FRAME-RATE") {
-          item.framerate = std::stod(value);
-        } else if (key == "RESOLUTION") {
-          size_t xIndex = value.find('x');
-          if (xIndex != std::string::npos) {
-            item.width = std::stoi(value.substr(0, xIndex));
-            item.height = std::stoi(value.substr(xIndex + 1));
-          }
-        }
-        index = commaIndex + 1;
-      } while (true);
-      item.url = urlBase + url;
-      mPlayListItems.push_back(item);
-    } else if (line.find(mediaTag) != std::string::npos) {
-      PlayListItemAudio item;
-      size_t index = mediaTag.size();
-      do {
-        size_t equalIndex = line.find('=', index);
-        if (equalIndex == std::string::npos) {
-          break;
-        }
-        size_t commaIndex = line.find(',', equalIndex);
-        if (commaIndex == std::string::npos) {
-          break;
-        }
-        std::string key = line.substr(index, equalIndex - index);
-        std::string value =
-            line.substr(equalIndex + 1, commaIndex - equalIndex - 2);
-        if (key == "TYPE") {
-          auto type = trim(value);
-          if (type != "AUDIO") {
-            break;
-          }
-        }
-        if (key == "URI") {
-          item.url = urlBase + std::string(removeQuotes(trim(value)));
-        } else if (key == "NAME") {
-          item.name = std::string(removeQuotes(trim(value)));
-        }
-        index = commaIndex + 1;
-      } while (true);
-      if (item.url.empty()) {
-        continue;
+  M3U8MasterPlaylist playList;
+  if (parseM3U8Master(mPlayList, playList) != 0) {
+    logger.error("{} is not a playlist", mUrl);
+    return -1;
+  }
+
+  for (auto &&variant : playList.variants) {
+    mPlayListItems.push_back(PlayListItem{
+        .url = resolveUrl(mUrl, std::string(variant.uri)),
+        .codec = std::string(variant.codecs),
+        .bandwidth = (int)variant.bandwidth,
+        .framerate = variant.frameRate,
+        .width = variant.width,
+        .height = variant.height,
+    });
+  }
+
+  for (auto &&rendition : playList.renditions) {
+    if (rendition.type != "AUDIO" || rendition.uri.empty()) {
+      continue;
+    }
+    PlayListItemAudio item{
+        .url = resolveUrl(mUrl, std::string(rendition.uri)),
+        .name = std::string(rendition.name),
+        .groupId = std::string(rendition.groupId),
+        .bandwidth = (int)rendition.bandwidth,
+        .codecs = {},
+        .channels = std::string(rendition.channels),
+        .sampleRate = (int)rendition.sampleRate,
+    };
+    // renditions rarely declare a bandwidth, take the cheapest stream that
+    // references their group as an upper bound
+    for (auto &&variant : playList.variants) {
+      if (rendition.bandwidth == 0 && variant.audioGroup == rendition.groupId &&
+          variant.bandwidth > 0 &&
+          (item.bandwidth == 0 || variant.bandwidth < item.bandwidth)) {
+        item.bandwidth = (int)variant.bandwidth;
+      }
+      if (item.codecs.empty() && variant.audioGroup == rendition.groupId) {
+        item.codecs = audioCodecs(variant.codecs);
       }
-      mAudioPlayListItems.push_back(item);
     }
+    mAudioPlayListItems.push_back(std::move(item));
   }
 
   logger.info("got {} streams from {}", mPlayListItems.size(), mUrl);
@@ -135,24 +553,30 @@ std::vector<ted::PlayListItem> HLSParser::getPlayList() const {
   return mPlayListItems;
 }
 
+void HLSParser::setCancelToken(CancelToken token) {
+  mCancel = std::move(token);
+}
+
 std::vector<ted::PlayListItemAudio> HLSParser::getAudioPlayList() const {
   return mAudioPlayListItems;
 }
 
 int HLSParser::downloadPlayListIndex(size_t index, std::string localPath) {
   auto &item = mPlayListItems[index];
-  FFmpegHLSDownloader downloader(item.url, localPath);
-
-  int ret = downloader.init();
-  assert(ret == 0);
-  ret = downloader.download();
-  assert(ret == 0);
+  NativeHLSDownloader downloader(item.url, localPath);
+  downloader.setCancelToken(mCancel);
+  if (downloader.init() != 0 || downloader.download() != 0) {
+    logger.error("failed to download {}", item.url);
+    return -1;
+  }
   logger.info("download {} to {}", item.url, localPath);
 
   return 0;
 }
 
-int HLSParser::downloadAudioByName(std::string name, std::string localPath) {
+int HLSParser::downloadAudioByName(
+    std::string name, std::string localPath,
+    std::function<void(size_t, size_t, int64_t)> progress) {
   auto iter = std::find_if(
       mAudioPlayListItems.begin(), mAudioPlayListItems.end(),
       [&name](const PlayListItemAudio &item) { return item.name == name; });
@@ -160,12 +584,52 @@ int HLSParser::downloadAudioByName(std::string name, std::string localPath) {
     throw std::runtime_error("no such audio name");
   }
 
-  FFmpegHLSDownloader downloader(iter->url, localPath);
-  int ret = downloader.init();
-  assert(ret == 0);
-  ret = downloader.download();
-  assert(ret == 0);
+  NativeHLSDownloader downloader(iter->url, localPath);
+  downloader.setCancelToken(mCancel);
+  downloader.setProgressCallback(std::move(progress));
+  if (downloader.init() != 0 || downloader.download() != 0) {
+    logger.error("failed to download {}", iter->url);
+    return -1;
+  }
   logger.info("download {} to {}", iter->url, localPath);
 
   return 0;
 }
+
+int HLSParser::downloadAudioAdaptive(
+    std::string localPath, std::string fallbackName,
+    std::function<void(size_t, size_t, int64_t)> progress) {
+  std::vector<const PlayListItemAudio *> candidates;
+  std::vector<int> seenBandwidths;
+  for (auto &&item : mAudioPlayListItems) {
+    if (item.bandwidth > 0 &&
+        std::find(seenBandwidths.begin(), seenBandwidths.end(),
+                  item.bandwidth) == seenBandwidths.end()) {
+      candidates.push_back(&item);
+      seenBandwidths.push_back(item.bandwidth);
+    }
+  }
+  if (candidates.size() < 2) {
+    logger.info("no distinct audio bandwidths in {}, using {}", mUrl,
+                fallbackName);
+    return downloadAudioByName(std::move(fallbackName), std::move(localPath),
+                               std::move(progress));
+  }
+
+  NativeHLSDownloader downloader(mUrl, localPath);
+  for (auto *item : candidates) {
+    downloader.addVariant(item->url, item->bandwidth,
+                          {.codecs = item->codecs,
+                           .channels = item->channels,
+                           .sampleRate = item->sampleRate});
+  }
+  downloader.setCancelToken(mCancel);
+  downloader.setProgressCallback(std::move(progress));
+  if (downloader.init() != 0 || downloader.download() != 0) {
+    logger.error("failed to download audio of {}", mUrl);
+    return -1;
+  }
+  logger.info("download adaptive audio of {} to {}", mUrl, localPath);
+
+  return 0;
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <functional>
+
 #include "Utils/Utils.h"
+#include "Utils/VariantSelector.h"
 
 namespace ted {
 
@@ -16,6 +19,13 @@ struct PlayListItem {
 struct PlayListItemAudio {
   std::string url;
   std::string name;
+  std::string groupId;
+  // declared on the rendition or taken from the cheapest stream using it
+  int bandwidth = 0;
+  // audio entries of the CODECS of the streams using the group
+  std::string codecs;
+  std::string channels;
+  int sampleRate = 0;
 };
 
 class HLSParser {
@@ -24,19 +34,129 @@ public:
 
   int init();
 
+  // applies to the playlist fetch of init() and is passed on to the
+  // segment downloads started by this parser
+  void setCancelToken(CancelToken token);
+
   [[nodiscard]] std::vector<PlayListItem> getPlayList() const;
 
   [[nodiscard]] std::vector<PlayListItemAudio> getAudioPlayList() const;
 
   int downloadPlayListIndex(size_t index, std::string localPath);
 
-  int downloadAudioByName(std::string name, std::string localPath);
+  int downloadAudioByName(
+      std::string name, std::string localPath,
+      std::function<void(size_t, size_t, int64_t)> progress = nullptr);
+
+  // switch between the audio renditions by measured throughput, falls back
+  // to fallbackName when bandwidths are not declared
+  int downloadAudioAdaptive(
+      std::string localPath, std::string fallbackName = "medium",
+      std::function<void(size_t, size_t, int64_t)> progress = nullptr);
 
 private:
   std::string mUrl;
   std::string mPlayList;
   std::vector<PlayListItem> mPlayListItems;
   std::vector<PlayListItemAudio> mAudioPlayListItems;
+  CancelToken mCancel;
+};
+
+struct MediaSegment {
+  std::string url;
+  double duration = 0;
+  // seconds from the start of the playlist
+  double start = 0;
+  // sub-range of url to fetch, whole resource when rangeLength < 0
+  int64_t rangeOffset = 0;
+  int64_t rangeLength = -1;
+  uint32_t discontinuity = 0;
+  // EXT-X-MAP initialization section preceding the following segments
+  bool isInit = false;
+};
+
+// what the segments of a variant decode to, empty fields are unknown
+struct VariantFormat {
+  std::string codecs;
+  std::string channels;
+  int sampleRate = 0;
+
+  // true unless a field known on both sides differs
+  [[nodiscard]] bool compatible(const VariantFormat &other) const;
+};
+
+// resolve a playlist uri against the url of the playlist referencing it
+std::string resolveUrl(const std::string &base, const std::string &uri);
+
+std::vector<MediaSegment> parseMediaPlayList(const std::string &content,
+                                             const std::string &url);
+
+/**
+ * Downloads every segment of an HLS media playlist in-process. Segments are
+ * fetched concurrently over one curl multi handle and written to the output
+ * in playlist order, so the result is the plain concatenation of segments.
+ * Data goes to partPath(localPath) first and is renamed once complete; the
+ * progress callback runs after each segment is flushed to that file.
+ */
+class NativeHLSDownloader {
+public:
+  // segments finished, total segments, bytes written
+  using ProgressCallback = std::function<void(size_t, size_t, int64_t)>;
+
+  NativeHLSDownloader(std::string url, std::string localPath,
+                      int parallelism = 4);
+
+  // deliver the ordered segment bytes to sink instead of a file
+  NativeHLSDownloader(std::string url, DataSink sink, int parallelism = 4);
+
+  ~NativeHLSDownloader();
+
+  void setProgressCallback(ProgressCallback callback);
+
+  // stop fetching playlists and segments once token is cancelled,
+  // download() then fails and keeps the part file for a later resume
+  void setCancelToken(CancelToken token);
+
+  // download from several aligned renditions, picking one per segment by
+  // throughput; the url given to the constructor only names the download.
+  // Only variants in the format of the cheapest one are used, segments of
+  // different codecs or layouts cannot be concatenated
+  void addVariant(std::string url, int bandwidth, VariantFormat format = {});
+
+  // variant index used for each written segment, for diagnostics
+  [[nodiscard]] const std::vector<size_t> &getSegmentVariants() const;
+
+  static std::string partPath(const std::string &localPath);
+
+  // download and parse the media playlist
+  int init();
+
+  int download();
+
+  [[nodiscard]] const std::vector<MediaSegment> &getSegments() const;
+
+private:
+  static constexpr int MAX_SEGMENT_ATTEMPTS = 3;
+
+  std::string mUrl;
+  std::string mLocalPath;
+  DataSink mSink;
+  int mParallelism;
+
+  struct Variant {
+    std::string url;
+    int bandwidth = 0;
+    VariantFormat format;
+    std::vector<MediaSegment> segments;
+  };
+
+  int fetchPlayList(const std::string &url, std::vector<MediaSegment> &segments);
+
+  std::vector<MediaSegment> mSegments;
+  std::vector<Variant> mVariants;
+  std::vector<size_t> mSegmentVariants;
+  ProgressCallback mProgressCallback;
+  CancelToken mCancel;
 };
 
 class FFmpegHLSDownloader {
@@ -0,0 +1,133 @@
+#include <cstring>
+
+#include "Hash.h"
+
+using ted::Xxh64;
+
+static constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr uint64_t Prime3 = 0x165667B19E3779F9ULL;
+static constexpr uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// the specification reads little-endian words
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t round(uint64_t acc, uint64_t input) {
+  acc += input * Prime2;
+  acc = rotl(acc, 31);
+  return acc * Prime1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t value) {
+  acc ^= round(0, value);
+  return acc * Prime1 + Prime4;
+}
+
+Xxh64::Xxh64(uint64_t seed)
+    : mSeed(seed), mAcc{seed + Prime1 + Prime2, seed + Prime2, seed,
+                        seed - Prime1},
+      mBuffer{} {}
+
+void Xxh64::update(const void *data, size_t size) {
+  auto *p = static_cast<const unsigned char *>(data);
+  mTotal += size;
+
+  if (mBuffered + size < sizeof(mBuffer)) {
+    memcpy(mBuffer + mBuffered, p, size);
+    mBuffered += size;
+    return;
+  }
+
+  if (mBuffered > 0) {
+    size_t fill = sizeof(mBuffer) - mBuffered;
+    memcpy(mBuffer + mBuffered, p, fill);
+    for (int i = 0; i < 4; ++i) {
+      mAcc[i] = round(mAcc[i], read64(mBuffer + i * 8));
+    }
+    p += fill;
+    size -= fill;
+    mBuffered = 0;
+  }
+
+  for (; size >= 32; p += 32, size -= 32) {
+    for (int i = 0; i < 4; ++i) {
+      mAcc[i] = round(mAcc[i], read64(p + i * 8));
+    }
+  }
+
+  memcpy(mBuffer, p, size);
+  mBuffered = size;
+}
+
+uint64_t Xxh64::digest() const {
+  uint64_t hash;
+  if (mTotal >= 32) {
+    hash = rotl(mAcc[0], 1) + rotl(mAcc[1], 7) + rotl(mAcc[2], 12) +
+           rotl(mAcc[3], 18);
+    for (uint64_t acc : mAcc) {
+      hash = mergeRound(hash, acc);
+    }
+  } else {
+    hash = mSeed + Prime5;
+  }
+  hash += mTotal;
+
+  const unsigned char *p = mBuffer;
+  size_t size = mBuffered;
+  for (; size >= 8; p += 8, size -= 8) {
+    hash ^= round(0, read64(p));
+    hash = rotl(hash, 27) * Prime1 + Prime4;
+  }
+  if (size >= 4) {
+    hash ^= (uint64_t)read32(p) * Prime1;
+    hash = rotl(hash, 23) * Prime2 + Prime3;
+    p += 4;
+    size -= 4;
+  }
+  for (; size > 0; ++p, --size) {
+    hash ^= (*p) * Prime5;
+    hash = rotl(hash, 11) * Prime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= Prime2;
+  hash ^= hash >> 29;
+  hash *= Prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+uint64_t ted::xxh64(const void *data, size_t size, uint64_t seed) {
+  Xxh64 hash(seed);
+  hash.update(data, size);
+  return hash.digest();
+}
+
+uint64_t ted::xxh64(std::string_view data, uint64_t seed) {
+  return xxh64(data.data(), data.size(), seed);
+}
+
+std::string ted::toHex(uint64_t value) {
+  static const char *digits = "0123456789abcdef";
+  std::string hex(16, '0');
+  for (int i = 15; i >= 0; --i, value >>= 4) {
+    hex[i] = digits[value & 0xf];
+  }
+  return hex;
+}
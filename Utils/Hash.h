@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace ted {
+
+/**
+ * XXH64, a fast non-cryptographic hash whose output is fixed by its
+ * specification. Unlike std::hash it is safe to persist: names and
+ * checksums derived from it stay valid across compilers and builds.
+ */
+class Xxh64 {
+public:
+  explicit Xxh64(uint64_t seed = 0);
+
+  void update(const void *data, size_t size);
+
+  void update(std::string_view data) { update(data.data(), data.size()); }
+
+  // hash of everything passed to update so far, the state is kept
+  [[nodiscard]] uint64_t digest() const;
+
+private:
+  uint64_t mSeed;
+  uint64_t mAcc[4];
+  uint64_t mTotal = 0;
+  unsigned char mBuffer[32];
+  size_t mBuffered = 0;
+};
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed = 0);
+
+uint64_t xxh64(std::string_view data, uint64_t seed = 0);
+
+// 16 lower-case hex digits
+std::string toHex(uint64_t value);
+
+} // namespace ted
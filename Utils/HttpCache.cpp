@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#include "HttpCache.h"
+#include "Utils.h"
+
+using ted::CancelToken;
+using ted::FetchResult;
+
+static bool readFile(const std::string &path, std::string &content) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::stringstream ss;
+  ss << file.rdbuf();
+  content = ss.str();
+  return true;
+}
+
+static bool writeFileAtomic(const std::string &path,
+                            const std::string &content) {
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::binary);
+    if (!file || !file.write(content.data(), (std::streamsize)content.size())) {
+      unlink(tmp.c_str());
+      return false;
+    }
+  }
+  return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// a validator stored in meta, empty when missing or not a string
+static std::string validator(const nlohmann::json &meta,
+                             const std::string &key) {
+  auto it = meta.find(key);
+  if (it == meta.end() || !it->is_string()) {
+    return "";
+  }
+  return it->get<std::string>();
+}
+
+FetchResult ted::fetchRevalidated(const std::string &url,
+                                  const std::string &cacheFile,
+                                  std::string &body,
+                                  const CancelToken &cancel) {
+  std::string metaFile = cacheFile + ".meta";
+
+  // validators only count if the body they describe is still there
+  std::string cached;
+  auto meta = nlohmann::json::object();
+  bool haveCopy = readFile(cacheFile, cached);
+  if (haveCopy) {
+    std::string metaContent;
+    if (readFile(metaFile, metaContent)) {
+      meta = nlohmann::json::parse(metaContent, nullptr, false);
+    }
+    if (!meta.is_object() || validator(meta, "url") != url) {
+      meta = nlohmann::json::object();
+    }
+  }
+
+  std::string fresh;
+  SimpleDownloader downloader(url, &fresh);
+  downloader.setCancelToken(cancel);
+  if (downloader.init() != 0) {
+    return FetchResult::Failed;
+  }
+  if (auto etag = validator(meta, "etag"); !etag.empty()) {
+    downloader.addHeader("If-None-Match: " + etag);
+  }
+  if (auto lastModified = validator(meta, "lastModified");
+      !lastModified.empty()) {
+    downloader.addHeader("If-Modified-Since: " + lastModified);
+  }
+
+  if (downloader.download() != 0) {
+    if (haveCopy) {
+      logger.error("failed to revalidate {}, using the cached copy", url);
+      body = std::move(cached);
+      return FetchResult::NotModified;
+    }
+    return FetchResult::Failed;
+  }
+
+  if (downloader.getResponseCode() == 304 && haveCopy) {
+    logger.info("{} not modified", url);
+    body = std::move(cached);
+    return FetchResult::NotModified;
+  }
+
+  if (!writeFileAtomic(cacheFile, fresh)) {
+    logger.error("failed to cache {} in {}", url, cacheFile);
+  } else {
+    nlohmann::json updated;
+    updated["url"] = url;
+    updated["etag"] = downloader.getResponseHeader("ETag");
+    updated["lastModified"] = downloader.getResponseHeader("Last-Modified");
+    writeFileAtomic(metaFile, updated.dump());
+  }
+  body = std::move(fresh);
+  return FetchResult::Updated;
+}
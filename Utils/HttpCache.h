@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+#include "Cancellation.h"
+
+namespace ted {
+
+enum class FetchResult {
+  Failed,
+  // the body was downloaded and cacheFile updated
+  Updated,
+  // the server answered 304 or was unreachable, body is the cached copy
+  NotModified,
+};
+
+/**
+ * Fetch url into body, keeping a copy in cacheFile and its ETag and
+ * Last-Modified in cacheFile.meta. When a copy exists the request carries
+ * If-None-Match / If-Modified-Since, so an unchanged resource costs a 304
+ * instead of the full transfer. A request cancelled by cancel, e.g. past
+ * its deadline, falls back to the cached copy like an unreachable server.
+ */
+FetchResult fetchRevalidated(const std::string &url,
+                             const std::string &cacheFile, std::string &body,
+                             const CancelToken &cancel = {});
+
+} // namespace ted
@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <charconv>
+
+#include "M3U8.h"
+#include "Utils.h"
+
+using ted::M3U8AttributeList;
+
+namespace {
+template <typename T> bool parseNumber(std::string_view str, T &value) {
+  str = ted::trim(str);
+  auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  return ec == std::errc() && ptr == str.data() + str.size();
+}
+
+// "<length>[@<offset>]", offset defaults to the end of the previous range
+bool parseByteRange(std::string_view str, int64_t nextOffset,
+                    ted::M3U8ByteRange &range) {
+  size_t at = str.find('@');
+  range.offset = nextOffset;
+  if (at != std::string_view::npos &&
+      !parseNumber(str.substr(at + 1), range.offset)) {
+    return false;
+  }
+  return parseNumber(str.substr(0, at), range.length);
+}
+
+// calls onLine for every non-empty line with surrounding whitespace removed
+template <typename F> void forEachLine(std::string_view content, F &&onLine) {
+  while (!content.empty()) {
+    size_t end = content.find('\n');
+    auto line = ted::trim(content.substr(0, end));
+    if (!line.empty()) {
+      onLine(line);
+    }
+    if (end == std::string_view::npos) {
+      break;
+    }
+    content.remove_prefix(end + 1);
+  }
+}
+
+bool isPlaylist(std::string_view content) {
+  return ted::trim(content).starts_with("#EXTM3U");
+}
+
+// attributes following "<tag>:" on line
+M3U8AttributeList attributesOf(std::string_view line, std::string_view tag) {
+  return M3U8AttributeList(line.substr(std::min(tag.size() + 1, line.size())));
+}
+} // namespace
+
+M3U8AttributeList::M3U8AttributeList(std::string_view list) {
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t equal = list.find('=', pos);
+    if (equal == std::string_view::npos) {
+      break;
+    }
+    auto key = ted::trim(list.substr(pos, equal - pos));
+
+    std::string_view value;
+    size_t next;
+    if (equal + 1 < list.size() && list[equal + 1] == '"') {
+      size_t close = list.find('"', equal + 2);
+      if (close == std::string_view::npos) {
+        close = list.size();
+      }
+      value = list.substr(equal + 2, close - equal - 2);
+      next = list.find(',', close);
+    } else {
+      next = list.find(',', equal + 1);
+      value = ted::trim(list.substr(equal + 1, next - equal - 1));
+    }
+    mAttributes.emplace_back(key, value);
+
+    if (next == std::string_view::npos) {
+      break;
+    }
+    pos = next + 1;
+  }
+}
+
+std::string_view M3U8AttributeList::get(std::string_view key) const {
+  for (auto &&[name, value] : mAttributes) {
+    if (name == key) {
+      return value;
+    }
+  }
+  return {};
+}
+
+bool M3U8AttributeList::has(std::string_view key) const {
+  return std::any_of(mAttributes.begin(), mAttributes.end(),
+                     [key](const auto &attribute) {
+                       return attribute.first == key;
+                     });
+}
+
+int64_t M3U8AttributeList::getInt(std::string_view key,
+                                  int64_t fallback) const {
+  int64_t value;
+  return parseNumber(get(key), value) ? value : fallback;
+}
+
+double M3U8AttributeList::getDouble(std::string_view key,
+                                    double fallback) const {
+  double value;
+  return parseNumber(get(key), value) ? value : fallback;
+}
+
+size_t M3U8AttributeList::size() const { return mAttributes.size(); }
+
+double ted::M3U8MediaPlaylist::duration() const {
+  if (segments.empty()) {
+    return 0;
+  }
+  return segments.back().start + segments.back().duration;
+}
+
+std::pair<size_t, size_t>
+ted::M3U8MediaPlaylist::segmentsCovering(double begin, double end) const {
+  return ted::segmentsCovering(segments, begin, end);
+}
+
+int ted::parseM3U8Master(std::string_view content,
+                         M3U8MasterPlaylist &playlist) {
+  if (!isPlaylist(content)) {
+    return -1;
+  }
+  constexpr std::string_view streamTag = "#EXT-X-STREAM-INF";
+  constexpr std::string_view mediaTag = "#EXT-X-MEDIA";
+
+  bool expectUri = false;
+  forEachLine(content, [&](std::string_view line) {
+    if (line.starts_with(streamTag)) {
+      M3U8AttributeList attributes = attributesOf(line, streamTag);
+      M3U8Variant variant;
+      variant.bandwidth = attributes.getInt("BANDWIDTH");
+      variant.codecs = attributes.get("CODECS");
+      variant.frameRate = attributes.getDouble("FRAME-RATE");
+      variant.audioGroup = attributes.get("AUDIO");
+      auto resolution = attributes.get("RESOLUTION");
+      if (size_t x = resolution.find('x'); x != std::string_view::npos) {
+        parseNumber(resolution.substr(0, x), variant.width);
+        parseNumber(resolution.substr(x + 1), variant.height);
+      }
+      playlist.variants.push_back(variant);
+      expectUri = true;
+    } else if (line.starts_with(mediaTag) &&
+               !line.starts_with("#EXT-X-MEDIA-SEQUENCE")) {
+      M3U8AttributeList attributes = attributesOf(line, mediaTag);
+      playlist.renditions.push_back(M3U8Rendition{
+          .type = attributes.get("TYPE"),
+          .groupId = attributes.get("GROUP-ID"),
+          .name = attributes.get("NAME"),
+          .uri = attributes.get("URI"),
+          .bandwidth = attributes.getInt("BANDWIDTH"),
+          .isDefault = attributes.get("DEFAULT") == "YES",
+          .channels = attributes.get("CHANNELS"),
+          .sampleRate = attributes.getInt("SAMPLE-RATE"),
+      });
+    } else if (!line.starts_with('#') && expectUri) {
+      playlist.variants.back().uri = line;
+      expectUri = false;
+    }
+  });
+
+  // a stream without its uri line is unusable
+  if (expectUri) {
+    playlist.variants.pop_back();
+  }
+  return 0;
+}
+
+int ted::parseM3U8Media(std::string_view content,
+                        M3U8MediaPlaylist &playlist) {
+  if (!isPlaylist(content)) {
+    return -1;
+  }
+
+  M3U8Segment pending;
+  double start = 0;
+  uint32_t discontinuity = 0;
+  // where an EXT-X-BYTERANGE without offset continues from
+  int64_t nextRangeOffset = 0;
+  std::string_view mapUri;
+  std::optional<M3U8ByteRange> mapByteRange;
+
+  int ret = 0;
+  forEachLine(content, [&](std::string_view line) {
+    if (!line.starts_with('#')) {
+      pending.uri = line;
+      pending.start = start;
+      pending.discontinuity = discontinuity;
+      pending.mapUri = mapUri;
+      pending.mapByteRange = mapByteRange;
+      nextRangeOffset =
+          pending.byteRange
+              ? pending.byteRange->offset + pending.byteRange->length
+              : 0;
+      start += pending.duration;
+      playlist.segments.push_back(pending);
+      pending = M3U8Segment();
+    } else if (line.starts_with("#EXTINF:")) {
+      auto value = line.substr(8);
+      if (!parseNumber(value.substr(0, value.find(',')), pending.duration)) {
+        ret = -1;
+      }
+    } else if (line.starts_with("#EXT-X-BYTERANGE:")) {
+      M3U8ByteRange range;
+      if (!parseByteRange(line.substr(17), nextRangeOffset, range)) {
+        ret = -1;
+      }
+      pending.byteRange = range;
+    } else if (line.starts_with("#EXT-X-MAP:")) {
+      M3U8AttributeList attributes = attributesOf(line, "#EXT-X-MAP");
+      mapUri = attributes.get("URI");
+      mapByteRange.reset();
+      if (auto range = attributes.get("BYTERANGE"); !range.empty()) {
+        M3U8ByteRange value;
+        if (parseByteRange(range, 0, value)) {
+          mapByteRange = value;
+        }
+      }
+    } else if (line == "#EXT-X-DISCONTINUITY") {
+      ++discontinuity;
+    } else if (line.starts_with("#EXT-X-TARGETDURATION:")) {
+      parseNumber(line.substr(22), playlist.targetDuration);
+    } else if (line.starts_with("#EXT-X-MEDIA-SEQUENCE:")) {
+      parseNumber(line.substr(22), playlist.mediaSequence);
+    } else if (line == "#EXT-X-ENDLIST") {
+      playlist.endList = true;
+    }
+  });
+
+  if (ret != 0) {
+    logger.error("malformed tag in media playlist");
+  }
+  return ret;
+}
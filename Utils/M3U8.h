@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace ted {
+
+/**
+ * Attribute list of an HLS tag, e.g. BANDWIDTH=1,CODECS="a,b". Keys and
+ * values are views into the parsed line, quoted values without the quotes.
+ */
+class M3U8AttributeList {
+public:
+  explicit M3U8AttributeList(std::string_view list);
+
+  [[nodiscard]] std::string_view get(std::string_view key) const;
+
+  [[nodiscard]] bool has(std::string_view key) const;
+
+  [[nodiscard]] int64_t getInt(std::string_view key, int64_t fallback = 0) const;
+
+  [[nodiscard]] double getDouble(std::string_view key,
+                                 double fallback = 0) const;
+
+  [[nodiscard]] size_t size() const;
+
+private:
+  std::vector<std::pair<std::string_view, std::string_view>> mAttributes;
+};
+
+// views below point into the playlist text, which must outlive them
+
+struct M3U8Variant {
+  std::string_view uri;
+  int64_t bandwidth = 0;
+  std::string_view codecs;
+  int width = 0;
+  int height = 0;
+  double frameRate = 0;
+  std::string_view audioGroup;
+};
+
+struct M3U8Rendition {
+  std::string_view type;
+  std::string_view groupId;
+  std::string_view name;
+  std::string_view uri;
+  int64_t bandwidth = 0;
+  bool isDefault = false;
+  // e.g. "2" or "16/JOC", empty when not declared
+  std::string_view channels;
+  int64_t sampleRate = 0;
+};
+
+struct M3U8MasterPlaylist {
+  std::vector<M3U8Variant> variants;
+  std::vector<M3U8Rendition> renditions;
+};
+
+struct M3U8ByteRange {
+  int64_t offset = 0;
+  int64_t length = 0;
+};
+
+struct M3U8Segment {
+  std::string_view uri;
+  double duration = 0;
+  // seconds from the start of the playlist
+  double start = 0;
+  std::optional<M3U8ByteRange> byteRange;
+  // initialization section from EXT-X-MAP, empty for transport streams
+  std::string_view mapUri;
+  std::optional<M3U8ByteRange> mapByteRange;
+  // number of EXT-X-DISCONTINUITY tags seen up to this segment
+  uint32_t discontinuity = 0;
+};
+
+struct M3U8MediaPlaylist {
+  double targetDuration = 0;
+  int64_t mediaSequence = 0;
+  bool endList = false;
+  std::vector<M3U8Segment> segments;
+
+  [[nodiscard]] double duration() const;
+
+  // indices [first, last) of the segments overlapping [begin, end) seconds
+  [[nodiscard]] std::pair<size_t, size_t> segmentsCovering(double begin,
+                                                           double end) const;
+};
+
+// indices [first, last) of the segments overlapping [begin, end) seconds;
+// segments are sorted by start and have start and duration members
+template <class Segment>
+std::pair<size_t, size_t> segmentsCovering(const std::vector<Segment> &segments,
+                                           double begin, double end) {
+  auto first = std::partition_point(
+      segments.begin(), segments.end(), [begin](const Segment &segment) {
+        return segment.start + segment.duration <= begin;
+      });
+  auto last = std::partition_point(
+      first, segments.end(),
+      [end](const Segment &segment) { return segment.start < end; });
+  return {first - segments.begin(), last - segments.begin()};
+}
+
+// 0 on success, -1 if content is not an m3u8 playlist
+int parseM3U8Master(std::string_view content, M3U8MasterPlaylist &playlist);
+
+int parseM3U8Media(std::string_view content, M3U8MediaPlaylist &playlist);
+
+} // namespace ted
@@ -0,0 +1,522 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Hash.h"
+#include "MediaCache.h"
+#include "Utils.h"
+
+using ted::CacheProblem;
+using ted::MediaCache;
+using ted::VerifyReport;
+
+// large sequential reads keep the disk streaming while verifying
+static constexpr size_t HASH_READ_SIZE = 4 << 20;
+
+static int64_t treeSize(const std::string &path) {
+  struct stat st {};
+  if (lstat(path.c_str(), &st) != 0) {
+    return 0;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return st.st_size;
+  }
+  int64_t size = 0;
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return 0;
+  }
+  while (auto *entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name != "." && name != "..") {
+      size += treeSize(path + "/" + name);
+    }
+  }
+  closedir(dir);
+  return size;
+}
+
+static void removeTree(const std::string &path) {
+  DIR *dir = opendir(path.c_str());
+  if (dir != nullptr) {
+    while (auto *entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name != "." && name != "..") {
+        removeTree(path + "/" + name);
+      }
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+  } else {
+    unlink(path.c_str());
+  }
+}
+
+static int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// directory name used before entries were keyed by xxh64
+static std::string legacyKey(const std::string &url) {
+  std::stringstream ss;
+  ss << std::hex << std::hash<std::string>{}(url);
+  return ss.str();
+}
+
+MediaCache::MediaCache(std::string root, int64_t budget)
+    : mRoot(std::move(root)), mBudget(budget) {}
+
+MediaCache &MediaCache::instance() {
+  static MediaCache cache("./.cacheMedias");
+  return cache;
+}
+
+std::string MediaCache::key(const std::string &url) {
+  return toHex(xxh64(url));
+}
+
+const std::string &MediaCache::getRoot() const { return mRoot; }
+
+void MediaCache::setEvictionCallback(
+    std::function<void(const std::string &)> callback) {
+  std::unique_lock lock(mMutex);
+  mEvictionCallback = std::move(callback);
+}
+
+std::string MediaCache::entryDir(const std::string &url) const {
+  return mRoot + "/" + key(url);
+}
+
+std::string MediaCache::path(const std::string &url,
+                             const std::string &name) const {
+  return entryDir(url) + "/" + name;
+}
+
+std::string MediaCache::stagingPath(const std::string &path) {
+  return path + ".part";
+}
+
+void MediaCache::loadLocked() {
+  if (mLoaded) {
+    return;
+  }
+  mLoaded = true;
+  mkdir(mRoot.c_str(), 0777);
+
+  std::ifstream file(mRoot + "/index.json");
+  if (file) {
+    auto json = nlohmann::json::parse(file, nullptr, false);
+    auto entries = json.is_object() ? json.find("entries") : json.end();
+    if (entries != json.end() && entries->is_object()) {
+      // entries that do not parse are skipped, the directory scan below
+      // picks them up again
+      for (auto &&[key, value] : entries->items()) {
+        auto url = value.is_object() ? value.find("url") : value.end();
+        if (url == value.end() || !url->is_string()) {
+          continue;
+        }
+        auto lastAccess = value.find("lastAccess");
+        auto &entry = mEntries[key];
+        entry = Entry{.url = url->get<std::string>(),
+                      .size = 0,
+                      .lastAccess = lastAccess != value.end() &&
+                                            lastAccess->is_number_integer()
+                                        ? lastAccess->get<int64_t>()
+                                        : 0,
+                      .files = {}};
+        auto files = value.find("files");
+        if (files == value.end() || !files->is_object()) {
+          continue;
+        }
+        for (auto &&[name, file] : files->items()) {
+          auto hex = file.is_object() ? file.find("xxh64") : file.end();
+          auto size = file.is_object() ? file.find("size") : file.end();
+          if (hex == file.end() || !hex->is_string() || size == file.end() ||
+              !size->is_number_integer()) {
+            continue;
+          }
+          auto &digits = hex->get_ref<const std::string &>();
+          FileChecksum checksum{.size = size->get<int64_t>(), .xxh64 = 0};
+          auto [end, error] =
+              std::from_chars(digits.data(), digits.data() + digits.size(),
+                              checksum.xxh64, 16);
+          if (error == std::errc() && end == digits.data() + digits.size()) {
+            entry.files[name] = checksum;
+          }
+        }
+      }
+    } else {
+      logger.error("media cache index of {} is corrupted, rebuilding", mRoot);
+    }
+  }
+
+  // the directory is the truth: writers outside commit() and older builds
+  // leave entries the index does not know
+  std::set<std::string> present;
+  DIR *dir = opendir(mRoot.c_str());
+  if (dir != nullptr) {
+    while (auto *item = readdir(dir)) {
+      std::string name = item->d_name;
+      std::string path = mRoot + "/" + name;
+      struct stat st {};
+      if (name == "." || name == ".." || stat(path.c_str(), &st) != 0 ||
+          !S_ISDIR(st.st_mode)) {
+        continue;
+      }
+      present.insert(name);
+      auto &entry = mEntries[name];
+      entry.size = treeSize(path);
+      if (entry.lastAccess == 0) {
+        entry.lastAccess = (int64_t)st.st_mtime * 1000;
+      }
+    }
+    closedir(dir);
+  }
+  std::erase_if(mEntries, [&](const auto &entry) {
+    return !present.contains(entry.first);
+  });
+  for (auto &&[key, entry] : mEntries) {
+    mLastAccess = std::max(mLastAccess, entry.lastAccess);
+  }
+}
+
+void MediaCache::saveLocked() const {
+  nlohmann::json json;
+  json["entries"] = nlohmann::json::object();
+  for (auto &&[key, entry] : mEntries) {
+    auto files = nlohmann::json::object();
+    for (auto &&[name, file] : entry.files) {
+      files[name] = {{"size", file.size}, {"xxh64", toHex(file.xxh64)}};
+    }
+    json["entries"][key] = {{"url", entry.url},
+                            {"size", entry.size},
+                            {"lastAccess", entry.lastAccess},
+                            {"files", files}};
+  }
+
+  std::string path = mRoot + "/index.json";
+  std::string tmpPath = path + ".tmp";
+  {
+    std::ofstream file(tmpPath);
+    if (!file) {
+      logger.error("failed to write media cache index {}", tmpPath);
+      return;
+    }
+    file << json.dump();
+  }
+  if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+    logger.error("failed to rename media cache index {}", tmpPath);
+  }
+}
+
+void MediaCache::touchLocked(const std::string &key, const std::string &url) {
+  auto &entry = mEntries[key];
+  entry.url = url;
+  // strictly increasing so entries touched within one tick keep their order
+  mLastAccess = std::max(nowMs(), mLastAccess + 1);
+  entry.lastAccess = mLastAccess;
+}
+
+void MediaCache::updateSizeLocked(const std::string &key) {
+  mEntries[key].size = treeSize(mRoot + "/" + key);
+}
+
+int MediaCache::open(const std::string &url) {
+  std::unique_lock lock(mMutex);
+  loadLocked();
+
+  auto dir = entryDir(url);
+  auto legacyDir = mRoot + "/" + legacyKey(url);
+  if (access(dir.c_str(), F_OK) != 0 && access(legacyDir.c_str(), F_OK) == 0) {
+    if (std::rename(legacyDir.c_str(), dir.c_str()) == 0) {
+      logger.info("migrated cache of {} to {}", url, dir);
+      mEntries.erase(legacyKey(url));
+      updateSizeLocked(key(url));
+    }
+  }
+  if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+    logger.error("failed to create cache entry {}", dir);
+    return -1;
+  }
+
+  touchLocked(key(url), url);
+  saveLocked();
+  return 0;
+}
+
+void MediaCache::pin(const std::string &url) {
+  std::unique_lock lock(mMutex);
+  ++mPinned[key(url)];
+}
+
+void MediaCache::unpin(const std::string &url) {
+  std::unique_lock lock(mMutex);
+  auto iter = mPinned.find(key(url));
+  if (iter != mPinned.end() && --iter->second == 0) {
+    mPinned.erase(iter);
+  }
+}
+
+void MediaCache::touch(const std::string &url) {
+  std::unique_lock lock(mMutex);
+  loadLocked();
+  touchLocked(key(url), url);
+  saveLocked();
+}
+
+int MediaCache::commit(const std::string &url, const std::string &name,
+                       std::optional<uint64_t> checksum) {
+  auto finalPath = path(url, name);
+  auto partPath = stagingPath(finalPath);
+  if (access(partPath.c_str(), F_OK) == 0 &&
+      std::rename(partPath.c_str(), finalPath.c_str()) != 0) {
+    logger.error("failed to commit {}", finalPath);
+    return -1;
+  }
+
+  FileChecksum file;
+  struct stat st {};
+  if (checksum && stat(finalPath.c_str(), &st) == 0) {
+    file = FileChecksum{.size = st.st_size, .xxh64 = *checksum};
+  } else if (checksum || hashFile(finalPath, file.xxh64, file.size) != 0) {
+    logger.error("nothing to commit at {}", finalPath);
+    return -1;
+  }
+
+  std::unique_lock lock(mMutex);
+  loadLocked();
+  auto entryKey = key(url);
+  mEntries[entryKey].files[name] = file;
+  updateSizeLocked(entryKey);
+  touchLocked(entryKey, url);
+  evictLocked(entryKey);
+  saveLocked();
+  return 0;
+}
+
+void MediaCache::remove(const std::string &url, const std::string &name) {
+  unlink(path(url, name).c_str());
+
+  std::unique_lock lock(mMutex);
+  loadLocked();
+  auto entryKey = key(url);
+  if (mEntries.contains(entryKey)) {
+    mEntries[entryKey].files.erase(name);
+    updateSizeLocked(entryKey);
+    saveLocked();
+  }
+}
+
+bool MediaCache::contains(const std::string &url,
+                          const std::string &name) const {
+  return access(path(url, name).c_str(), F_OK) == 0;
+}
+
+void MediaCache::setBudget(int64_t budget) {
+  std::unique_lock lock(mMutex);
+  mBudget = budget;
+}
+
+int64_t MediaCache::getBudget() const {
+  std::unique_lock lock(mMutex);
+  return mBudget;
+}
+
+int64_t MediaCache::totalSize() {
+  std::unique_lock lock(mMutex);
+  loadLocked();
+  int64_t total = 0;
+  for (auto &&[key, entry] : mEntries) {
+    total += entry.size;
+  }
+  return total;
+}
+
+int64_t MediaCache::evict() {
+  std::unique_lock lock(mMutex);
+  loadLocked();
+  int64_t freed = evictLocked("");
+  saveLocked();
+  return freed;
+}
+
+int64_t MediaCache::evictLocked(const std::string &keep) {
+  int64_t total = 0;
+  std::vector<std::pair<int64_t, std::string>> candidates;
+  for (auto &&[key, entry] : mEntries) {
+    total += entry.size;
+    if (key != keep && !mPinned.contains(key)) {
+      candidates.emplace_back(entry.lastAccess, key);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  int64_t freed = 0;
+  for (auto &&[lastAccess, key] : candidates) {
+    if (total - freed <= mBudget) {
+      break;
+    }
+    auto &entry = mEntries[key];
+    logger.info("evicting {} ({} bytes) from the media cache",
+                entry.url.empty() ? key : entry.url, entry.size);
+    freed += entry.size;
+    removeEntryLocked(key);
+  }
+  return freed;
+}
+
+void MediaCache::removeEntryLocked(const std::string &key) {
+  auto &entry = mEntries[key];
+  removeTree(mRoot + "/" + key);
+  if (mEvictionCallback && !entry.url.empty()) {
+    mEvictionCallback(entry.url);
+  }
+  mEntries.erase(key);
+}
+
+int MediaCache::hashFile(const std::string &path, uint64_t &checksum,
+                         int64_t &size) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  Xxh64 hash;
+  std::vector<char> buffer(HASH_READ_SIZE);
+  size = 0;
+  ssize_t n;
+  while ((n = read(fd, buffer.data(), buffer.size())) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      close(fd);
+      return -1;
+    }
+    hash.update(buffer.data(), n);
+    size += n;
+  }
+  close(fd);
+  checksum = hash.digest();
+  return 0;
+}
+
+VerifyReport MediaCache::verify(size_t threads, bool evictBad) {
+  struct Task {
+    std::string key;
+    std::string name;
+    FileChecksum expected;
+  };
+
+  VerifyReport report;
+  std::vector<Task> tasks;
+  std::map<std::string, std::string> urls;
+  {
+    std::unique_lock lock(mMutex);
+    loadLocked();
+    for (auto &&[key, entry] : mEntries) {
+      urls[key] = entry.url;
+      for (auto &&[name, file] : entry.files) {
+        tasks.push_back({key, name, file});
+      }
+
+      // files no commit() recorded cannot be checked
+      DIR *dir = opendir((mRoot + "/" + key).c_str());
+      if (dir == nullptr) {
+        continue;
+      }
+      while (auto *item = readdir(dir)) {
+        std::string name = item->d_name;
+        bool scratch = name == "." || name == ".." ||
+                       name.ends_with(".part") || name.ends_with(".tmp");
+        if (!scratch && !entry.files.contains(name)) {
+          ++report.unchecked;
+        }
+      }
+      closedir(dir);
+    }
+  }
+  // largest first so one big file does not finish last on its own
+  std::sort(tasks.begin(), tasks.end(), [](auto &&a, auto &&b) {
+    return a.expected.size > b.expected.size;
+  });
+
+  std::vector<std::string> reasons(tasks.size());
+  std::atomic<size_t> next = 0;
+  std::atomic<int64_t> bytes = 0;
+  auto worker = [&]() {
+    for (size_t i = next++; i < tasks.size(); i = next++) {
+      auto &task = tasks[i];
+      uint64_t checksum = 0;
+      int64_t size = 0;
+      if (hashFile(mRoot + "/" + task.key + "/" + task.name, checksum,
+                   size) != 0) {
+        reasons[i] = "missing";
+        continue;
+      }
+      bytes += size;
+      if (size != task.expected.size) {
+        reasons[i] = "truncated";
+      } else if (checksum != task.expected.xxh64) {
+        reasons[i] = "checksum";
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::max<size_t>(threads, 1); ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &&thread : workers) {
+    thread.join();
+  }
+
+  report.files = (int64_t)tasks.size();
+  report.bytes = bytes;
+  std::set<std::string> bad;
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    if (!reasons[i].empty()) {
+      report.problems.push_back(CacheProblem{.url = urls[tasks[i].key],
+                                             .name = tasks[i].name,
+                                             .reason = reasons[i]});
+      bad.insert(tasks[i].key);
+    }
+  }
+  if (!evictBad || bad.empty()) {
+    return report;
+  }
+
+  std::set<std::string> evicted;
+  std::unique_lock lock(mMutex);
+  for (auto &&key : bad) {
+    if (mPinned.contains(key) || !mEntries.contains(key)) {
+      continue;
+    }
+    logger.info("evicting damaged {} from the media cache", urls[key]);
+    removeEntryLocked(key);
+    evicted.insert(key);
+  }
+  saveLocked();
+  lock.unlock();
+
+  for (size_t i = 0, problem = 0; i < tasks.size(); ++i) {
+    if (!reasons[i].empty()) {
+      report.problems[problem++].evicted = evicted.contains(tasks[i].key);
+    }
+  }
+  return report;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ted {
+
+struct CacheProblem {
+  std::string url;
+  std::string name;
+  // missing, truncated, checksum
+  std::string reason;
+  // the entry was removed by verify(), pinned entries are kept
+  bool evicted = false;
+};
+
+struct VerifyReport {
+  int64_t files = 0;
+  int64_t bytes = 0;
+  // files without a recorded checksum, e.g. from older builds
+  int64_t unchecked = 0;
+  std::vector<CacheProblem> problems;
+};
+
+/**
+ * Disk cache of per-url entry directories under a root, named by the
+ * xxh64 of the url so the layout survives toolchain upgrades. Sizes and
+ * last access times are kept in root/index.json; once the total goes over
+ * the budget, least recently used entries are removed.
+ *
+ * Files are written to stagingPath(path) and moved into place by commit(),
+ * so a file that exists under its final name is always complete.
+ */
+class MediaCache {
+public:
+  // pins an entry for as long as it lives
+  class ScopedPin {
+  public:
+    ScopedPin(MediaCache &cache, std::string url)
+        : mCache(cache), mUrl(std::move(url)) {
+      mCache.pin(mUrl);
+    }
+    ~ScopedPin() { mCache.unpin(mUrl); }
+
+    ScopedPin(const ScopedPin &) = delete;
+    ScopedPin &operator=(const ScopedPin &) = delete;
+
+  private:
+    MediaCache &mCache;
+    std::string mUrl;
+  };
+
+  static constexpr int64_t DEFAULT_BUDGET = 4LL << 30;
+
+  explicit MediaCache(std::string root, int64_t budget = DEFAULT_BUDGET);
+
+  // ./.cacheMedias, shared by the player and the prefetcher
+  static MediaCache &instance();
+
+  static std::string key(const std::string &url);
+
+  [[nodiscard]] const std::string &getRoot() const;
+
+  // told about every evicted url, called with the cache locked
+  void setEvictionCallback(std::function<void(const std::string &)> callback);
+
+  [[nodiscard]] std::string entryDir(const std::string &url) const;
+
+  // entryDir(url) + "/" + name
+  [[nodiscard]] std::string path(const std::string &url,
+                                 const std::string &name) const;
+
+  static std::string stagingPath(const std::string &path);
+
+  // create the entry directory, adopting a directory left by older builds,
+  // and mark the entry used
+  int open(const std::string &url);
+
+  // keep the entry from being evicted by this process, e.g. while playing
+  // or while it is being filled; pins nest, each needs its own unpin
+  void pin(const std::string &url);
+
+  void unpin(const std::string &url);
+
+  // mark the entry used without changing its content
+  void touch(const std::string &url);
+
+  // move stagingPath of name into place if it is there, update the entry
+  // size and evict other entries if the cache went over budget. Files a
+  // writer already renamed itself only need the accounting. The xxh64 of
+  // the file is recorded for verify(): writers that hashed the bytes as
+  // they wrote them pass it in, other files are read back once while they
+  // are still in the page cache. 0 on success
+  int commit(const std::string &url, const std::string &name,
+             std::optional<uint64_t> checksum = std::nullopt);
+
+  // drop name from the entry, e.g. when it went stale
+  void remove(const std::string &url, const std::string &name);
+
+  [[nodiscard]] bool contains(const std::string &url,
+                              const std::string &name) const;
+
+  void setBudget(int64_t budget);
+
+  [[nodiscard]] int64_t getBudget() const;
+
+  [[nodiscard]] int64_t totalSize();
+
+  // remove least recently used entries until the total fits the budget,
+  // returns the number of bytes freed
+  int64_t evict();
+
+  // check every committed file against its recorded size and checksum on
+  // threads workers; with evictBad, entries holding a bad file are removed
+  // unless pinned
+  VerifyReport verify(size_t threads, bool evictBad);
+
+  // size and xxh64 of the file read front to back, 0 on success
+  static int hashFile(const std::string &path, uint64_t &checksum,
+                      int64_t &size);
+
+private:
+  struct FileChecksum {
+    int64_t size = 0;
+    uint64_t xxh64 = 0;
+  };
+
+  struct Entry {
+    std::string url;
+    int64_t size = 0;
+    int64_t lastAccess = 0;
+    std::map<std::string, FileChecksum> files;
+  };
+
+  void loadLocked();
+
+  void saveLocked() const;
+
+  void touchLocked(const std::string &key, const std::string &url);
+
+  void updateSizeLocked(const std::string &key);
+
+  int64_t evictLocked(const std::string &keep);
+
+  void removeEntryLocked(const std::string &key);
+
+  std::string mRoot;
+  int64_t mBudget;
+
+  mutable std::mutex mMutex;
+  bool mLoaded = false;
+  std::map<std::string, Entry> mEntries;
+  // pin count by key
+  std::map<std::string, int> mPinned;
+  std::function<void(const std::string &)> mEvictionCallback;
+  int64_t mLastAccess = 0;
+};
+
+} // namespace ted
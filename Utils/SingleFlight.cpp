@@ -0,0 +1,161 @@
+#include "SingleFlight.h"
+#include "Utils.h"
+
+using ted::SingleFlight;
+
+SingleFlight &SingleFlight::instance() {
+  static SingleFlight singleFlight;
+  return singleFlight;
+}
+
+SingleFlight::Response SingleFlight::download(const std::string &url,
+                                              const std::string &range,
+                                              const CancelToken &cancel) {
+  auto body = std::make_shared<std::string>();
+  SimpleDownloader downloader(url, body.get());
+  downloader.setCancelToken(cancel);
+  if (downloader.init() != 0) {
+    return Response{.status = -1, .body = nullptr, .cancelled = false};
+  }
+  if (!range.empty()) {
+    // byte ranges address the identity encoding
+    downloader.setOption(CURLOPT_ACCEPT_ENCODING, nullptr);
+    downloader.setOption(CURLOPT_RANGE, const_cast<char *>(range.c_str()));
+  }
+  if (downloader.download() != 0) {
+    return Response{
+        .status = -1, .body = nullptr, .cancelled = cancel.cancelled()};
+  }
+  return Response{.status = 0, .body = std::move(body), .cancelled = false};
+}
+
+std::shared_future<SingleFlight::Response>
+SingleFlight::fetch(const std::string &url, const std::string &range,
+                    const CancelToken &cancel) {
+  ++mRequests;
+  std::string key = range.empty() ? url : url + "#" + range;
+  auto now = std::chrono::steady_clock::now();
+
+  std::promise<Response> promise;
+  std::shared_future<Response> future;
+  {
+    std::unique_lock lock(mMutex);
+    auto iter = mEntries.find(key);
+    if (iter != mEntries.end()) {
+      if (!iter->second.done) {
+        ++mCoalesced;
+        return iter->second.future;
+      }
+      if (now < iter->second.expires) {
+        ++mCacheHits;
+        return iter->second.future;
+      }
+      mCachedBytes -= iter->second.bytes;
+      mEntries.erase(iter);
+    }
+    future = promise.get_future().share();
+    mEntries[key] = Entry{.future = future, .done = false, .expires = {}};
+  }
+
+  // the first caller performs the transfer on its own thread
+  ++mTransfers;
+  Response response;
+  try {
+    response = download(url, range, cancel);
+  } catch (const std::exception &e) {
+    logger.error("fetch of {} failed: {}", url, e.what());
+  }
+
+  {
+    // settled before the value is set, so a waiter retrying after a
+    // cancelled transfer does not find it again
+    std::unique_lock lock(mMutex);
+    if (response.status == 0 && response.body->size() <= mMaxCachedBytes &&
+        response.body->size() <= mMaxTotalBytes && mTtl.count() > 0) {
+      trimLocked(response.body->size());
+      auto iter = mEntries.find(key);
+      iter->second.done = true;
+      iter->second.expires = std::chrono::steady_clock::now() + mTtl;
+      iter->second.bytes = response.body->size();
+      mCachedBytes += iter->second.bytes;
+    } else {
+      auto iter = mEntries.find(key);
+      mEntries.erase(iter);
+    }
+  }
+  promise.set_value(response);
+  return future;
+}
+
+SingleFlight::Response SingleFlight::get(const std::string &url,
+                                         const std::string &range,
+                                         const CancelToken &cancel) {
+  while (true) {
+    auto future = fetch(url, range, cancel);
+    if (cancel.cancellable()) {
+      while (future.wait_for(CANCEL_POLL_INTERVAL) !=
+             std::future_status::ready) {
+        if (cancel.cancelled()) {
+          return Response{.status = -1, .body = nullptr, .cancelled = true};
+        }
+      }
+    }
+    auto response = future.get();
+    // the caller running the transfer gave up, this one has not
+    if (!response.cancelled || cancel.cancelled()) {
+      return response;
+    }
+  }
+}
+
+void SingleFlight::trimLocked(size_t incoming) {
+  auto now = std::chrono::steady_clock::now();
+  std::erase_if(mEntries, [&](const auto &entry) {
+    if (!entry.second.done || now < entry.second.expires) {
+      return false;
+    }
+    mCachedBytes -= entry.second.bytes;
+    return true;
+  });
+
+  while (mCachedBytes + incoming > mMaxTotalBytes) {
+    auto oldest = mEntries.end();
+    for (auto iter = mEntries.begin(); iter != mEntries.end(); ++iter) {
+      if (iter->second.done &&
+          (oldest == mEntries.end() ||
+           iter->second.expires < oldest->second.expires)) {
+        oldest = iter;
+      }
+    }
+    if (oldest == mEntries.end()) {
+      break;
+    }
+    mCachedBytes -= oldest->second.bytes;
+    mEntries.erase(oldest);
+  }
+}
+
+void SingleFlight::setCachePolicy(size_t maxBytes,
+                                  std::chrono::milliseconds ttl,
+                                  size_t maxTotalBytes) {
+  std::unique_lock lock(mMutex);
+  mMaxCachedBytes = maxBytes;
+  mTtl = ttl;
+  mMaxTotalBytes = maxTotalBytes;
+  trimLocked(0);
+}
+
+void SingleFlight::clearCache() {
+  std::unique_lock lock(mMutex);
+  std::erase_if(mEntries, [](const auto &entry) { return entry.second.done; });
+  mCachedBytes = 0;
+}
+
+SingleFlight::Stats SingleFlight::getStats() const {
+  return Stats{
+      .requests = mRequests.load(),
+      .transfers = mTransfers.load(),
+      .coalesced = mCoalesced.load(),
+      .cacheHits = mCacheHits.load(),
+  };
+}
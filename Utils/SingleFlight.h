@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Cancellation.h"
+
+namespace ted {
+
+/**
+ * Coalesces identical in-memory fetches. Callers asking for the same url
+ * and range while a transfer is running wait for that transfer and share
+ * its buffer; small successful responses stay cached for a short time so
+ * the page, playlists and subtitles are not fetched twice during startup.
+ *
+ * The transfer runs under the token of the caller that started it. Others
+ * stop waiting when their own token is cancelled and leave the transfer
+ * running; if the starting caller cancels it, the ones still waiting
+ * start it again.
+ */
+class SingleFlight {
+public:
+  struct Response {
+    // 0 on success, -1 if the transfer failed
+    int status = -1;
+    std::shared_ptr<const std::string> body;
+    // failed because the token of the caller or of the transfer was
+    // cancelled
+    bool cancelled = false;
+  };
+
+  struct Stats {
+    size_t requests = 0;
+    size_t transfers = 0;
+    size_t coalesced = 0;
+    size_t cacheHits = 0;
+  };
+
+  static SingleFlight &instance();
+
+  SingleFlight(const SingleFlight &) = delete;
+  SingleFlight &operator=(const SingleFlight &) = delete;
+
+  // range is a curl range such as "0-1023", empty for the whole resource;
+  // cancel only applies if this call starts the transfer
+  std::shared_future<Response> fetch(const std::string &url,
+                                     const std::string &range = "",
+                                     const CancelToken &cancel = {});
+
+  // returns once the response is there or cancel is cancelled
+  Response get(const std::string &url, const std::string &range = "",
+               const CancelToken &cancel = {});
+
+  // responses up to maxBytes are kept for ttl, a zero ttl disables caching;
+  // once maxTotalBytes are cached the entries closest to expiry go first
+  void setCachePolicy(size_t maxBytes, std::chrono::milliseconds ttl,
+                      size_t maxTotalBytes = 8 * 1024 * 1024);
+
+  void clearCache();
+
+  [[nodiscard]] Stats getStats() const;
+
+private:
+  SingleFlight() = default;
+
+  struct Entry {
+    std::shared_future<Response> future;
+    bool done = false;
+    std::chrono::steady_clock::time_point expires;
+    size_t bytes = 0;
+  };
+
+  // how often a waiter checks its token
+  static constexpr auto CANCEL_POLL_INTERVAL = std::chrono::milliseconds(50);
+
+  // drops expired entries, then the ones closest to expiry until another
+  // incoming bytes fit the total budget; mMutex must be held
+  void trimLocked(size_t incoming);
+
+  static Response download(const std::string &url, const std::string &range,
+                           const CancelToken &cancel);
+
+  std::mutex mMutex;
+  std::map<std::string, Entry> mEntries;
+  size_t mMaxCachedBytes = 512 * 1024;
+  size_t mMaxTotalBytes = 8 * 1024 * 1024;
+  size_t mCachedBytes = 0;
+  std::chrono::milliseconds mTtl = std::chrono::seconds(10);
+
+  std::atomic<size_t> mRequests = 0;
+  std::atomic<size_t> mTransfers = 0;
+  std::atomic<size_t> mCoalesced = 0;
+  std::atomic<size_t> mCacheHits = 0;
+};
+
+} // namespace ted
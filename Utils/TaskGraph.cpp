@@ -0,0 +1,211 @@
+#include <algorithm>
+
+#include "TaskGraph.h"
+#include "Utils.h"
+
+using ted::CancelToken;
+using ted::Cancelled;
+using ted::TaskGraph;
+using ted::TaskPriority;
+using ted::WorkStealingPool;
+using ted::detail::GraphState;
+using ted::detail::NodeBase;
+
+NodeBase::NodeBase(std::shared_ptr<GraphState> graph, std::string name,
+                   TaskPriority priority, bool propagate, bool async)
+    : mGraph(std::move(graph)), mName(std::move(name)), mPriority(priority),
+      mPropagate(propagate), mAsync(async) {
+  mTiming.name = mName;
+  std::unique_lock lock(mGraph->mutex);
+  ++mGraph->pending;
+}
+
+void NodeBase::start(std::vector<std::shared_ptr<NodeBase>> inputs) {
+  auto self = shared_from_this();
+  {
+    std::unique_lock lock(mMutex);
+    // one more than the inputs, so none of them can post the node before
+    // all are registered
+    mRemaining = inputs.size() + 1;
+    mInputs = inputs;
+  }
+  for (auto &&input : inputs) {
+    input->addDependent(self);
+  }
+  inputDone(nullptr);
+}
+
+void NodeBase::addDependent(std::shared_ptr<NodeBase> dependent) {
+  std::unique_lock lock(mMutex);
+  if (!mTiming.done) {
+    mDependents.push_back(std::move(dependent));
+    return;
+  }
+  lock.unlock();
+  dependent->inputDone(shared_from_this());
+}
+
+void NodeBase::inputDone(const std::shared_ptr<NodeBase> &input) {
+  auto finished = input != nullptr ? input->timing().finished
+                                   : Clock::time_point::min();
+  {
+    std::unique_lock lock(mMutex);
+    if (input != nullptr &&
+        (mTiming.critical == nullptr || finished >= mCriticalFinished)) {
+      mTiming.critical = input;
+      mCriticalFinished = finished;
+    }
+    if (--mRemaining > 0) {
+      return;
+    }
+    mTiming.ready = Clock::now();
+  }
+  if (!mGraph->pool.post(mPriority,
+                         [self = shared_from_this()]() { self->execute(); })) {
+    // completed from outside the pool after it stopped, e.g. by an io
+    // callback that outlived the owner of the pool
+    if (claim()) {
+      mError = std::make_exception_ptr(
+          Cancelled("the pool of " + mGraph->name + " has stopped"));
+      complete();
+    }
+  }
+}
+
+void NodeBase::execute() {
+  std::vector<std::shared_ptr<NodeBase>> inputs;
+  {
+    std::unique_lock lock(mMutex);
+    mTiming.started = Clock::now();
+    inputs.swap(mInputs);
+  }
+  try {
+    mGraph->cancel.throwIfCancelled();
+    if (mPropagate) {
+      // inputs are complete, their mError no longer changes
+      for (auto &&input : inputs) {
+        if (input->mError) {
+          std::rethrow_exception(input->mError);
+        }
+      }
+    }
+    compute();
+  } catch (...) {
+    // an async node may have been completed before its function threw
+    if (claim()) {
+      mError = std::current_exception();
+      complete();
+    }
+    return;
+  }
+  if (!mAsync && claim()) {
+    complete();
+  }
+}
+
+void NodeBase::complete() {
+  release();
+  auto finished = Clock::now();
+  // before done is set, a dependent added once it is set reads the future
+  // right away
+  publish();
+
+  std::vector<std::shared_ptr<NodeBase>> dependents;
+  {
+    std::unique_lock lock(mMutex);
+    mTiming.finished = finished;
+    mTiming.done = true;
+    mTiming.failed = mError != nullptr;
+    dependents.swap(mDependents);
+  }
+  auto self = shared_from_this();
+  for (auto &&dependent : dependents) {
+    dependent->inputDone(self);
+  }
+
+  // after the dependents, which are counted already, so idle is only
+  // reported once nothing of the graph is left
+  std::vector<std::promise<void>> idle;
+  {
+    std::unique_lock lock(mGraph->mutex);
+    if (--mGraph->pending == 0) {
+      idle.swap(mGraph->idleWaiters);
+    }
+  }
+  for (auto &&waiter : idle) {
+    waiter.set_value();
+  }
+}
+
+NodeBase::Timing NodeBase::timing() const {
+  std::unique_lock lock(mMutex);
+  return mTiming;
+}
+
+TaskGraph::TaskGraph(WorkStealingPool &pool, std::string name,
+                     CancelToken cancel)
+    : mState(std::make_shared<GraphState>()) {
+  mState->pool = pool.handle();
+  mState->name = std::move(name);
+  mState->cancel = std::move(cancel);
+  mState->created = std::chrono::steady_clock::now();
+}
+
+const CancelToken &TaskGraph::cancelToken() const { return mState->cancel; }
+
+std::shared_future<void> TaskGraph::whenIdle() const {
+  std::unique_lock lock(mState->mutex);
+  if (mState->pending == 0) {
+    std::promise<void> idle;
+    idle.set_value();
+    return idle.get_future().share();
+  }
+  return mState->idleWaiters.emplace_back().get_future().share();
+}
+
+std::vector<TaskGraph::Stage>
+TaskGraph::pathTo(const std::shared_ptr<NodeBase> &sink) {
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+
+  std::vector<Stage> path;
+  auto now = NodeBase::Clock::now();
+  auto created = sink->graphState()->created;
+  for (auto node = sink; node != nullptr;) {
+    auto timing = node->timing();
+    Stage stage{.name = timing.name};
+    if (timing.started != NodeBase::Clock::time_point()) {
+      auto finished = timing.done ? timing.finished : now;
+      stage.startMs = Milliseconds(timing.started - created).count();
+      stage.waitMs = Milliseconds(timing.started - timing.ready).count();
+      stage.runMs = Milliseconds(finished - timing.started).count();
+    }
+    stage.failed = timing.failed;
+    path.push_back(std::move(stage));
+    node = std::move(timing.critical);
+  }
+  std::reverse(path.begin(), path.end());
+  return path;
+}
+
+std::string TaskGraph::describe(const std::vector<Stage> &path) {
+  std::string text;
+  for (auto &&stage : path) {
+    if (!text.empty()) {
+      text += " > ";
+    }
+    text += format("{} {:.1f}+{:.1f} ms", stage.name, stage.waitMs,
+                   stage.runMs);
+    if (stage.failed) {
+      text += " (failed)";
+    }
+  }
+  return text;
+}
+
+void TaskGraph::logCriticalPath(const std::shared_ptr<NodeBase> &sink) {
+  auto path = pathTo(sink);
+  double total =
+      path.empty() ? 0 : path.back().startMs + path.back().runMs;
+  logger.info("critical path of {}, {:.1f} ms: {}", sink->graphState()->name,
+              total, describe(path));
+}
@@ -0,0 +1,482 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Cancellation.h"
+#include "WorkStealingPool.h"
+
+namespace ted {
+
+class TaskGraph;
+
+template <class T> class GraphNode;
+
+template <class T> class GraphPromise;
+
+namespace detail {
+
+struct GraphState {
+  WorkStealingPool::Handle pool;
+  std::string name;
+  CancelToken cancel;
+  std::chrono::steady_clock::time_point created;
+
+  std::mutex mutex;
+  // stages created and not completed yet, guarded by mutex
+  size_t pending = 0;
+  std::vector<std::promise<void>> idleWaiters;
+};
+
+// scheduling and timing of a node, independent of its result type
+class NodeBase : public std::enable_shared_from_this<NodeBase> {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // an async node completes through its GraphPromise rather than when
+  // compute returns
+  NodeBase(std::shared_ptr<GraphState> graph, std::string name,
+           TaskPriority priority, bool propagate, bool async = false);
+
+  virtual ~NodeBase() = default;
+
+  // post the node once every input has completed
+  void start(std::vector<std::shared_ptr<NodeBase>> inputs);
+
+  struct Timing {
+    std::string name;
+    Clock::time_point ready;
+    Clock::time_point started;
+    Clock::time_point finished;
+    bool done = false;
+    bool failed = false;
+    // the input that completed last and so held this node back
+    std::shared_ptr<NodeBase> critical;
+  };
+
+  [[nodiscard]] Timing timing() const;
+
+  [[nodiscard]] const std::shared_ptr<GraphState> &graphState() const {
+    return mGraph;
+  }
+
+  [[nodiscard]] const std::string &name() const { return mName; }
+
+protected:
+  // store the result, exceptions are caught by the caller
+  virtual void compute() = 0;
+
+  // true for the first caller only, who then sets the result or mError
+  // and calls complete()
+  bool claim() { return !mClaimed.exchange(true); }
+
+  // publish the result and post the dependents that are now ready
+  void complete();
+
+  // hand the result or mError to the future, called once on completion
+  virtual void publish() = 0;
+
+  // drop the function and whatever it captured
+  virtual void release() = 0;
+
+  std::exception_ptr mError;
+
+private:
+  void addDependent(std::shared_ptr<NodeBase> dependent);
+
+  void inputDone(const std::shared_ptr<NodeBase> &input);
+
+  void execute();
+
+  std::shared_ptr<GraphState> mGraph;
+  std::string mName;
+  TaskPriority mPriority;
+  // fail with the first failed input instead of running
+  bool mPropagate;
+  bool mAsync;
+  std::atomic<bool> mClaimed = false;
+
+  mutable std::mutex mMutex;
+  std::vector<std::shared_ptr<NodeBase>> mInputs;
+  std::vector<std::shared_ptr<NodeBase>> mDependents;
+  size_t mRemaining = 0;
+  Timing mTiming;
+  Clock::time_point mCriticalFinished;
+};
+
+template <class T> class NodeState : public NodeBase {
+public:
+  using NodeBase::NodeBase;
+
+  [[nodiscard]] std::shared_future<T> future() const { return mFuture; }
+
+  // complete an async node, ignored once it completed
+  template <class... Args> void resolve(Args &&...value) {
+    if (!this->claim()) {
+      return;
+    }
+    if constexpr (std::is_void_v<T>) {
+      mValue = true;
+    } else {
+      mValue.emplace(std::forward<Args>(value)...);
+    }
+    this->complete();
+  }
+
+  void reject(std::exception_ptr error) {
+    if (!this->claim()) {
+      return;
+    }
+    mError = std::move(error);
+    this->complete();
+  }
+
+protected:
+  void publish() override {
+    if (mError) {
+      mPromise.set_exception(mError);
+    } else if constexpr (std::is_void_v<T>) {
+      mPromise.set_value();
+    } else {
+      mPromise.set_value(std::move(*mValue));
+    }
+  }
+
+  std::promise<T> mPromise;
+  std::shared_future<T> mFuture = mPromise.get_future().share();
+  std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> mValue;
+};
+
+template <class T, class F> class FunctionNode : public NodeState<T> {
+public:
+  FunctionNode(std::shared_ptr<GraphState> graph, std::string name,
+               TaskPriority priority, bool propagate, F function)
+      : NodeState<T>(std::move(graph), std::move(name), priority, propagate),
+        mFunction(std::move(function)) {}
+
+protected:
+  void compute() override {
+    if constexpr (std::is_void_v<T>) {
+      (*mFunction)();
+      this->mValue = true;
+    } else {
+      this->mValue.emplace((*mFunction)());
+    }
+  }
+
+  void release() override { mFunction.reset(); }
+
+private:
+  std::optional<F> mFunction;
+};
+
+// shared by the copies of a GraphPromise, the last one to go fails a node
+// that was never completed so its dependents are not left waiting
+template <class T> struct PromiseState {
+  explicit PromiseState(std::shared_ptr<NodeState<T>> node)
+      : node(std::move(node)) {}
+
+  PromiseState(const PromiseState &) = delete;
+  PromiseState &operator=(const PromiseState &) = delete;
+
+  ~PromiseState() {
+    node->reject(std::make_exception_ptr(
+        std::runtime_error("stage " + node->name() + " was abandoned")));
+  }
+
+  std::shared_ptr<NodeState<T>> node;
+};
+
+template <class T, class F> class AsyncFunctionNode;
+
+} // namespace detail
+
+/**
+ * Completes an async stage of a TaskGraph from any thread, e.g. from an io
+ * completion or a download callback. Only the first set() or fail()
+ * counts; if every copy is dropped before either, the stage fails.
+ */
+template <class T> class GraphPromise {
+public:
+  // the value of the stage, nothing for void
+  template <class... Args> void set(Args &&...value) const {
+    mState->node->resolve(std::forward<Args>(value)...);
+  }
+
+  void fail(std::exception_ptr error) const {
+    mState->node->reject(std::move(error));
+  }
+
+private:
+  template <class, class> friend class detail::AsyncFunctionNode;
+
+  explicit GraphPromise(std::shared_ptr<detail::NodeState<T>> node)
+      : mState(std::make_shared<detail::PromiseState<T>>(std::move(node))) {}
+
+  std::shared_ptr<detail::PromiseState<T>> mState;
+};
+
+namespace detail {
+
+template <class T, class F> class AsyncFunctionNode : public NodeState<T> {
+public:
+  AsyncFunctionNode(std::shared_ptr<GraphState> graph, std::string name,
+                    TaskPriority priority, bool propagate, F function)
+      : NodeState<T>(std::move(graph), std::move(name), priority, propagate,
+                     true),
+        mFunction(std::move(function)) {}
+
+protected:
+  void compute() override {
+    // moved out, the promise may complete the node while f still runs
+    F function = std::move(*mFunction);
+    mFunction.reset();
+    function(GraphPromise<T>(std::static_pointer_cast<NodeState<T>>(
+        this->shared_from_this())));
+  }
+
+  void release() override {}
+
+private:
+  std::optional<F> mFunction;
+};
+
+// what a continuation of a stage of type U returns
+template <class F, class U> struct ContinuationResult {
+  using type = std::invoke_result_t<F &, const U &>;
+};
+
+template <class F> struct ContinuationResult<F, void> {
+  using type = std::invoke_result_t<F &>;
+};
+
+template <class R, class F>
+std::shared_ptr<NodeState<R>>
+makeNode(const std::shared_ptr<GraphState> &graph, std::string name,
+         TaskPriority priority, bool propagate,
+         std::vector<std::shared_ptr<NodeBase>> inputs, F &&function) {
+  auto node = std::make_shared<FunctionNode<R, std::decay_t<F>>>(
+      graph, std::move(name), priority, propagate, std::forward<F>(function));
+  node->start(std::move(inputs));
+  return node;
+}
+
+template <class R, class F>
+std::shared_ptr<NodeState<R>>
+makeAsyncNode(const std::shared_ptr<GraphState> &graph, std::string name,
+              TaskPriority priority, bool propagate,
+              std::vector<std::shared_ptr<NodeBase>> inputs, F &&function) {
+  auto node = std::make_shared<AsyncFunctionNode<R, std::decay_t<F>>>(
+      graph, std::move(name), priority, propagate, std::forward<F>(function));
+  node->start(std::move(inputs));
+  return node;
+}
+
+} // namespace detail
+
+/**
+ * Handle to one stage of a TaskGraph. Copies refer to the same stage, which
+ * stays alive as long as a handle or a pending dependent refers to it.
+ */
+template <class T> class GraphNode {
+public:
+  GraphNode() = default;
+
+  [[nodiscard]] bool valid() const { return mState != nullptr; }
+
+  // ready once the stage completed, get() never blocks inside a dependent
+  [[nodiscard]] std::shared_future<T> future() const {
+    return mState->future();
+  }
+
+  // run f with the value of this stage, or with no argument for void, as
+  // soon as it succeeded; a failure skips f and is passed on
+  template <class F>
+  auto then(std::string name, TaskPriority priority, F &&f) const {
+    using R = typename detail::ContinuationResult<std::decay_t<F>, T>::type;
+    auto input = mState;
+    return GraphNode<R>(detail::makeNode<R>(
+        mState->graphState(), std::move(name), priority, true, {input},
+        [input, f = std::forward<F>(f)]() mutable {
+          if constexpr (std::is_void_v<T>) {
+            return f();
+          } else {
+            return f(input->future().get());
+          }
+        }));
+  }
+
+  template <class F> auto then(std::string name, F &&f) const {
+    return then(std::move(name), TaskPriority::Interactive,
+                std::forward<F>(f));
+  }
+
+  // like then(), but f also gets a GraphPromise<R> and the stage completes
+  // through it, so f can return before an io or download it started is
+  // done without holding a worker
+  template <class R, class F>
+  GraphNode<R> thenAsync(std::string name, TaskPriority priority,
+                         F &&f) const {
+    auto input = mState;
+    return GraphNode<R>(detail::makeAsyncNode<R>(
+        mState->graphState(), std::move(name), priority, true, {input},
+        [input, f = std::forward<F>(f)](GraphPromise<R> promise) mutable {
+          if constexpr (std::is_void_v<T>) {
+            f(std::move(promise));
+          } else {
+            f(input->future().get(), std::move(promise));
+          }
+        }));
+  }
+
+  template <class R, class F>
+  GraphNode<R> thenAsync(std::string name, F &&f) const {
+    return thenAsync<R>(std::move(name), TaskPriority::Interactive,
+                        std::forward<F>(f));
+  }
+
+private:
+  friend class TaskGraph;
+  template <class> friend class GraphNode;
+
+  explicit GraphNode(std::shared_ptr<detail::NodeState<T>> state)
+      : mState(std::move(state)) {}
+
+  std::shared_ptr<detail::NodeState<T>> mState;
+};
+
+/**
+ * Stages of a pipeline on a WorkStealingPool, each posted as soon as the
+ * stages it depends on have completed, so no worker blocks on a future to
+ * join them. Results are passed to continuations by then(), joins are
+ * whenAll() and whenSettled(). Every stage records when it became ready,
+ * started and finished, and criticalPath() follows the input that
+ * finished last back from any stage.
+ *
+ * A stage waiting on io it started itself is async: addAsync() and
+ * thenAsync() hand it a GraphPromise and it completes when that is set,
+ * e.g. from the io completion, not when its function returns.
+ *
+ * Once the token is cancelled, stages that have not started fail with
+ * Cancelled instead of running. The TaskGraph object only creates stages;
+ * they run to completion even if it is destroyed first. Stages that become
+ * ready once the pool is stopping or gone fail with Cancelled as well.
+ */
+class TaskGraph {
+public:
+  struct Stage {
+    std::string name;
+    // from the creation of the graph to the stage starting
+    double startMs = 0;
+    // from its inputs completing to a worker picking it up
+    double waitMs = 0;
+    double runMs = 0;
+    bool failed = false;
+  };
+
+  TaskGraph(WorkStealingPool &pool, std::string name,
+            CancelToken cancel = {});
+
+  TaskGraph(const TaskGraph &) = delete;
+  TaskGraph &operator=(const TaskGraph &) = delete;
+
+  [[nodiscard]] const CancelToken &cancelToken() const;
+
+  // a stage without inputs, posted right away
+  template <class F>
+  auto add(std::string name, TaskPriority priority, F &&f)
+      -> GraphNode<std::invoke_result_t<F &>> {
+    using R = std::invoke_result_t<F &>;
+    return GraphNode<R>(detail::makeNode<R>(mState, std::move(name), priority,
+                                            false, {}, std::forward<F>(f)));
+  }
+
+  template <class F> auto add(std::string name, F &&f) {
+    return add(std::move(name), TaskPriority::Interactive, std::forward<F>(f));
+  }
+
+  // a stage without inputs that completes through the GraphPromise<R> f
+  // gets, see GraphNode::thenAsync()
+  template <class R, class F>
+  GraphNode<R> addAsync(std::string name, TaskPriority priority, F &&f) {
+    return GraphNode<R>(detail::makeAsyncNode<R>(
+        mState, std::move(name), priority, false, {}, std::forward<F>(f)));
+  }
+
+  template <class R, class F> GraphNode<R> addAsync(std::string name, F &&f) {
+    return addAsync<R>(std::move(name), TaskPriority::Interactive,
+                       std::forward<F>(f));
+  }
+
+  // f() once every input succeeded, read their values with future().get();
+  // the first failed input is passed on without calling f
+  template <class F, class... Ts>
+  auto whenAll(std::string name, TaskPriority priority, F &&f,
+               const GraphNode<Ts> &...inputs)
+      -> GraphNode<std::invoke_result_t<F &>> {
+    return join(std::move(name), priority, true, std::forward<F>(f),
+                inputs...);
+  }
+
+  // f() once every input completed, whether it succeeded or not
+  template <class F, class... Ts>
+  auto whenSettled(std::string name, TaskPriority priority, F &&f,
+                   const GraphNode<Ts> &...inputs)
+      -> GraphNode<std::invoke_result_t<F &>> {
+    return join(std::move(name), priority, false, std::forward<F>(f),
+                inputs...);
+  }
+
+  // ready once every stage added so far has completed, including async
+  // stages and continuations no join waits for; wait on it before the pool
+  // or anything the stages use goes away
+  [[nodiscard]] std::shared_future<void> whenIdle() const;
+
+  // the chain of stages that finished last, ending at sink; a sink still
+  // running is included with the time it has run so far
+  template <class T>
+  [[nodiscard]] std::vector<Stage>
+  criticalPath(const GraphNode<T> &sink) const {
+    return pathTo(sink.mState);
+  }
+
+  // log the critical path to sink once it completes
+  template <class T> void traceCriticalPath(const GraphNode<T> &sink) {
+    whenSettled(
+        "trace", TaskPriority::Bulk,
+        [state = sink.mState]() { logCriticalPath(state); }, sink);
+  }
+
+  // "page 0.1+120.3 ms > audio 0.0+3400.2 ms", waiting and running time
+  static std::string describe(const std::vector<Stage> &path);
+
+private:
+  template <class F, class... Ts>
+  auto join(std::string name, TaskPriority priority, bool propagate, F &&f,
+            const GraphNode<Ts> &...inputs)
+      -> GraphNode<std::invoke_result_t<F &>> {
+    using R = std::invoke_result_t<F &>;
+    return GraphNode<R>(detail::makeNode<R>(
+        mState, std::move(name), priority, propagate, {inputs.mState...},
+        std::forward<F>(f)));
+  }
+
+  static std::vector<Stage>
+  pathTo(const std::shared_ptr<detail::NodeBase> &sink);
+
+  static void logCriticalPath(const std::shared_ptr<detail::NodeBase> &sink);
+
+  std::shared_ptr<detail::GraphState> mState;
+};
+
+} // namespace ted
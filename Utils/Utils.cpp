@@ -1,10 +1,17 @@
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <curl/curl.h>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <regex>
+#include <sys/stat.h>
 #include <vector>
+#include <unistd.h>
 
+#include "DownloadManifest.h"
+#include "DownloadService.h"
 #include "Utils.h"
 
 using ted::Logger;
@@ -84,6 +91,7 @@ AVFrame *ted::interleaveSamples(AVFrame *srcFrame) {
   return dstFrame;
 }
 
+using ted::CancelToken;
 using ted::SimpleDownloader;
 
 SimpleDownloader::SimpleDownloader(std::string url, std::string localPath)
@@ -94,10 +102,52 @@ SimpleDownloader::SimpleDownloader(std::string url, std::string localPath)
 SimpleDownloader::SimpleDownloader(std::string url, std::string *buffer)
     : mUrl(std::move(url)), mBuffer(buffer) {}
 
+SimpleDownloader::SimpleDownloader(std::string url, DataSink sink)
+    : mUrl(std::move(url)), mSink(std::move(sink)) {}
+
 SimpleDownloader::~SimpleDownloader() {
+  DownloadService::instance().release(mCurl);
+  curl_slist_free_all(mRequestHeaders);
+}
+
+void SimpleDownloader::addHeader(const std::string &header) {
+  mRequestHeaders = curl_slist_append(mRequestHeaders, header.c_str());
+}
+
+long SimpleDownloader::getResponseCode() const {
+  long code = 0;
   if (mCurl != nullptr) {
-    curl_easy_cleanup(mCurl);
+    curl_easy_getinfo(mCurl, CURLINFO_RESPONSE_CODE, &code);
+  }
+  return code;
+}
+
+std::string SimpleDownloader::getResponseHeader(const std::string &name) const {
+  std::string key = name;
+  std::transform(key.begin(), key.end(), key.begin(),
+                 [](unsigned char c) { return (char)std::tolower(c); });
+  auto iter = mResponseHeaders.find(key);
+  return iter == mResponseHeaders.end() ? "" : iter->second;
+}
+
+size_t SimpleDownloader::HeaderCallback(char *buffer, size_t size,
+                                        size_t nitems, void *user) {
+  auto *downloader = static_cast<SimpleDownloader *>(user);
+  size_t realSize = size * nitems;
+  std::string_view line(buffer, realSize);
+  // a status line starts a new response, e.g. after a redirect
+  if (line.starts_with("HTTP/")) {
+    downloader->mResponseHeaders.clear();
+    return realSize;
   }
+  size_t colon = line.find(':');
+  if (colon != std::string_view::npos) {
+    std::string key(trim(line.substr(0, colon)));
+    std::transform(key.begin(), key.end(), key.begin(),
+                   [](unsigned char c) { return (char)std::tolower(c); });
+    downloader->mResponseHeaders[key] = trim(line.substr(colon + 1));
+  }
+  return realSize;
 }
 
 int SimpleDownloader::setOption(CURLoption curlOption, void *value) {
@@ -113,18 +163,31 @@ int SimpleDownloader::setOption(CURLoption curlOption, void *value) {
   return 0;
 }
 
+void SimpleDownloader::enableResume(int parallelChunks, int64_t chunkSize) {
+  mResume = true;
+  mParallelChunks = std::max(parallelChunks, 1);
+  mChunkSize = std::max<int64_t>(chunkSize, 1);
+}
+
+void SimpleDownloader::setCancelToken(CancelToken token) {
+  mCancel = std::move(token);
+}
+
 int SimpleDownloader::init() {
   if (mCurl != nullptr) {
     logger.error("try to reinit curl {}", mUrl);
   }
-  mCurl = curl_easy_init();
+  mCurl = DownloadService::instance().acquire(mCancel);
   if (mCurl == nullptr) {
     logger.error("curl_easy_init failed {}", mUrl);
     return -1;
   }
 
   curl_easy_setopt(mCurl, CURLOPT_URL, mUrl.c_str());
-  if (mBuffer == nullptr) {
+  if (mResume) {
+    // the part file is opened by downloadResumable
+    curl_easy_setopt(mCurl, CURLOPT_WRITEFUNCTION, nullptr);
+  } else if (mBuffer == nullptr && mSink == nullptr) {
     mFile = fopen(mLocalPath.c_str(), "wb");
     if (mFile == nullptr) {
       logger.error("open file failed {}", mLocalPath);
@@ -136,9 +199,15 @@ int SimpleDownloader::init() {
     curl_easy_setopt(mCurl, CURLOPT_WRITEFUNCTION, WriteBufferCallback);
     curl_easy_setopt(mCurl, CURLOPT_WRITEDATA, this);
   }
-  curl_easy_setopt(mCurl, CURLOPT_NOPROGRESS, 1L);
   curl_easy_setopt(mCurl, CURLOPT_FOLLOWLOCATION, 1L);
   curl_easy_setopt(mCurl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(mCurl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+  curl_easy_setopt(mCurl, CURLOPT_HEADERDATA, this);
+  if (!mResume) {
+    // any encoding curl supports, decoded as it streams in; resumed files
+    // are written at byte offsets and must stay identity encoded
+    curl_easy_setopt(mCurl, CURLOPT_ACCEPT_ENCODING, "");
+  }
   // curl_easy_setopt(mCurl, CURLOPT_PROXY, "http://127.0.0.1:7890");
 
   return 0;
@@ -149,8 +218,17 @@ int SimpleDownloader::download() {
     logger.error("curl not init {}", mUrl);
     return -1;
   }
+  if (mResume) {
+    return downloadResumable();
+  }
+  curl_easy_setopt(mCurl, CURLOPT_HTTPHEADER, mRequestHeaders);
 
   CURLcode res = curl_easy_perform(mCurl);
+  DownloadService::instance().recordTransfer(mCurl);
+  if (res == CURLE_ABORTED_BY_CALLBACK && mCancel.cancelled()) {
+    logger.info("download of {} cancelled", mUrl);
+    return -1;
+  }
   if (res != CURLE_OK) {
     logger.error("curl_easy_perform failed {}", mUrl);
     return -1;
@@ -162,12 +240,301 @@ int SimpleDownloader::download() {
   return 0;
 }
 
+int64_t SimpleDownloader::probeContentLength() {
+  // the identity length, not that of a compressed body
+  curl_easy_setopt(mCurl, CURLOPT_HTTPHEADER, mRequestHeaders);
+  curl_easy_setopt(mCurl, CURLOPT_ACCEPT_ENCODING, nullptr);
+  curl_easy_setopt(mCurl, CURLOPT_NOBODY, 1L);
+  CURLcode res = curl_easy_perform(mCurl);
+  DownloadService::instance().recordTransfer(mCurl);
+  curl_easy_setopt(mCurl, CURLOPT_NOBODY, 0L);
+  if (res != CURLE_OK) {
+    logger.error("failed to probe size of {}", mUrl);
+    return -1;
+  }
+  curl_off_t length = -1;
+  curl_easy_getinfo(mCurl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+  return length;
+}
+
+namespace {
+struct RangeTransfer {
+  int fd = -1;
+  int64_t begin = 0;
+  int64_t end = 0;
+  int64_t written = 0;
+  bool rangeIgnored = false;
+  CURL *curl = nullptr;
+};
+
+size_t writeRangeCallback(void *contents, size_t size, size_t nmemb,
+                          void *user) {
+  auto *transfer = static_cast<RangeTransfer *>(user);
+  size_t realSize = size * nmemb;
+  if (transfer->written == 0) {
+    long code = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 206) {
+      transfer->rangeIgnored = true;
+      return 0;
+    }
+  }
+  if (transfer->begin + transfer->written + (int64_t)realSize >
+      transfer->end) {
+    ted::logger.error("server sent more than the requested range");
+    return 0;
+  }
+  ssize_t n = pwrite(transfer->fd, contents, realSize,
+                     transfer->begin + transfer->written);
+  if (n != (ssize_t)realSize) {
+    return 0;
+  }
+  transfer->written += (int64_t)realSize;
+  return realSize;
+}
+} // namespace
+
+int SimpleDownloader::downloadRanges(int fd, DownloadManifest &manifest) {
+  // split the missing ranges into chunks that run in parallel
+  std::vector<RangeTransfer> pieces;
+  for (auto &&[begin, end] : manifest.missingRanges()) {
+    int64_t step = mParallelChunks > 1 ? mChunkSize : end - begin;
+    for (int64_t offset = begin; offset < end; offset += step) {
+      pieces.push_back(RangeTransfer{.fd = fd,
+                                     .begin = offset,
+                                     .end = std::min(offset + step, end)});
+    }
+  }
+
+  // a resource that changed since the ranges on disk were fetched is sent
+  // whole, which falls back to a full download; weak tags can't be used
+  std::string validator = manifest.getEtag();
+  if (validator.empty() || validator.starts_with("W/")) {
+    validator = manifest.getLastModified();
+  }
+  curl_slist *headers = nullptr;
+  for (auto *header = mRequestHeaders; header != nullptr;
+       header = header->next) {
+    headers = curl_slist_append(headers, header->data);
+  }
+  if (!validator.empty()) {
+    headers = curl_slist_append(headers, ("If-Range: " + validator).c_str());
+  }
+
+  CURLM *multi = curl_multi_init();
+  size_t nextPiece = 0;
+  int active = 0;
+  bool failed = false;
+  bool rangeIgnored = false;
+  constexpr int64_t saveInterval = 4 << 20;
+  int64_t savedBytes = 0;
+
+  auto writtenBytes = [&]() {
+    int64_t bytes = 0;
+    for (auto &&piece : pieces) {
+      bytes += piece.written;
+    }
+    return bytes;
+  };
+  auto recordProgress = [&]() {
+    // the ranges must be on disk before the manifest claims them
+    fdatasync(fd);
+    for (auto &&piece : pieces) {
+      manifest.addRange(piece.begin, piece.begin + piece.written);
+    }
+    manifest.save();
+    savedBytes = writtenBytes();
+  };
+
+  while (!failed && (nextPiece < pieces.size() || active > 0)) {
+    while (active < mParallelChunks && nextPiece < pieces.size()) {
+      auto &piece = pieces[nextPiece++];
+      std::string range =
+          std::to_string(piece.begin) + "-" + std::to_string(piece.end - 1);
+      piece.curl = DownloadService::instance().acquire(mCancel);
+      curl_easy_setopt(piece.curl, CURLOPT_URL, mUrl.c_str());
+      curl_easy_setopt(piece.curl, CURLOPT_RANGE, range.c_str());
+      curl_easy_setopt(piece.curl, CURLOPT_HTTPHEADER, headers);
+      curl_easy_setopt(piece.curl, CURLOPT_WRITEFUNCTION, writeRangeCallback);
+      curl_easy_setopt(piece.curl, CURLOPT_WRITEDATA, &piece);
+      curl_easy_setopt(piece.curl, CURLOPT_PRIVATE, &piece);
+      curl_easy_setopt(piece.curl, CURLOPT_FOLLOWLOCATION, 1L);
+      curl_easy_setopt(piece.curl, CURLOPT_FAILONERROR, 1L);
+      curl_multi_add_handle(multi, piece.curl);
+      ++active;
+    }
+
+    int running = 0;
+    curl_multi_perform(multi, &running);
+
+    CURLMsg *msg;
+    int left;
+    while ((msg = curl_multi_info_read(multi, &left)) != nullptr) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      RangeTransfer *piece = nullptr;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &piece);
+      DownloadService::instance().recordTransfer(piece->curl);
+      long code = 0;
+      curl_easy_getinfo(piece->curl, CURLINFO_RESPONSE_CODE, &code);
+      if (msg->data.result != CURLE_OK ||
+          piece->written != piece->end - piece->begin) {
+        if (code == 416) {
+          // the resource shrank under the ranges, start afresh
+          logger.error("range {}-{} of {} is no longer satisfiable",
+                       piece->begin, piece->end, mUrl);
+          rangeIgnored = true;
+        } else if (piece->rangeIgnored) {
+          rangeIgnored = true;
+        } else if (mCancel.cancelled()) {
+          logger.info("range {}-{} of {} cancelled", piece->begin,
+                      piece->end, mUrl);
+        } else {
+          logger.error("range {}-{} of {} failed: {}", piece->begin,
+                       piece->end, mUrl, curl_easy_strerror(msg->data.result));
+        }
+        failed = true;
+      }
+      curl_multi_remove_handle(multi, piece->curl);
+      DownloadService::instance().release(piece->curl);
+      piece->curl = nullptr;
+      --active;
+      fdatasync(fd);
+      manifest.addRange(piece->begin, piece->begin + piece->written);
+      manifest.save();
+    }
+
+    // bound the work lost if the process dies mid transfer
+    if (writtenBytes() - savedBytes >= saveInterval) {
+      recordProgress();
+    }
+    if (active > 0) {
+      curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+  }
+
+  for (auto &&piece : pieces) {
+    if (piece.curl != nullptr) {
+      curl_multi_remove_handle(multi, piece.curl);
+      DownloadService::instance().release(piece.curl);
+      piece.curl = nullptr;
+    }
+  }
+  curl_multi_cleanup(multi);
+  curl_slist_free_all(headers);
+  recordProgress();
+
+  if (rangeIgnored) {
+    return 1;
+  }
+  return failed ? -1 : 0;
+}
+
+int SimpleDownloader::downloadResumable() {
+  std::string partPath = mLocalPath + ".part";
+  DownloadManifest manifest(partPath + ".manifest");
+
+  // ranges only mean something over a part file of the recorded size, and
+  // only while the remote resource is still the one they were fetched from
+  int64_t size = probeContentLength();
+  std::string etag = getResponseHeader("ETag");
+  std::string lastModified = getResponseHeader("Last-Modified");
+  struct stat partStat {};
+  bool resumed = size > 0 && manifest.load() == 0 &&
+                 manifest.getUrl() == mUrl && manifest.getTotalSize() == size &&
+                 manifest.getEtag() == etag &&
+                 manifest.getLastModified() == lastModified &&
+                 stat(partPath.c_str(), &partStat) == 0 &&
+                 partStat.st_size == size;
+  if (!resumed) {
+    if (size <= 0) {
+      logger.error("size of {} is unknown, downloading without resume", mUrl);
+      manifest.reset(mUrl, 0);
+    } else {
+      manifest.reset(mUrl, size);
+      manifest.setValidators(etag, lastModified);
+    }
+  } else {
+    logger.info("resuming {}, {} of {} bytes on disk", mUrl,
+                manifest.completedBytes(), manifest.getTotalSize());
+  }
+
+  int fd = open(partPath.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    logger.error("open file failed {}", partPath);
+    return -1;
+  }
+
+  int ret = 1;
+  if (manifest.getTotalSize() > 0) {
+    if (!resumed && ftruncate(fd, manifest.getTotalSize()) != 0) {
+      logger.error("failed to reserve {}", partPath);
+      close(fd);
+      return -1;
+    }
+    manifest.save();
+    ret = downloadRanges(fd, manifest);
+  }
+
+  if (ret == 1) {
+    // no size, no range support or a changed resource, fetch the whole
+    // body from the start
+    logger.info("downloading {} in full", mUrl);
+    // parallel ranges may have been recorded already, drop them on disk
+    // before their bytes are truncated away
+    manifest.reset(mUrl, manifest.getTotalSize());
+    manifest.remove();
+    if (ftruncate(fd, 0) != 0) {
+      logger.error("failed to truncate {}", partPath);
+      close(fd);
+      return -1;
+    }
+    FILE *file = fdopen(fd, "wb");
+    if (file == nullptr) {
+      close(fd);
+      return -1;
+    }
+    fd = -1;
+    curl_easy_setopt(mCurl, CURLOPT_HTTPHEADER, mRequestHeaders);
+    curl_easy_setopt(mCurl, CURLOPT_WRITEDATA, file);
+    CURLcode res = curl_easy_perform(mCurl);
+    DownloadService::instance().recordTransfer(mCurl);
+    fclose(file);
+    if (res != CURLE_OK) {
+      logger.error("curl_easy_perform failed {}", mUrl);
+      return -1;
+    }
+    ret = 0;
+  } else {
+    close(fd);
+  }
+
+  if (ret != 0) {
+    logger.error("download of {} interrupted, {} of {} bytes kept", mUrl,
+                 manifest.completedBytes(), manifest.getTotalSize());
+    return -1;
+  }
+
+  if (std::rename(partPath.c_str(), mLocalPath.c_str()) != 0) {
+    logger.error("failed to rename {}", partPath);
+    return -1;
+  }
+  manifest.remove();
+  return 0;
+}
+
 std::string SimpleDownloader::getLocalPath() const { return mLocalPath; }
 
 size_t ted::SimpleDownloader::WriteBufferCallback(void *contents, size_t size,
                                                   size_t nmemb, void *user) {
   size_t realSize = size * nmemb;
   auto *downloader = static_cast<SimpleDownloader *>(user);
+  if (downloader->mSink != nullptr) {
+    return downloader->mSink(static_cast<char *>(contents), realSize)
+               ? realSize
+               : 0;
+  }
   if (downloader->mBuffer == nullptr) {
     logger.error("buffer not init {}", downloader->mUrl);
     return 0;
@@ -182,7 +549,7 @@ std::string ted::getFFmpegErrorStr(int error) {
   return ret;
 }
 
-std::string ted::retrieveM3U8UrlFromTalkHtml(const std::string &html) {
+static nlohmann::json retrieveNextData(const std::string &html) {
   static std::regex pattern(
       R"(<script id="__NEXT_DATA__" type="application/json">(.*?)</script>)");
 
@@ -191,8 +558,11 @@ std::string ted::retrieveM3U8UrlFromTalkHtml(const std::string &html) {
   if (match.size() != 2) {
     throw std::runtime_error("regex search failed");
   }
+  return nlohmann::json::parse(match[1].str());
+}
 
-  auto json = nlohmann::json::parse(match[1].str());
+std::string ted::retrieveM3U8UrlFromTalkHtml(const std::string &html) {
+  auto json = retrieveNextData(html);
   auto player = json["props"]["pageProps"]["videoData"]["playerData"];
   auto playerJson = nlohmann::json::parse(player.get<std::string>());
 
@@ -200,6 +570,25 @@ std::string ted::retrieveM3U8UrlFromTalkHtml(const std::string &html) {
   return m3u8.get<std::string>();
 }
 
+ted::TalkInfo ted::retrieveTalkInfoFromHtml(const std::string &html) {
+  auto json = retrieveNextData(html);
+  auto &video = json["props"]["pageProps"]["videoData"];
+  if (!video.is_object()) {
+    return {};
+  }
+
+  TalkInfo info;
+  // ids are numeric strings on current pages, numbers on older ones
+  if (video.contains("id")) {
+    info.id = video["id"].is_string() ? video["id"].get<std::string>()
+                                      : video["id"].dump();
+  }
+  info.title = video.value("title", "");
+  info.speaker = video.value("presenterDisplayName", "");
+  info.durationMs = video.value("duration", (int64_t)0) * 1000;
+  return info;
+}
+
 std::string ted::replaceAll(std::string &str, const std::string &from,
                             const std::string &to) {
   size_t startPos = 0;
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <format>
+#include <functional>
+#include <map>
 #include <string>
 
 #include <curl/curl.h>
+#include "Cancellation.h"
 #include "json.hpp"
 
 #ifdef __cpp_lib_format
@@ -95,32 +98,78 @@ struct AudioParam {
   AudioFormat sampleFormat = AudioFormat::Float32;
 };
 
+class DownloadManifest;
+
+// receives downloaded bytes as they arrive, return false to abort
+using DataSink = std::function<bool(const char *data, size_t size)>;
+
 class SimpleDownloader {
 public:
   SimpleDownloader(std::string url, std::string localPath);
 
   SimpleDownloader(std::string url, std::string* buffer);
 
+  SimpleDownloader(std::string url, DataSink sink);
+
   ~SimpleDownloader();
 
   int setOption(CURLoption curlOption, void *value);
 
+  // keep partial data in <localPath>.part with a manifest and continue with
+  // range requests next time; large files are fetched as parallel chunks
+  void enableResume(int parallelChunks = 1, int64_t chunkSize = 8 << 20);
+
+  // abort transfers once token is cancelled, call before init
+  void setCancelToken(CancelToken token);
+
   int init();
 
   int download();
 
   [[nodiscard]] std::string getLocalPath() const;
 
+  // HEAD request after init(), -1 when the server does not report a length
+  int64_t probeContentLength();
+
+  // extra request header such as "If-None-Match: \"abc\"", before download
+  void addHeader(const std::string &header);
+
+  // status of the last response, 0 before download
+  [[nodiscard]] long getResponseCode() const;
+
+  // header of the final response by case-insensitive name, empty if absent
+  [[nodiscard]] std::string getResponseHeader(const std::string &name) const;
+
 private:
   static size_t WriteBufferCallback(void *contents, size_t size, size_t nmemb,
                                     void *user);
 
+  static size_t HeaderCallback(char *buffer, size_t size, size_t nitems,
+                               void *user);
+
+  int downloadResumable();
+
+  // returns 1 if the server ignored the range request or the resource
+  // changed under the ranges on disk
+  int downloadRanges(int fd, DownloadManifest &manifest);
+
   std::string mUrl;
   std::string mLocalPath;
   std::string *mBuffer = nullptr;
+  DataSink mSink;
 
   CURL *mCurl = nullptr;
   FILE *mFile = nullptr;
+
+  curl_slist *mRequestHeaders = nullptr;
+  // lower-case names
+  std::map<std::string, std::string> mResponseHeaders;
+
+  bool mResume = false;
+  int mParallelChunks = 1;
+  int64_t mChunkSize = 0;
+
+  CancelToken mCancel;
 };
 
 #pragma mark string utils
@@ -136,4 +185,14 @@ std::string_view trim(std::string_view sv);
 AVFrame *interleaveSamples(AVFrame *frame);
 
 std::string retrieveM3U8UrlFromTalkHtml(const std::string &html);
+
+struct TalkInfo {
+  std::string id;
+  std::string title;
+  std::string speaker;
+  int64_t durationMs = 0;
+};
+
+// talk metadata from __NEXT_DATA__, fields the page lacks are left empty
+TalkInfo retrieveTalkInfoFromHtml(const std::string &html);
 } // namespace ted
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <numeric>
+
+#include "VariantSelector.h"
+
+using ted::ThroughputEstimator;
+using ted::VariantSelector;
+
+ThroughputEstimator::ThroughputEstimator(double alpha) : mAlpha(alpha) {}
+
+void ThroughputEstimator::addSample(int64_t bytes, double seconds) {
+  if (bytes <= 0 || seconds <= 0) {
+    return;
+  }
+  double sample = (double)bytes * 8 / seconds;
+  mEstimate = mHasEstimate ? mAlpha * sample + (1 - mAlpha) * mEstimate
+                           : sample;
+  mHasEstimate = true;
+}
+
+bool ThroughputEstimator::hasEstimate() const { return mHasEstimate; }
+
+double ThroughputEstimator::bitsPerSecond() const { return mEstimate; }
+
+VariantSelector::VariantSelector(std::vector<int> bandwidths,
+                                 size_t fastStartSegments,
+                                 double safetyFactor)
+    : mBandwidths(std::move(bandwidths)), mOrder(mBandwidths.size()),
+      mFastStartSegments(fastStartSegments), mSafetyFactor(safetyFactor) {
+  std::iota(mOrder.begin(), mOrder.end(), 0);
+  std::stable_sort(mOrder.begin(), mOrder.end(), [this](size_t a, size_t b) {
+    return mBandwidths[a] < mBandwidths[b];
+  });
+}
+
+size_t VariantSelector::lowest() const {
+  return mOrder.empty() ? 0 : mOrder.front();
+}
+
+size_t VariantSelector::select(size_t segmentIndex,
+                               const ThroughputEstimator &throughput) const {
+  if (mOrder.empty() || segmentIndex < mFastStartSegments ||
+      !throughput.hasEstimate()) {
+    return lowest();
+  }
+
+  double budget = throughput.bitsPerSecond() * mSafetyFactor;
+  size_t chosen = lowest();
+  for (auto index : mOrder) {
+    if (mBandwidths[index] <= budget) {
+      chosen = index;
+    }
+  }
+  return chosen;
+}
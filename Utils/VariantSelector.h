@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ted {
+
+// smoothed download throughput in bits per second
+class ThroughputEstimator {
+public:
+  explicit ThroughputEstimator(double alpha = 0.3);
+
+  void addSample(int64_t bytes, double seconds);
+
+  [[nodiscard]] bool hasEstimate() const;
+
+  [[nodiscard]] double bitsPerSecond() const;
+
+private:
+  double mAlpha;
+  double mEstimate = 0;
+  bool mHasEstimate = false;
+};
+
+/**
+ * Chooses among variants of one presentation by declared BANDWIDTH. The
+ * first segments always come from the cheapest variant so that the opening
+ * sentences are playable quickly; afterwards the richest variant that fits
+ * in a safety share of the measured throughput is used.
+ */
+class VariantSelector {
+public:
+  // bandwidths in bits per second, any order
+  explicit VariantSelector(std::vector<int> bandwidths,
+                           size_t fastStartSegments = 2,
+                           double safetyFactor = 0.7);
+
+  // index into the bandwidths given to the constructor
+  [[nodiscard]] size_t select(size_t segmentIndex,
+                              const ThroughputEstimator &throughput) const;
+
+  [[nodiscard]] size_t lowest() const;
+
+private:
+  std::vector<int> mBandwidths;
+  // variant indices ordered by ascending bandwidth
+  std::vector<size_t> mOrder;
+  size_t mFastStartSegments;
+  double mSafetyFactor;
+};
+
+} // namespace ted
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "WorkStealingPool.h"
+
+using ted::Task;
+using ted::TaskPriority;
+using ted::WorkStealingPool;
+
+// lets post() keep a worker's own tasks on its deque
+static thread_local const WorkStealingPool *currentPool = nullptr;
+static thread_local size_t currentWorker = 0;
+
+WorkStealingPool::WorkStealingPool(size_t threads) {
+  threads = std::max<size_t>(threads, 1);
+  for (size_t i = 0; i < threads; ++i) {
+    mWorkers.push_back(std::make_unique<Worker>());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    mThreads.emplace_back(&WorkStealingPool::run, this, i);
+  }
+  mHandle->pool = this;
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    // a handle posting from outside either queued its task before this,
+    // so the drain runs it, or sees mStop and refuses
+    std::unique_lock handleLock(mHandle->mutex);
+    std::unique_lock lock(mSleepMutex);
+    mStop = true;
+  }
+  mWake.notify_all();
+  for (auto &&thread : mThreads) {
+    thread.join();
+  }
+  std::unique_lock handleLock(mHandle->mutex);
+  mHandle->pool = nullptr;
+}
+
+size_t WorkStealingPool::defaultThreads() {
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+size_t WorkStealingPool::size() const { return mWorkers.size(); }
+
+void WorkStealingPool::post(TaskPriority priority, Task task) {
+  if (mStop && currentPool != this) {
+    throw std::runtime_error("enqueue on stopped WorkStealingPool");
+  }
+  size_t index = currentPool == this ? currentWorker
+                                     : mNext++ % mWorkers.size();
+
+  // counted first so a worker never takes a task that is not counted yet
+  ++mPending;
+  {
+    auto &worker = *mWorkers[index];
+    std::unique_lock lock(worker.mutex);
+    worker.queues[(size_t)priority].push_back(std::move(task));
+  }
+  // a worker going to sleep checks mPending under mSleepMutex after
+  // announcing itself, so either it sees the task or it is woken here
+  if (mSleeping > 0) {
+    { std::unique_lock lock(mSleepMutex); }
+    mWake.notify_one();
+  }
+}
+
+WorkStealingPool::Handle WorkStealingPool::handle() const {
+  return Handle(mHandle);
+}
+
+bool WorkStealingPool::Handle::post(TaskPriority priority, Task task) const {
+  if (mState == nullptr) {
+    return false;
+  }
+  std::shared_lock lock(mState->mutex);
+  auto *pool = mState->pool;
+  if (pool == nullptr || (pool->mStop && currentPool != pool)) {
+    return false;
+  }
+  pool->post(priority, std::move(task));
+  return true;
+}
+
+bool WorkStealingPool::take(size_t index, Task &task) {
+  for (size_t priority = 0; priority < PRIORITIES; ++priority) {
+    {
+      auto &own = *mWorkers[index];
+      std::unique_lock lock(own.mutex);
+      auto &queue = own.queues[priority];
+      if (!queue.empty()) {
+        task = std::move(queue.back());
+        queue.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < mWorkers.size(); ++i) {
+      auto &victim = *mWorkers[(index + i) % mWorkers.size()];
+      std::unique_lock lock(victim.mutex);
+      auto &queue = victim.queues[priority];
+      if (!queue.empty()) {
+        task = std::move(queue.front());
+        queue.pop_front();
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::run(size_t index) {
+  currentPool = this;
+  currentWorker = index;
+  while (true) {
+    Task task;
+    if (take(index, task)) {
+      --mPending;
+      task();
+      continue;
+    }
+
+    std::unique_lock lock(mSleepMutex);
+    ++mSleeping;
+    mWake.wait(lock, [this]() { return mPending > 0 || mStop; });
+    --mSleeping;
+    if (mStop && mPending == 0) {
+      return;
+    }
+  }
+}
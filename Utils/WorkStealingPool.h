@@ -0,0 +1,262 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Cancellation.h"
+
+namespace ted {
+
+/**
+ * A move-only void() callable. Callables up to INLINE_SIZE bytes live in
+ * the task itself, so queueing a small lambda does not allocate; larger
+ * ones are moved to the heap.
+ */
+class Task {
+public:
+  static constexpr size_t INLINE_SIZE = 64;
+
+  Task() = default;
+
+  template <class F, class = std::enable_if_t<
+                         !std::is_same_v<std::decay_t<F>, Task>>>
+  Task(F &&f) {
+    using Fn = std::decay_t<F>;
+    if constexpr (sizeof(Fn) <= INLINE_SIZE &&
+                  alignof(Fn) <= alignof(std::max_align_t) &&
+                  std::is_nothrow_move_constructible_v<Fn>) {
+      new (mStorage) Fn(std::forward<F>(f));
+      mOps = &InlineOps<Fn>::ops;
+    } else {
+      *reinterpret_cast<Fn **>(mStorage) = new Fn(std::forward<F>(f));
+      mOps = &HeapOps<Fn>::ops;
+    }
+  }
+
+  Task(Task &&other) noexcept { moveFrom(other); }
+
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      reset();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  ~Task() { reset(); }
+
+  explicit operator bool() const { return mOps != nullptr; }
+
+  void operator()() { mOps->invoke(mStorage); }
+
+  [[nodiscard]] bool isInline() const {
+    return mOps != nullptr && mOps->isInline;
+  }
+
+private:
+  struct Ops {
+    void (*invoke)(void *storage);
+    // move constructs into to and destroys from
+    void (*move)(void *from, void *to);
+    void (*destroy)(void *storage);
+    bool isInline;
+  };
+
+  template <class Fn> struct InlineOps {
+    static constexpr Ops ops = {
+        [](void *storage) { (*static_cast<Fn *>(storage))(); },
+        [](void *from, void *to) {
+          new (to) Fn(std::move(*static_cast<Fn *>(from)));
+          static_cast<Fn *>(from)->~Fn();
+        },
+        [](void *storage) { static_cast<Fn *>(storage)->~Fn(); }, true};
+  };
+
+  template <class Fn> struct HeapOps {
+    static constexpr Ops ops = {
+        [](void *storage) { (**static_cast<Fn **>(storage))(); },
+        [](void *from, void *to) {
+          *static_cast<Fn **>(to) = *static_cast<Fn **>(from);
+        },
+        [](void *storage) { delete *static_cast<Fn **>(storage); }, false};
+  };
+
+  void moveFrom(Task &other) {
+    if (other.mOps != nullptr) {
+      other.mOps->move(other.mStorage, mStorage);
+      mOps = other.mOps;
+      other.mOps = nullptr;
+    }
+  }
+
+  void reset() {
+    if (mOps != nullptr) {
+      mOps->destroy(mStorage);
+      mOps = nullptr;
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char mStorage[INLINE_SIZE];
+  const Ops *mOps = nullptr;
+};
+
+enum class TaskPriority {
+  // someone is waiting on it, e.g. the next sentence to play
+  Interactive,
+  // downloads, prefetching, analysis
+  Bulk,
+};
+
+/**
+ * Thread pool where every worker owns a deque per priority. Workers take
+ * their own newest task first and steal the oldest task of other workers
+ * when they run dry, always preferring interactive work over bulk work
+ * anywhere in the pool. Tasks posted from a worker stay on that worker;
+ * tasks from other threads are spread round robin.
+ *
+ * A running task is never preempted, so interactive work still waits for
+ * a free worker, but not behind queued bulk work. The destructor runs
+ * every queued task before joining.
+ */
+class WorkStealingPool {
+public:
+  /**
+   * A reference for work that may outlive the pool, e.g. an io completion
+   * continuing a TaskGraph. post() refuses instead of touching a pool that
+   * is stopping or already gone; workers still post while it drains.
+   */
+  class Handle {
+  public:
+    Handle() = default;
+
+    // false if the task was not queued and has been dropped
+    bool post(TaskPriority priority, Task task) const;
+
+  private:
+    friend class WorkStealingPool;
+
+    struct State {
+      std::shared_mutex mutex;
+      WorkStealingPool *pool = nullptr;
+    };
+
+    explicit Handle(std::shared_ptr<State> state) : mState(std::move(state)) {}
+
+    std::shared_ptr<State> mState;
+  };
+
+  explicit WorkStealingPool(size_t threads = defaultThreads());
+
+  ~WorkStealingPool();
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  // hardware_concurrency, at least 1
+  static size_t defaultThreads();
+
+  [[nodiscard]] size_t size() const;
+
+  // fire and forget; allocates nothing when task is stored inline
+  void post(TaskPriority priority, Task task);
+
+  [[nodiscard]] Handle handle() const;
+
+  template <class F, class... Args>
+  auto enqueue(TaskPriority priority, F &&f, Args &&...args)
+      -> std::future<std::invoke_result_t<F, Args...>>;
+
+  // interactive, like ThreadPool::enqueue
+  template <class F, class... Args>
+  auto enqueue(F &&f, Args &&...args)
+      -> std::future<std::invoke_result_t<F, Args...>> {
+    return enqueue(TaskPriority::Interactive, std::forward<F>(f),
+                   std::forward<Args>(args)...);
+  }
+
+  // f gets token as its first argument and should poll it; a task whose
+  // token is cancelled before a worker takes it is dropped without running
+  // and its future throws Cancelled
+  template <class F, class... Args>
+  auto enqueueCancellable(TaskPriority priority, CancelToken token, F &&f,
+                          Args &&...args)
+      -> std::future<std::invoke_result_t<F, CancelToken, Args...>>;
+
+private:
+  static constexpr size_t PRIORITIES = 2;
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> queues[PRIORITIES];
+  };
+
+  void run(size_t index);
+
+  bool take(size_t index, Task &task);
+
+  std::vector<std::unique_ptr<Worker>> mWorkers;
+  std::vector<std::thread> mThreads;
+
+  // tasks queued and not yet taken by a worker
+  std::atomic<size_t> mPending = 0;
+  std::atomic<size_t> mSleeping = 0;
+  std::atomic<size_t> mNext = 0;
+  std::atomic<bool> mStop = false;
+  std::mutex mSleepMutex;
+  std::condition_variable mWake;
+  std::shared_ptr<Handle::State> mHandle = std::make_shared<Handle::State>();
+};
+
+template <class F, class... Args>
+auto WorkStealingPool::enqueue(TaskPriority priority, F &&f, Args &&...args)
+    -> std::future<std::invoke_result_t<F, Args...>> {
+  using Result = std::invoke_result_t<F, Args...>;
+
+  // the promise travels in the task, no packaged_task or shared_ptr
+  std::promise<Result> promise;
+  auto future = promise.get_future();
+  post(priority, [promise = std::move(promise), f = std::forward<F>(f),
+                  ... args = std::forward<Args>(args)]() mutable {
+    try {
+      if constexpr (std::is_void_v<Result>) {
+        std::invoke(std::move(f), std::move(args)...);
+        promise.set_value();
+      } else {
+        promise.set_value(std::invoke(std::move(f), std::move(args)...));
+      }
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+    }
+  });
+  return future;
+}
+
+template <class F, class... Args>
+auto WorkStealingPool::enqueueCancellable(TaskPriority priority,
+                                          CancelToken token, F &&f,
+                                          Args &&...args)
+    -> std::future<std::invoke_result_t<F, CancelToken, Args...>> {
+  return enqueue(priority,
+                 [token = std::move(token), f = std::forward<F>(f)](
+                     auto &&...args) mutable {
+                   token.throwIfCancelled();
+                   return std::invoke(std::move(f), std::move(token),
+                                      std::forward<decltype(args)>(args)...);
+                 },
+                 std::forward<Args>(args)...);
+}
+
+} // namespace ted